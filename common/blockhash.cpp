@@ -0,0 +1,44 @@
+#include "blockhash.hpp"
+#include "crc32c.hpp"
+
+void BlockHasher::update(const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        size_t n = static_cast<size_t>(blockSize_ - blockFill_);
+        if (n > len) n = len;
+        blockCrc_ = crc32c(blockCrc_, p, n);
+        blockFill_ += n;
+        p += n;
+        len -= n;
+        if (blockFill_ == blockSize_) closeBlock();
+    }
+}
+
+void BlockHasher::finish() {
+    if (blockFill_ > 0) closeBlock();
+}
+
+void BlockHasher::closeBlock() {
+    leaves_.push_back(blockCrc_);
+    fileCrc_ = crc32cCombine(fileCrc_, blockCrc_, blockFill_);
+    blockCrc_ = 0;
+    blockFill_ = 0;
+}
+
+uint32_t merkleRoot(const std::vector<uint32_t>& leaves) {
+    if (leaves.empty()) return 0;
+    std::vector<uint32_t> level = leaves;
+    while (level.size() > 1) {
+        size_t out = 0;
+        for (size_t i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                level[out++] = level[i];
+                break;
+            }
+            uint32_t pair[2] = { level[i], level[i + 1] };
+            level[out++] = crc32c(0, pair, sizeof(pair));
+        }
+        level.resize(out);
+    }
+    return level[0];
+}
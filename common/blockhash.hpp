@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Files are hashed in fixed blocks so that a partial copy can be checked
+// block by block. Each leaf is the block's CRC-32C; the Merkle root folds
+// them pairwise (crc32c of the two 4-byte children, an odd node is carried
+// up unchanged) so one value identifies the whole list.
+constexpr uint32_t HASH_BLOCK_SIZE = 1024 * 1024;
+
+class BlockHasher {
+public:
+    explicit BlockHasher(uint32_t blockSize = HASH_BLOCK_SIZE) : blockSize_(blockSize) {}
+
+    // Bytes must arrive in file order.
+    void update(const void* data, size_t len);
+    // Closes the last, possibly short, block.
+    void finish();
+
+    const std::vector<uint32_t>& leaves() const { return leaves_; }
+    // CRC-32C of everything fed in, combined from the block CRCs.
+    uint32_t fileCrc() const { return fileCrc_; }
+
+private:
+    uint32_t blockSize_;
+    uint32_t blockCrc_ = 0;
+    uint64_t blockFill_ = 0;
+    uint32_t fileCrc_ = 0;
+    std::vector<uint32_t> leaves_;
+
+    void closeBlock();
+};
+
+uint32_t merkleRoot(const std::vector<uint32_t>& leaves);
@@ -1,4 +1,5 @@
 #include "common.hpp"
+#include <algorithm>
 #include <cstring>
 
 WinsockInit::WinsockInit() {
@@ -27,29 +28,86 @@ void recvAll(SOCKET s, char* buf, int len) {
     }
 }
 
-void sendMessage(SOCKET s, uint16_t type, const std::string& payload) {
+MsgHeader makeHeader(uint16_t type, uint32_t length, uint16_t version, uint32_t stream) {
     MsgHeader h{};
     h.magic = MAGIC;
-    h.version = 1;
+    h.version = version;
     h.type = type;
-    h.length = static_cast<uint32_t>(payload.size());
-    h.reserved = 0;
+    h.length = length;
+    h.stream = (version == PROTOCOL_V1) ? 0 : stream;
+    return h;
+}
+
+bool isValidHeader(const MsgHeader& hdr) {
+    return hdr.magic == MAGIC && (hdr.version == PROTOCOL_V1 || hdr.version == PROTOCOL_V2);
+}
+
+std::string frameMessage(uint16_t type, std::string_view payload, uint16_t version, uint32_t stream) {
+    std::string out;
+    frameMessage(out, type, payload, version, stream);
+    return out;
+}
 
-    sendAll(s, reinterpret_cast<const char*>(&h), sizeof(h));
-    if (!payload.empty()) {
-        sendAll(s, payload.data(), static_cast<int>(payload.size()));
+void frameMessage(std::string& out, uint16_t type, std::string_view payload, uint16_t version, uint32_t stream) {
+    MsgHeader h = makeHeader(type, static_cast<uint32_t>(payload.size()), version, stream);
+    out.clear();
+    out.reserve(sizeof(h) + payload.size());
+    out.append(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.append(payload);
+}
+
+// Header and payload in one WSASend, so a small message is one call and
+// one segment on the wire instead of two.
+static void sendFrame(SOCKET s, MsgHeader h, std::string_view payload) {
+    WSABUF wb[2]{};
+    wb[0].buf = reinterpret_cast<char*>(&h);
+    wb[0].len = sizeof(h);
+    wb[1].buf = const_cast<char*>(payload.data());
+    wb[1].len = static_cast<ULONG>(payload.size());
+    WSABUF* next = wb;
+    DWORD count = payload.empty() ? 1 : 2;
+    while (count) {
+        DWORD sent = 0;
+        if (WSASend(s, next, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR || sent == 0) {
+            throw SocketError("send failed");
+        }
+        // A blocking socket normally takes it all; carry on past whatever it did.
+        while (count && sent >= next->len) {
+            sent -= next->len;
+            ++next;
+            --count;
+        }
+        if (count) {
+            next->buf += sent;
+            next->len -= sent;
+        }
     }
 }
 
-void recvMessage(SOCKET s, MsgHeader& hdr, std::string& payload) {
+void sendMessage(SOCKET s, uint16_t type, std::string_view payload) {
+    sendFrame(s, makeHeader(type, static_cast<uint32_t>(payload.size())), payload);
+}
+
+void sendStreamMessage(SOCKET s, uint32_t stream, uint16_t type, std::string_view payload) {
+    sendFrame(s, makeHeader(type, static_cast<uint32_t>(payload.size()), PROTOCOL_V2, stream), payload);
+}
+
+void recvMessage(SOCKET s, MsgHeader& hdr, std::string& payload, uint32_t maxPayload) {
     recvAll(s, reinterpret_cast<char*>(&hdr), sizeof(hdr));
-    if (hdr.magic != MAGIC || hdr.version != 1) {
+    if (!isValidHeader(hdr)) {
         throw SocketError("bad header");
     }
+    if (hdr.length > maxPayload) {
+        throw SocketError("message too large");
+    }
     payload.clear();
-    if (hdr.length) {
-        payload.resize(hdr.length);
-        recvAll(s, payload.data(), static_cast<int>(hdr.length));
+    // A frame at a time, so a header that overstates its length costs no
+    // more memory than the bytes actually sent.
+    for (uint32_t got = 0; got < hdr.length;) {
+        const uint32_t n = std::min<uint32_t>(hdr.length - got, MAX_DATA_FRAME);
+        payload.resize(got + n);
+        recvAll(s, payload.data() + got, static_cast<int>(n));
+        got += n;
     }
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <stdexcept>
 #include <winsock2.h>
@@ -10,17 +11,29 @@
 
 struct MsgHeader {
     uint32_t magic;     // 'FTPL'
-    uint16_t version;   // 1
+    uint16_t version;   // 1 or 2
     uint16_t type;      // see enum
     uint32_t length;    // payload bytes
-    uint32_t reserved;  // 0
+    uint32_t stream;    // v1: 0; v2: stream id chosen by the client
 };
 
 enum MsgType : uint16_t {
     PING = 1, PONG = 2,
     LIST_REQ = 10, LIST_RESP = 11,
     GET_REQ = 20, GET_RESP = 21,
-    PUT_REQ = 30, PUT_RESP = 31,
+    PUT_REQ = 30, PUT_RESP = 31, PUT_DONE = 32,
+    DATA = 40,
+    STATS_REQ = 50, STATS_RESP = 51,
+    UPLOAD_OPEN_REQ = 60, UPLOAD_OPEN_RESP = 61,
+    UPLOAD_CHUNK_REQ = 62, UPLOAD_CHUNK_RESP = 63,
+    UPLOAD_COMMIT_REQ = 64, UPLOAD_COMMIT_RESP = 65,
+    BLOCKS_REQ = 70, BLOCKS_RESP = 71,
+    SIG_REQ = 80, SIG_RESP = 81,
+    DELTA_REQ = 82, DELTA_RESP = 83, DELTA_DATA = 84,
+    DELTA_COMMIT_REQ = 85, DELTA_COMMIT_RESP = 86,
+    MGET_REQ = 90, MGET_RESP = 91,
+    MPUT_REQ = 92, MPUT_RESP = 93, MPUT_DONE = 94,
+    RATE_REQ = 95, RATE_RESP = 96,
     ERR = 1000
 };
 
@@ -28,6 +41,18 @@ enum MsgType : uint16_t {
 
 constexpr uint32_t MAGIC = 0x4654504C; // 'FTPL'
 
+// v1: one request at a time; file bytes follow GET_RESP/PUT_RESP raw.
+// v2: every message carries a stream id, file bytes travel in DATA frames,
+//     and any number of requests may be in flight on one connection.
+constexpr uint16_t PROTOCOL_V1 = 1;
+constexpr uint16_t PROTOCOL_V2 = 2;
+
+// Largest DATA payload either side will send or accept.
+constexpr uint32_t MAX_DATA_FRAME = 1024 * 1024;
+// Largest payload recvMessage accepts by default. Listings and block hashes
+// of large files can be big, but not gigabytes.
+constexpr uint32_t MAX_MESSAGE = 64 * 1024 * 1024;
+
 class SocketError : public std::runtime_error {
 public: using std::runtime_error::runtime_error;
 };
@@ -35,8 +60,26 @@ public: using std::runtime_error::runtime_error;
 void sendAll(SOCKET s, const char* buf, int len);
 void recvAll(SOCKET s, char* buf, int len);
 
-void sendMessage(SOCKET s, uint16_t type, const std::string& payload);
-void recvMessage(SOCKET s, MsgHeader& hdr, std::string& payload);
+// Header and payload leave in one vectored send. The payload is only
+// viewed, so a caller can send part of a larger buffer without copying it.
+void sendMessage(SOCKET s, uint16_t type, std::string_view payload);
+void sendStreamMessage(SOCKET s, uint32_t stream, uint16_t type, std::string_view payload);
+// `payload` is overwritten in place; a caller that keeps passing the same
+// string stops allocating once it has grown to the largest message. A
+// header announcing more than `maxPayload` bytes is refused, and the
+// payload grows only as its bytes arrive.
+void recvMessage(SOCKET s, MsgHeader& hdr, std::string& payload, uint32_t maxPayload = MAX_MESSAGE);
+
+// Framing helpers shared by the blocking calls above and the server's
+// overlapped I/O path, which assembles and parses messages itself.
+MsgHeader makeHeader(uint16_t type, uint32_t length,
+                     uint16_t version = PROTOCOL_V1, uint32_t stream = 0);
+bool isValidHeader(const MsgHeader& hdr);
+std::string frameMessage(uint16_t type, std::string_view payload,
+                         uint16_t version = PROTOCOL_V1, uint32_t stream = 0);
+// Same, into `out` (replacing its contents) so its capacity can be reused.
+void frameMessage(std::string& out, uint16_t type, std::string_view payload,
+                  uint16_t version = PROTOCOL_V1, uint32_t stream = 0);
 
 // Small RAII for Winsock
 struct WinsockInit {
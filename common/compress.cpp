@@ -0,0 +1,120 @@
+#include "compress.hpp"
+#include <winsock2.h>
+#include <windows.h>
+#include <compressapi.h>
+#include <chrono>
+#include <cstring>
+
+namespace {
+
+DWORD algorithmFor(Codec codec) {
+    switch (codec) {
+    case Codec::Xpress: return COMPRESS_ALGORITHM_XPRESS;
+    case Codec::XpressHuff: return COMPRESS_ALGORITHM_XPRESS_HUFF;
+    default: return 0;
+    }
+}
+
+uint64_t microsSince(std::chrono::steady_clock::time_point t0) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - t0).count());
+}
+
+} // namespace
+
+const char* codecName(Codec codec) {
+    switch (codec) {
+    case Codec::Xpress: return "xpress";
+    case Codec::XpressHuff: return "xpress-huff";
+    default: return "none";
+    }
+}
+
+bool parseCodec(const std::string& name, Codec& codec) {
+    if (name.empty() || name == "none") codec = Codec::None;
+    else if (name == "xpress") codec = Codec::Xpress;
+    else if (name == "xpress-huff") codec = Codec::XpressHuff;
+    else return false;
+    return true;
+}
+
+// Raw mode: no per-call header, since the chunk header already carries the
+// lengths the decompressor needs.
+ChunkEncoder::ChunkEncoder(Codec codec) {
+    COMPRESSOR_HANDLE h = nullptr;
+    if (DWORD alg = algorithmFor(codec)) {
+        if (CreateCompressor(alg | COMPRESS_RAW, nullptr, &h)) h_ = h;
+    }
+}
+
+ChunkEncoder::~ChunkEncoder() {
+    if (h_) CloseCompressor(static_cast<COMPRESSOR_HANDLE>(h_));
+}
+
+size_t ChunkEncoder::encode(const void* data, uint32_t len, char* out) {
+    uint32_t wire = len;
+    if (h_ && skip_ > 0) {
+        --skip_;
+    }
+    else if (h_ && len > 0) {
+        // Anything that would not fit in 15/16 of the input is a miss; the
+        // compressor gives up with ERROR_INSUFFICIENT_BUFFER.
+        auto t0 = std::chrono::steady_clock::now();
+        SIZE_T n = 0;
+        BOOL ok = Compress(static_cast<COMPRESSOR_HANDLE>(h_), data, len, out + CHUNK_HEADER,
+                           len - len / 16, &n);
+        stats_.codecUs += microsSince(t0);
+        if (ok && n > 0 && n < len) {
+            wire = static_cast<uint32_t>(n);
+            backoff_ = 0;
+        }
+        else {
+            backoff_ = backoff_ ? (backoff_ < 64 ? backoff_ * 2 : 64) : 1;
+            skip_ = backoff_;
+        }
+    }
+    if (wire == len) {
+        std::memcpy(out + CHUNK_HEADER, data, len);
+        ++stats_.storedChunks;
+    }
+    std::memcpy(out, &len, 4);
+    std::memcpy(out + 4, &wire, 4);
+    stats_.rawBytes += len;
+    stats_.wireBytes += CHUNK_HEADER + wire;
+    ++stats_.chunks;
+    return CHUNK_HEADER + wire;
+}
+
+ChunkDecoder::ChunkDecoder(Codec codec) {
+    DECOMPRESSOR_HANDLE h = nullptr;
+    if (DWORD alg = algorithmFor(codec)) {
+        if (CreateDecompressor(alg | COMPRESS_RAW, nullptr, &h)) h_ = h;
+    }
+}
+
+ChunkDecoder::~ChunkDecoder() {
+    if (h_) CloseDecompressor(static_cast<DECOMPRESSOR_HANDLE>(h_));
+}
+
+bool ChunkDecoder::parseHeader(const void* p, uint32_t& rawLen, uint32_t& wireLen) {
+    std::memcpy(&rawLen, p, 4);
+    std::memcpy(&wireLen, static_cast<const char*>(p) + 4, 4);
+    return rawLen > 0 && rawLen <= MAX_COMPRESS_CHUNK && wireLen > 0 && wireLen <= rawLen;
+}
+
+bool ChunkDecoder::decode(const void* wire, uint32_t wireLen, void* out, uint32_t rawLen) {
+    stats_.rawBytes += rawLen;
+    stats_.wireBytes += CHUNK_HEADER + wireLen;
+    ++stats_.chunks;
+    if (wireLen == rawLen) {
+        std::memcpy(out, wire, rawLen);
+        ++stats_.storedChunks;
+        return true;
+    }
+    if (!h_) return false;
+    auto t0 = std::chrono::steady_clock::now();
+    SIZE_T n = 0;
+    BOOL ok = Decompress(static_cast<DECOMPRESSOR_HANDLE>(h_), wire, wireLen, out, rawLen, &n);
+    stats_.codecUs += microsSince(t0);
+    return ok && n == rawLen;
+}
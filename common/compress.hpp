@@ -0,0 +1,80 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Per-chunk compression for GET and PUT. The client names a codec in its
+// request and the server confirms it, or answers "none", in the reply. Each
+// chunk is compressed on its own, so a transfer can start or resume at any
+// chunk and every chunk is decoded as soon as it arrives.
+//
+// On the wire a chunk is u32 raw_len, u32 wire_len (little-endian), then
+// wire_len bytes: compressed when wire_len < raw_len, the raw bytes when
+// equal. In v2 each chunk is the payload of one DATA frame.
+enum class Codec : uint8_t {
+    None,
+    Xpress,         // "xpress": plain LZ77, LZ4-class speed
+    XpressHuff,     // "xpress-huff": LZ77 plus Huffman, better ratio for more CPU
+};
+
+constexpr size_t CHUNK_HEADER = 8;
+// Raw bytes per chunk that senders use; receivers accept up to the maximum,
+// which keeps a chunk within one DATA frame.
+constexpr uint32_t COMPRESS_CHUNK = 256 * 1024;
+constexpr uint32_t MAX_COMPRESS_CHUNK = 1024 * 1024 - CHUNK_HEADER;
+
+const char* codecName(Codec codec);
+// "" and "none" are Codec::None; false for a name this build doesn't know.
+bool parseCodec(const std::string& name, Codec& codec);
+
+// Running totals for one transfer.
+struct CodecStats {
+    uint64_t rawBytes = 0;
+    uint64_t wireBytes = 0;     // including chunk headers
+    uint64_t chunks = 0;
+    uint64_t storedChunks = 0;  // sent raw: did not compress, or not tried
+    uint64_t codecUs = 0;       // time spent inside the codec
+};
+
+// A chunk that saves less than 1/16 of its size goes out raw. After such a
+// miss the next 1, 2, 4, ... up to 64 chunks are sent raw without trying, so
+// already-compressed media costs almost no CPU; one hit resets the backoff.
+class ChunkEncoder {
+public:
+    explicit ChunkEncoder(Codec codec);
+    ~ChunkEncoder();
+    ChunkEncoder(const ChunkEncoder&) = delete;
+    ChunkEncoder& operator=(const ChunkEncoder&) = delete;
+
+    // False when the codec is None or the system has no compressor for it.
+    bool active() const { return h_ != nullptr; }
+    // Writes the chunk for `len` raw bytes (at most MAX_COMPRESS_CHUNK) to
+    // `out`, which needs room for CHUNK_HEADER + len. Returns bytes written.
+    size_t encode(const void* data, uint32_t len, char* out);
+    const CodecStats& stats() const { return stats_; }
+
+private:
+    void* h_ = nullptr;     // COMPRESSOR_HANDLE
+    uint32_t backoff_ = 0;
+    uint32_t skip_ = 0;     // chunks still to send without trying
+    CodecStats stats_;
+};
+
+class ChunkDecoder {
+public:
+    explicit ChunkDecoder(Codec codec);
+    ~ChunkDecoder();
+    ChunkDecoder(const ChunkDecoder&) = delete;
+    ChunkDecoder& operator=(const ChunkDecoder&) = delete;
+
+    bool active() const { return h_ != nullptr; }
+    // Reads a chunk header; false if the lengths are out of bounds.
+    static bool parseHeader(const void* p, uint32_t& rawLen, uint32_t& wireLen);
+    // Expands `wireLen` bytes into exactly `rawLen` bytes at `out`.
+    bool decode(const void* wire, uint32_t wireLen, void* out, uint32_t rawLen);
+    const CodecStats& stats() const { return stats_; }
+
+private:
+    void* h_ = nullptr;     // DECOMPRESSOR_HANDLE
+    CodecStats stats_;
+};
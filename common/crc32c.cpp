@@ -0,0 +1,237 @@
+#include "crc32c.hpp"
+#include <cstdio>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define FTPL_CRC32C_X64 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <nmmintrin.h>
+#define FTPL_TARGET_SSE42
+#else
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define FTPL_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+static constexpr uint32_t POLY = 0x82f63b78;   // reflected Castagnoli
+
+// Block sizes for the three-stream kernel. Each stream's CRC is shifted past
+// the following blocks with a precomputed "append N zero bytes" operator.
+static constexpr size_t LONG_BLOCK = 8192;
+static constexpr size_t SHORT_BLOCK = 256;
+
+namespace {
+
+// GF(2) 32x32 matrices as 32 column words; used to build zero-append operators.
+uint32_t gf2Times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat) {
+        if (vec & 1) sum ^= *mat;
+    }
+    return sum;
+}
+
+void gf2Square(uint32_t* square, const uint32_t* mat) {
+    for (int n = 0; n < 32; ++n) square[n] = gf2Times(mat, mat[n]);
+}
+
+// Operator that appends `len` zero bytes; `len` must be a power of two.
+void zerosOp(uint32_t* even, size_t len) {
+    uint32_t odd[32];
+    odd[0] = POLY;
+    for (int n = 1; n < 32; ++n) odd[n] = 1u << (n - 1);
+    gf2Square(even, odd);   // 2 zero bits
+    gf2Square(odd, even);   // 4 zero bits
+    for (;;) {
+        gf2Square(even, odd);   // 8, 32, ... bits
+        len >>= 1;
+        if (len == 0) return;
+        gf2Square(odd, even);   // 16, 64, ... bits
+        len >>= 1;
+        if (len == 0) break;
+    }
+    std::memcpy(even, odd, sizeof(odd));
+}
+
+struct Tables {
+    uint32_t slice[8][256];
+    uint32_t longShift[4][256];
+    uint32_t shortShift[4][256];
+    bool hw = false;
+
+    Tables() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+            slice[0][n] = c;
+        }
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = slice[0][n];
+            for (int k = 1; k < 8; ++k) {
+                c = slice[0][c & 0xff] ^ (c >> 8);
+                slice[k][n] = c;
+            }
+        }
+        buildShift(longShift, LONG_BLOCK);
+        buildShift(shortShift, SHORT_BLOCK);
+#ifdef FTPL_CRC32C_X64
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        hw = (info[2] & (1 << 20)) != 0;
+#else
+        unsigned a, b, c, d;
+        hw = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2);
+#endif
+#endif
+    }
+
+    static void buildShift(uint32_t table[4][256], size_t len) {
+        uint32_t op[32];
+        zerosOp(op, len);
+        for (uint32_t n = 0; n < 256; ++n) {
+            table[0][n] = gf2Times(op, n);
+            table[1][n] = gf2Times(op, n << 8);
+            table[2][n] = gf2Times(op, n << 16);
+            table[3][n] = gf2Times(op, n << 24);
+        }
+    }
+};
+
+const Tables& tables() {
+    static const Tables t;
+    return t;
+}
+
+inline uint32_t shift(const uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff]
+         ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+#ifdef FTPL_CRC32C_X64
+// Three independent streams keep the crc32 unit busy: its latency is three
+// cycles but it accepts a new instruction every cycle.
+FTPL_TARGET_SSE42
+void crc32cThreeWay(uint64_t& crc0, const unsigned char*& next, size_t& len,
+                    size_t block, const uint32_t table[4][256]) {
+    while (len >= block * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const unsigned char* end = next + block;
+        do {
+            uint64_t w0, w1, w2;
+            std::memcpy(&w0, next, 8);
+            std::memcpy(&w1, next + block, 8);
+            std::memcpy(&w2, next + block * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            next += 8;
+        } while (next < end);
+        crc0 = shift(table, static_cast<uint32_t>(crc0)) ^ crc1;
+        crc0 = shift(table, static_cast<uint32_t>(crc0)) ^ crc2;
+        next += block * 2;
+        len -= block * 3;
+    }
+}
+
+FTPL_TARGET_SSE42
+uint32_t crc32cSse42(uint32_t crc, const unsigned char* next, size_t len) {
+    const Tables& t = tables();
+    uint64_t crc0 = crc ^ 0xffffffffu;
+
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *next++);
+        --len;
+    }
+    crc32cThreeWay(crc0, next, len, LONG_BLOCK, t.longShift);
+    crc32cThreeWay(crc0, next, len, SHORT_BLOCK, t.shortShift);
+
+    while (len >= 8) {
+        uint64_t w;
+        std::memcpy(&w, next, 8);
+        crc0 = _mm_crc32_u64(crc0, w);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), *next++);
+        --len;
+    }
+    return static_cast<uint32_t>(crc0) ^ 0xffffffffu;
+}
+#endif
+
+} // namespace
+
+uint32_t crc32cPortable(uint32_t crc, const void* buf, size_t len) {
+    const Tables& t = tables();
+    const unsigned char* next = static_cast<const unsigned char*>(buf);
+    uint32_t c = crc ^ 0xffffffffu;
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+        c = t.slice[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+        --len;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, next, 4);
+        std::memcpy(&hi, next + 4, 4);
+        lo ^= c;
+        c = t.slice[7][lo & 0xff] ^ t.slice[6][(lo >> 8) & 0xff]
+          ^ t.slice[5][(lo >> 16) & 0xff] ^ t.slice[4][lo >> 24]
+          ^ t.slice[3][hi & 0xff] ^ t.slice[2][(hi >> 8) & 0xff]
+          ^ t.slice[1][(hi >> 16) & 0xff] ^ t.slice[0][hi >> 24];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        c = t.slice[0][(c ^ *next++) & 0xff] ^ (c >> 8);
+        --len;
+    }
+    return c ^ 0xffffffffu;
+}
+
+bool crc32cAccelerated() {
+    return tables().hw;
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+#ifdef FTPL_CRC32C_X64
+    if (tables().hw) return crc32cSse42(crc, static_cast<const unsigned char*>(buf), len);
+#endif
+    return crc32cPortable(crc, buf, len);
+}
+
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lenB) {
+    if (lenB == 0) return crcA;
+    // Shift crc(A) past lenB zero bytes, one power of two at a time.
+    uint32_t even[32], odd[32];
+    odd[0] = POLY;
+    for (int n = 1; n < 32; ++n) odd[n] = 1u << (n - 1);
+    gf2Square(even, odd);
+    gf2Square(odd, even);
+    do {
+        gf2Square(even, odd);
+        if (lenB & 1) crcA = gf2Times(even, crcA);
+        lenB >>= 1;
+        if (lenB == 0) break;
+        gf2Square(odd, even);
+        if (lenB & 1) crcA = gf2Times(odd, crcA);
+        lenB >>= 1;
+    } while (lenB);
+    return crcA ^ crcB;
+}
+
+std::string formatCrc32c(uint32_t crc) {
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%08x", crc);
+    return std::string("crc32c:") + buf;
+}
+
+bool parseCrc32c(const std::string& text, uint32_t& crc) {
+    if (text.size() != 15 || text.compare(0, 7, "crc32c:") != 0) return false;
+    try { crc = static_cast<uint32_t>(std::stoul(text.substr(7), nullptr, 16)); }
+    catch (...) { return false; }
+    return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// CRC-32C (Castagnoli). Incremental: start with crc = 0 and feed the result
+// of each call into the next. Uses the SSE4.2 crc32 instruction when the CPU
+// has it, with three interleaved streams to hide its latency, and a
+// slicing-by-8 table walk otherwise.
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+uint32_t crc32cPortable(uint32_t crc, const void* buf, size_t len);
+bool crc32cAccelerated();
+
+// CRC of A followed by B, given crc(A), crc(B) and B's length.
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lenB);
+
+// As stored in files.checksum and sent in GET_RESP: "crc32c:xxxxxxxx".
+std::string formatCrc32c(uint32_t crc);
+bool parseCrc32c(const std::string& text, uint32_t& crc);
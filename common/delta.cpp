@@ -0,0 +1,25 @@
+#include "delta.hpp"
+#include <cmath>
+
+uint32_t deltaBlockSize(uint64_t fileSize) {
+    uint64_t b = static_cast<uint64_t>(std::sqrt(static_cast<double>(fileSize)));
+    b = (b + 1023) & ~uint64_t(1023);
+    if (b < 2048) b = 2048;
+    if (b > 128 * 1024) b = 128 * 1024;
+    return static_cast<uint32_t>(b);
+}
+
+void RollingChecksum::init(const uint8_t* p, size_t len) {
+    a_ = b_ = 0;
+    len_ = static_cast<uint32_t>(len);
+    for (size_t i = 0; i < len; ++i) {
+        a_ += p[i];
+        b_ += a_;
+    }
+}
+
+uint32_t weakChecksum(const uint8_t* p, size_t len) {
+    RollingChecksum r;
+    r.init(p, len);
+    return r.value();
+}
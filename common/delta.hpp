@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// rsync-style delta encoding. The server describes its copy of a file as a
+// signature: per block, a rolling weak checksum and a CRC-32C. The client
+// slides a window over the new version, and wherever the weak checksum and
+// then the CRC match a block it emits a copy of that block; everything else
+// goes out as literal bytes.
+//
+// SIG_RESP, little-endian: u64 size, u32 block_size, u32 count, then per
+// block u32 weak, u32 crc. DELTA_DATA carries a run of instructions:
+//   u8 DELTA_COPY,    u32 first_block, u32 block_count
+//   u8 DELTA_LITERAL, u32 length, `length` bytes
+// An instruction never spans two messages.
+constexpr uint8_t DELTA_COPY = 1;
+constexpr uint8_t DELTA_LITERAL = 2;
+
+// Largest literal in one instruction.
+constexpr uint32_t DELTA_MAX_LITERAL = 1024 * 1024;
+
+// About sqrt(size), rounded to a KiB and kept within [2 KiB, 128 KiB]:
+// a few MB changed in a multi-GB file then costs a signature well under a
+// megabyte plus the changed blocks.
+uint32_t deltaBlockSize(uint64_t fileSize);
+
+// rsync's weak checksum: a = sum of bytes, b = sum of running a, each mod
+// 2^16. Rolling one byte forward is O(1).
+class RollingChecksum {
+public:
+    void init(const uint8_t* p, size_t len);
+    void roll(uint8_t out, uint8_t in) {
+        a_ += in - out;
+        b_ += a_ - len_ * out;
+    }
+    uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+
+private:
+    uint32_t a_ = 0, b_ = 0, len_ = 0;
+};
+
+uint32_t weakChecksum(const uint8_t* p, size_t len);
@@ -0,0 +1,55 @@
+#include "sha256.hpp"
+#include <winsock2.h>
+#include <windows.h>
+#include <bcrypt.h>
+#include <stdexcept>
+
+Sha256::Sha256() {
+    // The pseudo-handle needs no BCryptOpenAlgorithmProvider (Windows 10+).
+    BCRYPT_HASH_HANDLE h = nullptr;
+    if (!BCRYPT_SUCCESS(BCryptCreateHash(BCRYPT_SHA256_ALG_HANDLE, &h, nullptr, 0, nullptr, 0, 0)))
+        throw std::runtime_error("BCryptCreateHash failed");
+    h_ = h;
+}
+
+Sha256::~Sha256() {
+    if (h_) BCryptDestroyHash(static_cast<BCRYPT_HASH_HANDLE>(h_));
+}
+
+void Sha256::update(const void* data, size_t len) {
+    auto p = static_cast<PUCHAR>(const_cast<void*>(data));
+    while (len > 0 && !failed_) {
+        ULONG n = static_cast<ULONG>(len > 0x40000000 ? 0x40000000 : len);
+        if (!BCRYPT_SUCCESS(BCryptHashData(static_cast<BCRYPT_HASH_HANDLE>(h_), p, n, 0))) failed_ = true;
+        p += n;
+        len -= n;
+    }
+}
+
+std::string Sha256::finishHex() {
+    // A digest of part of the data would name the wrong content.
+    UCHAR digest[32];
+    if (failed_ || !BCRYPT_SUCCESS(BCryptFinishHash(static_cast<BCRYPT_HASH_HANDLE>(h_), digest, sizeof(digest), 0)))
+        return std::string();
+    static const char hex[] = "0123456789abcdef";
+    std::string out(64, '0');
+    for (int i = 0; i < 32; ++i) {
+        out[i * 2] = hex[digest[i] >> 4];
+        out[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+    return out;
+}
+
+std::string formatSha256(const std::string& hex) {
+    return "sha256:" + hex;
+}
+
+bool parseSha256(const std::string& text, std::string& hex) {
+    if (text.size() != 71 || text.compare(0, 7, "sha256:") != 0) return false;
+    hex = text.substr(7);
+    for (char& c : hex) {
+        if (c >= 'A' && c <= 'F') c = static_cast<char>(c - 'A' + 'a');
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Incremental SHA-256 through Windows CNG, which uses the CPU's SHA
+// extensions where present. Keys the deduplicating blob store, where a
+// CRC match is too weak to treat two files as the same content.
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const void* data, size_t len);
+    // 64 lowercase hex digits, or empty if CNG failed along the way. The
+    // hash cannot be updated afterwards.
+    std::string finishHex();
+
+private:
+    void* h_ = nullptr;     // BCRYPT_HASH_HANDLE
+    bool failed_ = false;   // a BCryptHashData call failed; the rest is skipped
+};
+
+// As offered in PUT_REQ and UPLOAD_OPEN_REQ: "sha256:<64 hex digits>".
+std::string formatSha256(const std::string& hex);
+bool parseSha256(const std::string& text, std::string& hex);
@@ -1,10 +1,26 @@
 #include "common.hpp"
+#include "crc32c.hpp"
+#include "blockhash.hpp"
+#include "sha256.hpp"
+#include "compress.hpp"
+#include "delta.hpp"
 #include <iostream>
 #include <string>
 #include <filesystem>
 #include <fstream>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <vector>
 #include <sstream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 static std::unordered_map<int, std::string> resumeIdMap;
 static std::unordered_map<int, uint64_t> resumeOffsetMap;
@@ -37,6 +53,85 @@ static void deleteResumeFile(int file_id) {
     std::remove(resumeFilename(file_id).c_str());
 }
 
+static std::string newResumeId() {
+    std::random_device rd;
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0');
+    for (int i = 0; i < 4; ++i) oss << std::setw(8) << rd();
+    return oss.str();
+}
+
+// GET_RESP payload is "size|offset|length|checksum[|codec]". Older servers
+// send "size|offset" or just the size; the bytes then run to the end of the
+// file. A codec other than "none" means the bytes come as compressed chunks.
+struct GetResp {
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    bool hasCrc = false;
+    uint32_t crc = 0;
+    Codec codec = Codec::None;
+};
+
+static GetResp parseGetResp(const std::string& payload) {
+    std::vector<std::string> f;
+    std::istringstream iss(payload);
+    for (std::string item; std::getline(iss, item, '|');) f.push_back(item);
+    GetResp r;
+    r.size = f.empty() ? 0 : std::stoull(f[0]);
+    r.offset = f.size() > 1 ? std::stoull(f[1]) : 0;
+    r.length = f.size() > 2 ? std::stoull(f[2]) : r.size - r.offset;
+    r.hasCrc = f.size() > 3 && parseCrc32c(f[3], r.crc);
+    if (f.size() > 4 && !parseCodec(f[4], r.codec)) r.codec = Codec::None;
+    return r;
+}
+
+// One line per transfer: effective throughput over the file bytes, and with
+// a codec the bytes on the wire and the time this side spent in it.
+static void reportTransfer(uint64_t bytes, double secs, Codec codec, const CodecStats* cs) {
+    std::cout << bytes << " bytes in " << std::fixed << std::setprecision(2) << secs << " s ("
+        << std::setprecision(1) << (secs > 0 ? bytes / (1024.0 * 1024.0) / secs : 0.0) << " MiB/s)";
+    if (cs && cs->rawBytes > 0) {
+        std::cout << ", " << cs->wireBytes << " on the wire ("
+            << std::setprecision(1) << 100.0 * cs->wireBytes / cs->rawBytes << "%), "
+            << codecName(codec) << " " << std::setprecision(1) << cs->codecUs / 1000.0 << " ms CPU, "
+            << cs->storedChunks << "/" << cs->chunks << " chunks sent raw";
+    }
+    std::cout << "\n";
+}
+
+// CRC-32C of `len` bytes of a local file starting at `offset`.
+static uint32_t crcOfRange(const std::string& path, uint64_t offset, uint64_t len) {
+    std::ifstream in(path, std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+    std::vector<char> buf(1024 * 1024);
+    uint32_t crc = 0;
+    while (len > 0 && in) {
+        in.read(buf.data(), static_cast<std::streamsize>(std::min<uint64_t>(buf.size(), len)));
+        std::streamsize n = in.gcount();
+        if (n <= 0) break;
+        crc = crc32c(crc, buf.data(), static_cast<size_t>(n));
+        len -= static_cast<uint64_t>(n);
+    }
+    return crc;
+}
+
+static uint32_t crcOfFile(const std::string& path, uint64_t len) {
+    return crcOfRange(path, 0, len);
+}
+
+// Offered with uploads so the server can skip content it already stores.
+static std::string sha256OfFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::vector<char> buf(1024 * 1024);
+    Sha256 sha;
+    while (in) {
+        in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        if (in.gcount() > 0) sha.update(buf.data(), static_cast<size_t>(in.gcount()));
+    }
+    return sha.finishHex();
+}
+
 static SOCKET connectTo(const char* host, const char* port) {
     addrinfo hints{};
     hints.ai_family = AF_INET;
@@ -64,13 +159,82 @@ static void doPing(SOCKET s) {
     std::cout << "PONG: " << payload << "\n";
 }
 
-static void doList(SOCKET s, const std::string& path) {
-    sendMessage(s, LIST_REQ, path);
+// PONG lists the server's features after "OK". Only a server that
+// deduplicates has any use for an upload's hash, which costs a full read of
+// the file before the first byte goes out.
+static bool serverDedups(SOCKET s) {
+    sendMessage(s, PING, "");
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+    return h.type == PONG && ("|" + payload + "|").find("|dedup|") != std::string::npos;
+}
+
+// "sha256:<hex>" for a server that deduplicates, empty otherwise or if the
+// file can't be hashed.
+static std::string offerHash(SOCKET s, const std::string& path) {
+    if (!serverDedups(s)) return "";
+    std::string hex = sha256OfFile(path);
+    return hex.empty() ? "" : formatSha256(hex);
+}
+
+static uint64_t getVarint(const std::string& in, size_t& pos) {
+    uint64_t v = 0;
+    for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+        uint8_t b = static_cast<uint8_t>(in[pos++]);
+        v |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return v;
+}
+
+// Decodes a format=binary LIST page (see ListService on the server).
+static void printBinaryList(const std::string& payload) {
+    size_t pos = 1;
+    uint64_t count = getVarint(payload, pos);
+    uint64_t cursorLen = getVarint(payload, pos);
+    std::string next = payload.substr(pos, static_cast<size_t>(cursorLen));
+    pos += static_cast<size_t>(cursorLen);
+
+    std::cout << "ID   SIZE(bytes)  UPLOADED_AT(unix)  DL  NAME\n";
+    for (uint64_t i = 0; i < count && pos < payload.size(); ++i) {
+        uint64_t id = getVarint(payload, pos);
+        uint64_t size = getVarint(payload, pos);
+        uint64_t at = getVarint(payload, pos);
+        uint64_t dl = getVarint(payload, pos);
+        uint64_t nameLen = getVarint(payload, pos);
+        std::string name = payload.substr(pos, static_cast<size_t>(nameLen));
+        pos += static_cast<size_t>(nameLen);
+        std::cout << std::setw(4) << id << " " << std::setw(12) << size << "  "
+            << std::setw(17) << at << "  " << std::setw(3) << dl << "  " << name << "\n";
+    }
+    if (!next.empty()) std::cout << "next: " << next << "\n";
+    std::cout << "(" << payload.size() << " bytes)\n";
+}
+
+static void doList(SOCKET s, const std::string& args) {
+    // Options are marked with a leading '?'; a bare request lists newest first.
+    sendMessage(s, LIST_REQ, args.empty() ? args : "?" + args);
     MsgHeader h{};
     std::string payload;
     recvMessage(s, h, payload);
 
     if (h.type == LIST_RESP) {
+        if (args.find("format=binary") != std::string::npos) printBinaryList(payload);
+        else std::cout << payload << "\n";
+    }
+    else {
+        std::cout << "ERR: " << payload << "\n";
+    }
+}
+
+static void doStats(SOCKET s) {
+    sendMessage(s, STATS_REQ, "");
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+
+    if (h.type == STATS_RESP) {
         std::cout << payload << "\n";
     }
     else {
@@ -78,7 +242,123 @@ static void doList(SOCKET s, const std::string& path) {
     }
 }
 
-static void doGet(SOCKET s, const std::string& filename) {
+// rate [key=value...]: changes the server's bandwidth limits, then shows
+// them; with no arguments only shows them.
+static void doRate(SOCKET s, const std::string& args) {
+    sendMessage(s, RATE_REQ, args);
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+
+    if (h.type == RATE_RESP) {
+        std::cout << payload;
+    }
+    else {
+        std::cout << "ERR: " << payload << "\n";
+    }
+}
+
+// Block hashes of a server file, from BLOCKS_RESP.
+struct BlockHashes {
+    uint64_t size = 0;
+    uint32_t blockSize = 0;
+    uint32_t root = 0;
+    std::vector<uint32_t> leaves;
+
+    uint64_t blockStart(size_t i) const { return i * static_cast<uint64_t>(blockSize); }
+    uint64_t blockLen(size_t i) const { return std::min<uint64_t>(blockSize, size - blockStart(i)); }
+};
+
+// False if the server has no hashes for the file or the list doesn't match
+// its root.
+static bool fetchBlockHashes(SOCKET s, const std::string& file, BlockHashes& bh) {
+    sendMessage(s, BLOCKS_REQ, file);
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+    if (h.type != BLOCKS_RESP || payload.size() < 20) return false;
+
+    uint32_t count = 0;
+    std::memcpy(&bh.size, payload.data(), 8);
+    std::memcpy(&bh.blockSize, payload.data() + 8, 4);
+    std::memcpy(&bh.root, payload.data() + 12, 4);
+    std::memcpy(&count, payload.data() + 16, 4);
+    if (bh.blockSize == 0 || payload.size() != 20 + count * 4ull ||
+        count != (bh.size + bh.blockSize - 1) / bh.blockSize) return false;
+    bh.leaves.resize(count);
+    std::memcpy(bh.leaves.data(), payload.data() + 20, count * 4ull);
+    return merkleRoot(bh.leaves) == bh.root;
+}
+
+// Checks every block of `path` that lies wholly below `upto` against its
+// leaf, spread over all cores, and re-fetches the ones that differ with
+// ranged GETs. Returns the number of blocks repaired, or -1 on failure.
+static int repairBlocks(SOCKET s, const std::string& file, const std::string& path,
+                        const BlockHashes& bh, uint64_t upto) {
+    size_t blocks = 0;
+    while (blocks < bh.leaves.size() && bh.blockStart(blocks) + bh.blockLen(blocks) <= upto) ++blocks;
+
+    std::vector<char> bad(blocks, 0);
+    std::atomic<size_t> next{0};
+    auto worker = [&]() {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> buf(bh.blockSize);
+        for (size_t i; (i = next++) < blocks;) {
+            const uint64_t len = bh.blockLen(i);
+            in.clear();
+            in.seekg(static_cast<std::streamoff>(bh.blockStart(i)), std::ios::beg);
+            in.read(buf.data(), static_cast<std::streamsize>(len));
+            bad[i] = in.gcount() != static_cast<std::streamsize>(len) ||
+                     crc32c(0, buf.data(), static_cast<size_t>(len)) != bh.leaves[i];
+        }
+    };
+    const unsigned jobs = std::max<unsigned>(1, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned j = 0; j < jobs; ++j) workers.emplace_back(worker);
+    for (auto& t : workers) t.join();
+
+    int repaired = 0;
+    std::fstream out;
+    std::vector<char> buf(bh.blockSize);
+    for (size_t i = 0; i < blocks; ++i) {
+        if (!bad[i]) continue;
+        if (!out.is_open()) out.open(path, std::ios::binary | std::ios::in | std::ios::out);
+        const uint64_t start = bh.blockStart(i), len = bh.blockLen(i);
+        sendMessage(s, GET_REQ, file + "||" + std::to_string(start) + "|" + std::to_string(len));
+        MsgHeader h{};
+        std::string payload;
+        recvMessage(s, h, payload);
+        if (h.type != GET_RESP || parseGetResp(payload).length != len) return -1;
+        recvAll(s, buf.data(), static_cast<int>(len));
+        if (crc32c(0, buf.data(), static_cast<size_t>(len)) != bh.leaves[i]) return -1;
+        out.seekp(static_cast<std::streamoff>(start), std::ios::beg);
+        out.write(buf.data(), static_cast<std::streamsize>(len));
+        if (!out) return -1;
+        ++repaired;
+    }
+    return repaired;
+}
+
+// verify <file>: checks a local copy block by block against the server's
+// hashes and re-fetches only the blocks that differ.
+static void doVerify(SOCKET s, const std::string& file) {
+    BlockHashes bh;
+    if (!fetchBlockHashes(s, file, bh)) {
+        std::cout << "No block hashes for " << file << "\n";
+        return;
+    }
+    std::error_code ec;
+    const uint64_t local = std::filesystem::file_size(file, ec);
+    if (ec || local != bh.size) {
+        std::cout << "Local size " << (ec ? 0 : local) << " differs from " << bh.size << "; use get\n";
+        return;
+    }
+    int repaired = repairBlocks(s, file, file, bh, local);
+    if (repaired < 0) std::cout << "Repair failed\n";
+    else std::cout << bh.leaves.size() << " blocks checked, " << repaired << " re-fetched\n";
+}
+
+static void doGet(SOCKET s, const std::string& filename, Codec codec) {
     std::string payload = filename;
     int file_id = 0;
     try { file_id = std::stoi(filename); }
@@ -86,10 +366,46 @@ static void doGet(SOCKET s, const std::string& filename) {
 
     loadResume(file_id);
 
-    if (resumeIdMap.count(file_id)) {
-        payload += "|" + resumeIdMap[file_id];
+    // The server may restart at or before the offset we saved, never after,
+    // so resuming needs at least that much of the partial file on disk.
+    std::error_code ec;
+    if (resumeIdMap.count(file_id) &&
+        (!std::filesystem::exists(filename, ec) || std::filesystem::file_size(filename, ec) < resumeOffsetMap[file_id])) {
+        resumeIdMap.erase(file_id);
     }
+    if (!resumeIdMap.count(file_id)) {
+        resumeIdMap[file_id] = newResumeId();
+        resumeOffsetMap[file_id] = 0;
+    }
+    payload += "|" + resumeIdMap[file_id];
 
+    // Before resuming, the partial file is checked against the server's
+    // block hashes and damaged blocks are fetched again, so the prefix is
+    // known good without streaming it a second time.
+    BlockHashes bh;
+    bool haveBlocks = false;
+    if (resumeOffsetMap[file_id] > 0 && fetchBlockHashes(s, filename, bh)) {
+        int repaired = repairBlocks(s, filename, filename, bh, resumeOffsetMap[file_id]);
+        if (repaired < 0) {
+            std::cout << "Download failed: could not repair partial file\n";
+            return;
+        }
+        if (repaired > 0) std::cout << "Re-fetched " << repaired << " damaged blocks\n";
+        haveBlocks = true;
+    }
+
+    // A resumed download asks for the rest of the file from what is on disk
+    // here: the server's checkpoint only knows what it sent, which may be
+    // more than was written before we stopped.
+    uint64_t have = 0;
+    if (resumeOffsetMap[file_id] > 0) {
+        have = std::min<uint64_t>(resumeOffsetMap[file_id], std::filesystem::file_size(filename, ec));
+        if (ec) have = 0;
+    }
+    if (have > 0) payload += "|" + std::to_string(have) + "|";
+    else if (codec != Codec::None) payload += "||";
+    if (codec != Codec::None) payload += std::string("|") + codecName(codec);
+    auto t0 = std::chrono::steady_clock::now();
     sendMessage(s, GET_REQ, payload);
 
     MsgHeader h{};
@@ -100,33 +416,164 @@ static void doGet(SOCKET s, const std::string& filename) {
         return;
     }
 
-    uint64_t fileSize = std::stoull(payload);
-    std::ofstream out(filename, std::ios::binary);
+    GetResp resp = parseGetResp(payload);
+    uint64_t fileSize = resp.size, offset = resp.offset;
+    if (offset > have) {
+        // Only an older server restarts past what we asked for; the bytes
+        // in between are missing here, so this partial file can't be used.
+        resumeIdMap.erase(file_id);
+        resumeOffsetMap.erase(file_id);
+        deleteResumeFile(file_id);
+        throw std::runtime_error("server resumed past the local file; run get again");
+    }
+    // Verified as it arrives. For a resumed download the prefix's CRC comes
+    // from the verified blocks' leaves, plus a read of any partial block.
+    uint32_t crc = 0;
+    if (resp.hasCrc && offset > 0) {
+        uint64_t pos = 0;
+        if (haveBlocks && bh.size == fileSize) {
+            for (size_t i = 0; i < bh.leaves.size() && pos + bh.blockLen(i) <= offset; ++i) {
+                crc = crc32cCombine(crc, bh.leaves[i], bh.blockLen(i));
+                pos += bh.blockLen(i);
+            }
+        }
+        crc = crc32cCombine(crc, crcOfRange(filename, pos, offset - pos), offset - pos);
+    }
+    std::fstream out;
+    if (offset > 0) {
+        out.open(filename, std::ios::binary | std::ios::in | std::ios::out);
+        out.seekp(static_cast<std::streamoff>(offset), std::ios::beg);
+    }
+    else {
+        out.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+    }
 
     const size_t BUF_SIZE = 64 * 1024;
     char buffer[BUF_SIZE];
-    uint64_t received = 0;
+    uint64_t received = offset;
+    // Compressed chunks are whole units: header, body, then expand.
+    std::unique_ptr<ChunkDecoder> dec;
+    std::vector<char> wire, raw;
+    if (resp.codec != Codec::None) {
+        dec = std::make_unique<ChunkDecoder>(resp.codec);
+        wire.resize(CHUNK_HEADER + MAX_COMPRESS_CHUNK);
+        raw.resize(MAX_COMPRESS_CHUNK);
+    }
 
     while (received < fileSize) {
-        int toRead = (int)std::min<uint64_t>(BUF_SIZE, fileSize - received);
-        recvAll(s, buffer, toRead);
-        out.write(buffer, toRead);
-        received += toRead;
+        const char* data = buffer;
+        int n = 0;
+        if (dec) {
+            uint32_t rawLen = 0, wireLen = 0;
+            recvAll(s, wire.data(), CHUNK_HEADER);
+            if (!ChunkDecoder::parseHeader(wire.data(), rawLen, wireLen) || rawLen > fileSize - received)
+                throw std::runtime_error("bad compressed chunk");
+            recvAll(s, wire.data() + CHUNK_HEADER, (int)wireLen);
+            if (!dec->decode(wire.data() + CHUNK_HEADER, wireLen, raw.data(), rawLen))
+                throw std::runtime_error("corrupt compressed chunk");
+            data = raw.data();
+            n = (int)rawLen;
+        }
+        else {
+            n = (int)std::min<uint64_t>(BUF_SIZE, fileSize - received);
+            recvAll(s, buffer, n);
+        }
+        out.write(data, n);
+        if (resp.hasCrc) crc = crc32c(crc, data, n);
+        received += n;
         resumeOffsetMap[file_id] = received;
         saveResume(file_id);
 
         std::cout << "Downloaded " << received << "/" << fileSize << " bytes\r";
     }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
 
     out.close();
     resumeIdMap.erase(file_id);
     resumeOffsetMap.erase(file_id);
     deleteResumeFile(file_id);
 
-    std::cout << "\nDownload complete\n";
+    if (resp.hasCrc && crc != resp.crc) {
+        std::cout << "\nChecksum mismatch: expected " << formatCrc32c(resp.crc) << ", got " << formatCrc32c(crc) << "\n";
+        return;
+    }
+    std::cout << "\nDownload complete" << (resp.hasCrc ? " (" + formatCrc32c(crc) + " verified)" : "") << "\n";
+    reportTransfer(received - offset, secs, resp.codec, dec ? &dec->stats() : nullptr);
 }
 
-static void doPut(SOCKET s, const std::string& filename) {
+// One full GET into a scratch buffer; returns bytes received.
+static uint64_t benchGetOnce(SOCKET s, const std::string& request) {
+    sendMessage(s, GET_REQ, request);
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+    if (h.type != GET_RESP) throw std::runtime_error("GET failed: " + payload);
+
+    GetResp resp = parseGetResp(payload);
+    uint64_t fileSize = resp.size, offset = resp.offset;
+    static char buffer[64 * 1024];
+    uint64_t received = offset;
+    while (received < fileSize) {
+        int toRead = (int)std::min<uint64_t>(sizeof(buffer), fileSize - received);
+        recvAll(s, buffer, toRead);
+        received += toRead;
+    }
+    return received - offset;
+}
+
+// bench get <file_id> [rounds]: GET throughput without and with a resume ID,
+// i.e. without and with server-side resume checkpointing.
+static void doBenchGet(SOCKET s, const std::string& args) {
+    std::istringstream iss(args);
+    std::string id;
+    int rounds = 3;
+    iss >> id >> rounds;
+    if (id.empty() || rounds <= 0) {
+        std::cout << "usage: bench get <file_id> [rounds]\n";
+        return;
+    }
+
+    for (int withResume = 0; withResume < 2; ++withResume) {
+        uint64_t bytes = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            bytes += benchGetOnce(s, withResume ? id + "|" + newResumeId() : id);
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << (withResume ? "with resume id:    " : "without resume id: ")
+            << std::fixed << std::setprecision(1) << (bytes / (1024.0 * 1024.0)) / secs << " MiB/s ("
+            << bytes << " bytes in " << std::setprecision(3) << secs << " s)\n";
+    }
+}
+
+// bench crc [MiB]: CRC-32C kernel throughput, table-driven vs. SSE4.2.
+static void doBenchCrc(const std::string& args) {
+    size_t mib = 256;
+    std::istringstream(args) >> mib;
+    if (mib == 0) mib = 256;
+    std::vector<char> buf(64 * 1024 * 1024);
+    std::mt19937 rng(42);
+    for (auto& c : buf) c = static_cast<char>(rng());
+    const uint64_t total = static_cast<uint64_t>(mib) * 1024 * 1024;
+
+    for (int accel = 0; accel < 2; ++accel) {
+        if (accel && !crc32cAccelerated()) {
+            std::cout << "sse4.2: not supported on this CPU\n";
+            break;
+        }
+        uint32_t crc = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (uint64_t done = 0; done < total; done += buf.size()) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(buf.size(), total - done));
+            crc = accel ? crc32c(crc, buf.data(), n) : crc32cPortable(crc, buf.data(), n);
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << (accel ? "sse4.2:   " : "portable: ") << std::fixed << std::setprecision(2)
+            << total / secs / 1e9 << " GB/s (" << formatCrc32c(crc) << ")\n";
+    }
+}
+
+static void doPut(SOCKET s, const std::string& filename, Codec codec) {
     std::ifstream in(filename, std::ios::binary);
     if (!in) {
         std::cout << "File not found: " << filename << "\n";
@@ -137,35 +584,834 @@ static void doPut(SOCKET s, const std::string& filename) {
     uint64_t fileSize = in.tellg();
     in.seekg(0, std::ios::beg);
 
-    std::string payload = filename + "|" + std::to_string(fileSize);
+    std::string payload = filename + "|" + std::to_string(fileSize) + "|" + offerHash(s, filename);
+    if (codec != Codec::None) payload += std::string("|") + codecName(codec);
+    auto t0 = std::chrono::steady_clock::now();
     sendMessage(s, PUT_REQ, payload);
 
     MsgHeader hdr{};
     std::string resp;
     recvMessage(s, hdr, resp);
 
+    if (hdr.type == PUT_DONE) {
+        std::cout << "Stored as " << resp << " (content already on server, nothing sent)\n";
+        return;
+    }
     if (hdr.type != PUT_RESP) {
         std::cout << "Server rejected upload: " << resp << "\n";
         return;
     }
+    // "OK|codec" when a codec was asked for; the server may decline it.
+    Codec agreed = Codec::None;
+    auto bar = resp.find('|');
+    if (bar != std::string::npos && !parseCodec(resp.substr(bar + 1), agreed)) agreed = Codec::None;
+    // Without a local compressor the chunks all go out raw.
+    std::unique_ptr<ChunkEncoder> enc;
+    if (agreed != Codec::None) enc = std::make_unique<ChunkEncoder>(agreed);
 
-    const size_t BUF_SIZE = 64 * 1024;
-    char buffer[BUF_SIZE];
+    const size_t BUF_SIZE = enc ? COMPRESS_CHUNK : 64 * 1024;
+    std::vector<char> buffer(BUF_SIZE), wire(enc ? CHUNK_HEADER + BUF_SIZE : 0);
     uint64_t sent = 0;
 
     while (in) {
-        in.read(buffer, BUF_SIZE);
+        in.read(buffer.data(), BUF_SIZE);
         std::streamsize n = in.gcount();
         if (n > 0) {
-            sendAll(s, buffer, (int)n);
+            if (enc) {
+                size_t w = enc->encode(buffer.data(), static_cast<uint32_t>(n), wire.data());
+                sendAll(s, wire.data(), (int)w);
+            }
+            else {
+                sendAll(s, buffer.data(), (int)n);
+            }
             sent += n;
             std::cout << "Uploaded " << sent << "/" << fileSize << " bytes\r";
         }
     }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
 
     std::cout << "\nUpload complete\n";
+    reportTransfer(sent, secs, agreed, enc ? &enc->stats() : nullptr);
+}
+
+
+// sync <file>: re-uploads a file the server already has under this name by
+// sending only what changed. The server's signature lists a weak rolling
+// checksum and a CRC-32C per block; a window slides over the local file,
+// and blocks found in the signature go out as copy instructions, the rest
+// as literals.
+static void doSync(SOCKET s, const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        std::cout << "File not found: " << file << "\n";
+        return;
+    }
+    std::error_code ec;
+    const uint64_t fileSize = std::filesystem::file_size(file, ec);
+
+    sendMessage(s, SIG_REQ, file);
+    MsgHeader h{};
+    std::string sig;
+    recvMessage(s, h, sig);
+    if (h.type != SIG_RESP) {
+        if (sig == "file-not-found") {
+            doPut(s, file, Codec::None);
+            return;
+        }
+        std::cout << "Sync failed: " << sig << "\n";
+        return;
+    }
+    uint64_t baseSize = 0;
+    uint32_t blockSize = 0, count = 0;
+    if (sig.size() < 16) { std::cout << "Sync failed: bad signature\n"; return; }
+    std::memcpy(&baseSize, sig.data(), 8);
+    std::memcpy(&blockSize, sig.data() + 8, 4);
+    std::memcpy(&count, sig.data() + 12, 4);
+    if (blockSize == 0 || sig.size() != 16 + count * 8ull) { std::cout << "Sync failed: bad signature\n"; return; }
+    std::vector<uint32_t> weak(count), crcs(count);
+    std::unordered_map<uint32_t, std::vector<uint32_t>> byWeak;
+    for (uint32_t i = 0; i < count; ++i) {
+        std::memcpy(&weak[i], sig.data() + 16 + i * 8ull, 4);
+        std::memcpy(&crcs[i], sig.data() + 20 + i * 8ull, 4);
+        // Only full blocks can match a full window; the short last block
+        // is tried separately at the end of the file.
+        if (static_cast<uint64_t>(i + 1) * blockSize <= baseSize) byWeak[weak[i]].push_back(i);
+    }
+    const uint64_t lastLen = baseSize % blockSize;
+
+    sendMessage(s, DELTA_REQ, file + "|" + std::to_string(fileSize) + "|" + std::to_string(blockSize));
+    std::string resp;
+    recvMessage(s, h, resp);
+    if (h.type != DELTA_RESP) {
+        std::cout << "Sync failed: " << resp << "\n";
+        return;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    Sha256 sha;
+    std::string batch;
+    uint64_t literalBytes = 0, copiedBytes = 0;
+    uint32_t copyFirst = 0, copyCount = 0;
+    auto flushBatch = [&](bool force) {
+        if (batch.empty() || (!force && batch.size() < MAX_DATA_FRAME)) return;
+        sendMessage(s, DELTA_DATA, batch);
+        batch.clear();
+    };
+    auto flushCopy = [&]() {
+        if (copyCount == 0) return;
+        batch.push_back(static_cast<char>(DELTA_COPY));
+        batch.append(reinterpret_cast<const char*>(&copyFirst), 4);
+        batch.append(reinterpret_cast<const char*>(&copyCount), 4);
+        copyCount = 0;
+        flushBatch(false);
+    };
+    auto emitCopy = [&](uint32_t block, uint64_t len) {
+        if (copyCount > 0 && block == copyFirst + copyCount) ++copyCount;
+        else {
+            flushCopy();
+            copyFirst = block;
+            copyCount = 1;
+        }
+        copiedBytes += len;
+    };
+    auto emitLiteral = [&](const uint8_t* p, size_t len) {
+        if (len == 0) return;
+        flushCopy();
+        const uint32_t n = static_cast<uint32_t>(len);
+        batch.push_back(static_cast<char>(DELTA_LITERAL));
+        batch.append(reinterpret_cast<const char*>(&n), 4);
+        batch.append(reinterpret_cast<const char*>(p), len);
+        literalBytes += len;
+        flushBatch(false);
+    };
+
+    // buf[lit, p) is pending literal, buf[p, p + blockSize) the window.
+    std::vector<uint8_t> buf(DELTA_MAX_LITERAL + 4ull * blockSize + (4 << 20));
+    size_t lit = 0, p = 0, end = 0;
+    uint64_t bufPos = 0, nextReport = 64ull << 20;   // file offset of buf[0]
+    bool eof = false, rolling = false;
+    RollingChecksum roll;
+    for (;;) {
+        if (!eof && end - p < static_cast<size_t>(blockSize) + 1) {
+            // Slide the unprocessed tail to the front and refill.
+            std::memmove(buf.data(), buf.data() + lit, end - lit);
+            bufPos += lit;
+            p -= lit;
+            end -= lit;
+            lit = 0;
+            in.read(reinterpret_cast<char*>(buf.data() + end), static_cast<std::streamsize>(buf.size() - end));
+            const size_t n = static_cast<size_t>(in.gcount());
+            sha.update(buf.data() + end, n);
+            end += n;
+            eof = !in;
+        }
+        if (end - p < blockSize) break;
+
+        if (!rolling) {
+            roll.init(buf.data() + p, blockSize);
+            rolling = true;
+        }
+        bool matched = false;
+        auto it = byWeak.find(roll.value());
+        if (it != byWeak.end()) {
+            const uint32_t crc = crc32c(0, buf.data() + p, blockSize);
+            for (uint32_t block : it->second) {
+                if (crcs[block] != crc) continue;
+                emitLiteral(buf.data() + lit, p - lit);
+                emitCopy(block, blockSize);
+                p += blockSize;
+                lit = p;
+                rolling = false;
+                matched = true;
+                break;
+            }
+        }
+        if (matched) continue;
+
+        if (p + blockSize < end) roll.roll(buf[p], buf[p + blockSize]);
+        else rolling = false;
+        ++p;
+        if (p - lit >= DELTA_MAX_LITERAL) {
+            emitLiteral(buf.data() + lit, p - lit);
+            lit = p;
+        }
+        if (bufPos + p >= nextReport) {
+            std::cout << "Scanned " << bufPos + p << "/" << fileSize << " bytes\r";
+            nextReport += 64ull << 20;
+        }
+    }
+    // The tail shorter than a block may still equal the old file's tail.
+    const size_t tail = end - p;
+    if (tail > 0 && tail == lastLen && crc32c(0, buf.data() + p, tail) == crcs[count - 1] &&
+        weakChecksum(buf.data() + p, tail) == weak[count - 1]) {
+        emitLiteral(buf.data() + lit, p - lit);
+        emitCopy(count - 1, tail);
+        lit = p = end;
+    }
+    emitLiteral(buf.data() + lit, end - lit);
+    flushCopy();
+    flushBatch(true);
+
+    sendMessage(s, DELTA_COMMIT_REQ, formatSha256(sha.finishHex()));
+    recvMessage(s, h, resp);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (h.type != DELTA_COMMIT_RESP) {
+        std::cout << "\nSync failed: " << resp << "\n";
+        return;
+    }
+    std::cout << "\nSynced as " << resp << ": " << literalBytes << " bytes sent, " << copiedBytes
+        << " reused from the server's copy (" << sig.size() << "-byte signature, "
+        << std::fixed << std::setprecision(2) << secs << " s)\n";
+}
+
+// pget progress: "size range_size" followed by the bytes done in each range.
+struct PgetState {
+    uint64_t size = 0;
+    uint64_t rangeSize = 0;
+    std::vector<uint64_t> done;
+};
+
+static std::string pgetFilename(const std::string& file) {
+    return ".pget_" + file + ".txt";
+}
+
+static bool loadPget(const std::string& file, PgetState& st) {
+    std::ifstream in(pgetFilename(file));
+    if (!in || !(in >> st.size >> st.rangeSize) || st.rangeSize == 0) return false;
+    st.done.assign(static_cast<size_t>((st.size + st.rangeSize - 1) / st.rangeSize), 0);
+    for (auto& d : st.done) {
+        if (!(in >> d)) return false;
+    }
+    return true;
+}
+
+static void savePget(const std::string& file, const PgetState& st) {
+    std::ofstream out(pgetFilename(file), std::ios::trunc);
+    if (!out) return;
+    out << st.size << " " << st.rangeSize << "\n";
+    for (auto d : st.done) out << d << "\n";
+}
+
+// pwrite: a positioned WriteFile leaves the other ranges' writers alone.
+static bool writeAt(HANDLE h, uint64_t offset, const char* buf, DWORD len) {
+    while (len > 0) {
+        OVERLAPPED ov{};
+        ov.Offset = static_cast<DWORD>(offset);
+        ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD n = 0;
+        if (!WriteFile(h, buf, len, &n, &ov) || n == 0) return false;
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+    return true;
 }
 
+// pget <file> [-j N]: splits the file into ranges and fetches them over N
+// connections into a preallocated output. Per-range progress is saved, so
+// an interrupted pget continues each range where it stopped.
+static void doPget(SOCKET s, const char* host, const char* port, const std::string& args) {
+    std::istringstream iss(args);
+    std::string file, opt;
+    int jobs = 4;
+    iss >> file;
+    while (iss >> opt) {
+        if (opt == "-j") iss >> jobs;
+        else if (opt.rfind("-j", 0) == 0) jobs = std::atoi(opt.c_str() + 2);
+    }
+    if (file.empty() || jobs <= 0) {
+        std::cout << "usage: pget <file> [-j N]\n";
+        return;
+    }
+
+    // An empty range just reports the size.
+    sendMessage(s, GET_REQ, file + "||0|0");
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+    if (h.type != GET_RESP) {
+        std::cout << "Download failed: " << payload << "\n";
+        return;
+    }
+    GetResp resp = parseGetResp(payload);
+    const uint64_t fileSize = resp.size;
+
+    std::error_code ec;
+    PgetState st;
+    if (!loadPget(file, st) || st.size != fileSize || std::filesystem::file_size(file, ec) != fileSize) {
+        const uint64_t MiB = 1024 * 1024;
+        st = PgetState{};
+        st.size = fileSize;
+        st.rangeSize = std::min<uint64_t>(std::max<uint64_t>(fileSize / (jobs * 4ull), MiB), 64 * MiB);
+        st.done.assign(static_cast<size_t>((fileSize + st.rangeSize - 1) / st.rangeSize), 0);
+    }
+    else {
+        std::cout << "Resuming " << file << "\n";
+    }
+
+    HANDLE out = CreateFileW(std::filesystem::path(file).wstring().c_str(), GENERIC_WRITE,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (out == INVALID_HANDLE_VALUE) {
+        std::cout << "Cannot open " << file << "\n";
+        return;
+    }
+    FILE_ALLOCATION_INFO alloc{};
+    alloc.AllocationSize.QuadPart = static_cast<LONGLONG>(fileSize);
+    SetFileInformationByHandle(out, FileAllocationInfo, &alloc, sizeof(alloc));
+    FILE_END_OF_FILE_INFO eof{};
+    eof.EndOfFile.QuadPart = static_cast<LONGLONG>(fileSize);
+    SetFileInformationByHandle(out, FileEndOfFileInfo, &eof, sizeof(eof));
+    savePget(file, st);
+
+    std::mutex mu;
+    std::atomic<size_t> nextRange{0};
+    std::atomic<uint64_t> total{0};
+    std::atomic<bool> failed{false};
+    const size_t ranges = st.done.size();
+    const uint64_t SAVE_EVERY = 8 * 1024 * 1024;
+
+    auto worker = [&]() {
+        SOCKET c = INVALID_SOCKET;
+        std::vector<char> buf(256 * 1024);
+        try {
+            c = connectTo(host, port);
+            for (;;) {
+                const size_t i = nextRange++;
+                if (failed || i >= ranges) break;
+                const uint64_t start = i * st.rangeSize;
+                const uint64_t len = std::min<uint64_t>(st.rangeSize, fileSize - start);
+                uint64_t done;
+                {
+                    std::lock_guard<std::mutex> lock(mu);
+                    done = st.done[i];
+                }
+                if (done >= len) continue;
+
+                MsgHeader rh{};
+                std::string resp;
+                sendMessage(c, GET_REQ, file + "||" + std::to_string(start + done) + "|" + std::to_string(len - done));
+                recvMessage(c, rh, resp);
+                if (rh.type != GET_RESP) throw std::runtime_error(resp);
+
+                uint64_t unsaved = 0;
+                while (done < len) {
+                    int n = static_cast<int>(std::min<uint64_t>(buf.size(), len - done));
+                    recvAll(c, buf.data(), n);
+                    if (!writeAt(out, start + done, buf.data(), static_cast<DWORD>(n)))
+                        throw std::runtime_error("write failed");
+                    done += n;
+                    unsaved += n;
+                    total += n;
+                    if (unsaved >= SAVE_EVERY || done >= len) {
+                        std::lock_guard<std::mutex> lock(mu);
+                        st.done[i] = done;
+                        savePget(file, st);
+                        unsaved = 0;
+                    }
+                }
+            }
+        }
+        catch (const std::exception& ex) {
+            std::lock_guard<std::mutex> lock(mu);
+            std::cout << "pget worker: " << ex.what() << "\n";
+            failed = true;
+        }
+        if (c != INVALID_SOCKET) closesocket(c);
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; ++j) workers.emplace_back(worker);
+    for (auto& t : workers) t.join();
+    CloseHandle(out);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    if (failed) {
+        std::cout << "Download incomplete; run pget again to resume\n";
+        return;
+    }
+    std::remove(pgetFilename(file).c_str());
+    if (resp.hasCrc) {
+        // Ranges land out of order, so verify the assembled file in one pass.
+        uint32_t crc = crcOfFile(file, fileSize);
+        if (crc != resp.crc) {
+            std::cout << "Checksum mismatch: expected " << formatCrc32c(resp.crc) << ", got " << formatCrc32c(crc) << "\n";
+            return;
+        }
+    }
+    std::cout << "Download complete: " << total.load() << " bytes over " << jobs << " connections in "
+        << std::fixed << std::setprecision(3) << secs << " s ("
+        << std::setprecision(1) << (total.load() / (1024.0 * 1024.0)) / std::max<double>(secs, 1e-9) << " MiB/s)\n";
+}
+
+static std::string putSessionFilename(const std::string& file) {
+    return ".put_" + std::filesystem::path(file).filename().string() + ".txt";
+}
+
+// put <file> -j N: uploads through a resumable session. Chunks go out over
+// N connections; the server reports which ranges it already holds, so
+// rerunning after a failure sends only the missing ones.
+static void doPutSession(SOCKET s, const char* host, const char* port, const std::string& file, int jobs) {
+    std::error_code ec;
+    uint64_t fileSize = std::filesystem::file_size(file, ec);
+    if (ec) {
+        std::cout << "File not found: " << file << "\n";
+        return;
+    }
+
+    std::string uploadId;
+    {
+        std::ifstream in(putSessionFilename(file));
+        if (in) in >> uploadId;
+    }
+    std::string request = file + "|" + std::to_string(fileSize) + "|" + uploadId + "|" + offerHash(s, file);
+    sendMessage(s, UPLOAD_OPEN_REQ, request);
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+    if (h.type == UPLOAD_COMMIT_RESP) {
+        std::remove(putSessionFilename(file).c_str());
+        std::cout << "Stored as " << payload << " (content already on server, nothing sent)\n";
+        return;
+    }
+    if (h.type != UPLOAD_OPEN_RESP) {
+        std::cout << "Server rejected upload: " << payload << "\n";
+        return;
+    }
+    auto sep = payload.find('|');
+    if (payload.substr(0, sep) == uploadId) std::cout << "Resuming upload " << uploadId << "\n";
+    uploadId = payload.substr(0, sep);
+    std::ofstream(putSessionFilename(file), std::ios::trunc) << uploadId << "\n";
+
+    // Everything not in the server's "start-end,..." list, in chunks.
+    const uint64_t CHUNK_SIZE = 4 * 1024 * 1024;
+    std::vector<std::pair<uint64_t, uint64_t>> missing;
+    uint64_t pos = 0;
+    std::istringstream ranges(payload.substr(sep + 1));
+    std::string item;
+    auto addGap = [&](uint64_t from, uint64_t to) {
+        for (; from < to; from += CHUNK_SIZE) missing.emplace_back(from, std::min<uint64_t>(CHUNK_SIZE, to - from));
+    };
+    while (std::getline(ranges, item, ',')) {
+        auto dash = item.find('-');
+        if (dash == std::string::npos) continue;
+        uint64_t start = std::stoull(item.substr(0, dash)), end = std::stoull(item.substr(dash + 1));
+        addGap(pos, start);
+        pos = std::max<uint64_t>(pos, end);
+    }
+    addGap(pos, fileSize);
+
+    std::mutex mu;
+    std::atomic<size_t> next{0};
+    std::atomic<uint64_t> total{0};
+    std::atomic<bool> failed{false};
+    auto worker = [&]() {
+        SOCKET c = INVALID_SOCKET;
+        try {
+            c = connectTo(host, port);
+            std::ifstream in(file, std::ios::binary);
+            // The request is built in place around the chunk, in buffers
+            // that keep their size from one chunk to the next.
+            std::string request, resp;
+            for (;;) {
+                const size_t i = next++;
+                if (failed || i >= missing.size()) break;
+                const auto [offset, len] = missing[i];
+                request.assign(uploadId).append("|").append(std::to_string(offset)).append("|");
+                const size_t head = request.size();
+                request.resize(head + static_cast<size_t>(len));
+                in.seekg(static_cast<std::streamoff>(offset));
+                if (!in.read(request.data() + head, static_cast<std::streamsize>(len))) throw std::runtime_error("read failed");
+
+                sendMessage(c, UPLOAD_CHUNK_REQ, request);
+                MsgHeader rh{};
+                recvMessage(c, rh, resp);
+                if (rh.type != UPLOAD_CHUNK_RESP) throw std::runtime_error(resp);
+                total += len;
+            }
+        }
+        catch (const std::exception& ex) {
+            std::lock_guard<std::mutex> lock(mu);
+            std::cout << "put worker: " << ex.what() << "\n";
+            failed = true;
+        }
+        if (c != INVALID_SOCKET) closesocket(c);
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; ++j) workers.emplace_back(worker);
+    for (auto& t : workers) t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (failed) {
+        std::cout << "Upload incomplete; run the same put again to resume\n";
+        return;
+    }
+
+    sendMessage(s, UPLOAD_COMMIT_REQ, uploadId);
+    recvMessage(s, h, payload);
+    if (h.type != UPLOAD_COMMIT_RESP) {
+        std::cout << "Commit failed: " << payload << "\n";
+        return;
+    }
+    std::remove(putSessionFilename(file).c_str());
+    std::cout << "Upload complete: file id " << payload << ", sent " << total.load() << " bytes in "
+        << std::fixed << std::setprecision(3) << secs << " s\n";
+}
+
+// pipeline get <a> <b> ...: every GET goes out at once on its own v2 stream;
+// the replies come back as interleaved DATA frames.
+static void doPipelineGet(SOCKET s, const std::string& args) {
+    struct Stream {
+        std::string name;
+        std::ofstream out;
+        uint64_t size = 0;
+        uint64_t received = 0;
+        GetResp resp;
+        uint32_t crc = 0;
+    };
+    std::map<uint32_t, Stream> streams;
+
+    std::istringstream iss(args);
+    std::string name;
+    uint32_t next = 1;
+    while (iss >> name) {
+        sendStreamMessage(s, next, GET_REQ, name);
+        streams[next++].name = name;
+    }
+    if (streams.empty()) {
+        std::cout << "usage: pipeline get <file> [file...]\n";
+        return;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    uint64_t total = 0;
+    MsgHeader h{};
+    std::string payload;
+    while (!streams.empty()) {
+        recvMessage(s, h, payload);
+        auto it = streams.find(h.stream);
+        if (it == streams.end()) continue;
+        Stream& st = it->second;
+
+        bool done = false;
+        if (h.type == GET_RESP) {
+            st.resp = parseGetResp(payload);
+            st.size = st.resp.size;
+            st.out.open(st.name, std::ios::binary | std::ios::trunc);
+            done = (st.size == 0);
+        }
+        else if (h.type == DATA) {
+            st.out.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+            st.crc = crc32c(st.crc, payload.data(), payload.size());
+            st.received += payload.size();
+            total += payload.size();
+            done = (st.received >= st.size);
+        }
+        else {
+            std::cout << st.name << ": failed: " << payload << "\n";
+            streams.erase(it);
+            continue;
+        }
+
+        if (done) {
+            std::cout << st.name << ": " << st.received << " bytes";
+            if (st.resp.hasCrc) std::cout << (st.crc == st.resp.crc ? ", checksum ok" : ", CHECKSUM MISMATCH");
+            std::cout << "\n";
+            streams.erase(it);
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "Downloaded " << total << " bytes in " << std::fixed << std::setprecision(3) << secs << " s\n";
+}
+
+// pipeline put <a> <b> ...: opens one v2 stream per file and sends their
+// DATA frames round-robin without waiting for the server in between.
+static void doPipelinePut(SOCKET s, const std::string& args) {
+    struct Stream {
+        std::string name;
+        std::ifstream in;
+        uint64_t size = 0;
+        uint64_t sent = 0;
+    };
+    std::map<uint32_t, Stream> streams;
+
+    std::istringstream iss(args);
+    std::string name;
+    uint32_t next = 1;
+    while (iss >> name) {
+        Stream st;
+        st.name = name;
+        st.in.open(name, std::ios::binary);
+        if (!st.in) {
+            std::cout << "File not found: " << name << "\n";
+            continue;
+        }
+        st.in.seekg(0, std::ios::end);
+        st.size = static_cast<uint64_t>(st.in.tellg());
+        st.in.seekg(0, std::ios::beg);
+        sendStreamMessage(s, next, PUT_REQ, name + "|" + std::to_string(st.size));
+        streams.emplace(next++, std::move(st));
+    }
+    if (streams.empty()) {
+        std::cout << "usage: pipeline put <file> [file...]\n";
+        return;
+    }
+
+    const size_t FRAME = 256 * 1024;
+    std::string chunk(FRAME, '\0');
+    for (bool more = true; more;) {
+        more = false;
+        for (auto& [id, st] : streams) {
+            if (st.sent >= st.size) continue;
+            size_t n = static_cast<size_t>(std::min<uint64_t>(FRAME, st.size - st.sent));
+            st.in.read(chunk.data(), static_cast<std::streamsize>(n));
+            sendStreamMessage(s, id, DATA, std::string_view(chunk.data(), n));
+            st.sent += n;
+            more = more || st.sent < st.size;
+        }
+    }
+
+    MsgHeader h{};
+    std::string payload;
+    while (!streams.empty()) {
+        recvMessage(s, h, payload);
+        auto it = streams.find(h.stream);
+        if (it == streams.end() || h.type == PUT_RESP) continue;
+        if (h.type == PUT_DONE) std::cout << it->second.name << ": stored as " << payload << "\n";
+        else std::cout << it->second.name << ": failed: " << payload << "\n";
+        streams.erase(it);
+    }
+}
+
+// Removes " <flag> <value>" from a command's arguments and returns the
+// value, or "" when the flag is absent.
+static std::string takeOption(std::string& args, const std::string& flag) {
+    auto at = args.find(" " + flag + " ");
+    if (at == std::string::npos) return "";
+    size_t start = at + flag.size() + 2;
+    size_t end = args.find(' ', start);
+    std::string value = args.substr(start, end == std::string::npos ? end : end - start);
+    args.erase(at, end == std::string::npos ? end : end - at);
+    return value;
+}
+
+// Where a batch download writes a server file: under `dir`, keeping any
+// relative subdirectories in the name but never leaving `dir`.
+static std::filesystem::path localPathFor(const std::filesystem::path& dir, const std::string& name) {
+    std::filesystem::path rel(name);
+    bool safe = !rel.has_root_path();
+    for (const auto& part : rel) {
+        if (part == "..") safe = false;
+    }
+    if (!safe) rel = rel.filename();
+    std::filesystem::path p = dir / rel;
+    std::error_code ec;
+    if (p.has_parent_path()) std::filesystem::create_directories(p.parent_path(), ec);
+    return p;
+}
+
+// mget <file> [file...] [-o dir]: fetches every file in one request on one
+// v2 stream. The reply lists each file's size and checksum, then their
+// bytes follow back to back and each file is written as it arrives.
+static void doMget(SOCKET s, const std::string& args) {
+    std::string rest = " " + args;
+    const std::filesystem::path dir = takeOption(rest, "-o");
+    std::vector<std::string> names;
+    std::istringstream iss(rest);
+    for (std::string name; iss >> name;) names.push_back(name);
+    if (names.empty()) {
+        std::cout << "usage: mget <file> [file...] [-o dir]\n";
+        return;
+    }
+
+    std::string request;
+    for (const auto& name : names) request += (request.empty() ? "" : "\n") + name;
+    const uint32_t stream = 1;
+    auto t0 = std::chrono::steady_clock::now();
+    sendStreamMessage(s, stream, MGET_REQ, request);
+    MsgHeader h{};
+    std::string payload;
+    recvMessage(s, h, payload);
+    if (h.type != MGET_RESP) {
+        std::cout << "Download failed: " << payload << "\n";
+        return;
+    }
+
+    // "size|checksum" per file, or "-|error" for one the server won't send.
+    struct Item {
+        std::string name;
+        uint64_t size = 0;
+        bool hasCrc = false;
+        uint32_t crc = 0;
+    };
+    std::vector<Item> items;
+    std::istringstream lines(payload);
+    std::string line;
+    for (size_t i = 0; i < names.size() && std::getline(lines, line); ++i) {
+        const size_t bar = line.find('|');
+        const std::string size = line.substr(0, bar);
+        const std::string rest2 = bar == std::string::npos ? std::string() : line.substr(bar + 1);
+        if (size == "-") {
+            std::cout << names[i] << ": failed: " << rest2 << "\n";
+            continue;
+        }
+        Item it;
+        it.name = names[i];
+        it.size = std::stoull(size);
+        it.hasCrc = parseCrc32c(rest2, it.crc);
+        items.push_back(std::move(it));
+    }
+
+    uint64_t total = 0;
+    size_t verified = 0;
+    for (const Item& it : items) {
+        std::ofstream out(localPathFor(dir, it.name), std::ios::binary | std::ios::trunc);
+        uint32_t crc = 0;
+        uint64_t got = 0;
+        // No frame spans two files.
+        while (got < it.size) {
+            recvMessage(s, h, payload);
+            if (h.stream != stream) continue;
+            if (h.type != DATA) {
+                std::cout << it.name << ": failed: " << payload << "\n";
+                return;
+            }
+            if (payload.size() > it.size - got) throw std::runtime_error("mget frame overruns " + it.name);
+            out.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+            crc = crc32c(crc, payload.data(), payload.size());
+            got += payload.size();
+        }
+        total += got;
+        if (it.hasCrc && crc != it.crc) std::cout << it.name << ": CHECKSUM MISMATCH\n";
+        else ++verified;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << verified << "/" << items.size() << " files downloaded, ";
+    reportTransfer(total, secs, Codec::None, nullptr);
+}
+
+// mput <dir|file> [...]: uploads many files in one request on one v2
+// stream. Names and sizes go first and the server creates every row in one
+// transaction; after its reply the accepted files' bytes follow back to
+// back without waiting on the server. A directory contributes every file
+// under it, named by its path relative to the directory.
+static void doMput(SOCKET s, const std::string& args) {
+    struct Item {
+        std::filesystem::path path;
+        std::string name;
+        uint64_t size = 0;
+    };
+    std::vector<Item> items;
+    std::istringstream iss(args);
+    std::error_code ec;
+    for (std::string arg; iss >> arg;) {
+        const std::filesystem::path p(arg);
+        if (std::filesystem::is_directory(p, ec)) {
+            for (const auto& e : std::filesystem::recursive_directory_iterator(p, ec)) {
+                if (e.is_regular_file(ec)) items.push_back({ e.path(), e.path().lexically_relative(p).generic_string(), e.file_size(ec) });
+            }
+        }
+        else if (std::filesystem::is_regular_file(p, ec)) {
+            items.push_back({ p, arg, std::filesystem::file_size(p, ec) });
+        }
+        else {
+            std::cout << "File not found: " << arg << "\n";
+        }
+    }
+    if (items.empty()) {
+        std::cout << "usage: mput <dir|file> [dir|file...]\n";
+        return;
+    }
+
+    std::string request;
+    for (const auto& it : items) request += it.name + "|" + std::to_string(it.size) + "\n";
+    const uint32_t stream = 1;
+    auto t0 = std::chrono::steady_clock::now();
+    sendStreamMessage(s, stream, MPUT_REQ, request);
+    MsgHeader h{};
+    std::string payload;
+    do recvMessage(s, h, payload); while (h.stream != stream);
+    if (h.type != MPUT_RESP) {
+        std::cout << "Upload failed: " << payload << "\n";
+        return;
+    }
+
+    // One line per file: its new id, or "-" if the name is taken.
+    std::istringstream ids(payload);
+    std::string id;
+    const size_t FRAME = 256 * 1024;
+    std::string chunk;
+    uint64_t total = 0;
+    for (const auto& it : items) {
+        if (!std::getline(ids, id)) break;
+        if (id == "-") {
+            std::cout << it.name << ": name taken, skipped\n";
+            continue;
+        }
+        std::ifstream in(it.path, std::ios::binary);
+        for (uint64_t sent = 0; sent < it.size;) {
+            chunk.resize(static_cast<size_t>(std::min<uint64_t>(FRAME, it.size - sent)));
+            in.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+            // The server counts on the announced size; a short file would
+            // put the rest of the batch out of step.
+            if (static_cast<size_t>(in.gcount()) != chunk.size()) throw std::runtime_error(it.name + " shrank during mput");
+            sendStreamMessage(s, stream, DATA, chunk);
+            sent += chunk.size();
+            total += chunk.size();
+        }
+    }
+
+    do recvMessage(s, h, payload); while (h.stream != stream);
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (h.type != MPUT_DONE) {
+        std::cout << "Upload failed: " << payload << "\n";
+        return;
+    }
+    std::cout << payload << " files stored, ";
+    reportTransfer(total, secs, Codec::None, nullptr);
+}
 
 int main(int argc, char** argv) {
     try {
@@ -179,9 +1425,19 @@ int main(int argc, char** argv) {
         std::cout << "Connected to FTP-Lite\n";
         std::cout << "Commands:\n"
             "  ping\n"
-            "  list [path]\n"
-            "  get <filename>\n"
-			"  put <filename>\n"
+            "  list [sort=newest|name|size] [limit=N] [prefix=P|glob=G] [after=CURSOR] [format=text|binary]\n"
+            "  get <filename> [-z xpress|xpress-huff]\n"
+            "  verify <filename>\n"
+			"  put <filename> [-j N] [-z xpress|xpress-huff]\n"
+            "  sync <filename>\n"
+            "  stats\n"
+            "  rate [[down.|up.]global|conn|small|bulk=KiB/s] [small_kb=N] [small_weight=N] [bulk_weight=N]\n"
+            "  bench get <file_id> [rounds]\n"
+            "  bench crc [MiB]\n"
+            "  pget <file> [-j N]\n"
+            "  pipeline get|put <file> [file...]\n"
+            "  mget <file> [file...] [-o dir]\n"
+            "  mput <dir|file> [dir|file...]\n"
             "  quit\n\n";
 
         for (;;) {
@@ -192,19 +1448,70 @@ int main(int argc, char** argv) {
             if (cmd == "ping") {
                 doPing(s);
             }
+            else if (cmd == "stats") {
+                doStats(s);
+            }
+            else if (cmd == "rate" || cmd.rfind("rate ", 0) == 0) {
+                doRate(s, cmd.size() > 5 ? cmd.substr(5) : "");
+            }
+            else if (cmd.rfind("bench get ", 0) == 0) {
+                doBenchGet(s, cmd.substr(10));
+            }
+            else if (cmd.rfind("bench crc", 0) == 0) {
+                doBenchCrc(cmd.substr(9));
+            }
+            else if (cmd.rfind("pget ", 0) == 0) {
+                doPget(s, host, port, cmd.substr(5));
+            }
+            else if (cmd.rfind("pipeline get ", 0) == 0) {
+                doPipelineGet(s, cmd.substr(13));
+            }
+            else if (cmd.rfind("pipeline put ", 0) == 0) {
+                doPipelinePut(s, cmd.substr(13));
+            }
+            else if (cmd.rfind("mget ", 0) == 0) {
+                doMget(s, cmd.substr(5));
+            }
+            else if (cmd.rfind("mput ", 0) == 0) {
+                doMput(s, cmd.substr(5));
+            }
             else if (cmd.rfind("list", 0) == 0) {
                 std::string arg = "";
                 if (cmd.size() > 5)
                     arg = cmd.substr(5);
                 doList(s, arg);
             }
+            else if (cmd.rfind("verify ", 0) == 0) {
+                doVerify(s, cmd.substr(7));
+            }
             else if (cmd.rfind("get ", 0) == 0) {
                 std::string filename = cmd.substr(4);
-                doGet(s, filename);
+                Codec codec = Codec::None;
+                if (!parseCodec(takeOption(filename, "-z"), codec)) {
+                    std::cout << "Unknown codec\n";
+                    continue;
+                }
+                doGet(s, filename, codec);
+            }
+            else if (cmd.rfind("sync ", 0) == 0) {
+                doSync(s, cmd.substr(5));
             }
             else if (cmd.rfind("put ", 0) == 0) {
                 std::string filename = cmd.substr(4);
-                doPut(s, filename);
+                Codec codec = Codec::None;
+                if (!parseCodec(takeOption(filename, "-z"), codec)) {
+                    std::cout << "Unknown codec\n";
+                    continue;
+                }
+                auto j = filename.find(" -j");
+                if (j == std::string::npos) {
+                    doPut(s, filename, codec);
+                }
+                else {
+                    if (codec != Codec::None) std::cout << "-z applies to single-stream put; sending uncompressed\n";
+                    int jobs = std::atoi(filename.c_str() + j + 3);
+                    doPutSession(s, host, port, filename.substr(0, j), jobs > 0 ? jobs : 4);
+                }
             }
             else if (cmd == "quit" || cmd == "exit") {
                 break;
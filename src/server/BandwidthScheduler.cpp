@@ -0,0 +1,180 @@
+#include "BandwidthScheduler.hpp"
+#include <algorithm>
+
+using Clock = std::chrono::steady_clock;
+
+// How often waiters are looked at while there are any.
+static constexpr auto TICK = std::chrono::milliseconds(5);
+// The frame a waiter is assumed to send, for its tag and its reservation.
+static constexpr uint64_t NOMINAL_FRAME = 256 * 1024;
+// Buckets hold a tenth of a second at their rate, and at least a frame.
+static double burstFor(uint64_t rate) {
+    return std::max<double>(double(rate) / 10, double(NOMINAL_FRAME));
+}
+
+static bool anyRate(const BandwidthScheduler::Limits& l) {
+    return l.global || l.conn || l.small || l.bulk;
+}
+
+void BandwidthScheduler::Bucket::refill(uint64_t rate, Clock::time_point now) {
+    const double dt = std::chrono::duration<double>(now - last).count();
+    last = now;
+    if (rate == 0) {
+        tokens = 0;
+        return;
+    }
+    tokens = std::min<double>(burstFor(rate), tokens + double(rate) * dt);
+}
+
+BandwidthScheduler::BandwidthScheduler(const Limits& limits) : limits_(limits) {
+    limits_.smallWeight = std::max<unsigned>(1, limits_.smallWeight);
+    limits_.bulkWeight = std::max<unsigned>(1, limits_.bulkWeight);
+    active_ = anyRate(limits_);
+    ticker_ = std::thread([this]() { tickLoop(); });
+}
+
+BandwidthScheduler::~BandwidthScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (ticker_.joinable()) ticker_.join();
+}
+
+std::shared_ptr<BandwidthScheduler::Flow> BandwidthScheduler::newFlow() {
+    return std::make_shared<Flow>();
+}
+
+BandwidthScheduler::Class BandwidthScheduler::classify(uint64_t transferBytes) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return transferBytes <= limits_.smallBytes ? Small : Bulk;
+}
+
+unsigned BandwidthScheduler::weight(Class c) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return c == Small ? limits_.smallWeight : limits_.bulkWeight;
+}
+
+bool BandwidthScheduler::acquire(const std::shared_ptr<Flow>& flow, Class c, std::function<void()> wake) {
+    if (!active_.load()) return true;
+    std::lock_guard<std::mutex> lock(mu_);
+    if (flow->reserved) return true;
+    const Clock::time_point now = Clock::now();
+    refillLocked(*flow, now);
+    const double tag = tagLocked(*flow, c);
+    if (openLocked(*flow, c)) {
+        // Still behind any waiter with an earlier tag that could go too; the
+        // ticker wakes that one first.
+        bool behind = false;
+        for (Waiter& w : waiters_) {
+            if (w.tag > tag) break;
+            w.flow->bucket.refill(limits_.conn, now);
+            if (openLocked(*w.flow, w.cls)) {
+                behind = true;
+                break;
+            }
+        }
+        if (!behind) return true;
+    }
+    auto at = std::upper_bound(waiters_.begin(), waiters_.end(), tag,
+                               [](double t, const Waiter& w) { return t < w.tag; });
+    waiters_.insert(at, Waiter{flow, c, tag, std::move(wake)});
+    ++waits_;
+    cv_.notify_all();
+    return false;
+}
+
+void BandwidthScheduler::consume(Flow& flow, Class c, uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (!active_.load() && !flow.reserved) return;
+    // The reservation was charged when the frame was granted.
+    chargeLocked(flow, c, double(bytes) - double(flow.reserved));
+    flow.reserved = 0;
+    // Start-time fair queueing: the frame starts at the later of the server's
+    // virtual time and the flow's last finish, and takes bytes/weight.
+    const double start = std::max<double>(vtime_, flow.tag);
+    flow.tag = start + double(bytes) / (c == Small ? limits_.smallWeight : limits_.bulkWeight);
+    vtime_ = start;
+}
+
+BandwidthScheduler::Limits BandwidthScheduler::limits() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return limits_;
+}
+
+void BandwidthScheduler::setLimits(const Limits& limits) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        limits_ = limits;
+        limits_.smallWeight = std::max<unsigned>(1, limits_.smallWeight);
+        limits_.bulkWeight = std::max<unsigned>(1, limits_.bulkWeight);
+        active_ = anyRate(limits_);
+    }
+    // Waiters are looked at again under the new limits, and all let go if
+    // there are none left.
+    cv_.notify_all();
+}
+
+void BandwidthScheduler::refillLocked(Flow& flow, Clock::time_point now) {
+    global_.refill(limits_.global, now);
+    classes_[Small].refill(limits_.small, now);
+    classes_[Bulk].refill(limits_.bulk, now);
+    flow.bucket.refill(limits_.conn, now);
+}
+
+bool BandwidthScheduler::openLocked(const Flow& flow, Class c) const {
+    return global_.open(limits_.global) && classes_[c].open(c == Small ? limits_.small : limits_.bulk)
+        && flow.bucket.open(limits_.conn);
+}
+
+// A waiter is ordered by where a nominal frame would finish, so a small
+// transfer's frame, taking a fraction of the virtual time, lines up ahead
+// of bulk frames that started at the same point.
+double BandwidthScheduler::tagLocked(const Flow& flow, Class c) const {
+    const unsigned w = c == Small ? limits_.smallWeight : limits_.bulkWeight;
+    return std::max<double>(vtime_, flow.tag) + double(NOMINAL_FRAME) / w;
+}
+
+void BandwidthScheduler::chargeLocked(Flow& flow, Class c, double bytes) {
+    global_.tokens -= bytes;
+    classes_[c].tokens -= bytes;
+    flow.bucket.tokens -= bytes;
+}
+
+void BandwidthScheduler::tickLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!stop_) {
+        if (waiters_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        cv_.wait_for(lock, TICK);
+        if (stop_) break;
+
+        // In tag order, every waiter whose buckets all have tokens gets a
+        // frame set aside. One held back by its own connection or class
+        // doesn't hold up the others; one held back by the global bucket
+        // holds up everything after it.
+        std::vector<std::function<void()>> woken;
+        const Clock::time_point now = Clock::now();
+        for (auto it = waiters_.begin(); it != waiters_.end();) {
+            refillLocked(*it->flow, now);
+            if (!global_.open(limits_.global)) break;
+            if (!openLocked(*it->flow, it->cls)) {
+                ++it;
+                continue;
+            }
+            if (active_.load()) {
+                it->flow->reserved = NOMINAL_FRAME;
+                chargeLocked(*it->flow, it->cls, double(NOMINAL_FRAME));
+            }
+            woken.push_back(std::move(it->wake));
+            it = waiters_.erase(it);
+        }
+        if (woken.empty()) continue;
+        lock.unlock();
+        for (auto& wake : woken) wake();
+        lock.lock();
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Rate limits for one direction of file data: downloads or uploads. Bytes
+// are drawn from three token buckets at once, the server's, the transfer
+// class's and the connection's; a bucket may go into debt by one frame, and
+// a transfer goes again once all three are back above zero. Control replies
+// and request payloads are never held back.
+//
+// Transfers come in two classes: small ones (up to `smallBytes`) and bulk.
+// Connections waiting for tokens are served in weighted-fair order, each
+// frame tagged with a virtual finish time that advances by its size over its
+// class's weight, so while bulk transfers saturate the limit a small one
+// still gets its frames out first. A ticker thread refills the buckets and
+// wakes waiters in tag order.
+//
+// Every limit is 0 for unlimited, and all of them can be changed while the
+// server runs.
+class BandwidthScheduler {
+public:
+    enum Class { Small = 0, Bulk = 1 };
+
+    struct Limits {
+        uint64_t global = 0;        // bytes per second across the server
+        uint64_t conn = 0;          // ...per connection
+        uint64_t small = 0;         // ...for all small transfers together
+        uint64_t bulk = 0;          // ...for all bulk transfers together
+        uint64_t smallBytes = 1024 * 1024;
+        unsigned smallWeight = 8;
+        unsigned bulkWeight = 1;
+    };
+
+    // One connection's share: its bucket and its place in the fair order.
+    class Flow;
+
+    explicit BandwidthScheduler(const Limits& limits);
+    ~BandwidthScheduler();
+
+    BandwidthScheduler(const BandwidthScheduler&) = delete;
+    BandwidthScheduler& operator=(const BandwidthScheduler&) = delete;
+
+    std::shared_ptr<Flow> newFlow();
+    Class classify(uint64_t transferBytes) const;
+    unsigned weight(Class c) const;
+
+    // True if `flow` may move its next frame of class `c` now. Otherwise
+    // queues `wake` to run on the ticker thread once a frame's worth has
+    // been set aside for it, after which acquire() says yes straight away,
+    // and returns false. A flow waits for one frame at a time.
+    bool acquire(const std::shared_ptr<Flow>& flow, Class c, std::function<void()> wake);
+    // Charges the frame that acquire() let through, once its size is known.
+    void consume(Flow& flow, Class c, uint64_t bytes);
+
+    Limits limits() const;
+    void setLimits(const Limits& limits);
+
+    // Frames held back so far.
+    uint64_t waits() const { return waits_.load(); }
+
+private:
+    struct Bucket {
+        double tokens = 0;
+        std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+        void refill(uint64_t rate, std::chrono::steady_clock::time_point now);
+        bool open(uint64_t rate) const { return rate == 0 || tokens > 0; }
+    };
+    struct Waiter {
+        std::shared_ptr<Flow> flow;
+        Class cls;
+        double tag;
+        std::function<void()> wake;
+    };
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    Limits limits_;
+    std::atomic<bool> active_{false};   // any rate is set
+    Bucket global_;
+    Bucket classes_[2];
+    double vtime_ = 0;      // start tag of the last frame let through
+    std::vector<Waiter> waiters_;       // kept sorted by tag
+    std::atomic<uint64_t> waits_{0};
+    bool stop_ = false;
+    std::thread ticker_;
+
+    void refillLocked(Flow& flow, std::chrono::steady_clock::time_point now);
+    bool openLocked(const Flow& flow, Class c) const;
+    double tagLocked(const Flow& flow, Class c) const;
+    void chargeLocked(Flow& flow, Class c, double bytes);
+    void tickLoop();
+};
+
+class BandwidthScheduler::Flow {
+    friend class BandwidthScheduler;
+    Bucket bucket;
+    double tag = 0;         // virtual finish time of its last frame
+    uint64_t reserved = 0;  // set aside by the ticker for the frame it woke
+};
@@ -0,0 +1,165 @@
+#include "BlockCache.hpp"
+#include "BufferPool.hpp"
+#include "FileManager.hpp"
+#include "MetadataStore.hpp"
+#include "../../common/crc32c.hpp"
+#include <algorithm>
+#include <cstring>
+
+static constexpr size_t SHARDS = 16;
+static constexpr uint64_t FILE_ID_KEY = 1ull << 63;    // marks keys not taken from a content hash
+
+bool BlockCache::fileKey(const FileRow& row, FileKey& key) {
+    if (row.content_hash && row.content_hash->size() == 64) {
+        try {
+            key.hi = std::stoull(row.content_hash->substr(0, 16), nullptr, 16) & ~FILE_ID_KEY;
+            key.lo = std::stoull(row.content_hash->substr(16, 16), nullptr, 16);
+            return true;
+        }
+        catch (...) {}
+    }
+    uint32_t crc = 0;
+    if (!row.checksum || !parseCrc32c(*row.checksum, crc)) return false;
+    // The upload time tells apart two versions that happen to share a CRC.
+    uint32_t stamp = 2166136261u;
+    for (unsigned char c : row.uploaded_at) stamp = (stamp ^ c) * 16777619u;
+    key.hi = FILE_ID_KEY | static_cast<uint32_t>(row.file_id);
+    key.lo = (static_cast<uint64_t>(crc) << 32) | stamp;
+    return true;
+}
+
+BlockCache::BlockCache(uint64_t capacityBytes, BufferPool& pool) : pool_(pool) {
+    const uint64_t pages = capacityBytes / PAGE_SIZE;
+    if (pages == 0) return;
+    const size_t perShard = static_cast<size_t>(std::max<uint64_t>(1, pages / SHARDS));
+    for (size_t i = 0; i < SHARDS; ++i) shards_.push_back(std::make_unique<Shard>(perShard));
+}
+
+uint64_t BlockCache::hashKey(const Key& k) {
+    // splitmix64 finaliser over the three words.
+    uint64_t h = k.file.hi ^ (k.file.lo * 0x9e3779b97f4a7c15ull) ^ (k.page * 0xc2b2ae3d27d4eb4full);
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27; h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+int64_t BlockCache::read(const FileKey& file, const BlobFile& blob, uint64_t fileSize,
+                         uint64_t offset, void* out, size_t len) {
+    char* dst = static_cast<char*>(out);
+    size_t done = 0;
+    while (done < len && offset + done < fileSize) {
+        const uint64_t pos = offset + done;
+        const Key key{ file, pos / PAGE_SIZE };
+        const uint64_t h = hashKey(key);
+        std::shared_ptr<const Page> page = get(key, h);
+        const bool hit = page != nullptr;
+        if (!hit) {
+            const uint64_t start = key.page * PAGE_SIZE;
+            const size_t want = static_cast<size_t>(std::min<uint64_t>(PAGE_SIZE, fileSize - start));
+            Page buf = pool_.acquire(want);
+            int64_t n = blob.readAt(start, buf.data(), want);
+            if (n <= 0) {
+                pool_.release(buf);
+                return done ? static_cast<int64_t>(done) : n;
+            }
+            // A short page means the blob is not what the row says; serve
+            // what there is but don't keep it.
+            buf.resize(static_cast<size_t>(n));
+            page = pool_.share(std::move(buf));
+            if (static_cast<size_t>(n) == want) put(key, h, page);
+        }
+        const size_t from = static_cast<size_t>(pos - key.page * PAGE_SIZE);
+        if (from >= page->size()) break;
+        const size_t n = std::min<size_t>(page->size() - from, len - done);
+        std::memcpy(dst + done, page->data() + from, n);
+        if (hit) bytesSaved_ += n;
+        done += n;
+    }
+    return static_cast<int64_t>(done);
+}
+
+std::shared_ptr<const BlockCache::Page> BlockCache::lookup(const FileKey& file, uint64_t page) {
+    const Key key{ file, page };
+    std::shared_ptr<const Page> p = get(key, hashKey(key));
+    if (p) bytesSaved_ += p->size();
+    return p;
+}
+
+void BlockCache::insert(const FileKey& file, uint64_t page, std::shared_ptr<const Page> data) {
+    const Key key{ file, page };
+    put(key, hashKey(key), std::move(data));
+}
+
+std::shared_ptr<const BlockCache::Page> BlockCache::get(const Key& key, uint64_t h) {
+    Shard& s = shardFor(h);
+    std::lock_guard<std::mutex> lock(s.mu);
+    s.sketch.add(h);
+    auto it = s.map.find(key);
+    if (it == s.map.end()) {
+        ++misses_;
+        return nullptr;
+    }
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    ++hits_;
+    return it->second->second;
+}
+
+void BlockCache::put(const Key& key, uint64_t h, std::shared_ptr<const Page> page) {
+    Shard& s = shardFor(h);
+    std::lock_guard<std::mutex> lock(s.mu);
+    if (s.map.count(key)) return;   // another reader filled it first
+    if (s.lru.size() >= s.capacity) {
+        auto& victim = s.lru.back();
+        if (s.sketch.estimate(h) <= s.sketch.estimate(hashKey(victim.first))) {
+            ++rejections_;
+            return;
+        }
+        bytesResident_ -= victim.second->size();
+        ++evictions_;
+        // The new page takes over the victim's list and map nodes, so a
+        // full cache turns pages over without going to the heap.
+        auto node = s.map.extract(victim.first);
+        s.lru.splice(s.lru.begin(), s.lru, std::prev(s.lru.end()));
+        bytesResident_ += page->size();
+        s.lru.front() = { key, std::move(page) };
+        node.key() = key;
+        node.mapped() = s.lru.begin();
+        s.map.insert(std::move(node));
+        return;
+    }
+    bytesResident_ += page->size();
+    s.lru.emplace_front(key, std::move(page));
+    s.map[key] = s.lru.begin();
+}
+
+BlockCache::Sketch::Sketch(size_t pages) {
+    size_t width = 64;
+    while (width < pages * 2) width <<= 1;
+    table_.assign(width * 4, 0);
+    mask_ = width - 1;
+    sample_ = static_cast<uint64_t>(pages) * 10;
+}
+
+size_t BlockCache::Sketch::index(uint64_t h, int row) const {
+    static const uint64_t seeds[4] = {
+        0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0xd6e8feb86659fd93ull };
+    return static_cast<size_t>(row) * (mask_ + 1) + static_cast<size_t>(((h * seeds[row]) >> 32) & mask_);
+}
+
+void BlockCache::Sketch::add(uint64_t h) {
+    for (int row = 0; row < 4; ++row) {
+        uint8_t& c = table_[index(h, row)];
+        if (c < 15) ++c;
+    }
+    if (++additions_ >= sample_) {
+        for (uint8_t& c : table_) c >>= 1;
+        additions_ /= 2;
+    }
+}
+
+uint8_t BlockCache::Sketch::estimate(uint64_t h) const {
+    uint8_t est = 15;
+    for (int row = 0; row < 4; ++row) est = std::min<uint8_t>(est, table_[index(h, row)]);
+    return est;
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct FileRow;
+class BlobFile;
+class BufferPool;
+
+// Server-wide cache of file pages for downloads that read into user space,
+// so concurrent GETs of one hot file read each page from disk once and share
+// it. (TransmitFile and mapped blobs already share the system file cache;
+// this serves files still stored as <file_id>.bin.)
+//
+// Pages are keyed by content, not by file_id alone: the blob's SHA-256 when
+// the file has one, so duplicate files share pages too, otherwise the
+// file_id with its checksum and upload time. A file whose content changes
+// gets a new key, so nothing needs invalidating; old pages age out.
+//
+// The cache is split into shards, each an LRU list under its own mutex. A
+// new page displaces the LRU victim only if a TinyLFU sketch has seen its
+// key more often than the victim's, so one pass over a cold file cannot
+// flush the hot set.
+class BlockCache {
+public:
+    static constexpr uint32_t PAGE_SIZE = 64 * 1024;
+    using Page = std::vector<char>;
+
+    struct FileKey {
+        uint64_t hi = 0;
+        uint64_t lo = 0;
+    };
+    // False for files with neither a content hash nor a checksum; those
+    // are read around the cache.
+    static bool fileKey(const FileRow& row, FileKey& key);
+
+    // 0 disables the cache. Pages read here come from `pool` and return
+    // to it once evicted and no longer in use.
+    BlockCache(uint64_t capacityBytes, BufferPool& pool);
+
+    bool enabled() const { return !shards_.empty(); }
+
+    // Read-through: copies [offset, offset + len) of a file of `fileSize`
+    // bytes into `out`, filling missing pages from `file`. Same contract as
+    // BlobFile::readAt.
+    int64_t read(const FileKey& key, const BlobFile& file, uint64_t fileSize,
+                 uint64_t offset, void* out, size_t len);
+    // For readers that fetch missing pages themselves, asynchronously:
+    // page number `page` of the file if cached (counted as a hit or miss),
+    // and a full page read from disk, offered to the cache.
+    std::shared_ptr<const Page> lookup(const FileKey& file, uint64_t page);
+    void insert(const FileKey& file, uint64_t page, std::shared_ptr<const Page> data);
+
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t misses() const { return misses_.load(); }
+    uint64_t evictions() const { return evictions_.load(); }
+    uint64_t rejections() const { return rejections_.load(); }   // pages refused by admission
+    uint64_t bytesSaved() const { return bytesSaved_.load(); }   // bytes served without a disk read
+    uint64_t bytesResident() const { return bytesResident_.load(); }
+
+private:
+    struct Key {
+        FileKey file;
+        uint64_t page;
+        bool operator==(const Key& o) const {
+            return file.hi == o.file.hi && file.lo == o.file.lo && page == o.page;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const { return static_cast<size_t>(hashKey(k)); }
+    };
+
+    // Count-min sketch of 4-bit counters in four rows. Every counter is
+    // halved after `sample` additions so the estimate favours recent use.
+    class Sketch {
+    public:
+        explicit Sketch(size_t pages);
+        void add(uint64_t h);
+        uint8_t estimate(uint64_t h) const;
+    private:
+        std::vector<uint8_t> table_;
+        size_t mask_;
+        uint64_t additions_ = 0;
+        uint64_t sample_;
+        size_t index(uint64_t h, int row) const;
+    };
+
+    struct Shard {
+        explicit Shard(size_t pages) : capacity(pages), sketch(pages) {}
+        std::mutex mu;
+        size_t capacity;
+        std::list<std::pair<Key, std::shared_ptr<const Page>>> lru;   // front = most recent
+        std::unordered_map<Key, decltype(lru)::iterator, KeyHash> map;
+        Sketch sketch;
+    };
+
+    BufferPool& pool_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+    std::atomic<uint64_t> rejections_{0};
+    std::atomic<uint64_t> bytesSaved_{0};
+    std::atomic<uint64_t> bytesResident_{0};
+
+    static uint64_t hashKey(const Key& k);
+    Shard& shardFor(uint64_t h) { return *shards_[h % shards_.size()]; }
+    std::shared_ptr<const Page> get(const Key& key, uint64_t h);
+    void put(const Key& key, uint64_t h, std::shared_ptr<const Page> page);
+};
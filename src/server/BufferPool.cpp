@@ -0,0 +1,101 @@
+#include "BufferPool.hpp"
+
+// Smallest power-of-two shift, at least `minShift`, that holds `size` bytes.
+static unsigned classFor(size_t size, unsigned minShift) {
+    unsigned shift = minShift;
+    while ((size_t{1} << shift) < size && shift < 63) ++shift;
+    return shift;
+}
+
+// A shared buffer goes back to its pool when the last reference does.
+struct SharedBuffer {
+    BufferPool* pool;
+    DiskIo::Buffer buf;
+    SharedBuffer(BufferPool* p, DiskIo::Buffer&& b) : pool(p), buf(std::move(b)) {}
+    ~SharedBuffer() { pool->release(buf); }
+};
+
+// Hands allocate_shared its control block from the pool's blocks.
+template <class T>
+struct BlockAllocator {
+    using value_type = T;
+    BufferPool* pool;
+    explicit BlockAllocator(BufferPool* p) : pool(p) {}
+    template <class U> BlockAllocator(const BlockAllocator<U>& o) : pool(o.pool) {}
+    T* allocate(size_t n) { return static_cast<T*>(pool->takeBlock(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { pool->giveBlock(p, n * sizeof(T)); }
+    template <class U> bool operator==(const BlockAllocator<U>& o) const { return pool == o.pool; }
+    template <class U> bool operator!=(const BlockAllocator<U>& o) const { return pool != o.pool; }
+};
+
+BufferPool::BufferPool(uint64_t maxIdleBytes) : maxIdle_(maxIdleBytes) {}
+
+BufferPool::~BufferPool() {
+    for (void* p : blocks_) ::operator delete(p);
+}
+
+DiskIo::Buffer BufferPool::acquire(size_t size) {
+    const unsigned shift = classFor(size, MIN_SHIFT);
+    DiskIo::Buffer buf;
+    if (shift <= MAX_SHIFT && maxIdle_) {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto& list = free_[shift - MIN_SHIFT];
+        if (!list.empty()) {
+            buf = std::move(list.back());
+            list.pop_back();
+            idleBytes_ -= buf.capacity();
+        }
+    }
+    if (buf.capacity()) {
+        ++hits_;
+    }
+    else {
+        ++allocs_;
+        // Allocate the whole class so the buffer files back under it.
+        if (shift <= MAX_SHIFT) buf.reserve(size_t{1} << shift);
+    }
+    buf.resize(size);
+    return buf;
+}
+
+void BufferPool::release(DiskIo::Buffer& buf) {
+    DiskIo::Buffer gone = std::move(buf);
+    buf.clear();
+    const size_t cap = gone.capacity();
+    if (cap < (size_t{1} << MIN_SHIFT)) return;
+    // The largest class the capacity fully covers.
+    unsigned shift = classFor(cap, MIN_SHIFT);
+    if ((size_t{1} << shift) > cap) --shift;
+    if (shift > MAX_SHIFT) return;
+    std::lock_guard<std::mutex> lock(mu_);
+    if (idleBytes_.load() + cap > maxIdle_) return;
+    idleBytes_ += cap;
+    free_[shift - MIN_SHIFT].push_back(std::move(gone));
+}
+
+std::shared_ptr<const DiskIo::Buffer> BufferPool::share(DiskIo::Buffer&& buf) {
+    auto shared = std::allocate_shared<SharedBuffer>(BlockAllocator<SharedBuffer>(this), this, std::move(buf));
+    return std::shared_ptr<const DiskIo::Buffer>(shared, &shared->buf);
+}
+
+void* BufferPool::takeBlock(size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (size == blockSize_ && !blocks_.empty()) {
+            void* p = blocks_.back();
+            blocks_.pop_back();
+            return p;
+        }
+    }
+    return ::operator new(size);
+}
+
+void BufferPool::giveBlock(void* p, size_t size) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (blockSize_ == 0) blockSize_ = size;
+    if (size != blockSize_) {
+        ::operator delete(p);
+        return;
+    }
+    blocks_.push_back(p);
+}
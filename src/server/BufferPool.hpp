@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "DiskIo.hpp"
+
+// Server-wide free lists for the large buffers transfers work through:
+// upload receive and write-behind buffers, compressed-GET read buffers and
+// block-cache pages. Once the pool has seen the server's working set, a
+// transfer takes its buffers from here and gives them back when it ends,
+// instead of going to the heap for each one.
+//
+// Buffers are kept by power-of-two capacity, 4 KiB to 2 MiB; anything else
+// is simply freed. Idle buffers are capped at a byte budget so a burst of
+// uploads doesn't keep its memory forever.
+//
+// A shared buffer's bookkeeping, the shared_ptr control block it lives in,
+// is allocated from blocks kept here as well, as many as have ever been
+// shared at once, so sharing a page doesn't go to the heap either.
+class BufferPool {
+public:
+    // 0 disables pooling: every acquire allocates and release frees.
+    explicit BufferPool(uint64_t maxIdleBytes);
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // A buffer of exactly `size` bytes with unspecified contents.
+    DiskIo::Buffer acquire(size_t size);
+    // Takes back a buffer from acquire() or anywhere else; leaves `buf` empty.
+    void release(DiskIo::Buffer& buf);
+    // Shares a filled buffer read-only; it comes back here when the last
+    // reference goes.
+    std::shared_ptr<const DiskIo::Buffer> share(DiskIo::Buffer&& buf);
+
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t allocs() const { return allocs_.load(); }
+    uint64_t bytesIdle() const { return idleBytes_.load(); }
+
+private:
+    template <class T> friend struct BlockAllocator;
+
+    static constexpr unsigned MIN_SHIFT = 12;
+    static constexpr unsigned MAX_SHIFT = 21;
+
+    const uint64_t maxIdle_;
+    std::mutex mu_;
+    std::vector<DiskIo::Buffer> free_[MAX_SHIFT - MIN_SHIFT + 1];
+    // Control blocks for share(), all of one size.
+    size_t blockSize_ = 0;
+    std::vector<void*> blocks_;
+    std::atomic<uint64_t> idleBytes_{0};
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> allocs_{0};
+
+    void* takeBlock(size_t size);
+    void giveBlock(void* p, size_t size);
+};
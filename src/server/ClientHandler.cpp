@@ -2,176 +2,1875 @@
 #include "../../common/common.hpp"
 #include "MetadataStore.hpp"
 #include "FileManager.hpp"
+#include "ResumeCheckpointer.hpp"
+#include "FileCache.hpp"
+#include "ListService.hpp"
+#include "UploadSessions.hpp"
+#include "ContentStore.hpp"
+#include "MemoryBudget.hpp"
+#include "HeapCounter.hpp"
+#include "WorkQueue.hpp"
+#include "../../common/crc32c.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
 #include <filesystem>
 #include <sstream>
 #include <vector>
 #include <iomanip>
-#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <mswsock.h>
 
 namespace fs = std::filesystem;
 
-ClientHandler::ClientHandler(SOCKET sock, const fs::path& root, MetadataStore& meta, FileManager& fm)
-    : clientSock(sock), rootDir(root), meta_(meta), fm_(fm) {
+static constexpr size_t CHUNK = 64 * 1024;
+// Upload receive buffer: each completion lands here and goes to disk with a
+// single positioned write.
+static constexpr size_t UPLOAD_CHUNK = 1024 * 1024;
+// Per-TransmitFile request; also the resume checkpoint granularity on that path.
+static constexpr uint64_t ZERO_COPY_CHUNK = 1024 * 1024;
+// v2 DATA frame size. Smaller than a v1 TransmitFile so that streams sharing
+// a connection take turns often enough for small files to get through.
+static constexpr uint64_t STREAM_FRAME = 256 * 1024;
+// A download's turn at the front is this many bytes times its class weight.
+static constexpr int64_t STREAM_QUANTUM = static_cast<int64_t>(MAX_DATA_FRAME);
+// v2 limits per connection. Once either is reached the handler stops reading
+// requests until responses drain, which pushes back on the client.
+static constexpr size_t MAX_STREAMS = 64;
+static constexpr size_t MAX_QUEUED_REPLIES = 256;
+// MPUT files still being written after the stream moved past them; at this
+// many the handler stops reading until one lands.
+static constexpr size_t MAX_DRAINING = 4;
+// Reply strings kept for reuse per connection, and the largest kept.
+static constexpr size_t SPARE_REPLIES = 16;
+static constexpr size_t SPARE_REPLY_BYTES = 64 * 1024;
+// Streamed payloads are read this much at a time, and a payload buffer
+// grown past it is freed once its request has been handled.
+static constexpr size_t PAYLOAD_PIECE = 256 * 1024;
+// sendBuf_ is freed after a reply that grew it past a DATA frame.
+static constexpr size_t SEND_BUFFER_KEEP = MAX_DATA_FRAME + 64 * 1024;
+
+// TransmitFile is a Winsock extension; resolving it at runtime is what lets
+// the buffered path stand in where the provider does not offer it.
+static LPFN_TRANSMITFILE transmitFileFn(SOCKET s) {
+    static std::once_flag once;
+    static LPFN_TRANSMITFILE fn = nullptr;
+    std::call_once(once, [s]() {
+        GUID guid = WSAID_TRANSMITFILE;
+        DWORD bytes = 0;
+        if (WSAIoctl(s, SIO_GET_EXTENSION_FUNCTION_POINTER, &guid, sizeof(guid),
+                     &fn, sizeof(fn), &bytes, nullptr, nullptr) != 0) {
+            fn = nullptr;
+        }
+    });
+    return fn;
+}
+
+// Adds what one chunk moved through a codec to the server-wide counters.
+static void countCodec(ServerStats& stats, const CodecStats& before, const CodecStats& after) {
+    stats.codecBytesRaw += after.rawBytes - before.rawBytes;
+    stats.codecBytesWire += after.wireBytes - before.wireBytes;
+    stats.codecStoredChunks += after.storedChunks - before.storedChunks;
+    stats.codecUs += after.codecUs - before.codecUs;
+}
+
+static std::string hitRate(uint64_t hits, uint64_t misses) {
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%.3f", hits + misses ? double(hits) / double(hits + misses) : 0.0);
+    return buf;
+}
+
+ClientHandler::ClientHandler(SOCKET sock, ServerContext& ctx)
+    : clientSock(sock), ctx_(ctx), meta_(ctx.meta), fm_(ctx.fm),
+      sendFlow_(ctx.sendRate.newFlow()), recvFlow_(ctx.recvRate.newFlow()) {
+}
+
+ClientHandler::~ClientHandler() {
+    // Also hands back anything still charged to the memory budget.
+    close();
 }
 
 static std::string padLeft(uint64_t v, int w) {
     std::ostringstream oss; oss << std::setw(w) << v; return oss.str();
 }
 
-std::string ClientHandler::makeListPayload() {
-    auto rows = meta_.listFilesNewestFirst(1000);
-    std::vector<std::string> lines;
-    lines.emplace_back("ID   SIZE(bytes)  UPLOADED_AT        DL  NAME");
-    for (auto& r : rows) {
-        std::ostringstream row;
-        row << std::setw(4) << r.file_id << " "
-            << std::setw(12) << r.size << "  "
-            << std::setw(16) << r.uploaded_at << "  "
-            << std::setw(3) << r.download_count << "  "
-            << r.name;
-        lines.push_back(row.str());
-    }
-    return joinLines(lines);
+void ClientHandler::start() {
+    std::lock_guard<std::mutex> lock(mu_);
+    try { postRecv(); }
+    catch (...) { close(); }
 }
 
-void ClientHandler::process() {
+void ClientHandler::onIoComplete(IoOp& op, DWORD bytes, DWORD error) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (&op == &wakeOp_) {
+        // Memory was released somewhere; try the waiting payload again.
+        wakeQueued_ = false;
+        if (closing_ || recvState_ != RecvState::Admit) return;
+        try { postRecv(); }
+        catch (...) { close(); }
+        return;
+    }
+    if (&op == &insertOp_) {
+        // A PUT's row, or an offered duplicate, has committed or failed to.
+        auto put = std::move(putPending_);
+        if (closing_) {
+            // A duplicate is already a published file.
+            if (!put->offered && put->file_id >= 0) discardFile(put->file_id);
+            for (int id : put->ids) {
+                if (id >= 0) discardFile(id);
+            }
+            return;
+        }
+        try {
+            if (put->type == MPUT_REQ) openBatch(*put);
+            else if (put->offered) finishOffer(put);
+            else openPut(*put);
+            if (recvState_ != RecvState::Header || acceptingRequests()) postRecv();
+        }
+        catch (...) { close(); }
+        return;
+    }
+    if (&op == &sendRateOp_ || &op == &recvRateOp_) {
+        // The bandwidth scheduler has set a frame aside for this direction.
+        const bool send = (&op == &sendRateOp_);
+        (send ? sendRateWait_ : recvRateWait_) = false;
+        if (closing_) return;
+        try {
+            if (send) postSend();
+            else postRecv();
+        }
+        catch (...) { close(); }
+        return;
+    }
+    const bool isRecv = (&op == &recvOp_);
+    if (isRecv) recvPending_ = false;
+    else {
+        sendPending_ = false;
+        transmitting_.reset();
+    }
+
+    if (closing_) return;
+    if (error != 0 || (isRecv && bytes == 0)) {
+        // client closed / error
+        close();
+        return;
+    }
+
     try {
-        for (;;) {
-            MsgHeader hdr{}; std::string payload;
-            recvMessage(clientSock, hdr, payload);
-
-            switch (hdr.type) {
-            case PING:
-                sendMessage(clientSock, PONG, "OK");
-                break;
-
-            case LIST_REQ: {
-                // payload ignored; we list from DB
-                auto table = makeListPayload();
-                sendMessage(clientSock, LIST_RESP, table);
-                break;
+        if (isRecv) onRecv(bytes);
+        else onSend(bytes);
+    }
+    catch (...) {
+        close();
+    }
+}
+
+void ClientHandler::close() {
+    if (closing_) return;
+    closing_ = true;
+    for (auto& dl : downloads_) {
+        if (!dl->resume_id.empty()) ctx_.resume.release(dl->resume_id);
+    }
+    if (sendPending_ && sendKind_ == SendKind::Transmit && sending_) {
+        auto it = std::find_if(downloads_.begin(), downloads_.end(),
+            [this](const std::unique_ptr<Download>& d) { return d.get() == sending_; });
+        if (it != downloads_.end()) transmitting_ = std::move(*it);
+    }
+    downloads_.clear();
+    sending_ = nullptr;
+    // Nothing unfinished is kept: its rows were never visible.
+    for (auto& kv : uploads_) discardFile(kv.second->file_id);
+    for (auto& up : draining_) discardFile(up->file_id);
+    for (auto& kv : putBatches_) {
+        for (const auto& f : kv.second.files) discardFile(f.first);
+    }
+    uploads_.clear();
+    recvUpload_ = nullptr;
+    putBatches_.clear();
+    draining_.clear();
+    deltas_.clear();
+    outQ_.clear();
+    ctx_.memory.release(charged_);
+    charged_ = 0;
+    admitted_ = 0;
+    // Aborts whatever is still pending; those completions drop the last pins.
+    if (clientSock != INVALID_SOCKET) closesocket(clientSock);
+    clientSock = INVALID_SOCKET;
+}
+
+void ClientHandler::postRecv() {
+    if (recvPending_ || closing_ || putPending_ || deltaApplying_) return;
+    // Upload bytes are only read into a free write-behind buffer, and a v1
+    // upload reads nothing more until its last write has landed. While one
+    // upload waits on the disk, nothing else on the connection is read.
+    if (recvState_ == RecvState::Upload || recvState_ == RecvState::UploadCompressed
+        || recvState_ == RecvState::StreamData) {
+        if (recvUpload_->received >= recvUpload_->size) return;
+        if (recvUpload_->buf.empty()) {
+            ++ctx_.stats.uploadStalls;
+            return;
+        }
+        if (!rateAllows(false, recvUpload_->cls)) return;
+    }
+
+    WSABUF wb{};
+    switch (recvState_) {
+    case RecvState::Header:
+        wb.buf = reinterpret_cast<char*>(&hdr_) + recvGot_;
+        wb.len = static_cast<ULONG>(sizeof(hdr_) - recvGot_);
+        break;
+    case RecvState::Admit:
+        // The header is in; its payload is read once memory is charged for it.
+        if (!admitPayload()) return;
+        payload_.resize(hdr_.length);
+        recvState_ = RecvState::Payload;
+        [[fallthrough]];
+    case RecvState::Payload:
+    case RecvState::PayloadPiece:
+        wb.buf = payload_.data() + recvGot_;
+        wb.len = static_cast<ULONG>(payload_.size() - recvGot_);
+        break;
+    case RecvState::Upload: {
+        Upload& up = *recvUpload_;
+        uint64_t want = std::min<uint64_t>(up.buf.size(), up.size - up.received);
+        wb.buf = reinterpret_cast<char*>(up.buf.data()) + up.fill;
+        wb.len = static_cast<ULONG>(want - up.fill);
+        break;
+    }
+    case RecvState::UploadCompressed: {
+        // The chunk header first, then the body it announces.
+        Upload& up = *recvUpload_;
+        size_t want = up.fill < CHUNK_HEADER ? CHUNK_HEADER : CHUNK_HEADER + up.wireLen;
+        wb.buf = reinterpret_cast<char*>(up.wire.data()) + up.fill;
+        wb.len = static_cast<ULONG>(want - up.fill);
+        break;
+    }
+    case RecvState::StreamData: {
+        Upload& up = *recvUpload_;
+        wb.buf = (up.decoder ? reinterpret_cast<char*>(up.wire.data()) : up.buf.data()) + recvGot_;
+        wb.len = static_cast<ULONG>(hdr_.length - recvGot_);
+        break;
+    }
+    }
+
+    recvOp_.reset();
+    recvOp_.target = shared_from_this();
+    DWORD flags = 0;
+    if (WSARecv(clientSock, &wb, 1, nullptr, &flags, &recvOp_.ov, nullptr) == SOCKET_ERROR
+        && WSAGetLastError() != WSA_IO_PENDING) {
+        recvOp_.target.reset();
+        throw SocketError("WSARecv failed");
+    }
+    recvPending_ = true;
+}
+
+void ClientHandler::onRecv(DWORD bytes) {
+    if (recvState_ == RecvState::Upload || recvState_ == RecvState::UploadCompressed
+        || recvState_ == RecvState::StreamData) {
+        ctx_.recvRate.consume(*recvFlow_, recvUpload_->cls, bytes);
+    }
+    switch (recvState_) {
+    case RecvState::Header:
+        recvGot_ += bytes;
+        if (recvGot_ < sizeof(hdr_)) break;
+        if (!isValidHeader(hdr_)) throw SocketError("bad header");
+        // A connection stays on v2 once it gets there: raw v1 file bytes
+        // cannot be told apart from the frames of other streams.
+        if (hdr_.version == PROTOCOL_V2) v2_ = true;
+        else if (v2_) throw SocketError("v1 message on a v2 connection");
+        recvGot_ = 0;
+        if (hdr_.type == DATA && onDataHeader()) break;
+        payload_.clear();
+        if (!hdr_.length) {
+            dispatch();
+            break;
+        }
+        // Nothing is allocated for a payload yet: chunk data and anything to
+        // be dropped go through one piece-sized buffer, and the rest waits
+        // in Admit until the memory budgets can take it.
+        if (hdr_.type == DATA || hdr_.type == UPLOAD_CHUNK_REQ || hdr_.length > ctx_.config.maxMessageBytes) {
+            beginPieces();
+            break;
+        }
+        recvState_ = RecvState::Admit;
+        break;
+
+    case RecvState::Admit:
+        break;
+
+    case RecvState::Payload:
+        recvGot_ += bytes;
+        if (recvGot_ < payload_.size()) break;
+        recvGot_ = 0;
+        recvState_ = RecvState::Header;
+        dispatch();
+        releasePayload();
+        break;
+
+    case RecvState::PayloadPiece:
+        recvGot_ += bytes;
+        if (recvGot_ < payload_.size()) break;
+        recvGot_ = 0;
+        piece_.left -= payload_.size();
+        onPiece();
+        if (piece_.left) {
+            payload_.resize(static_cast<size_t>(std::min<uint64_t>(PAYLOAD_PIECE, piece_.left)));
+            break;
+        }
+        recvState_ = RecvState::Header;
+        endPieces();
+        break;
+
+    case RecvState::Upload: {
+        Upload& up = *recvUpload_;
+        up.fill += bytes;
+        uint64_t want = std::min<uint64_t>(up.buf.size(), up.size - up.received);
+        if (up.fill < want) break;
+        storeUpload(up, up.fill);
+        up.fill = 0;
+        uploadStored(up);
+        break;
+    }
+
+    case RecvState::UploadCompressed: {
+        Upload& up = *recvUpload_;
+        up.fill += bytes;
+        if (up.fill < CHUNK_HEADER) break;
+        if (up.fill == CHUNK_HEADER) {
+            if (!ChunkDecoder::parseHeader(up.wire.data(), up.rawLen, up.wireLen)
+                || up.rawLen > up.size - up.received) {
+                throw SocketError("bad compressed chunk");
             }
+        }
+        if (up.fill < CHUNK_HEADER + up.wireLen) break;
+        if (!decodeUpload(up)) throw SocketError("corrupt compressed chunk");
+        up.fill = 0;
+        uploadStored(up);
+        break;
+    }
 
-            case GET_REQ: {
-                int file_id = 0;
-                std::string resume_id;
-                std::string file_id_str = payload;
+    case RecvState::StreamData: {
+        recvGot_ += bytes;
+        if (recvGot_ < hdr_.length) break;
+        Upload& up = *recvUpload_;
+        recvGot_ = 0;
+        recvState_ = RecvState::Header;
+        recvUpload_ = nullptr;
+        if (!up.decoder) {
+            storeUpload(up, hdr_.length);
+        }
+        else if (!ChunkDecoder::parseHeader(up.wire.data(), up.rawLen, up.wireLen)
+                 || CHUNK_HEADER + up.wireLen != hdr_.length || up.rawLen > up.size - up.received
+                 || !decodeUpload(up)) {
+            const uint32_t stream = up.stream;
+            queueStreamMessage(stream, ERR, "bad-chunk");
+            abortUploads(stream);
+            break;
+        }
+        uploadStored(up);
+        break;
+    }
+    }
 
-                auto sep = payload.find('|');
-                if (sep != std::string::npos) {
-                    file_id_str = payload.substr(0, sep);
-                    resume_id = payload.substr(sep + 1);
-                }
+    // Upload data is always read; the next request only when the connection
+    // may take one (see acceptingRequests).
+    if (recvState_ != RecvState::Header || acceptingRequests()) postRecv();
+}
 
-                try { file_id = std::stoi(file_id_str); }
-                catch (...) { file_id = 0; }
+// Routes a DATA frame for an open v2 upload straight into its buffer.
+// Returns false when the payload should be read and dropped instead.
+bool ClientHandler::onDataHeader() {
+    if (hdr_.version != PROTOCOL_V2 || hdr_.length == 0) return false;
+    if (hdr_.length > MAX_DATA_FRAME) throw SocketError("oversized data frame");
+    auto it = uploads_.find(hdr_.stream);
+    if (it == uploads_.end()) return false;   // stream was rejected or never opened
 
-                FileRow fr{};
-                if (!meta_.getFile(file_id, fr)) {
-                    sendMessage(clientSock, ERR, "file-not-found");
-                    break;
-                }
+    Upload& up = *it->second;
+    // A compressed frame is checked once its chunk header is in.
+    if (up.decoder ? hdr_.length < CHUNK_HEADER || hdr_.length > up.wire.size()
+                   : hdr_.length > up.size - up.received) {
+        queueStreamMessage(up.stream, ERR, "upload-overrun");
+        abortUploads(up.stream);
+        return false;
+    }
+    recvUpload_ = &up;
+    recvState_ = RecvState::StreamData;
+    return true;
+}
 
-                auto p = fm_.filePath(file_id);
-                if (!fs::exists(p)) {
-                    sendMessage(clientSock, ERR, "file-missing");
-                    break;
-                }
+// Charges the payload announced by hdr_ to the connection's budget and the
+// server's. If the connection's is spent, its queued replies free it as
+// they go out and onSend tries again; if the server's is, the budget posts
+// wakeOp_ once memory is released anywhere. Either way nothing more is read
+// until then.
+bool ClientHandler::admitPayload() {
+    const uint64_t n = hdr_.length;
+    bool ok = !wakeQueued_ && (charged_ == 0 || charged_ + n <= ctx_.config.connMemoryBytes);
+    if (ok) {
+        auto self = shared_from_this();
+        ok = ctx_.memory.charge(n, [self]() {
+            // Runs on the releasing thread, which may be closing a connection
+            // or destroying one, so it must not throw; the handler picks it
+            // up on its own. The post only fails once the port is going away.
+            self->wakeOp_.reset();
+            self->wakeOp_.target = self;
+            try { self->ctx_.io.post(self->wakeOp_); }
+            catch (...) { self->wakeOp_.target.reset(); }
+        });
+        wakeQueued_ = !ok;
+    }
+    if (!ok) {
+        if (!memoryWait_) ++ctx_.stats.memoryWaits;
+        memoryWait_ = true;
+        return false;
+    }
+    memoryWait_ = false;
+    charged_ += n;
+    admitted_ = n;
+    return true;
+}
 
-                uint64_t fileSize = static_cast<uint64_t>(fs::file_size(p));
-                uint64_t offset = 0;
+// The request has been handled; its payload no longer counts, and a buffer
+// grown for a large one is let go.
+void ClientHandler::releasePayload() {
+    releaseMemory(admitted_);
+    admitted_ = 0;
+    if (payload_.capacity() > PAYLOAD_PIECE) std::string().swap(payload_);
+    else payload_.clear();
+}
 
-                if (!resume_id.empty()) {
-                    ResumeRow rr{};
-                    if (meta_.getResume(resume_id, rr) && rr.file_id == file_id) {
-                        offset = rr.offset;
-                        if (offset >= fileSize) offset = 0;
-                    }
-                }
+void ClientHandler::releaseMemory(uint64_t n) {
+    if (n == 0) return;
+    charged_ -= n;
+    ctx_.memory.release(n);
+}
 
-                sendMessage(clientSock, GET_RESP, std::to_string(fileSize));
+void ClientHandler::beginPieces() {
+    piece_ = PieceState{};
+    piece_.left = hdr_.length;
+    piece_.chunk = hdr_.type == UPLOAD_CHUNK_REQ;
+    if (!piece_.chunk && hdr_.type != DATA) {
+        piece_.error = "message-too-large";
+        ++ctx_.stats.oversizeMessages;
+    }
+    payload_.resize(static_cast<size_t>(std::min<uint64_t>(PAYLOAD_PIECE, piece_.left)));
+    recvState_ = RecvState::PayloadPiece;
+}
 
-                std::ifstream in(p, std::ios::binary);
-                if (!in) {
-                    sendMessage(clientSock, ERR, "open-failed");
-                    break;
-                }
+// One piece of a streamed payload is in payload_. UPLOAD_CHUNK_REQ is
+// "upload_id|offset|" then the bytes, written to the session piece by piece
+// through one handle and recorded in endPieces; its prefix has to fit in
+// the first piece.
+void ClientHandler::onPiece() {
+    if (!piece_.chunk || !piece_.error.empty()) return;
+    const char* data = payload_.data();
+    size_t len = payload_.size();
+    if (!piece_.prefixed) {
+        size_t a = payload_.find('|');
+        size_t b = (a == std::string::npos) ? a : payload_.find('|', a + 1);
+        if (b == std::string::npos) { piece_.error = "bad-request"; return; }
+        try { piece_.start = std::stoull(payload_.substr(a + 1, b - a - 1)); }
+        catch (...) { piece_.error = "bad-request"; return; }
+        piece_.offset = piece_.start;
+        piece_.prefixed = true;
+        piece_.writer = ctx_.uploads.openChunk(payload_.substr(0, a), piece_.start, piece_.error);
+        if (!piece_.writer) return;
+        data += b + 1;
+        len -= b + 1;
+    }
+    if (len == 0) return;
+    if (!ctx_.uploads.write(*piece_.writer, data, len, piece_.error)) return;
+    piece_.offset += len;
+}
 
-                in.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+void ClientHandler::endPieces() {
+    if (payload_.capacity() > PAYLOAD_PIECE) std::string().swap(payload_);
+    // What landed is recorded even if the rest failed; the client sends
+    // again whatever the ranges don't list.
+    std::string error;
+    if (piece_.writer && !ctx_.uploads.finishChunk(*piece_.writer, error) && piece_.error.empty())
+        piece_.error = error;
+    if (!piece_.error.empty()) queueMessage(ERR, piece_.error);
+    else if (piece_.chunk) queueMessage(UPLOAD_CHUNK_RESP, std::to_string(piece_.start) + "|" + std::to_string(piece_.offset - piece_.start));
+    // A dropped DATA frame has no reply.
+    piece_ = PieceState{};
+}
 
-                const size_t BUF = 64 * 1024;
-                std::vector<uint8_t> chunk;
-                uint64_t sent = offset;
+bool ClientHandler::responseIdle() const {
+    return !sendPending_ && outQ_.empty() && downloads_.empty() && sendOff_ >= sendSize() && working_ == 0;
+}
 
-                while (sent < fileSize) {
-                    size_t toRead = static_cast<size_t>(std::min<uint64_t>(BUF, fileSize - sent));
-                    chunk.resize(toRead);
-                    in.read(reinterpret_cast<char*>(chunk.data()), std::streamsize(toRead));
-                    std::streamsize n = in.gcount();
-                    if (n <= 0) break;
-                    sendAll(clientSock, reinterpret_cast<const char*>(chunk.data()), (int)n);
-                    sent += (uint64_t)n;
+// v1 is strictly request/response: the next request is only read once the
+// previous response has fully left. v2 keeps reading up to its limits.
+bool ClientHandler::acceptingRequests() const {
+    if (!v2_) return responseIdle();
+    return downloads_.size() < MAX_STREAMS && outQ_.size() < MAX_QUEUED_REPLIES
+        && draining_.size() < MAX_DRAINING && charged_ < ctx_.config.connMemoryBytes;
+}
 
-                    if (!resume_id.empty()) {
-                        meta_.upsertResume(resume_id, file_id, sent, (uint32_t)BUF);
+// Asks the direction's scheduler whether the next frame of file data may
+// move. If not, the scheduler posts sendRateOp_ or recvRateOp_ once it may,
+// and until then this keeps saying no without asking again.
+bool ClientHandler::rateAllows(bool send, BandwidthScheduler::Class cls) {
+    bool& waiting = send ? sendRateWait_ : recvRateWait_;
+    if (waiting) return false;
+    BandwidthScheduler& sched = send ? ctx_.sendRate : ctx_.recvRate;
+    IoOp* op = send ? &sendRateOp_ : &recvRateOp_;
+    std::weak_ptr<ClientHandler> weak = weak_from_this();
+    if (sched.acquire(send ? sendFlow_ : recvFlow_, cls, [weak, op]() {
+            // Runs on the scheduler's thread, which must not see an exception;
+            // the handler picks it up on its own. The post only fails once
+            // the port is going away, and the connection with it.
+            if (auto self = weak.lock()) {
+                op->reset();
+                op->target = self;
+                try { self->ctx_.io.post(*op); }
+                catch (...) { op->target.reset(); }
+            }
+        })) {
+        return true;
+    }
+    waiting = true;
+    return false;
+}
+
+// Replies to the request being dispatched, in its version and stream.
+void ClientHandler::queueMessage(uint16_t type, const std::string& payload) {
+    frameReply(type, payload, hdr_.version, hdr_.stream);
+    postSend();
+}
+
+void ClientHandler::queueStreamMessage(uint32_t stream, uint16_t type, const std::string& payload) {
+    frameReply(type, payload, PROTOCOL_V2, stream);
+    postSend();
+}
+
+// Queues a framed reply without starting a send.
+void ClientHandler::frameReply(uint16_t type, const std::string& payload, uint16_t version, uint32_t stream) {
+    std::string out;
+    if (!spare_.empty()) {
+        out = std::move(spare_.back());
+        spare_.pop_back();
+    }
+    frameMessage(out, type, payload, version, stream);
+    // Already built, so charged even past the limits; reading stops instead.
+    charged_ += out.size();
+    ctx_.memory.force(out.size());
+    outQ_.push_back(std::move(out));
+}
+
+// Moves the next reply into sendBuf_. Only a reply bigger than sendBuf_
+// has room for is swapped in; its string goes back to the spares.
+void ClientHandler::takeReply() {
+    std::string& next = outQ_.front();
+    releaseMemory(next.size());
+    if (next.size() <= sendBuf_.capacity()) sendBuf_.assign(next);
+    else sendBuf_.swap(next);
+    if (spare_.size() < SPARE_REPLIES && next.capacity() <= SPARE_REPLY_BYTES) {
+        next.clear();
+        spare_.push_back(std::move(next));
+    }
+    outQ_.pop_front();
+}
+
+void ClientHandler::postSend() {
+    if (sendPending_ || closing_) return;
+
+    if (sendOff_ >= sendSize()) {
+        if (sendBuf_.capacity() > SEND_BUFFER_KEEP) std::string().swap(sendBuf_);
+        sendBuf_.clear();
+        sendSpan_ = ByteSpan{};
+        sendPin_.reset();
+        sendOff_ = 0;
+        sendKind_ = SendKind::Message;
+        sending_ = nullptr;
+        if (!outQ_.empty()) {
+            // Control replies go ahead of file data so that a LIST or PING
+            // is never stuck behind a large download.
+            takeReply();
+        }
+        else {
+            size_t waiting = 0;
+            while (!downloads_.empty()) {
+                Download& dl = *downloads_.front();
+                if (dl.sent >= dl.end) {
+                    finishDownload(dl);
+                    continue;
+                }
+                // Deficit round-robin: the stream at the front keeps sending
+                // until its turn is used up, then moves to the back with a
+                // new one; a small transfer's turn is worth more bytes.
+                if (dl.credit <= 0) {
+                    dl.credit += STREAM_QUANTUM * ctx_.sendRate.weight(dl.cls);
+                    if (downloads_.size() > 1) {
+                        // Rotated in place: a deque's push and pop can
+                        // allocate and free a block each turn.
+                        std::rotate(downloads_.begin(), downloads_.begin() + 1, downloads_.end());
+                        waiting = 0;
+                        continue;
                     }
                 }
+                // Held back by the bandwidth limits; sendRateOp_ comes back
+                // here. Queued replies still go out meanwhile.
+                if (!rateAllows(true, dl.cls)) break;
 
-                if (sent >= fileSize && !resume_id.empty()) {
-                    meta_.deleteResume(resume_id);
+                if (dl.zeroCopy && postTransmit(dl)) {
+                    ctx_.sendRate.consume(*sendFlow_, dl.cls, sendData_);
+                    dl.credit -= static_cast<int64_t>(sendData_);
+                    return;
+                }
+                if (dl.asyncRead && !pageReady(dl)) {
+                    // Its next page is still on the way; the read's
+                    // completion calls back in here.
+                    if (++waiting >= downloads_.size()) break;
+                    std::rotate(downloads_.begin(), downloads_.begin() + 1, downloads_.end());
+                    continue;
                 }
+                if (nextDownloadChunk(dl)) {
+                    ctx_.sendRate.consume(*sendFlow_, dl.cls, sendData_);
+                    dl.credit -= static_cast<int64_t>(sendData_);
+                    sendKind_ = SendKind::Chunk;
+                    sending_ = &dl;
+                    break;
+                }
+                failDownload(dl);
+                return;
+            }
+        }
+        if (sendSize() == 0) {
+            // An MGET that broke off above left its error queued.
+            if (outQ_.empty()) return;
+            takeReply();
+        }
+    }
 
-                meta_.incrementDownloadCount(file_id);
+    // The frame header (or a whole message) from sendBuf_, then any span.
+    WSABUF wb[2]{};
+    DWORD count = 0;
+    if (sendOff_ < sendBuf_.size()) {
+        wb[count].buf = sendBuf_.data() + sendOff_;
+        wb[count++].len = static_cast<ULONG>(sendBuf_.size() - sendOff_);
+    }
+    if (sendSpan_.size) {
+        const size_t skip = sendOff_ > sendBuf_.size() ? sendOff_ - sendBuf_.size() : 0;
+        wb[count].buf = reinterpret_cast<char*>(const_cast<uint8_t*>(sendSpan_.data + skip));
+        wb[count++].len = static_cast<ULONG>(sendSpan_.size - skip);
+    }
 
-                break;
-            }
+    sendOp_.reset();
+    sendOp_.target = shared_from_this();
+    if (WSASend(clientSock, wb, count, nullptr, 0, &sendOp_.ov, nullptr) == SOCKET_ERROR
+        && WSAGetLastError() != WSA_IO_PENDING) {
+        sendOp_.target.reset();
+        throw SocketError("WSASend failed");
+    }
+    sendPending_ = true;
+}
 
-            case PUT_REQ: {
-                auto sep = payload.find('|');
-                if (sep == std::string::npos) { sendMessage(clientSock, ERR, "bad-request"); break; }
-                std::string name = payload.substr(0, sep);
-                uint64_t size = 0; try { size = std::stoull(payload.substr(sep + 1)); }
-                catch (...) { size = 0; }
+void ClientHandler::onSend(DWORD bytes) {
+    if (sendKind_ == SendKind::Transmit) {
+        sendKind_ = SendKind::Message;
+        Download* dl = sending_;
+        sending_ = nullptr;
+        uint64_t data = bytes;
+        if (dl && dl->framed) {
+            // A frame cannot be resumed halfway; the stream would desync.
+            if (bytes != sizeof(MsgHeader) + sendData_) throw SocketError("short TransmitFile");
+            data = sendData_;
+        }
+        ctx_.stats.bytesZeroCopy += data;
+        ++ctx_.stats.getFrames;
+        // Nothing came off the file, e.g. a blob shorter than its row;
+        // posting the same offset again would only spin.
+        if (dl && data == 0) failDownload(*dl);
+        else if (dl) advanceDownload(*dl, data);
+    }
+    else {
+        sendOff_ += bytes;
+        if (sendOff_ >= sendSize() && sendKind_ == SendKind::Chunk && sending_) {
+            Download* dl = sending_;
+            sending_ = nullptr;
+            ctx_.stats.bytesBuffered += sendData_;
+            ++ctx_.stats.getFrames;
+            advanceDownload(*dl, sendData_);
+        }
+    }
 
-                int file_id = -1;
-                try {
-                    file_id = meta_.insertFile(name, size, std::nullopt);
-                }
-                catch (...) {
-                    sendMessage(clientSock, ERR, "insert-meta-failed"); break;
-                }
+    postSend();
+    // A payload waiting on the connection's budget may fit now.
+    if ((recvState_ == RecvState::Header && acceptingRequests()) || recvState_ == RecvState::Admit) postRecv();
+}
 
-                if (!fm_.allocateForNewFile(file_id, name)) { sendMessage(clientSock, ERR, "alloc-failed"); break; }
+void ClientHandler::advanceDownload(Download& dl, uint64_t bytes) {
+    dl.sent += bytes;
+    if (!dl.resume_id.empty()) {
+        ctx_.resume.record(dl.resume_id, dl.file_id, dl.sent, (uint32_t)CHUNK);
+    }
+    if (dl.sent >= dl.end) finishDownload(dl);
+}
 
-                sendMessage(clientSock, PUT_RESP, "OK");
+bool ClientHandler::postTransmit(Download& dl) {
+    if (dl.sent >= dl.end) return false;
+    LPFN_TRANSMITFILE transmit = transmitFileFn(clientSock);
+    if (!transmit) {
+        dl.zeroCopy = false;
+        return false;
+    }
 
-                const size_t BUF = 64 * 1024;
-                std::vector<uint8_t> buf(BUF);
-                uint64_t received = 0;
-                auto path = fm_.filePath(file_id);
-                std::fstream out(path, std::ios::binary | std::ios::in | std::ios::out);
-                if (!out) { sendMessage(clientSock, ERR, "open-failed"); break; }
+    DWORD n = static_cast<DWORD>(std::min<uint64_t>(dl.framed ? STREAM_FRAME : ZERO_COPY_CHUNK,
+                                                    dl.end - dl.sent));
+    // For v2 the DATA header rides along as TransmitFile's head buffer, so
+    // framing costs no extra send and no copy of the file bytes.
+    LPTRANSMIT_FILE_BUFFERS bufs = nullptr;
+    if (dl.framed) {
+        dl.frame = makeHeader(DATA, n, PROTOCOL_V2, dl.stream);
+        dl.frameBufs = TRANSMIT_FILE_BUFFERS{};
+        dl.frameBufs.Head = &dl.frame;
+        dl.frameBufs.HeadLength = sizeof(dl.frame);
+        bufs = &dl.frameBufs;
+    }
 
-                while (received < size) {
-                    int toRead = static_cast<int>(std::min<uint64_t>(BUF, size - received));
-                    recvAll(clientSock, reinterpret_cast<char*>(buf.data()), toRead);
-                    out.seekp(static_cast<std::streamoff>(received), std::ios::beg);
-                    out.write(reinterpret_cast<const char*>(buf.data()), toRead);
-                    received += static_cast<uint64_t>(toRead);
-                }
-                out.flush();
-                meta_.updateFileSize(file_id, size);
-                break;
+    // A packed blob is a window into its segment.
+    const uint64_t at = dl.file->base() + dl.sent;
+    sendOp_.reset();
+    sendOp_.ov.Offset = static_cast<DWORD>(at);
+    sendOp_.ov.OffsetHigh = static_cast<DWORD>(at >> 32);
+    sendOp_.target = shared_from_this();
+    if (!transmit(clientSock, dl.file->handle(), n, 0, &sendOp_.ov, bufs, TF_USE_KERNEL_APC)) {
+        int err = WSAGetLastError();
+        if (err != WSA_IO_PENDING && err != ERROR_IO_PENDING) {
+            // Not usable for this socket/file; finish the transfer buffered.
+            sendOp_.target.reset();
+            dl.zeroCopy = false;
+            return false;
+        }
+    }
+    sendKind_ = SendKind::Transmit;
+    sending_ = &dl;
+    sendData_ = n;
+    sendPending_ = true;
+    return true;
+}
+
+bool ClientHandler::nextDownloadChunk(Download& dl) {
+    if (dl.sent >= dl.end) return false;
+    const size_t head = dl.framed ? sizeof(MsgHeader) : 0;
+    if (dl.encoder) {
+        // One chunk per frame; the resume offset stays in file bytes.
+        uint32_t toRead = static_cast<uint32_t>(std::min<uint64_t>(COMPRESS_CHUNK, dl.end - dl.sent));
+        const void* src = nullptr;
+        int64_t n = 0;
+        std::shared_ptr<const void> pin;
+        if (dl.asyncRead) {
+            ByteSpan sp = takePage(dl, toRead, pin);
+            src = sp.data;
+            n = static_cast<int64_t>(sp.size);
+        }
+        else {
+            if (dl.raw.empty()) {
+                dl.raw = ctx_.buffers.acquire(COMPRESS_CHUNK);
+                dl.pool = &ctx_.buffers;
             }
+            // The compressor reads the mapping itself, so it gets a copy
+            // that survives a page that can't be read in.
+            src = dl.raw.data();
+            n = dl.map ? dl.map->read(dl.sent, dl.raw.data(), toRead, &dl.readAhead)
+                       : readDownload(dl, dl.raw.data(), toRead);
+        }
+        if (n <= 0) return false;
+        sendBuf_.resize(head + CHUNK_HEADER + static_cast<size_t>(n));
+        CodecStats before = dl.encoder->stats();
+        size_t wire = dl.encoder->encode(src, static_cast<uint32_t>(n), &sendBuf_[head]);
+        countCodec(ctx_.stats, before, dl.encoder->stats());
+        sendBuf_.resize(head + wire);
+        if (dl.framed) {
+            MsgHeader h = makeHeader(DATA, static_cast<uint32_t>(wire), PROTOCOL_V2, dl.stream);
+            std::memcpy(&sendBuf_[0], &h, sizeof(h));
+        }
+        sendData_ = static_cast<uint64_t>(n);
+        return true;
+    }
+    if (dl.map || dl.asyncRead) {
+        // No copy: the span is sent from the mapping, in frames as large
+        // as TransmitFile's, or from the page read ahead.
+        ByteSpan sp;
+        if (dl.map) {
+            sp = dl.map->span(dl.sent, static_cast<size_t>(std::min<uint64_t>(
+                dl.framed ? STREAM_FRAME : ZERO_COPY_CHUNK, dl.end - dl.sent)), &dl.readAhead);
+            sendPin_ = dl.map;
+        }
+        else {
+            sp = takePage(dl, dl.end - dl.sent, sendPin_);
+        }
+        if (sp.size == 0) return false;
+        sendBuf_.resize(head);
+        if (dl.framed) {
+            MsgHeader h = makeHeader(DATA, static_cast<uint32_t>(sp.size), PROTOCOL_V2, dl.stream);
+            std::memcpy(&sendBuf_[0], &h, sizeof(h));
+        }
+        sendSpan_ = sp;
+        sendData_ = sp.size;
+        return true;
+    }
+    size_t toRead = static_cast<size_t>(std::min<uint64_t>(CHUNK, dl.end - dl.sent));
+    sendBuf_.resize(head + toRead);
+    int64_t n = readDownload(dl, sendBuf_.data() + head, toRead);
+    if (n <= 0) {
+        sendBuf_.clear();
+        return false;
+    }
+    sendBuf_.resize(head + static_cast<size_t>(n));
+    if (dl.framed) {
+        MsgHeader h = makeHeader(DATA, static_cast<uint32_t>(n), PROTOCOL_V2, dl.stream);
+        std::memcpy(sendBuf_.data(), &h, sizeof(h));
+    }
+    sendData_ = static_cast<uint64_t>(n);
+    return true;
+}
+
+// Reads from the download's current offset, through the block cache when
+// the file has a cache key.
+int64_t ClientHandler::readDownload(Download& dl, void* buf, size_t len) {
+    if (dl.cached) return ctx_.blocks.read(dl.cacheKey, *dl.file, dl.size, dl.sent, buf, len);
+    return dl.file->readAt(dl.sent, buf, len);
+}
+
+// Tops up the download's reads in flight and says whether the page holding
+// its current offset is in. Pages already in the block cache need no read.
+bool ClientHandler::pageReady(Download& dl) {
+    constexpr uint64_t PAGE = BlockCache::PAGE_SIZE;
+    // Nothing queued: start from the page holding the offset, which also
+    // covers a transfer that began on TransmitFile.
+    if (dl.aheadCount == 0) dl.nextRead = dl.sent - dl.sent % PAGE;
+    while (dl.aheadCount < dl.ahead.size() && dl.nextRead < dl.end) {
+        PageRead& pr = dl.aheadAt(dl.aheadCount++);
+        pr.offset = dl.nextRead;
+        pr.tag = ++readTag_;
+        pr.done = false;
+        dl.nextRead += PAGE;
+        if (dl.cached && (pr.page = ctx_.blocks.lookup(dl.cacheKey, pr.offset / PAGE))) {
+            pr.done = true;
+            continue;
+        }
+        // Whole pages, even past the end of a range, so they can be cached.
+        const size_t want = static_cast<size_t>(std::min<uint64_t>(PAGE, dl.size - pr.offset));
+        // Just a weak_ptr and the tag, which std::function keeps inline.
+        std::weak_ptr<ClientHandler> self = weak_from_this();
+        const uint64_t tag = pr.tag;
+        ++ctx_.stats.diskAsyncReads;
+        ctx_.disk.read(dl.file, pr.offset, ctx_.buffers.acquire(want),
+            [self, tag](int64_t n, DiskIo::Buffer& buf) {
+                if (auto h = self.lock()) h->onPageRead(tag, n, buf);
+            });
+    }
+    return dl.aheadCount && dl.aheadAt(0).done;
+}
+
+// Up to `max` bytes from the current offset out of the front page, which
+// is dropped from the queue once the send has used it up; `pin` keeps it
+// alive. Empty if its read failed or came up short.
+ByteSpan ClientHandler::takePage(Download& dl, uint64_t max, std::shared_ptr<const void>& pin) {
+    if (dl.aheadCount == 0) return ByteSpan{};
+    const PageRead& pr = dl.aheadAt(0);
+    const size_t from = static_cast<size_t>(dl.sent - pr.offset);
+    if (!pr.page || from >= pr.page->size()) return ByteSpan{};
+    pin = pr.page;
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(pr.page->size() - from, max));
+    ByteSpan sp{ reinterpret_cast<const uint8_t*>(pr.page->data()) + from, n };
+    if (from + n >= pr.page->size()) dl.popAhead();
+    return sp;
+}
+
+void ClientHandler::onPageRead(uint64_t tag, int64_t n, DiskIo::Buffer& buf) {
+    std::lock_guard<std::mutex> lock(mu_);
+    Download* dl = nullptr;
+    PageRead* pr = nullptr;
+    for (auto& d : downloads_) {
+        for (size_t i = 0; i < d->aheadCount && !pr; ++i) {
+            if (d->aheadAt(i).tag == tag) pr = &d->aheadAt(i);
+        }
+        if (pr) {
+            dl = d.get();
+            break;
+        }
+    }
+    if (!pr) {
+        ctx_.buffers.release(buf);
+        return;
+    }
+    pr->done = true;
+    if (n > 0) {
+        ctx_.stats.diskAsyncBytes += static_cast<uint64_t>(n);
+        buf.resize(static_cast<size_t>(n));
+        auto page = ctx_.buffers.share(std::move(buf));
+        // A short page means the blob is not what the row says; don't keep it.
+        const uint64_t want = std::min<uint64_t>(BlockCache::PAGE_SIZE, dl->size - pr->offset);
+        if (dl->cached && static_cast<uint64_t>(n) == want) {
+            ctx_.blocks.insert(dl->cacheKey, pr->offset / BlockCache::PAGE_SIZE, page);
+        }
+        pr->page = std::move(page);
+    }
+    else {
+        ctx_.buffers.release(buf);
+    }
+    if (closing_) return;
+    try {
+        postSend();
+        if (recvState_ == RecvState::Header && acceptingRequests()) postRecv();
+    }
+    catch (...) {
+        close();
+    }
+}
+
+// The file gave no more bytes before the end the client was promised. Other
+// streams carry on and this one ends with an error; a v1 response can't say
+// so mid-stream, so there the connection goes.
+void ClientHandler::failDownload(Download& dl) {
+    const uint32_t stream = dl.stream;
+    const bool framed = dl.framed;
+    finishDownload(dl);
+    if (!framed) throw SocketError("download read failed");
+    queueStreamMessage(stream, ERR, "read-failed");
+}
+
+void ClientHandler::finishDownload(Download& dl) {
+    if (!dl.resume_id.empty()) {
+        if (dl.sent >= dl.end) ctx_.resume.complete(dl.resume_id);
+        else ctx_.resume.release(dl.resume_id);
+    }
+    // A ranged fetch counts once, on the range that reaches the end, and
+    // only if it got there.
+    if (dl.sent >= dl.end && dl.end == dl.size) meta_.incrementDownloadCount(dl.file_id);
+    // An MGET moves on to its next file in the same slot.
+    if (dl.sent >= dl.end && !dl.batch.empty()) {
+        if (nextBatchFile(dl)) return;
+        // Queued without sending: this may run inside postSend.
+        frameReply(ERR, "file-missing", PROTOCOL_V2, dl.stream);
+    }
+    auto it = std::find_if(downloads_.begin(), downloads_.end(),
+        [&dl](const std::unique_ptr<Download>& d) { return d.get() == &dl; });
+    if (it != downloads_.end()) downloads_.erase(it);
+}
 
-            default:
-                sendMessage(clientSock, ERR, "unknown-msg");
+// Takes the first `len` bytes of up.buf: hashed here, in order, then
+// written inline or handed to the pipeline, which swaps in a free buffer.
+void ClientHandler::storeUpload(Upload& up, size_t len) {
+    up.hasher.update(up.buf.data(), len);
+    if (up.sha) up.sha->update(up.buf.data(), len);
+    if (up.pipe) {
+        up.pipe->submit(std::move(up.buf), len);
+        up.buf = up.pipe->acquire();
+    }
+    else if (!up.out->writeAt(up.received, up.buf.data(), len)) {
+        throw std::runtime_error("write failed");
+    }
+    ctx_.stats.bytesUploaded += len;
+    up.received += len;
+}
+
+// Expands the chunk in `wire` (header already parsed) and stores it.
+bool ClientHandler::decodeUpload(Upload& up) {
+    CodecStats before = up.decoder->stats();
+    bool ok = up.decoder->decode(up.wire.data() + CHUNK_HEADER, up.wireLen, up.buf.data(), up.rawLen);
+    countCodec(ctx_.stats, before, up.decoder->stats());
+    if (!ok) return false;
+    storeUpload(up, up.rawLen);
+    return true;
+}
+
+// Finishes the upload once all of it is in and on disk. An MPUT file that
+// is all in but still being written steps aside for the next one.
+void ClientHandler::uploadStored(Upload& up) {
+    if (up.received < up.size) return;
+    const uint32_t stream = up.stream;
+    const bool batched = up.batched;
+    if (!up.pipe || up.pipe->idle()) {
+        finishUpload(up);
+    }
+    else {
+        auto it = uploads_.find(stream);
+        if (!batched || it == uploads_.end() || it->second.get() != &up) return;
+        draining_.push_back(std::move(it->second));
+        uploads_.erase(it);
+    }
+    if (batched) nextBatchUpload(stream);
+}
+
+// Called from a disk thread: a buffer came free for a held-back receive,
+// the last write landed, or a write failed.
+void ClientHandler::onUploadWritten(uint32_t stream, const WritePipeline* pipe) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (closing_) return;
+    Upload* found = nullptr;
+    auto it = uploads_.find(stream);
+    if (it != uploads_.end() && it->second->pipe.get() == pipe) found = it->second.get();
+    for (auto& d : draining_) {
+        if (d->pipe.get() == pipe) found = d.get();
+    }
+    if (!found) return;
+    Upload& up = *found;
+    try {
+        if (pipe->failed()) throw std::runtime_error("write failed");
+        if (up.buf.empty() && up.received < up.size) up.buf = up.pipe->acquire();
+        uploadStored(up);
+        if (recvState_ != RecvState::Header || acceptingRequests()) postRecv();
+    }
+    catch (...) {
+        close();
+    }
+}
+
+void ClientHandler::finishUpload(Upload& up) {
+    up.hasher.finish();
+    BlockHashRow blocks;
+    blocks.file_id = up.file_id;
+    blocks.block_size = HASH_BLOCK_SIZE;
+    blocks.leaves = up.hasher.leaves();
+    blocks.root = merkleRoot(blocks.leaves);
+    meta_.putBlockHashes(blocks);
+    // Commits after the block hashes, so the row is complete when it shows.
+    meta_.publishFile(up.file_id, up.size, formatCrc32c(up.hasher.fileCrc()));
+    up.pipe.reset();
+    up.out.reset();
+    if (up.sha) ctx_.content.adopt(up.file_id, up.size, up.sha->finishHex());
+    const uint32_t stream = up.stream;
+    if (up.batched) {
+        // The batch answers once, for all its files.
+        auto b = putBatches_.find(stream);
+        if (b != putBatches_.end()) {
+            --b->second.open;
+            ++b->second.stored;
+        }
+        ++ctx_.stats.mputFiles;
+    }
+    else if (up.framed) {
+        // v2 clients have many uploads in flight and need to know which landed.
+        queueStreamMessage(stream, PUT_DONE, std::to_string(up.file_id));
+    }
+    else {
+        recvState_ = RecvState::Header;
+    }
+    if (recvUpload_ == &up) recvUpload_ = nullptr;
+    auto d = std::find_if(draining_.begin(), draining_.end(),
+        [&up](const std::unique_ptr<Upload>& u) { return u.get() == &up; });
+    if (d != draining_.end()) draining_.erase(d);
+    else uploads_.erase(stream);
+}
+
+// Drops a stream's upload, and the MPUT files it had yet to start, along
+// with their pending rows and blobs.
+void ClientHandler::abortUploads(uint32_t stream) {
+    auto it = uploads_.find(stream);
+    if (it != uploads_.end()) {
+        discardFile(it->second->file_id);
+        uploads_.erase(it);
+    }
+    auto b = putBatches_.find(stream);
+    if (b != putBatches_.end()) {
+        for (const auto& f : b->second.files) discardFile(f.first);
+        putBatches_.erase(b);
+    }
+}
+
+// A blob still open for write-behind goes once its last handle closes.
+void ClientHandler::discardFile(int file_id) {
+    meta_.discardFile(file_id);
+    fm_.removeFile(file_id);
+}
+
+void ClientHandler::dispatch() {
+    switch (hdr_.type) {
+    case PING:
+        // Features follow, so a client hashes uploads only for a server
+        // that can use the hash.
+        queueMessage(PONG, ctx_.content.enabled() ? "OK|dedup" : "OK");
+        break;
+
+    case LIST_REQ: {
+        std::string page, error;
+        if (ctx_.list.handle(payload_, page, error)) queueMessage(LIST_RESP, page);
+        else queueMessage(ERR, error);
+        break;
+    }
+
+    case GET_REQ:
+        handleGet();
+        break;
+
+    case PUT_REQ:
+        handlePut();
+        break;
+
+    case MGET_REQ:
+        handleMget();
+        break;
+
+    case MPUT_REQ:
+        handleMput();
+        break;
+
+    case DATA:
+        // Frames for a stream whose PUT was rejected; already consumed.
+        break;
+
+    case UPLOAD_OPEN_REQ:
+        handleUploadOpen();
+        break;
+
+    case UPLOAD_CHUNK_REQ:
+        // Any with a payload are streamed (see onPiece).
+        queueMessage(ERR, "bad-request");
+        break;
+
+    case BLOCKS_REQ:
+        handleBlocks();
+        break;
+
+    case RATE_REQ:
+        handleRate();
+        break;
+
+    case SIG_REQ:
+        // Reads the whole file.
+        defer([this, request = payload_]() {
+            std::string sig, error;
+            if (ctx_.delta.signature(request, sig, error)) return std::make_pair(uint16_t(SIG_RESP), std::move(sig));
+            return std::make_pair(uint16_t(ERR), error);
+        });
+        break;
+
+    case DELTA_REQ: {
+        if (deltas_.count(hdr_.stream)) { queueMessage(ERR, "stream-busy"); break; }
+        std::string error;
+        auto w = ctx_.delta.open(payload_, error);
+        if (!w) { queueMessage(ERR, error); break; }
+        deltas_[hdr_.stream] = std::move(w);
+        queueMessage(DELTA_RESP, "OK");
+        break;
+    }
+
+    case DELTA_DATA: {
+        // Unacknowledged so the client can stream; errors surface at commit.
+        auto it = deltas_.find(hdr_.stream);
+        if (it != deltas_.end()) applyDelta(it->second);
+        break;
+    }
+
+    case DELTA_COMMIT_REQ: {
+        auto it = deltas_.find(hdr_.stream);
+        if (it == deltas_.end()) { queueMessage(ERR, "no-delta"); break; }
+        // Flushes the new version, moves it into blobs/ and waits on the
+        // catalog; the writer goes with the job.
+        defer([this, w = std::move(it->second), request = payload_]() {
+            int file_id = 0;
+            std::string error;
+            if (ctx_.delta.commit(*w, request, file_id, error))
+                return std::make_pair(uint16_t(DELTA_COMMIT_RESP), std::to_string(file_id));
+            return std::make_pair(uint16_t(ERR), error);
+        });
+        deltas_.erase(it);
+        break;
+    }
+
+    case UPLOAD_COMMIT_REQ:
+        // Waits on the row, and reads the whole blob after a restart.
+        defer([this, upload_id = payload_]() {
+            int file_id = 0;
+            std::string error;
+            if (ctx_.uploads.commit(upload_id, file_id, error))
+                return std::make_pair(uint16_t(UPLOAD_COMMIT_RESP), std::to_string(file_id));
+            return std::make_pair(uint16_t(ERR), error);
+        });
+        break;
+
+    case STATS_REQ:
+        queueMessage(STATS_RESP, ctx_.stats.format() + "\n"
+            + "metadata_commits=" + std::to_string(meta_.commitCount()) + "\n"
+            + "metadata_writes=" + std::to_string(meta_.writeCount()) + "\n"
+            + "file_cache_hits=" + std::to_string(meta_.cache().hits()) + "\n"
+            + "file_cache_misses=" + std::to_string(meta_.cache().misses()) + "\n"
+            + "list_snapshot_hits=" + std::to_string(ctx_.list.snapshotHits()) + "\n"
+            + "list_snapshot_misses=" + std::to_string(ctx_.list.snapshotMisses()) + "\n"
+            + "block_cache_hits=" + std::to_string(ctx_.blocks.hits()) + "\n"
+            + "block_cache_misses=" + std::to_string(ctx_.blocks.misses()) + "\n"
+            + "block_cache_hit_rate=" + hitRate(ctx_.blocks.hits(), ctx_.blocks.misses()) + "\n"
+            + "block_cache_evictions=" + std::to_string(ctx_.blocks.evictions()) + "\n"
+            + "block_cache_rejected=" + std::to_string(ctx_.blocks.rejections()) + "\n"
+            + "block_cache_bytes=" + std::to_string(ctx_.blocks.bytesResident()) + "\n"
+            + "block_cache_bytes_saved=" + std::to_string(ctx_.blocks.bytesSaved()) + "\n"
+            + "buffer_pool_hits=" + std::to_string(ctx_.buffers.hits()) + "\n"
+            + "buffer_pool_allocs=" + std::to_string(ctx_.buffers.allocs()) + "\n"
+            + "buffer_pool_bytes_idle=" + std::to_string(ctx_.buffers.bytesIdle()) + "\n"
+            + "io_heap_allocs=" + std::to_string(HeapCounter::allocations()) + "\n"
+            + "memory_bytes_charged=" + std::to_string(ctx_.memory.used()) + "\n"
+            + "rate_waits_down=" + std::to_string(ctx_.sendRate.waits()) + "\n"
+            + "rate_waits_up=" + std::to_string(ctx_.recvRate.waits()));
+        break;
+
+    default:
+        queueMessage(ERR, "unknown-msg");
+    }
+}
+
+// "key=value" settings separated by spaces or newlines, applied to both
+// directions or, prefixed "down." or "up.", to GET or PUT data only:
+// global, conn, small and bulk in KiB/s (0 = unlimited), small_kb,
+// small_weight and bulk_weight. All of them or none are applied. RATE_RESP
+// has the settings in force for each direction, one per line; an empty
+// request only asks for those.
+void ClientHandler::handleRate() {
+    BandwidthScheduler* scheds[2] = { &ctx_.sendRate, &ctx_.recvRate };
+    BandwidthScheduler::Limits lim[2] = { scheds[0]->limits(), scheds[1]->limits() };
+    std::istringstream in(payload_);
+    std::string item;
+    while (in >> item) {
+        const size_t eq = item.find('=');
+        if (eq == std::string::npos) { queueMessage(ERR, "bad-request"); return; }
+        std::string key = item.substr(0, eq);
+        bool dir[2] = { true, true };
+        if (key.rfind("down.", 0) == 0) { key.erase(0, 5); dir[1] = false; }
+        else if (key.rfind("up.", 0) == 0) { key.erase(0, 3); dir[0] = false; }
+        uint64_t v = 0;
+        try {
+            size_t used = 0;
+            v = std::stoull(item.substr(eq + 1), &used);
+            if (used != item.size() - eq - 1 || item[eq + 1] == '-') throw std::invalid_argument(item);
+        }
+        catch (...) { queueMessage(ERR, "bad-request"); return; }
+        for (int d = 0; d < 2; ++d) {
+            if (!dir[d]) continue;
+            BandwidthScheduler::Limits& l = lim[d];
+            if (key == "global") l.global = v * 1024;
+            else if (key == "conn") l.conn = v * 1024;
+            else if (key == "small") l.small = v * 1024;
+            else if (key == "bulk") l.bulk = v * 1024;
+            else if (key == "small_kb") l.smallBytes = v * 1024;
+            else if (key == "small_weight" && v >= 1 && v <= 1000) l.smallWeight = static_cast<unsigned>(v);
+            else if (key == "bulk_weight" && v >= 1 && v <= 1000) l.bulkWeight = static_cast<unsigned>(v);
+            else { queueMessage(ERR, "bad-request"); return; }
+        }
+    }
+
+    std::string resp;
+    for (int d = 0; d < 2; ++d) {
+        scheds[d]->setLimits(lim[d]);
+        const BandwidthScheduler::Limits l = scheds[d]->limits();
+        const std::string dir = d == 0 ? "down." : "up.";
+        resp += dir + "global=" + std::to_string(l.global / 1024) + "\n"
+            + dir + "conn=" + std::to_string(l.conn / 1024) + "\n"
+            + dir + "small=" + std::to_string(l.small / 1024) + "\n"
+            + dir + "bulk=" + std::to_string(l.bulk / 1024) + "\n"
+            + dir + "small_kb=" + std::to_string(l.smallBytes / 1024) + "\n"
+            + dir + "small_weight=" + std::to_string(l.smallWeight) + "\n"
+            + dir + "bulk_weight=" + std::to_string(l.bulkWeight) + "\n";
+    }
+    queueMessage(RATE_RESP, resp);
+}
+
+void ClientHandler::handleGet() {
+    // file_id[|resume_id[|offset|length[|codec]]], offset and length both
+    // empty for the whole file, length alone empty for the rest of it
+    std::vector<std::string> fields;
+    for (size_t pos = 0;;) {
+        size_t sep = payload_.find('|', pos);
+        fields.push_back(payload_.substr(pos, sep - pos));
+        if (sep == std::string::npos) break;
+        pos = sep + 1;
+    }
+    int file_id = 0;
+    std::string file_id_str = fields[0];
+    std::string resume_id = fields.size() > 1 ? fields[1] : std::string();
+
+    bool ranged = false, rangeOk = fields.size() <= 2;
+    uint64_t rangeOff = 0, rangeLen = 0;
+    if (fields.size() == 4 || fields.size() == 5) {
+        try {
+            if (!fields[2].empty() || !fields[3].empty()) {
+                rangeOff = std::stoull(fields[2]);
+                rangeLen = fields[3].empty() ? UINT64_MAX : std::stoull(fields[3]);
+                ranged = true;
             }
+            rangeOk = true;
+        }
+        catch (...) {}
+    }
+    if (!rangeOk) {
+        queueMessage(ERR, "bad-range");
+        return;
+    }
+    // An unknown codec is declined rather than refused; the reply says so.
+    Codec codec = Codec::None;
+    if (fields.size() == 5 && !parseCodec(fields[4], codec)) codec = Codec::None;
+
+    const bool framed = (hdr_.version == PROTOCOL_V2);
+    if (framed) {
+        for (const auto& d : downloads_) {
+            if (d->stream == hdr_.stream) { queueMessage(ERR, "stream-busy"); return; }
+        }
+    }
+
+    FileRow fr{};
+    if (!lookupFile(file_id_str, fr)) {
+        queueMessage(ERR, "file-not-found");
+        return;
+    }
+    file_id = fr.file_id;
+
+    // The size comes from the (usually cached) row; the hot path does no
+    // stat and no query.
+    auto dl = std::make_unique<Download>();
+    dl->stream = hdr_.stream;
+    dl->framed = framed;
+    dl->file_id = file_id;
+    dl->resume_id = resume_id;
+    dl->size = fr.size;
+    dl->end = fr.size;
+    dl->zeroCopy = ctx_.config.zeroCopy;
+
+    if (codec != Codec::None) {
+        dl->encoder = std::make_unique<ChunkEncoder>(codec);
+        if (dl->encoder->active()) dl->zeroCopy = false;
+        else dl->encoder.reset();
+    }
+
+    if (ranged) {
+        if (rangeOff > fr.size) {
+            queueMessage(ERR, "bad-range");
+            return;
+        }
+        dl->sent = rangeOff;
+        dl->end = rangeOff + std::min<uint64_t>(rangeLen, fr.size - rangeOff);
+    }
+
+    // The checkpoint only says what was handed to the socket, which may be
+    // more than the client wrote; an offset the client asked for wins.
+    if (!resume_id.empty() && !ranged) {
+        ResumeRow rr{};
+        if (ctx_.resume.lookup(resume_id, rr) && rr.file_id == file_id
+            && rr.offset > dl->sent && rr.offset < dl->end) {
+            dl->sent = rr.offset;
+        }
+    }
+
+    if (!chargeDownload(*dl)) {
+        queueMessage(ERR, "server-busy");
+        return;
+    }
+    if (!openDownload(*dl, fr)) {
+        queueMessage(ERR, "file-missing");
+        return;
+    }
+
+    // "size|offset|length|checksum[|codec]": the client must start writing
+    // where we start sending, which with coalesced checkpoints may be behind
+    // its own offset; length is what follows after clamping a range, in file
+    // bytes. The checksum covers the whole file and is empty for files stored
+    // before it existed. The codec is echoed when one was asked for.
+    std::string resp = std::to_string(dl->size) + "|" + std::to_string(dl->sent)
+        + "|" + std::to_string(dl->end - dl->sent) + "|" + fr.checksum.value_or("");
+    if (fields.size() == 5) resp += std::string("|") + codecName(dl->encoder ? codec : Codec::None);
+    downloads_.push_back(std::move(dl));
+    queueMessage(GET_RESP, resp);
+}
+
+// Opens the file's bytes and picks how the download reads them.
+bool ClientHandler::openDownload(Download& dl, const FileRow& fr) {
+    dl.file = std::make_shared<BlobFile>(fm_.openForRead(fr.file_id, fr.content_hash, ctx_.disk.overlapped()));
+    if (!*dl.file) return false;
+    // TransmitFile sends from the handle; the mapping serves the buffered path.
+    dl.map = fr.content_hash ? fm_.mapBlob(*fr.content_hash) : nullptr;
+    dl.cached = !dl.map && ctx_.blocks.enabled() && BlockCache::fileKey(fr, dl.cacheKey);
+    dl.asyncRead = !dl.map && ctx_.disk.async() && ctx_.disk.attach(*dl.file);
+    if (dl.asyncRead && dl.ahead.empty()) dl.ahead.resize(std::max<size_t>(1, ctx_.config.diskDepth));
+    dl.cls = ctx_.sendRate.classify(dl.end - dl.sent);
+    return true;
+}
+
+// Charges what a download may hold besides its frame, read-ahead pages and
+// the compressor's input, to the server's budget. Not to the connection's:
+// a connection short of that stops reading, and its own uploads would
+// stall with it. False if it doesn't fit; the request is then refused.
+bool ClientHandler::chargeDownload(Download& dl) {
+    uint64_t n = 0;
+    if (!dl.zeroCopy && ctx_.disk.async()) n += uint64_t(ctx_.config.diskDepth) * BlockCache::PAGE_SIZE;
+    if (dl.encoder) n += COMPRESS_CHUNK;
+    if (n == 0) return true;
+    if (!ctx_.memory.tryCharge(n)) {
+        ++ctx_.stats.memoryRefusals;
+        return false;
+    }
+    dl.budget = &ctx_.memory;
+    dl.buffers = n;
+    return true;
+}
+
+// Points an MGET download at the next file of its batch.
+bool ClientHandler::nextBatchFile(Download& dl) {
+    FileRow fr = std::move(dl.batch.front());
+    dl.batch.pop_front();
+    dl.file_id = fr.file_id;
+    dl.size = fr.size;
+    dl.sent = 0;
+    dl.end = fr.size;
+    dl.zeroCopy = ctx_.config.zeroCopy;
+    dl.readAhead = 0;
+    dl.clearAhead();
+    return openDownload(dl, fr);
+}
+
+// One file id or name per line. MGET_RESP has a line per file,
+// "size|checksum", or "-|error" for one that can't be sent; the bytes of
+// the others follow back to back in DATA frames on the request's stream,
+// in order, each frame within one file. Files are opened as their turn
+// comes, so a batch holds one handle at a time.
+void ClientHandler::handleMget() {
+    if (hdr_.version != PROTOCOL_V2) { queueMessage(ERR, "v2-required"); return; }
+    for (const auto& d : downloads_) {
+        if (d->stream == hdr_.stream) { queueMessage(ERR, "stream-busy"); return; }
+    }
+
+    auto dl = std::make_unique<Download>();
+    dl->stream = hdr_.stream;
+    dl->framed = true;
+    std::string resp;
+    for (size_t pos = 0; pos < payload_.size();) {
+        size_t eol = payload_.find('\n', pos);
+        if (eol == std::string::npos) eol = payload_.size();
+        FileRow fr{};
+        if (lookupFile(payload_.substr(pos, eol - pos), fr)) {
+            resp += std::to_string(fr.size) + "|" + fr.checksum.value_or("") + "\n";
+            dl->batch.push_back(std::move(fr));
+        }
+        else {
+            resp += "-|file-not-found\n";
+        }
+        pos = eol + 1;
+    }
+    ctx_.stats.mgetFiles += dl->batch.size();
+    if (!dl->batch.empty()) {
+        dl->zeroCopy = ctx_.config.zeroCopy;
+        if (!chargeDownload(*dl)) { queueMessage(ERR, "server-busy"); return; }
+        if (!nextBatchFile(*dl)) { queueMessage(ERR, "file-missing"); return; }
+        downloads_.push_back(std::move(dl));
+    }
+    queueMessage(MGET_RESP, resp);
+}
+
+// Makes a request's reply on the work queue, for requests that may read a
+// whole file, and sends it from there. A v1 connection reads no further
+// request until then; v2 replies come in any order anyway.
+void ClientHandler::defer(std::function<std::pair<uint16_t, std::string>()> job) {
+    auto self = shared_from_this();
+    const uint16_t version = hdr_.version;
+    const uint32_t stream = hdr_.stream;
+    ++working_;
+    ctx_.work.submit([self, this, version, stream, job = std::move(job)]() {
+        std::pair<uint16_t, std::string> reply;
+        try { reply = job(); }
+        catch (...) { reply = { uint16_t(ERR), "internal-error" }; }
+        std::lock_guard<std::mutex> lock(mu_);
+        --working_;
+        if (closing_) return;
+        try {
+            frameReply(reply.first, reply.second, version, stream);
+            postSend();
+        }
+        catch (...) { close(); }
+    });
+}
+
+// Applies a DELTA_DATA payload on the work queue, since one copy
+// instruction may read and write the whole file. Nothing more is read
+// until it is done, so a stream's payloads land in order and its commit
+// finds them all applied. The payload stays charged until then.
+void ClientHandler::applyDelta(std::shared_ptr<DeltaSync::Writer> w) {
+    auto self = shared_from_this();
+    const uint64_t charge = admitted_;
+    admitted_ = 0;
+    deltaApplying_ = true;
+    ctx_.work.submit([self, this, w = std::move(w), data = std::move(payload_), charge]() {
+        bool ok = true;
+        try { w->apply(data.data(), data.size()); }
+        catch (...) { ok = false; }
+        std::lock_guard<std::mutex> lock(mu_);
+        deltaApplying_ = false;
+        // close() has already let go of everything charged.
+        if (closing_) return;
+        releaseMemory(charge);
+        if (!ok) {
+            close();
+            return;
+        }
+        try {
+            if (recvState_ == RecvState::Header && acceptingRequests()) postRecv();
         }
+        catch (...) { close(); }
+    });
+}
+
+// "name|size[|sha256:<hex>[|codec]]", the hash possibly empty. When the
+// offered hash names content already stored, the file is added without its
+// bytes and PUT_DONE answers once its row commits. With a codec, PUT_RESP is "OK|codec"
+// and the bytes arrive as compressed chunks.
+void ClientHandler::handlePut() {
+    std::vector<std::string> fields;
+    for (size_t pos = 0;;) {
+        size_t sep = payload_.find('|', pos);
+        fields.push_back(payload_.substr(pos, sep - pos));
+        if (sep == std::string::npos) break;
+        pos = sep + 1;
+    }
+    if (fields.size() < 2 || fields.size() > 4) { queueMessage(ERR, "bad-request"); return; }
+    std::string name = fields[0];
+    uint64_t size = 0; try { size = std::stoull(fields[1]); }
+    catch (...) { size = 0; }
+    Codec codec = Codec::None;
+    if (fields.size() == 4 && !parseCodec(fields[3], codec)) codec = Codec::None;
+
+    const bool framed = (hdr_.version == PROTOCOL_V2);
+    if (framed) {
+        if (uploads_.count(hdr_.stream) || putBatches_.count(hdr_.stream)) { queueMessage(ERR, "stream-busy"); return; }
+        if (uploads_.size() >= MAX_STREAMS) { queueMessage(ERR, "too-many-streams"); return; }
+    }
+
+    std::string hash;
+    if (fields.size() >= 3 && !fields[2].empty() && !parseSha256(fields[2], hash)) {
+        queueMessage(ERR, "bad-request");
+        return;
     }
+
+    auto put = std::make_shared<PendingPut>();
+    put->type = PUT_REQ;
+    put->stream = hdr_.stream;
+    put->version = hdr_.version;
+    put->name = name;
+    put->size = size;
+    put->codec = codec;
+    put->codecField = (fields.size() == 4);
+    putPending_ = put;
+    if (!hash.empty() && offerPut(put, hash)) return;
+    insertPut(put);
+}
+
+// "name|size[|upload_id[|sha256:<hex>]]": an offered hash is looked up
+// first, as for PUT, and the session opened only if it finds nothing.
+void ClientHandler::handleUploadOpen() {
+    auto put = std::make_shared<PendingPut>();
+    std::string hash;
+    if (UploadSessions::offered(payload_, put->name, put->size, hash)) {
+        put->type = UPLOAD_OPEN_REQ;
+        put->stream = hdr_.stream;
+        put->version = hdr_.version;
+        put->request = payload_;
+        putPending_ = put;
+        if (offerPut(put, hash)) return;
+        putPending_.reset();
+    }
+    std::string reply, error;
+    if (ctx_.uploads.open(payload_, reply, error)) queueMessage(UPLOAD_OPEN_RESP, reply);
+    else queueMessage(ERR, error);
+}
+
+// Offers the hash to the content store; finishOffer picks up the answer.
+// False if no duplicate can be taken, and then nothing comes back.
+bool ClientHandler::offerPut(const std::shared_ptr<PendingPut>& put, const std::string& hash) {
+    put->offered = true;
+    std::weak_ptr<ClientHandler> weak = weak_from_this();
+    MetadataStore& meta = meta_;
+    if (ctx_.content.offer(put->name, put->size, hash, [weak, put, hash, &meta](int file_id) {
+            put->file_id = file_id;
+            auto self = weak.lock();
+            if (self && self->postInsert(self)) return;
+            // No one will hear of the duplicate; it goes again so that a
+            // retry can take the name.
+            if (file_id >= 0) meta.withdrawDuplicate(file_id, hash);
+        }))
+        return true;
+    put->offered = false;
+    return false;
+}
+
+// The row commits with the writer's next group; openPut carries on from
+// there on an I/O worker.
+void ClientHandler::insertPut(const std::shared_ptr<PendingPut>& put) {
+    std::weak_ptr<ClientHandler> weak = weak_from_this();
+    MetadataStore& meta = meta_;
+    meta_.insertFileAsync(put->name, put->size, std::nullopt, [weak, put, &meta](int file_id) {
+        put->file_id = file_id;
+        auto self = weak.lock();
+        if (self && self->postInsert(self)) return;
+        // No one will open the blob, which doesn't exist yet; the pending
+        // row goes now rather than at the next startup, so that a retry
+        // can take the name.
+        if (file_id >= 0) meta.discardFile(file_id);
+    });
+}
+
+// Runs on the writer thread, which must not see an exception. False if the
+// post fails as the port goes away.
+bool ClientHandler::postInsert(const std::shared_ptr<ClientHandler>& self) {
+    insertOp_.reset();
+    insertOp_.target = self;
+    try { ctx_.io.post(insertOp_); }
     catch (...) {
-        // client closed / error
+        insertOp_.target.reset();
+        return false;
+    }
+    return true;
+}
+
+// An offered duplicate went in, and answers the request, or didn't, and
+// the request goes on as if no hash had come with it.
+void ClientHandler::finishOffer(const std::shared_ptr<PendingPut>& put) {
+    auto reply = [this, &put](uint16_t type, const std::string& payload) {
+        frameReply(type, payload, put->version, put->stream);
+        postSend();
+    };
+    if (put->file_id >= 0) {
+        ++ctx_.stats.dedupFiles;
+        ctx_.stats.dedupBytes += put->size;
+        reply(put->type == PUT_REQ ? PUT_DONE : UPLOAD_COMMIT_RESP, std::to_string(put->file_id));
+        return;
+    }
+    if (put->type == UPLOAD_OPEN_REQ) {
+        std::string out, error;
+        if (ctx_.uploads.open(put->request, out, error)) reply(UPLOAD_OPEN_RESP, out);
+        else reply(ERR, error);
+        return;
     }
-    closesocket(clientSock);
+    put->offered = false;
+    putPending_ = put;
+    insertPut(put);
+}
+
+// Second half of a PUT, once its row is in: opens the blob and answers.
+void ClientHandler::openPut(const PendingPut& put) {
+    auto reply = [this, &put](uint16_t type, const std::string& payload) {
+        frameReply(type, payload, put.version, put.stream);
+        postSend();
+    };
+    if (put.file_id < 0) {
+        reply(ERR, "insert-meta-failed");
+        return;
+    }
+    const bool framed = (put.version == PROTOCOL_V2);
+    std::string error;
+    auto up = openUpload(put.stream, framed, put.file_id, put.size, put.codec, error);
+    if (!up) {
+        discardFile(put.file_id);
+        reply(ERR, error);
+        return;
+    }
+
+    if (put.codecField) reply(PUT_RESP, std::string("OK|") + codecName(up->decoder ? put.codec : Codec::None));
+    else reply(PUT_RESP, "OK");
+
+    Upload& ref = *up;
+    uploads_[ref.stream] = std::move(up);
+    if (put.size == 0) {
+        finishUpload(ref);
+        return;
+    }
+    // v1 bytes follow raw; v2 bytes arrive as DATA frames between other
+    // requests and are routed by onDataHeader.
+    if (!framed) {
+        recvUpload_ = &ref;
+        recvState_ = ref.decoder ? RecvState::UploadCompressed : RecvState::Upload;
+    }
+}
+
+// Creates the file's blob and the buffers its bytes are received into,
+// with a write-behind pipeline when the disk backend is async.
+std::unique_ptr<ClientHandler::Upload> ClientHandler::openUpload(uint32_t stream, bool framed, int file_id,
+                                                                 uint64_t size, Codec codec, std::string& error) {
+    auto up = std::make_unique<Upload>();
+    up->stream = stream;
+    up->framed = framed;
+    up->file_id = file_id;
+    up->size = size;
+    up->cls = ctx_.recvRate.classify(size);
+    const bool writeBehind = ctx_.disk.async() && ctx_.config.uploadBuffers >= 2 && size > 0;
+    if (codec != Codec::None) {
+        up->decoder = std::make_unique<ChunkDecoder>(codec);
+        if (!up->decoder->active()) up->decoder.reset();
+    }
+    const size_t bufSize = static_cast<size_t>(std::min<uint64_t>(
+        up->decoder ? MAX_COMPRESS_CHUNK : framed ? MAX_DATA_FRAME : UPLOAD_CHUNK, size));
+    // Charged like a download's (see chargeDownload), before the buffers
+    // are allocated.
+    const uint64_t buffers = uint64_t(bufSize) * (writeBehind ? ctx_.config.uploadBuffers : 1)
+        + (up->decoder ? CHUNK_HEADER + bufSize : 0);
+    if (buffers && !ctx_.memory.tryCharge(buffers)) {
+        ++ctx_.stats.memoryRefusals;
+        error = "server-busy";
+        return nullptr;
+    }
+    up->budget = &ctx_.memory;
+    up->buffers = buffers;
+    up->out = std::make_shared<BlobFile>(fm_.openForWrite(file_id, size, writeBehind && ctx_.disk.overlapped()));
+    if (!*up->out) { error = "alloc-failed"; return nullptr; }
+    if (ctx_.content.enabled()) up->sha = std::make_unique<Sha256>();
+
+    if (up->decoder) up->wire.resize(CHUNK_HEADER + bufSize);
+    if (writeBehind && ctx_.disk.attach(*up->out)) {
+        std::weak_ptr<ClientHandler> self = weak_from_this();
+        up->pipe = std::make_shared<WritePipeline>(ctx_.disk, ctx_.buffers, up->out, size, ctx_.config.uploadBuffers, bufSize,
+            [self, stream](WritePipeline& p) {
+                if (auto h = self.lock()) h->onUploadWritten(stream, &p);
+            });
+        up->buf = up->pipe->acquire();
+    }
+    else {
+        up->buf = ctx_.buffers.acquire(bufSize);
+    }
+    up->pool = &ctx_.buffers;
+    return up;
+}
+
+// One "name|size" line per file. All the rows are created in one
+// transaction, and MPUT_RESP has a line per file: its id, or "-" if the
+// name is taken. The accepted files' bytes then arrive back to back in
+// DATA frames on the request's stream, in order, each frame within one
+// file; MPUT_DONE carries the number stored once the last has landed.
+void ClientHandler::handleMput() {
+    if (hdr_.version != PROTOCOL_V2) { queueMessage(ERR, "v2-required"); return; }
+    if (uploads_.count(hdr_.stream) || putBatches_.count(hdr_.stream)) { queueMessage(ERR, "stream-busy"); return; }
+    if (uploads_.size() >= MAX_STREAMS) { queueMessage(ERR, "too-many-streams"); return; }
+
+    std::vector<std::pair<std::string, uint64_t>> files;
+    for (size_t pos = 0; pos < payload_.size();) {
+        size_t eol = payload_.find('\n', pos);
+        if (eol == std::string::npos) eol = payload_.size();
+        const std::string line = payload_.substr(pos, eol - pos);
+        pos = eol + 1;
+        const size_t bar = line.rfind('|');
+        uint64_t size = 0;
+        try {
+            if (bar == 0 || bar == std::string::npos) throw std::invalid_argument(line);
+            size = std::stoull(line.substr(bar + 1));
+        }
+        catch (...) {
+            queueMessage(ERR, "bad-request");
+            return;
+        }
+        files.emplace_back(line.substr(0, bar), size);
+    }
+    if (files.empty()) { queueMessage(ERR, "bad-request"); return; }
+
+    // The rows commit with the writer's next group; openBatch carries on
+    // from there on an I/O worker, as openPut does for a PUT.
+    auto put = std::make_shared<PendingPut>();
+    put->type = MPUT_REQ;
+    put->stream = hdr_.stream;
+    put->version = hdr_.version;
+    put->batch = std::move(files);
+    putPending_ = put;
+    std::weak_ptr<ClientHandler> weak = weak_from_this();
+    MetadataStore& meta = meta_;
+    meta_.insertFiles(put->batch, [weak, put, &meta](std::vector<int> ids) {
+        put->ids = std::move(ids);
+        auto self = weak.lock();
+        if (self && self->postInsert(self)) return;
+        // As for a PUT (see insertPut).
+        for (int id : put->ids) {
+            if (id >= 0) meta.discardFile(id);
+        }
+    });
+}
+
+// Second half of an MPUT, once its rows are in: answers with their ids and
+// starts on the first file.
+void ClientHandler::openBatch(const PendingPut& put) {
+    if (put.ids.size() != put.batch.size()) {
+        queueStreamMessage(put.stream, ERR, "insert-meta-failed");
+        return;
+    }
+    PutBatch batch;
+    std::string resp;
+    for (size_t i = 0; i < put.batch.size(); ++i) {
+        if (put.ids[i] < 0) {
+            resp += "-\n";
+            continue;
+        }
+        resp += std::to_string(put.ids[i]) + "\n";
+        batch.files.emplace_back(put.ids[i], put.batch[i].second);
+    }
+    queueStreamMessage(put.stream, MPUT_RESP, resp);
+    putBatches_[put.stream] = std::move(batch);
+    nextBatchUpload(put.stream);
+}
+
+// Opens the upload for an MPUT's next file unless one is still receiving,
+// finishing empty files on the spot, and answers MPUT_DONE once every file
+// is stored.
+void ClientHandler::nextBatchUpload(uint32_t stream) {
+    auto it = putBatches_.find(stream);
+    if (it == putBatches_.end()) return;
+    PutBatch& batch = it->second;
+    while (!uploads_.count(stream) && !batch.files.empty()) {
+        const auto [file_id, size] = batch.files.front();
+        batch.files.pop_front();
+        std::string error;
+        auto up = openUpload(stream, true, file_id, size, Codec::None, error);
+        if (!up) {
+            // The client is already sending; with no upload open, the rest
+            // of its frames are dropped.
+            discardFile(file_id);
+            abortUploads(stream);
+            queueStreamMessage(stream, ERR, error);
+            return;
+        }
+        up->batched = true;
+        ++batch.open;
+        Upload& ref = *up;
+        uploads_[stream] = std::move(up);
+        if (size == 0) finishUpload(ref);
+    }
+    if (batch.files.empty() && batch.open == 0) {
+        const size_t stored = batch.stored;
+        putBatches_.erase(it);
+        queueStreamMessage(stream, MPUT_DONE, std::to_string(stored));
+    }
+}
+
+// A file is requested by id, or by name when the field isn't numeric.
+bool ClientHandler::lookupFile(const std::string& field, FileRow& fr) {
+    if (!field.empty() && std::all_of(field.begin(), field.end(),
+        [](unsigned char c) { return std::isdigit(c) != 0; })) {
+        int file_id = 0;
+        try { file_id = std::stoi(field); }
+        catch (...) { return false; }
+        return meta_.getFile(file_id, fr);
+    }
+    return meta_.getFileByName(field, fr);
+}
+
+// BLOCKS_RESP, little-endian: u64 size, u32 block_size, u32 root, u32 count,
+// then count u32 leaves.
+void ClientHandler::handleBlocks() {
+    FileRow fr{};
+    if (!lookupFile(payload_, fr)) {
+        queueMessage(ERR, "file-not-found");
+        return;
+    }
+    BlockHashRow row;
+    if (!meta_.getBlockHashes(fr.file_id, row)) {
+        queueMessage(ERR, "no-block-hashes");
+        return;
+    }
+
+    std::string resp;
+    auto put = [&resp](const void* p, size_t n) { resp.append(static_cast<const char*>(p), n); };
+    const uint64_t size = fr.size;
+    const uint32_t count = static_cast<uint32_t>(row.leaves.size());
+    resp.reserve(20 + row.leaves.size() * sizeof(uint32_t));
+    put(&size, sizeof(size));
+    put(&row.block_size, sizeof(row.block_size));
+    put(&row.root, sizeof(row.root));
+    put(&count, sizeof(count));
+    put(row.leaves.data(), row.leaves.size() * sizeof(uint32_t));
+    queueMessage(BLOCKS_RESP, resp);
 }
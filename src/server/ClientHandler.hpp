@@ -1,20 +1,318 @@
 #pragma once
 #include <filesystem>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <winsock2.h>
+#include <mswsock.h>
+#include "../../common/common.hpp"
+#include "../../common/blockhash.hpp"
+#include "../../common/compress.hpp"
+#include "../../common/sha256.hpp"
+#include "IoService.hpp"
+#include "ServerContext.hpp"
+#include "FileManager.hpp"
+#include "MetadataStore.hpp"
+#include "DeltaSync.hpp"
+#include "UploadSessions.hpp"
+#include "MemoryBudget.hpp"
+#include "BlockCache.hpp"
+#include "DiskIo.hpp"
+#include "WritePipeline.hpp"
+#include "BufferPool.hpp"
+#include "BandwidthScheduler.hpp"
 
-class MetadataStore;
-class FileManager;
-
-class ClientHandler {
+// Per-connection state machine driven by completion-port callbacks.
+// At most one receive and one send are outstanding; either may complete
+// partially and is simply re-posted for the remainder.
+//
+// A v1 connection is strictly request/response on stream 0. Once a client
+// speaks v2 the connection is full-duplex: requests keep being read while
+// responses stream out, and active downloads take turns sending DATA
+// frames, each for a quantum of bytes weighted by its transfer class.
+// File data in either direction goes through the bandwidth
+// schedulers; control replies never wait on them.
+class ClientHandler : public IoCompletionTarget, public std::enable_shared_from_this<ClientHandler> {
 public:
-    ClientHandler(SOCKET sock, const std::filesystem::path& root, MetadataStore& meta, FileManager& fm);
-    void process();
+    ClientHandler(SOCKET sock, ServerContext& ctx);
+    ~ClientHandler() override;
+
+    void start();
+    void onIoComplete(IoOp& op, DWORD bytes, DWORD error) override;
 
 private:
+    enum class RecvState { Header, Admit, Payload, PayloadPiece, Upload, UploadCompressed, StreamData };
+    enum class SendKind { Message, Chunk, Transmit };
+
+    // One block-cache page of a download, read ahead through DiskIo. Its
+    // read finds it again by tag, so a download that moved on or went away
+    // just lets the page go.
+    struct PageRead {
+        uint64_t offset{};
+        uint64_t tag{};
+        bool done{};
+        std::shared_ptr<const BlockCache::Page> page;   // null if the read failed
+    };
+
+    struct Download {
+        uint32_t stream{};
+        bool framed{};          // v2: bytes go out as DATA frames
+        int file_id{};
+        std::string resume_id;
+        uint64_t size{};        // whole file, as reported in GET_RESP
+        uint64_t sent{};        // next offset to send
+        uint64_t end{};         // exclusive; size unless a range was asked for
+        std::shared_ptr<BlobFile> file;     // shared with reads in flight
+        // Buffered sends of a stored blob go straight from its mapping.
+        std::shared_ptr<const MappedBlob> map;
+        uint64_t readAhead{};
+        bool cached{};          // other buffered reads go through the block cache
+        BlockCache::FileKey cacheKey;
+        // With an async disk backend those reads are issued up to
+        // --disk-depth pages ahead of the send, in file order, into a ring
+        // of slots sized when the download opens.
+        bool asyncRead{};
+        std::vector<PageRead> ahead;
+        size_t aheadFront{};
+        size_t aheadCount{};
+        uint64_t nextRead{};    // offset of the next page to request
+        bool zeroCopy{};
+        std::unique_ptr<ChunkEncoder> encoder;  // compressed GET; never zero-copy
+        DiskIo::Buffer raw;     // file bytes read for the encoder, from `pool`
+        BufferPool* pool{};
+        MsgHeader frame{};      // DATA header handed to TransmitFile
+        TRANSMIT_FILE_BUFFERS frameBufs{};
+        // MGET: the files still to send once this one is done, in order.
+        std::deque<FileRow> batch;
+        BandwidthScheduler::Class cls = BandwidthScheduler::Bulk;
+        int64_t credit{};       // bytes left of its turn at the front
+        // Read-ahead pages and compressor input, charged to the server's
+        // budget for as long as the download lasts.
+        MemoryBudget* budget{};
+        uint64_t buffers{};
+
+        ~Download() {
+            if (pool) pool->release(raw);
+            if (budget) budget->release(buffers);
+        }
+        PageRead& aheadAt(size_t i) { return ahead[(aheadFront + i) % ahead.size()]; }
+        void popAhead() {
+            aheadAt(0).page.reset();
+            aheadFront = (aheadFront + 1) % ahead.size();
+            --aheadCount;
+        }
+        void clearAhead() { while (aheadCount) popAhead(); }
+    };
+
+    struct Upload {
+        uint32_t stream{};
+        bool framed{};
+        int file_id{};
+        uint64_t size{};
+        uint64_t received{};    // bytes taken in; with a pipeline, not yet all written
+        std::shared_ptr<BlobFile> out;
+        // Write-behind with an async disk backend; buf then comes from its
+        // pool and is empty while the disk is behind.
+        std::shared_ptr<WritePipeline> pipe;
+        DiskIo::Buffer buf;
+        BufferPool* pool{};     // where buf goes back to
+        size_t fill{};
+        std::unique_ptr<ChunkDecoder> decoder;  // compressed PUT
+        std::vector<uint8_t> wire;  // chunk header and body as received
+        uint32_t rawLen{};
+        uint32_t wireLen{};
+        BlockHasher hasher;     // block CRCs and file CRC, built as bytes land
+        std::unique_ptr<Sha256> sha;    // content hash, with --dedup
+        bool batched{};         // one file of an MPUT
+        BandwidthScheduler::Class cls = BandwidthScheduler::Bulk;
+        // Receive and write-behind buffers, charged like a Download's.
+        MemoryBudget* budget{};
+        uint64_t buffers{};
+
+        ~Upload() {
+            if (pool) pool->release(buf);
+            if (budget) budget->release(buffers);
+        }
+    };
+
+    // A request payload taken a piece at a time instead of whole:
+    // UPLOAD_CHUNK_REQ, written as it arrives, and DATA for no open upload
+    // or anything over --max-message-kb, read and dropped.
+    struct PieceState {
+        uint64_t left{};        // payload bytes not read yet
+        bool chunk{};           // UPLOAD_CHUNK_REQ
+        bool prefixed{};        // its "upload_id|offset|" has been parsed
+        std::unique_ptr<UploadSessions::Chunk> writer;
+        uint64_t start{};       // offset named in the request
+        uint64_t offset{};      // where the next bytes go
+        std::string error;      // first failure; the rest is dropped
+    };
+
+    // A PUT or MPUT whose rows are being inserted, or a PUT or UPLOAD_OPEN
+    // whose offered hash is being added as a duplicate. Filled in by the
+    // store's writer thread before it posts insertOp_, and picked up by the
+    // handler.
+    struct PendingPut {
+        uint16_t type{};        // PUT_REQ, MPUT_REQ or UPLOAD_OPEN_REQ
+        uint32_t stream{};
+        uint16_t version{};
+        std::string name;
+        std::string request;    // UPLOAD_OPEN_REQ's, opened if no duplicate went in
+        uint64_t size{};
+        Codec codec = Codec::None;
+        bool codecField{};      // the request named a codec, so the reply does
+        bool offered{};         // waiting on the duplicate, not the row
+        int file_id = -1;
+        std::vector<std::pair<std::string, uint64_t>> batch;    // MPUT's files...
+        std::vector<int> ids;   // ...and their ids, -1 for a name taken; empty if the insert failed
+    };
+
+    // An MPUT in progress: files whose rows exist and whose bytes have not
+    // started arriving yet, in the order they will.
+    struct PutBatch {
+        std::deque<std::pair<int, uint64_t>> files;
+        size_t open{};          // uploads started and not finished
+        size_t stored{};
+    };
+
     SOCKET clientSock;
-    std::filesystem::path rootDir;
+    ServerContext& ctx_;
     MetadataStore& meta_;
     FileManager& fm_;
 
-    std::string makeListPayload();
+    std::mutex mu_;
+    bool closing_ = false;
+
+    IoOp recvOp_;
+    bool recvPending_ = false;
+    RecvState recvState_ = RecvState::Header;
+    MsgHeader hdr_{};
+    std::string payload_;
+    size_t recvGot_ = 0;
+    PieceState piece_;
+    // Bytes charged to the memory budgets: the payload being read or
+    // dispatched, and replies not yet sent.
+    uint64_t charged_ = 0;
+    uint64_t admitted_ = 0;     // the payload's share
+    // Posted by the server-wide budget when a payload waiting on it may fit.
+    IoOp wakeOp_;
+    bool wakeQueued_ = false;
+    bool memoryWait_ = false;   // the payload in Admit has been turned away
+    bool v2_ = false;
+    std::unordered_map<uint32_t, std::unique_ptr<Upload>> uploads_;
+    Upload* recvUpload_ = nullptr;  // target of Upload, UploadCompressed, StreamData
+    std::unordered_map<uint32_t, PutBatch> putBatches_;
+    // Nothing more is read while a PUT's or MPUT's rows commit: a v2 client
+    // sends the DATA frames right behind the request. Likewise while an
+    // offered hash is looked up, as the bytes follow if it finds nothing.
+    std::shared_ptr<PendingPut> putPending_;
+    IoOp insertOp_;
+    unsigned working_ = 0;      // requests whose reply is being made on the work queue
+    // MPUT files whose bytes are all in while their last writes land; the
+    // stream has already moved on to the next file.
+    std::vector<std::unique_ptr<Upload>> draining_;
+    // Open delta syncs by stream (v1: stream 0).
+    // Shared with the work-queue job applying or committing one.
+    std::unordered_map<uint32_t, std::shared_ptr<DeltaSync::Writer>> deltas_;
+    bool deltaApplying_ = false;    // nothing is read until the payload is applied
+
+    IoOp sendOp_;
+    bool sendPending_ = false;
+    std::deque<std::string> outQ_;
+    // Emptied reply strings, reused for the next replies.
+    std::vector<std::string> spare_;
+    // Keeps the capacity of the largest frame sent so far; replies are
+    // copied in rather than swapped in so it doesn't shrink.
+    std::string sendBuf_;
+    // Sent after sendBuf_ in the same WSASend; sendPin_ keeps its mapping
+    // or page alive even if the download goes away first.
+    ByteSpan sendSpan_;
+    std::shared_ptr<const void> sendPin_;
+    size_t sendOff_ = 0;
+    SendKind sendKind_ = SendKind::Message;
+    // Active downloads in round-robin order; the front sends next.
+    std::deque<std::unique_ptr<Download>> downloads_;
+    Download* sending_ = nullptr;   // owner of the frame in flight
+    // A download closed while its TransmitFile is in flight: the kernel is
+    // still reading its frame header and file handle. Freed on completion.
+    std::unique_ptr<Download> transmitting_;
+    uint64_t sendData_ = 0;         // file bytes in that frame
+    uint64_t readTag_ = 0;          // last PageRead::tag handed out
+
+    // This connection's share of the bandwidth limits, per direction. While
+    // the scheduler holds a frame back, nothing more moves that way until it
+    // posts the direction's op.
+    std::shared_ptr<BandwidthScheduler::Flow> sendFlow_;
+    std::shared_ptr<BandwidthScheduler::Flow> recvFlow_;
+    IoOp sendRateOp_;
+    IoOp recvRateOp_;
+    bool sendRateWait_ = false;
+    bool recvRateWait_ = false;
+
+    void postRecv();
+    void postSend();
+    void onRecv(DWORD bytes);
+    void onSend(DWORD bytes);
+    void close();
+
+    void dispatch();
+    void queueMessage(uint16_t type, const std::string& payload);
+    void queueStreamMessage(uint32_t stream, uint16_t type, const std::string& payload);
+    void frameReply(uint16_t type, const std::string& payload, uint16_t version, uint32_t stream);
+    void takeReply();
+    size_t sendSize() const { return sendBuf_.size() + sendSpan_.size; }
+    bool responseIdle() const;
+    bool acceptingRequests() const;
+    bool rateAllows(bool send, BandwidthScheduler::Class cls);
+
+    void handleGet();
+    void defer(std::function<std::pair<uint16_t, std::string>()> job);
+    void applyDelta(std::shared_ptr<DeltaSync::Writer> w);
+    void handlePut();
+    void handleUploadOpen();
+    bool offerPut(const std::shared_ptr<PendingPut>& put, const std::string& hash);
+    void insertPut(const std::shared_ptr<PendingPut>& put);
+    bool postInsert(const std::shared_ptr<ClientHandler>& self);
+    void finishOffer(const std::shared_ptr<PendingPut>& put);
+    void openPut(const PendingPut& put);
+    void handleMget();
+    void handleMput();
+    void openBatch(const PendingPut& put);
+    bool openDownload(Download& dl, const FileRow& fr);
+    bool chargeDownload(Download& dl);
+    bool nextBatchFile(Download& dl);
+    std::unique_ptr<Upload> openUpload(uint32_t stream, bool framed, int file_id, uint64_t size, Codec codec,
+                                       std::string& error);
+    void nextBatchUpload(uint32_t stream);
+    void handleBlocks();
+    void handleRate();
+    bool lookupFile(const std::string& field, FileRow& fr);
+    bool onDataHeader();
+    bool admitPayload();
+    void releasePayload();
+    void releaseMemory(uint64_t n);
+    void beginPieces();
+    void onPiece();
+    void endPieces();
+    bool nextDownloadChunk(Download& dl);
+    int64_t readDownload(Download& dl, void* buf, size_t len);
+    bool pageReady(Download& dl);
+    ByteSpan takePage(Download& dl, uint64_t max, std::shared_ptr<const void>& pin);
+    void onPageRead(uint64_t tag, int64_t n, DiskIo::Buffer& buf);
+    bool postTransmit(Download& dl);
+    void advanceDownload(Download& dl, uint64_t bytes);
+    void finishDownload(Download& dl);
+    void failDownload(Download& dl);
+    void storeUpload(Upload& up, size_t len);
+    bool decodeUpload(Upload& up);
+    void uploadStored(Upload& up);
+    void onUploadWritten(uint32_t stream, const WritePipeline* pipe);
+    void finishUpload(Upload& up);
+    void abortUploads(uint32_t stream);
+    void discardFile(int file_id);
 };
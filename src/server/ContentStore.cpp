@@ -0,0 +1,137 @@
+#include "ContentStore.hpp"
+#include "MetadataStore.hpp"
+#include "FileManager.hpp"
+#include "SegmentStore.hpp"
+#include "ServerStats.hpp"
+#include "../../common/sha256.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <vector>
+
+ContentStore::ContentStore(MetadataStore& meta, FileManager& fm, ServerStats& stats, SegmentStore& segments,
+                           bool enabled)
+    : meta_(meta), fm_(fm), stats_(stats), segments_(segments), enabled_(enabled) {
+    recover();
+    worker_ = std::thread([this]() { workLoop(); });
+}
+
+ContentStore::~ContentStore() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    worker_.join();
+}
+
+// Scans the per-id blobs. One whose row already has a content hash was
+// adopted just before a restart and only needs moving, even with --dedup=0;
+// a complete one without a hash is queued when dedup is on, with the digest
+// kept from an earlier run if it got that far.
+void ContentStore::recover() {
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(fm_.filePath(0).parent_path(), ec)) {
+        const auto& p = entry.path();
+        const std::string stem = p.stem().string();
+        if (p.extension() != ".bin" || stem.empty() ||
+            !std::all_of(stem.begin(), stem.end(), [](unsigned char c) { return std::isdigit(c) != 0; }))
+            continue;
+        int file_id = 0;
+        try { file_id = std::stoi(stem); }
+        catch (...) { continue; }
+        FileRow fr;
+        if (!meta_.getFile(file_id, fr)) continue;
+        if (fr.content_hash) {
+            bool existed = false;
+            if (fm_.storeBlob(file_id, *fr.content_hash, existed)) segments_.offer(*fr.content_hash, fr.size);
+        }
+        else if (enabled_ && entry.file_size(ec) == fr.size) {
+            jobs_.push_back({ file_id, fr.size, meta_.getSha256(file_id) });
+        }
+    }
+}
+
+bool ContentStore::offer(const std::string& name, uint64_t size, const std::string& hash,
+                         std::function<void(int)> done) {
+    uint64_t stored = 0;
+    if (!enabled_ || !meta_.getBlob(hash, stored) || stored != size) return false;
+    // An adoption commits the blob's row before it moves the bytes in; a
+    // duplicate taken in between would have nothing to read until then.
+    if (!fm_.hasBlob(hash)) return false;
+    meta_.insertDuplicate(name, hash, size, std::move(done));
+    return true;
+}
+
+void ContentStore::adopt(int file_id, uint64_t size, std::optional<std::string> hash) {
+    if (!enabled_) return;
+    if (hash && hash->empty()) hash.reset();
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        jobs_.push_back({ file_id, size, std::move(hash) });
+    }
+    cv_.notify_one();
+}
+
+void ContentStore::workLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    for (;;) {
+        cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+        // Pending jobs are dropped; their blobs stay per-id and the next
+        // startup queues them again.
+        if (stop_) return;
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+        try {
+            run(job);
+        }
+        catch (const std::exception& ex) {
+            std::cerr << "dedup of file " << job.file_id << " failed: " << ex.what() << "\n";
+        }
+        lock.lock();
+    }
+}
+
+void ContentStore::run(Job& job) {
+    if (!job.hash) {
+        job.hash = hashBlob(job.file_id, job.size);
+        if (!job.hash) return;
+        // Kept, so a restart before the adoption commits, or an adoption
+        // that fails, doesn't read the whole file again.
+        meta_.recordSha256(job.file_id, *job.hash);
+    }
+    std::lock_guard<std::mutex> lock(blobMu_);
+    // The reference commits before the move, so a reader that sees the hash
+    // but no blob yet still finds <file_id>.bin.
+    if (!meta_.adoptBlob(job.file_id, *job.hash, job.size).get()) return;
+    bool existed = false;
+    if (!fm_.storeBlob(job.file_id, *job.hash, existed)) return;
+    if (existed) {
+        ++stats_.dedupFiles;
+        stats_.dedupBytes += job.size;
+    }
+    segments_.offer(*job.hash, job.size);
+}
+
+void ContentStore::release(const std::string& hash) {
+    std::lock_guard<std::mutex> lock(blobMu_);
+    uint64_t size = 0;
+    if (meta_.getBlob(hash, size)) return;
+    fm_.removeBlob(hash);
+}
+
+std::optional<std::string> ContentStore::hashBlob(int file_id, uint64_t size) {
+    Sha256 sha;
+    uint64_t pos = 0;
+    bool ok = fm_.scan(file_id, std::nullopt, 1024 * 1024, [&](ByteSpan s) {
+        sha.update(s.data, s.size);
+        pos += s.size;
+        return true;
+    });
+    if (!ok || pos != size) return std::nullopt;
+    std::string hex = sha.finishHex();
+    if (hex.empty()) return std::nullopt;
+    return hex;
+}
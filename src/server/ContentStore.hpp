@@ -0,0 +1,77 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+class MetadataStore;
+class FileManager;
+class SegmentStore;
+struct ServerStats;
+
+// Content-addressed storage (--dedup). A file's bytes are kept once under
+// blobs/, keyed by their SHA-256, and the blobs table counts the files that
+// reference each blob. A duplicate is caught before its bytes are sent,
+// when the client offers the hash, or after they have landed in
+// <file_id>.bin, which is then dropped in favour of the stored blob.
+//
+// Adoption runs on a background thread: it commits the reference first and
+// moves the blob second, and reads fall back to <file_id>.bin in between.
+// At startup every <file_id>.bin is looked at again, which finishes
+// interrupted moves and brings files stored before --dedup into blobs/.
+// A small blob goes on to SegmentStore once it is in place.
+class ContentStore {
+public:
+    ContentStore(MetadataStore& meta, FileManager& fm, ServerStats& stats, SegmentStore& segments, bool enabled);
+    ~ContentStore();
+
+    ContentStore(const ContentStore&) = delete;
+    ContentStore& operator=(const ContentStore&) = delete;
+
+    bool enabled() const { return enabled_; }
+
+    // If a blob with this hash and size is stored and in place, adds `name`
+    // as another file referencing it and returns true; `done` is called on
+    // the store's writer thread with the new id, or -1 if the bytes have to
+    // be sent after all. False means they do, and `done` is never called.
+    bool offer(const std::string& name, uint64_t size, const std::string& hash, std::function<void(int)> done);
+    // Queues a complete, closed <file_id>.bin for adoption. Without a hash
+    // (or with an empty one) the blob is read to compute one, which is kept
+    // in its row until the adoption is done.
+    void adopt(int file_id, uint64_t size, std::optional<std::string> hash = std::nullopt);
+    // Deletes a blob whose last reference went elsewhere (a delta commit),
+    // unless a file has taken one again since. Works with dedup off too.
+    void release(const std::string& hash);
+
+private:
+    struct Job {
+        int file_id{};
+        uint64_t size{};
+        std::optional<std::string> hash;
+    };
+
+    MetadataStore& meta_;
+    FileManager& fm_;
+    ServerStats& stats_;
+    SegmentStore& segments_;
+    bool enabled_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    bool stop_ = false;
+    std::thread worker_;
+    // Held by an adoption from its reference commit to its blob move, and by
+    // release from its reference check to the delete, so an adoption never
+    // finds a blob already there that is about to go.
+    std::mutex blobMu_;
+
+    void recover();
+    void workLoop();
+    void run(Job& job);
+    std::optional<std::string> hashBlob(int file_id, uint64_t size);
+};
@@ -0,0 +1,193 @@
+#include "DeltaSync.hpp"
+#include "ContentStore.hpp"
+#include "SegmentStore.hpp"
+#include "ServerStats.hpp"
+#include "../../common/crc32c.hpp"
+#include "../../common/delta.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+static std::string newStagingId() {
+    std::random_device rd;
+    std::ostringstream oss;
+    oss << "delta-" << std::hex << std::setfill('0');
+    for (int i = 0; i < 4; ++i) oss << std::setw(8) << rd();
+    return oss.str();
+}
+
+DeltaSync::DeltaSync(MetadataStore& meta, FileManager& fm, ServerStats& stats, ContentStore& content,
+                     SegmentStore& segments)
+    : meta_(meta), fm_(fm), stats_(stats), content_(content), segments_(segments) {}
+
+bool DeltaSync::signature(const std::string& request, std::string& reply, std::string& error) {
+    auto sep = request.find('|');
+    FileRow fr;
+    if (!meta_.getFileByName(request.substr(0, sep), fr)) { error = "file-not-found"; return false; }
+    uint32_t blockSize = deltaBlockSize(fr.size);
+    if (sep != std::string::npos) {
+        try { blockSize = static_cast<uint32_t>(std::stoul(request.substr(sep + 1))); }
+        catch (...) { error = "bad-request"; return false; }
+        if (blockSize < 512 || blockSize > DELTA_MAX_LITERAL) { error = "bad-block-size"; return false; }
+    }
+
+    const uint64_t count = (fr.size + blockSize - 1) / blockSize;
+    reply.clear();
+    reply.reserve(16 + count * 8);
+    auto put = [&reply](const void* p, size_t n) { reply.append(static_cast<const char*>(p), n); };
+    const uint32_t count32 = static_cast<uint32_t>(count);
+    put(&fr.size, sizeof(fr.size));
+    put(&blockSize, sizeof(blockSize));
+    put(&count32, sizeof(count32));
+
+    // Whole blocks per span, about a megabyte at a time; spans of a stored
+    // blob point straight into its mapping.
+    uint64_t pos = 0;
+    bool ok = fm_.scan(fr.file_id, fr.content_hash, std::max<size_t>(1, (1024 * 1024) / blockSize) * blockSize,
+        [&](ByteSpan s) {
+            const size_t got = static_cast<size_t>(std::min<uint64_t>(s.size, fr.size - pos));
+            for (size_t off = 0; off < got; off += blockSize) {
+                const size_t len = std::min<size_t>(blockSize, got - off);
+                const uint32_t weak = weakChecksum(s.data + off, len);
+                const uint32_t crc = crc32c(0, s.data + off, len);
+                put(&weak, sizeof(weak));
+                put(&crc, sizeof(crc));
+            }
+            pos += got;
+            return pos < fr.size;
+        });
+    if (!ok) { error = "file-missing"; return false; }
+    if (pos != fr.size) { error = "read-failed"; return false; }
+    return true;
+}
+
+std::unique_ptr<DeltaSync::Writer> DeltaSync::open(const std::string& request, std::string& error) {
+    std::vector<std::string> fields;
+    std::istringstream iss(request);
+    for (std::string item; std::getline(iss, item, '|');) fields.push_back(item);
+    if (fields.size() != 3) { error = "bad-request"; return nullptr; }
+
+    auto w = std::make_unique<Writer>();
+    try {
+        w->size_ = std::stoull(fields[1]);
+        w->blockSize_ = static_cast<uint32_t>(std::stoul(fields[2]));
+    }
+    catch (...) { error = "bad-request"; return nullptr; }
+    if (w->blockSize_ == 0) { error = "bad-block-size"; return nullptr; }
+    if (!meta_.getFileByName(fields[0], w->base_)) { error = "file-not-found"; return nullptr; }
+
+    w->fm_ = &fm_;
+    w->stats_ = &stats_;
+    w->in_ = fm_.openForRead(w->base_.file_id, w->base_.content_hash);
+    if (!w->in_) { error = "file-missing"; return nullptr; }
+    w->stagingId_ = newStagingId();
+    w->out_ = fm_.openStaging(w->stagingId_, w->size_);
+    if (!w->out_) { error = "alloc-failed"; return nullptr; }
+    return w;
+}
+
+bool DeltaSync::commit(Writer& w, const std::string& request, int& file_id, std::string& error) {
+    std::string expected;
+    if (!parseSha256(request, expected)) { error = "bad-request"; return false; }
+    if (!w.error_.empty()) { error = w.error_; return false; }
+    if (w.written_ != w.size_) { error = "incomplete"; return false; }
+    const std::string hash = w.sha_.finishHex();
+    if (hash.empty()) { error = "hash-failed"; return false; }
+    if (hash != expected) { error = "checksum-mismatch"; return false; }
+
+    if (!FlushFileBuffers(w.out_.handle())) { error = "write-failed"; return false; }
+    w.out_ = BlobFile();
+    w.in_ = BlobFile();
+    w.hasher_.finish();
+    BlockHashRow blocks;
+    blocks.file_id = w.base_.file_id;
+    blocks.block_size = HASH_BLOCK_SIZE;
+    blocks.leaves = w.hasher_.leaves();
+    blocks.root = merkleRoot(blocks.leaves);
+
+    // The new version goes under blobs/ by its hash even without --dedup:
+    // renamed over <file_id>.bin it would replace the old one before the row
+    // could be switched.
+    std::lock_guard<std::mutex> lock(commitMu_);
+    bool existed = false;
+    if (!fm_.storeStagingBlob(w.stagingId_, hash, existed)) { error = "commit-failed"; return false; }
+    w.committed_ = true;
+
+    std::optional<std::string> released;
+    try {
+        released = meta_.replaceContent(w.base_.file_id, w.size_, formatCrc32c(w.hasher_.fileCrc()),
+                                        hash, blocks).get();
+    }
+    catch (...) {
+        // The file still points at the old version; the new blob goes
+        // unless another file holds it.
+        content_.release(hash);
+        error = "update-meta-failed";
+        return false;
+    }
+    if (released && *released != hash) content_.release(*released);
+    // The bytes now live in blobs/; a per-id copy of the old version is stale.
+    fm_.removeFile(w.base_.file_id);
+    segments_.offer(hash, w.size_);
+    file_id = w.base_.file_id;
+    return true;
+}
+
+DeltaSync::Writer::~Writer() {
+    if (committed_ || stagingId_.empty()) return;
+    out_ = BlobFile();
+    fm_->removeStaging(stagingId_);
+}
+
+void DeltaSync::Writer::apply(const char* data, size_t len) {
+    while (error_.empty() && len > 0) {
+        const uint8_t op = static_cast<uint8_t>(*data);
+        uint32_t a = 0, b = 0;
+        if (op == DELTA_COPY && len >= 9) {
+            std::memcpy(&a, data + 1, 4);
+            std::memcpy(&b, data + 5, 4);
+            if (!copyBlocks(a, b)) return;
+            data += 9;
+            len -= 9;
+        }
+        else if (op == DELTA_LITERAL && len >= 5) {
+            std::memcpy(&a, data + 1, 4);
+            if (a > len - 5) { error_ = "bad-delta"; return; }
+            if (!append(data + 5, a)) return;
+            stats_->deltaBytesLiteral += a;
+            data += 5 + a;
+            len -= 5 + a;
+        }
+        else {
+            error_ = "bad-delta";
+        }
+    }
+}
+
+bool DeltaSync::Writer::append(const void* data, size_t len) {
+    if (len > size_ - written_) { error_ = "bad-delta"; return false; }
+    if (!out_.writeAt(written_, data, len)) { error_ = "write-failed"; return false; }
+    sha_.update(data, len);
+    hasher_.update(data, len);
+    written_ += len;
+    return true;
+}
+
+bool DeltaSync::Writer::copyBlocks(uint32_t first, uint32_t count) {
+    uint64_t from = static_cast<uint64_t>(first) * blockSize_;
+    const uint64_t end = std::min<uint64_t>((static_cast<uint64_t>(first) + count) * blockSize_, base_.size);
+    if (count == 0 || from >= end) { error_ = "bad-delta"; return false; }
+    if (buf_.empty()) buf_.resize(1024 * 1024);
+    while (from < end) {
+        const size_t want = static_cast<size_t>(std::min<uint64_t>(buf_.size(), end - from));
+        int64_t n = in_.readAt(from, buf_.data(), want);
+        if (n <= 0) { error_ = "read-failed"; return false; }
+        if (!append(buf_.data(), static_cast<size_t>(n))) return false;
+        stats_->deltaBytesCopied += static_cast<uint64_t>(n);
+        from += static_cast<uint64_t>(n);
+    }
+    return true;
+}
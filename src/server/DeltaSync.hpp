@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "FileManager.hpp"
+#include "MetadataStore.hpp"
+#include "../../common/blockhash.hpp"
+#include "../../common/sha256.hpp"
+
+struct ServerStats;
+class ContentStore;
+class SegmentStore;
+
+// Delta updates of an existing file (see common/delta.hpp). SIG_REQ returns
+// the file's signature. DELTA_REQ opens a Writer, which rebuilds the new
+// version from DELTA_DATA instructions into a staging blob, copying
+// unchanged blocks from the current one. DELTA_COMMIT_REQ checks the result
+// against the client's SHA-256 and swaps it in: the blob moves into blobs/
+// under its hash first, then one metadata transaction points the file (same
+// id and name) at it, so readers see either the old or the new version.
+// Only then does the old version go; if the transaction fails, the file
+// keeps it and the new blob is dropped.
+class DeltaSync {
+public:
+    class Writer {
+    public:
+        ~Writer();
+        // Applies one DELTA_DATA payload, reading and writing blocks inline,
+        // so it runs on the work queue. After the first failure the rest is
+        // ignored and commit reports the error.
+        void apply(const char* data, size_t len);
+
+    private:
+        friend class DeltaSync;
+        FileManager* fm_{};
+        ServerStats* stats_{};
+        FileRow base_;
+        BlobFile in_;
+        uint32_t blockSize_{};
+        std::string stagingId_;
+        BlobFile out_;
+        uint64_t size_{};
+        uint64_t written_{};
+        Sha256 sha_;
+        BlockHasher hasher_;
+        std::vector<uint8_t> buf_;
+        std::string error_;
+        bool committed_ = false;
+
+        bool append(const void* data, size_t len);
+        bool copyBlocks(uint32_t first, uint32_t count);
+    };
+
+    DeltaSync(MetadataStore& meta, FileManager& fm, ServerStats& stats, ContentStore& content,
+              SegmentStore& segments);
+
+    // "name[|block_size]" -> SIG_RESP payload. Reads the whole file, so it
+    // is called from the work queue, not an I/O worker.
+    bool signature(const std::string& request, std::string& reply, std::string& error);
+    // "name|size|block_size", block_size as in the signature used.
+    std::unique_ptr<Writer> open(const std::string& request, std::string& error);
+    // "sha256:<hex>" of the new version. Flushes, renames and waits on the
+    // catalog under commitMu_; called from the work queue.
+    bool commit(Writer& w, const std::string& request, int& file_id, std::string& error);
+
+private:
+    MetadataStore& meta_;
+    FileManager& fm_;
+    ServerStats& stats_;
+    ContentStore& content_;
+    SegmentStore& segments_;
+    // Commits of the same file must not interleave their blob moves and
+    // metadata updates; deltas are rare enough to serialize them all.
+    std::mutex commitMu_;
+};
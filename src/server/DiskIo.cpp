@@ -0,0 +1,256 @@
+#include "DiskIo.hpp"
+#include "FileManager.hpp"
+#include "HeapCounter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <ostream>
+
+// One read or write in flight. In iocp mode it pins itself through its
+// IoOp until the completion is dequeued. Requests are reused: one that has
+// finished goes back to its DiskIo's idle list.
+struct DiskIo::Request : IoCompletionTarget, std::enable_shared_from_this<Request> {
+    DiskIo* owner = nullptr;
+    IoOp op;
+    std::shared_ptr<const BlobFile> file;
+    uint64_t offset = 0;
+    bool write = false;
+    Buffer buf;
+    size_t len = 0;
+    Callback cb;
+    DWORD error = 0;    // set when the call failed before it was issued
+    std::shared_ptr<Request> next;  // threads mode queue
+
+    // Back in the pool before the callback runs, which may be the last
+    // thing a caller waits for before destroying the DiskIo.
+    void finish(int64_t result) {
+        file.reset();
+        Callback done = std::move(cb);
+        Buffer b = std::move(buf);
+        owner->recycle(shared_from_this());
+        done(result, b);
+    }
+
+    void onIoComplete(IoOp&, DWORD bytes, DWORD err) override {
+        if (!err) err = error;
+        if (err) finish(err == ERROR_HANDLE_EOF ? 0 : -1);
+        else finish(static_cast<int64_t>(bytes));
+    }
+};
+
+DiskIo::DiskIo(Mode mode, IoService& io, unsigned threads) : mode_(mode), io_(io) {
+    if (mode_ != Mode::Threads) return;
+    for (unsigned i = 0; i < std::max<unsigned>(1u, threads); ++i) {
+        workers_.emplace_back([this]() {
+            HeapCounter::track();
+            workerLoop();
+        });
+    }
+}
+
+DiskIo::~DiskIo() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) t.join();
+}
+
+bool DiskIo::attach(const BlobFile& file) {
+    if (mode_ != Mode::Iocp) return true;
+    if (!file.overlapped()) return false;
+    if (file.isView()) return file.attached();
+    try {
+        io_.associate(file.handle());
+        return true;
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+std::shared_ptr<DiskIo::Request> DiskIo::take() {
+    {
+        std::lock_guard<std::mutex> lock(poolMu_);
+        if (!idle_.empty()) {
+            std::shared_ptr<Request> req = std::move(idle_.back());
+            idle_.pop_back();
+            return req;
+        }
+    }
+    auto req = std::make_shared<Request>();
+    req->owner = this;
+    return req;
+}
+
+void DiskIo::recycle(std::shared_ptr<Request> req) {
+    req->write = false;
+    req->error = 0;
+    Buffer().swap(req->buf);    // not taken by the callback; don't hold on to it
+    std::lock_guard<std::mutex> lock(poolMu_);
+    idle_.push_back(std::move(req));
+}
+
+void DiskIo::read(std::shared_ptr<const BlobFile> file, uint64_t offset, Buffer buf, Callback cb) {
+    auto req = take();
+    req->file = std::move(file);
+    req->offset = offset;
+    req->len = buf.size();
+    req->buf = std::move(buf);
+    req->cb = std::move(cb);
+    submit(std::move(req));
+}
+
+void DiskIo::write(std::shared_ptr<const BlobFile> file, uint64_t offset, Buffer buf, size_t len, Callback cb) {
+    auto req = take();
+    req->file = std::move(file);
+    req->offset = offset;
+    req->write = true;
+    req->len = std::min<size_t>(len, buf.size());
+    req->buf = std::move(buf);
+    req->cb = std::move(cb);
+    submit(std::move(req));
+}
+
+void DiskIo::submit(std::shared_ptr<Request> req) {
+    if (mode_ == Mode::Iocp) {
+        Request& r = *req;
+        uint64_t offset = r.offset;
+        DWORD len = static_cast<DWORD>(r.len);
+        if (r.file->isView()) {
+            // Within the view's window of the shared handle, as readAt does.
+            const uint64_t size = r.file->size();
+            len = static_cast<DWORD>(std::min<uint64_t>(len, offset < size ? size - offset : 0));
+            offset += r.file->base();
+        }
+        r.op.reset();
+        r.op.ov.Offset = static_cast<DWORD>(offset);
+        r.op.ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        r.op.target = std::move(req);
+        BOOL ok = FALSE;
+        if (!r.file->overlapped() || (r.write && r.file->isView())) SetLastError(ERROR_INVALID_PARAMETER);
+        else if (r.write) ok = WriteFile(r.file->handle(), r.buf.data(), len, nullptr, &r.op.ov);
+        else ok = ReadFile(r.file->handle(), r.buf.data(), len, nullptr, &r.op.ov);
+        // Even a call that finishes at once queues its completion; one that
+        // fails is posted so its callback still runs on a worker.
+        if (!ok && GetLastError() != ERROR_IO_PENDING) {
+            r.error = GetLastError();
+            io_.post(r.op);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        Request* r = req.get();
+        if (tail_) tail_->next = std::move(req);
+        else head_ = std::move(req);
+        tail_ = r;
+    }
+    cv_.notify_one();
+}
+
+void DiskIo::workerLoop() {
+    for (;;) {
+        std::shared_ptr<Request> req;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            cv_.wait(lock, [this]() { return stopping_ || head_; });
+            if (stopping_) return;
+            req = std::move(head_);
+            head_ = std::move(req->next);
+            if (!head_) tail_ = nullptr;
+        }
+        if (req->write) {
+            bool ok = req->file->writeAt(req->offset, req->buf.data(), req->len);
+            req->finish(ok ? static_cast<int64_t>(req->len) : -1);
+        }
+        else {
+            req->finish(req->file->readAt(req->offset, req->buf.data(), req->len));
+        }
+    }
+}
+
+const char* DiskIo::modeName(Mode mode) {
+    switch (mode) {
+    case Mode::Iocp: return "iocp";
+    case Mode::Threads: return "threads";
+    default: return "sync";
+    }
+}
+
+bool DiskIo::parseMode(const std::string& name, Mode& mode) {
+    if (name == "sync") mode = Mode::Sync;
+    else if (name == "iocp") mode = Mode::Iocp;
+    else if (name == "threads") mode = Mode::Threads;
+    else return false;
+    return true;
+}
+
+void DiskIo::benchmark(const std::filesystem::path& path, unsigned depth, std::ostream& out) {
+    constexpr size_t BLOCK = 64 * 1024;     // what a buffered GET reads at a time
+    depth = std::max<unsigned>(1u, depth);
+    IoService io(2);
+    io.run();
+
+    for (Mode mode : { Mode::Sync, Mode::Threads, Mode::Iocp }) {
+        DiskIo disk(mode, io, depth);
+        const DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN
+            | (disk.overlapped() ? FILE_FLAG_OVERLAPPED : 0);
+        auto file = std::make_shared<BlobFile>(CreateFileW(path.wstring().c_str(), GENERIC_READ,
+            FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr), disk.overlapped());
+        if (!*file || !disk.attach(*file)) {
+            out << modeName(mode) << ": cannot open " << path.string() << "\n";
+            continue;
+        }
+        const uint64_t size = file->size();
+        uint64_t total = 0;
+        bool failed = false;
+        auto t0 = std::chrono::steady_clock::now();
+
+        if (mode == Mode::Sync) {
+            // The blocking path: one read at a time on the calling thread.
+            Buffer buf(BLOCK);
+            for (uint64_t off = 0; off < size; off += BLOCK) {
+                int64_t n = file->readAt(off, buf.data(), BLOCK);
+                if (n <= 0) { failed = true; break; }
+                total += static_cast<uint64_t>(n);
+            }
+        }
+        else {
+            // Keep `depth` reads queued; each completion issues the next.
+            std::mutex mu;
+            std::condition_variable idle;
+            uint64_t next = 0;
+            unsigned inFlight = 0;
+            Callback onRead;
+            onRead = [&](int64_t n, Buffer& buf) {
+                std::lock_guard<std::mutex> lock(mu);
+                --inFlight;
+                if (n <= 0) failed = true;
+                else total += static_cast<uint64_t>(n);
+                if (!failed && next < size) {
+                    ++inFlight;
+                    disk.read(file, next, std::move(buf), onRead);
+                    next += BLOCK;
+                }
+                if (inFlight == 0) idle.notify_one();
+            };
+            std::unique_lock<std::mutex> lock(mu);
+            while (inFlight < depth && next < size) {
+                ++inFlight;
+                disk.read(file, next, Buffer(BLOCK), onRead);
+                next += BLOCK;
+            }
+            idle.wait(lock, [&]() { return inFlight == 0; });
+        }
+
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        out << std::left << std::setw(8) << modeName(mode) << " depth " << std::setw(3)
+            << (mode == Mode::Sync ? 1u : depth) << " ";
+        if (failed) out << "read failed\n";
+        else out << std::fixed << std::setprecision(1) << (secs > 0 ? total / secs / (1 << 20) : 0.0) << " MiB/s\n";
+    }
+    io.stop();
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "IoService.hpp"
+
+class BlobFile;
+
+// Asynchronous positioned reads and writes on blobs, so a connection waiting
+// on the disk doesn't hold an I/O worker and a transfer can keep several
+// requests queued at the device. Chosen at startup with --disk-io:
+//
+//   iocp     files are opened overlapped and bound to the server's completion
+//            port; their completions arrive on the I/O workers like socket I/O
+//   threads  a small pool runs blocking ReadFile/WriteFile, for volumes and
+//            filter drivers that complete overlapped file I/O synchronously
+//   sync     no async path; callers read and write inline as before
+//
+// Callbacks never run inside read() or write(), so a caller may submit while
+// holding the lock its callback takes. A request lets go of its file before
+// the callback runs.
+//
+// Requests are pooled, so once as many have been in flight as ever will be,
+// I/O costs no allocation here; a callback small enough for std::function's
+// inline storage, e.g. a weak_ptr and a tag, costs none either.
+class DiskIo {
+public:
+    enum class Mode { Sync, Iocp, Threads };
+    using Buffer = std::vector<char>;
+    // `result` is the bytes moved, 0 at end of file, or -1 on error. `buf` is
+    // the buffer passed in, for the callback to keep.
+    using Callback = std::function<void(int64_t result, Buffer& buf)>;
+
+    DiskIo(Mode mode, IoService& io, unsigned threads);
+    ~DiskIo();
+    DiskIo(const DiskIo&) = delete;
+    DiskIo& operator=(const DiskIo&) = delete;
+
+    Mode mode() const { return mode_; }
+    bool async() const { return mode_ != Mode::Sync; }
+    // Whether files for read()/write() must be opened with FILE_FLAG_OVERLAPPED.
+    bool overlapped() const { return mode_ == Mode::Iocp; }
+    // Binds an overlapped file to the completion port. A file that can't be
+    // bound must be read synchronously.
+    bool attach(const BlobFile& file);
+
+    // Reads buf.size() bytes at `offset`; the result may be short at the end.
+    void read(std::shared_ptr<const BlobFile> file, uint64_t offset, Buffer buf, Callback cb);
+    // Writes the first `len` bytes of `buf` at `offset`.
+    void write(std::shared_ptr<const BlobFile> file, uint64_t offset, Buffer buf, size_t len, Callback cb);
+
+    static const char* modeName(Mode mode);
+    static bool parseMode(const std::string& name, Mode& mode);
+    // Reads `path` front to back in each mode, `depth` requests deep, and
+    // prints the throughput of each. Pages already in the system cache are
+    // not re-read from the device, so use a file larger than memory to
+    // compare the disk rather than the copy.
+    static void benchmark(const std::filesystem::path& path, unsigned depth, std::ostream& out);
+
+private:
+    struct Request;
+
+    Mode mode_;
+    IoService& io_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    // Threads mode queue, linked through the requests.
+    std::shared_ptr<Request> head_;
+    Request* tail_ = nullptr;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+    std::mutex poolMu_;
+    std::vector<std::shared_ptr<Request>> idle_;
+
+    std::shared_ptr<Request> take();
+    void recycle(std::shared_ptr<Request> req);
+    void submit(std::shared_ptr<Request> req);
+    void workerLoop();
+};
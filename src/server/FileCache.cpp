@@ -0,0 +1,85 @@
+#include "FileCache.hpp"
+#include <mutex>
+
+FileCache::FileCache(size_t capacity) : capacity_(capacity) {
+    ring_.reserve(capacity_);
+}
+
+bool FileCache::get(int file_id, FileRow& out) const {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    auto it = byId_.find(file_id);
+    if (it == byId_.end()) {
+        ++misses_;
+        return false;
+    }
+    it->second->referenced.store(true, std::memory_order_relaxed);
+    out = it->second->row;
+    ++hits_;
+    return true;
+}
+
+bool FileCache::getByName(const std::string& name, FileRow& out) const {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    auto n = byName_.find(name);
+    if (n == byName_.end()) {
+        ++misses_;
+        return false;
+    }
+    const Entry& e = *byId_.at(n->second);
+    e.referenced.store(true, std::memory_order_relaxed);
+    out = e.row;
+    ++hits_;
+    return true;
+}
+
+void FileCache::put(const FileRow& row, uint64_t gen) {
+    if (capacity_ == 0) return;
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    if (gen != gen_.load(std::memory_order_acquire)) return;
+    if (byId_.count(row.file_id)) return;
+
+    auto e = std::make_unique<Entry>();
+    e->row = row;
+    e->slot = claimSlotLocked();
+    ring_[e->slot] = row.file_id;
+    byName_[row.name] = row.file_id;
+    byId_.emplace(row.file_id, std::move(e));
+}
+
+void FileCache::invalidate(int file_id) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    gen_.fetch_add(1, std::memory_order_release);
+    eraseLocked(file_id);
+}
+
+void FileCache::invalidateName(const std::string& name) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    gen_.fetch_add(1, std::memory_order_release);
+    auto n = byName_.find(name);
+    if (n != byName_.end()) eraseLocked(n->second);
+}
+
+void FileCache::eraseLocked(int file_id) {
+    auto it = byId_.find(file_id);
+    if (it == byId_.end()) return;
+    auto n = byName_.find(it->second->row.name);
+    if (n != byName_.end() && n->second == file_id) byName_.erase(n);
+    // The ring slot stays behind as a hole that claimSlotLocked() reuses.
+    byId_.erase(it);
+}
+
+size_t FileCache::claimSlotLocked() {
+    if (ring_.size() < capacity_) {
+        ring_.push_back(0);
+        return ring_.size() - 1;
+    }
+    for (;;) {
+        size_t slot = hand_;
+        hand_ = (hand_ + 1) % ring_.size();
+        auto it = byId_.find(ring_[slot]);
+        if (it == byId_.end() || it->second->slot != slot) return slot;   // hole
+        if (it->second->referenced.exchange(false, std::memory_order_relaxed)) continue;
+        eraseLocked(ring_[slot]);
+        return slot;
+    }
+}
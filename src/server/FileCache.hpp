@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "MetadataStore.hpp"
+
+// Read-mostly cache of `files` rows keyed by file_id and by name, bounded by
+// an entry budget and evicted with CLOCK so hits only take a shared lock.
+//
+// Fills race with invalidations: a reader samples generation() before its
+// database query and put() drops the row if anything was invalidated since,
+// so a row read before a commit can never outlive that commit's invalidation.
+class FileCache {
+public:
+    explicit FileCache(size_t capacity);
+
+    bool get(int file_id, FileRow& out) const;
+    bool getByName(const std::string& name, FileRow& out) const;
+
+    uint64_t generation() const { return gen_.load(std::memory_order_acquire); }
+    void put(const FileRow& row, uint64_t gen);
+
+    void invalidate(int file_id);
+    void invalidateName(const std::string& name);
+
+    uint64_t hits() const { return hits_.load(); }
+    uint64_t misses() const { return misses_.load(); }
+
+private:
+    struct Entry {
+        FileRow row;
+        size_t slot{};
+        mutable std::atomic<bool> referenced{ true };
+    };
+
+    size_t capacity_;
+    mutable std::shared_mutex mu_;
+    std::unordered_map<int, std::unique_ptr<Entry>> byId_;
+    std::unordered_map<std::string, int> byName_;
+    std::vector<int> ring_;
+    size_t hand_ = 0;
+    std::atomic<uint64_t> gen_{0};
+    mutable std::atomic<uint64_t> hits_{0};
+    mutable std::atomic<uint64_t> misses_{0};
+
+    void eraseLocked(int file_id);
+    size_t claimSlotLocked();
+};
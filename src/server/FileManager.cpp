@@ -1,10 +1,155 @@
 #include "FileManager.hpp"
-#include <fstream>
+#include "SegmentStore.hpp"
+#include <algorithm>
+#include <cstring>
 #include <string>
 
 
-FileManager::FileManager(std::filesystem::path root) : root_(std::move(root)) {
-    std::filesystem::create_directories(root_);
+BlobFile BlobFile::view(const BlobFile& file, std::shared_ptr<const void> owner, uint64_t base, uint64_t length,
+                        bool attached) {
+    BlobFile f(file.h_, file.overlapped_);
+    f.attached_ = attached;
+    f.owner_ = std::move(owner);
+    f.base_ = base;
+    f.length_ = length;
+    return f;
+}
+
+BlobFile::~BlobFile() {
+    if (h_ != INVALID_HANDLE_VALUE && !owner_) CloseHandle(h_);
+}
+
+BlobFile& BlobFile::operator=(BlobFile&& o) noexcept {
+    if (this != &o) {
+        if (h_ != INVALID_HANDLE_VALUE && !owner_) CloseHandle(h_);
+        h_ = o.h_;
+        overlapped_ = o.overlapped_;
+        attached_ = o.attached_;
+        owner_ = std::move(o.owner_);
+        base_ = o.base_;
+        length_ = o.length_;
+        o.h_ = INVALID_HANDLE_VALUE;
+    }
+    return *this;
+}
+
+uint64_t BlobFile::size() const {
+    if (owner_) return length_;
+    LARGE_INTEGER sz{};
+    if (!GetFileSizeEx(h_, &sz)) return 0;
+    return static_cast<uint64_t>(sz.QuadPart);
+}
+
+// One blocking positioned ReadFile/WriteFile. On an overlapped handle it
+// waits on a per-thread event whose low bit is set, which keeps the
+// completion off the port the handle is bound to.
+bool BlobFile::transfer(bool write, uint64_t offset, void* buf, DWORD len, DWORD& done) const {
+    OVERLAPPED ov{};
+    ov.Offset = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    done = 0;
+    if (!overlapped_) {
+        return write ? WriteFile(h_, buf, len, &done, &ov) != 0 : ReadFile(h_, buf, len, &done, &ov) != 0;
+    }
+    thread_local HANDLE event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!event) return false;
+    ov.hEvent = reinterpret_cast<HANDLE>(reinterpret_cast<ULONG_PTR>(event) | 1);
+    BOOL ok = write ? WriteFile(h_, buf, len, nullptr, &ov) : ReadFile(h_, buf, len, nullptr, &ov);
+    if (!ok && GetLastError() != ERROR_IO_PENDING) return false;
+    if (!ok) WaitForSingleObject(event, INFINITE);
+    return GetOverlappedResult(h_, &ov, &done, FALSE) != 0;
+}
+
+int64_t BlobFile::readAt(uint64_t offset, void* buf, size_t len) const {
+    if (owner_) {
+        if (offset >= length_) return 0;
+        len = static_cast<size_t>(std::min<uint64_t>(len, length_ - offset));
+        offset += base_;
+    }
+    DWORD got = 0;
+    if (!transfer(false, offset, buf, static_cast<DWORD>(len), got)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return static_cast<int64_t>(got);
+}
+
+bool BlobFile::writeAt(uint64_t offset, const void* buf, size_t len) const {
+    if (owner_) return false;
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+        DWORD put = 0;
+        if (!transfer(true, offset, const_cast<char*>(p), static_cast<DWORD>(len), put) || put == 0) return false;
+        p += put;
+        offset += put;
+        len -= put;
+    }
+    return true;
+}
+
+std::shared_ptr<MappedBlob> MappedBlob::open(const std::filesystem::path& p, std::function<void()> onClose) {
+    std::shared_ptr<MappedBlob> m(new MappedBlob());
+    m->onClose_ = std::move(onClose);
+    m->file_ = BlobFile(CreateFileW(p.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+    if (!m->file_) return nullptr;
+    LARGE_INTEGER sz{};
+    if (GetFileSizeEx(m->file_.handle(), &sz) && sz.QuadPart > 0
+        && static_cast<uint64_t>(sz.QuadPart) <= static_cast<uint64_t>(SIZE_MAX)) {
+        m->mapping_ = CreateFileMappingW(m->file_.handle(), nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (!m->mapping_) return nullptr;
+    m->base_ = static_cast<const uint8_t*>(MapViewOfFile(m->mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (!m->base_) return nullptr;
+    m->size_ = static_cast<uint64_t>(sz.QuadPart);
+    return m;
+}
+
+MappedBlob::~MappedBlob() {
+    if (base_) UnmapViewOfFile(base_);
+    if (mapping_) CloseHandle(mapping_);
+    file_ = BlobFile();
+    if (onClose_) onClose_();
+}
+
+ByteSpan MappedBlob::span(uint64_t offset, size_t len, uint64_t* readAhead) const {
+    if (offset >= size_) return {};
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(len, size_ - offset));
+    if (readAhead && *readAhead < size_ && offset + n + READ_AHEAD / 2 > *readAhead) {
+        const uint64_t from = std::max<uint64_t>(*readAhead, offset);
+        WIN32_MEMORY_RANGE_ENTRY range{};
+        range.VirtualAddress = const_cast<uint8_t*>(base_ + from);
+        range.NumberOfBytes = static_cast<SIZE_T>(std::min<uint64_t>(READ_AHEAD, size_ - from));
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        *readAhead = from + range.NumberOfBytes;
+    }
+    return { base_ + offset, n };
+}
+
+// Kept apart from anything with a destructor, which a __try can't share a
+// function with. Only an in-page error is caught; any other fault is a bug.
+static bool copyFromView(void* dst, const uint8_t* src, size_t len) {
+    __try {
+        std::memcpy(dst, src, len);
+    }
+    __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+        return false;
+    }
+    return true;
+}
+
+int64_t MappedBlob::read(uint64_t offset, void* buf, size_t len, uint64_t* readAhead) const {
+    ByteSpan sp = span(offset, len, readAhead);
+    if (sp.size == 0) return 0;
+    if (copyFromView(buf, sp.data, sp.size)) return static_cast<int64_t>(sp.size);
+    // The file may still read where the page didn't, e.g. after a
+    // transient error; if not, the caller sees the error.
+    return file_.readAt(offset, buf, sp.size);
+}
+
+FileManager::FileManager(std::filesystem::path root, size_t mappedBlobs)
+    : root_(std::move(root)), mappedBlobs_(mappedBlobs) {
+    std::filesystem::create_directories(root_ / "staging");
+    std::filesystem::create_directories(root_ / "blobs");
 }
 
 std::filesystem::path FileManager::filePath(int file_id) const {
@@ -12,36 +157,222 @@ std::filesystem::path FileManager::filePath(int file_id) const {
     return root_ / (std::to_string(file_id) + ".bin");
 }
 
-bool FileManager::allocateForNewFile(int file_id, const std::string&) {
-    auto p = filePath(file_id);
-    std::ofstream f(p, std::ios::binary | std::ios::trunc);
-    return bool(f);
+std::filesystem::path FileManager::blobPath(const std::string& hash) const {
+    // Fanned out by the first byte so no directory grows past a few
+    // thousand entries per million blobs.
+    return root_ / "blobs" / hash.substr(0, 2) / (hash + ".bin");
 }
 
-bool FileManager::readChunk(int file_id, uint64_t offset, size_t maxBytes, std::vector<uint8_t>& out) {
-    auto p = filePath(file_id);
-    std::ifstream in(p, std::ios::binary);
-    if (!in) return false;
-    in.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
-    out.resize(maxBytes);
-    in.read(reinterpret_cast<char*>(out.data()), static_cast<std::streamsize>(maxBytes));
-    std::streamsize got = in.gcount();
-    if (got < 0) return false;
-    out.resize(static_cast<size_t>(got));
+BlobFile FileManager::openForRead(int file_id, const std::optional<std::string>& contentHash, bool overlapped) const {
+    // FILE_SHARE_DELETE lets storeBlob move or delete <file_id>.bin under
+    // an open download.
+    const DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN | (overlapped ? FILE_FLAG_OVERLAPPED : 0);
+    auto open = [flags, overlapped](const std::filesystem::path& p) {
+        return BlobFile(CreateFileW(p.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, flags, nullptr), overlapped);
+    };
+    if (contentHash) {
+        BlobFile f;
+        if (segments_ && segments_->open(*contentHash, f)) return f;
+        f = open(blobPath(*contentHash));
+        if (f) return f;
+    }
+    return open(filePath(file_id));
+}
+
+bool FileManager::storeBlob(int file_id, const std::string& hash, bool& existed) const {
+    return moveToBlob(filePath(file_id), hash, existed);
+}
+
+bool FileManager::storeStagingBlob(const std::string& upload_id, const std::string& hash, bool& existed) const {
+    return moveToBlob(stagingPath(upload_id), hash, existed);
+}
+
+bool FileManager::hasBlob(const std::string& hash) const {
+    if (segments_ && segments_->contains(hash)) return true;
+    std::error_code ec;
+    return std::filesystem::exists(blobPath(hash), ec);
+}
+
+void FileManager::removeBlob(const std::string& hash) const {
+    if (segments_) segments_->release(hash);
+    dropBlobFile(hash);
+}
+
+void FileManager::dropBlobFile(const std::string& hash) const {
+    {
+        // Readers still holding the mapping keep it until they finish; the
+        // file itself is gone once they do.
+        std::lock_guard<std::mutex> lock(mapMu_);
+        auto it = mapIndex_.find(hash);
+        if (it != mapIndex_.end()) {
+            maps_.erase(it->second);
+            mapIndex_.erase(it);
+        }
+    }
+    std::lock_guard<std::mutex> lock(unlinks_->mu);
+    std::error_code ec;
+    std::filesystem::remove(blobPath(hash), ec);
+    if (ec && unlinks_->mapped.count(hash)) unlinks_->pending.insert(hash);
+}
+
+void FileManager::removeFile(int file_id) const {
+    std::error_code ec;
+    std::filesystem::remove(filePath(file_id), ec);
+}
+
+bool FileManager::moveToBlob(const std::filesystem::path& from, const std::string& hash, bool& existed) const {
+    auto to = blobPath(hash);
+    {
+        // Stored again: a delete still waiting for its mappings would
+        // take the new copy's bytes.
+        std::lock_guard<std::mutex> lock(unlinks_->mu);
+        unlinks_->pending.erase(hash);
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(to.parent_path(), ec);
+    existed = false;
+    // No REPLACE_EXISTING: two uploads of the same content may race here,
+    // and the loser's copy is simply dropped.
+    if (MoveFileExW(from.wstring().c_str(), to.wstring().c_str(), MOVEFILE_WRITE_THROUGH)) return true;
+    DWORD err = GetLastError();
+    if (err != ERROR_ALREADY_EXISTS && err != ERROR_FILE_EXISTS) return false;
+    existed = true;
+    std::filesystem::remove(from, ec);
     return true;
 }
 
-bool FileManager::writeChunk(int file_id, uint64_t offset, const std::vector<uint8_t>& data) {
+BlobFile FileManager::openForWrite(int file_id, uint64_t expectedSize, bool overlapped) const {
     auto p = filePath(file_id);
-    std::fstream io(p, std::ios::binary | std::ios::in | std::ios::out);
-    if (!io) {
-        io.open(p, std::ios::binary | std::ios::out | std::ios::trunc);
-        io.close();
-        io.open(p, std::ios::binary | std::ios::in | std::ios::out);
-        if (!io) return false;
+    // Shared for delete so an abandoned upload's blob can be removed while
+    // write-behind still holds it.
+    HANDLE h = CreateFileW(p.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN
+        | (overlapped ? FILE_FLAG_OVERLAPPED : 0), nullptr);
+    BlobFile f(h, overlapped);
+    if (f && expectedSize > 0) {
+        // Reserve only; the logical size still grows with what is written,
+        // so an interrupted upload never exposes unwritten bytes.
+        FILE_ALLOCATION_INFO alloc{};
+        alloc.AllocationSize.QuadPart = static_cast<LONGLONG>(expectedSize);
+        SetFileInformationByHandle(h, FileAllocationInfo, &alloc, sizeof(alloc));
+    }
+    return f;
+}
+
+std::shared_ptr<const MappedBlob> FileManager::mapBlob(const std::string& hash) const {
+    if (mappedBlobs_ == 0 || (segments_ && segments_->contains(hash))) return nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mapMu_);
+        auto it = mapIndex_.find(hash);
+        if (it != mapIndex_.end()) {
+            maps_.splice(maps_.begin(), maps_, it->second);
+            return it->second->second;
+        }
+    }
+    // Counted before the file is opened, so a delete that fails because of
+    // this mapping is sure to be retried when it closes.
+    {
+        std::lock_guard<std::mutex> lock(unlinks_->mu);
+        ++unlinks_->mapped[hash];
     }
-    io.seekp(static_cast<std::streamoff>(offset), std::ios::beg);
-    io.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
-    return bool(io);
+    auto unlinks = unlinks_;
+    auto path = blobPath(hash);
+    auto onClose = [unlinks, hash, path]() {
+        std::lock_guard<std::mutex> lock(unlinks->mu);
+        auto it = unlinks->mapped.find(hash);
+        if (it == unlinks->mapped.end() || --it->second > 0) return;
+        unlinks->mapped.erase(it);
+        if (unlinks->pending.erase(hash)) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+        }
+    };
+    // Mapped outside the lock; a racing reader's mapping is simply dropped.
+    std::shared_ptr<MappedBlob> m = MappedBlob::open(path, onClose);
+    if (!m) return nullptr;
+    std::lock_guard<std::mutex> lock(mapMu_);
+    auto it = mapIndex_.find(hash);
+    if (it != mapIndex_.end()) return it->second->second;
+    maps_.emplace_front(hash, m);
+    mapIndex_[hash] = maps_.begin();
+    if (maps_.size() > mappedBlobs_) {
+        mapIndex_.erase(maps_.back().first);
+        maps_.pop_back();
+    }
+    return m;
 }
 
+bool FileManager::scan(int file_id, const std::optional<std::string>& contentHash, size_t spanSize,
+                       const std::function<bool(ByteSpan)>& fn) const {
+    std::shared_ptr<const MappedBlob> m = contentHash ? mapBlob(*contentHash) : nullptr;
+    BlobFile f;
+    if (!m) {
+        f = openForRead(file_id, contentHash);
+        if (!f) return false;
+    }
+    std::vector<uint8_t> buf(spanSize);
+    uint64_t ahead = 0;
+    for (uint64_t pos = 0;;) {
+        size_t got = 0;
+        while (got < spanSize) {
+            int64_t n = m ? m->read(pos + got, buf.data() + got, spanSize - got, &ahead)
+                          : f.readAt(pos + got, buf.data() + got, spanSize - got);
+            if (n < 0) return false;
+            if (n == 0) break;
+            got += static_cast<size_t>(n);
+        }
+        if (got == 0 || !fn(ByteSpan{ buf.data(), got }) || got < spanSize) break;
+        pos += got;
+    }
+    return true;
+}
+
+std::filesystem::path FileManager::stagingPath(const std::string& upload_id) const {
+    return root_ / "staging" / (upload_id + ".part");
+}
+
+bool FileManager::createStaging(const std::string& upload_id, uint64_t expectedSize) const {
+    return bool(openStaging(upload_id, expectedSize));
+}
+
+BlobFile FileManager::openStaging(const std::string& upload_id, uint64_t expectedSize) const {
+    auto p = stagingPath(upload_id);
+    BlobFile f(CreateFileW(p.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr));
+    if (f && expectedSize > 0) {
+        FILE_ALLOCATION_INFO alloc{};
+        alloc.AllocationSize.QuadPart = static_cast<LONGLONG>(expectedSize);
+        SetFileInformationByHandle(f.handle(), FileAllocationInfo, &alloc, sizeof(alloc));
+    }
+    return f;
+}
+
+BlobFile FileManager::openStagingForChunks(const std::string& upload_id) const {
+    auto p = stagingPath(upload_id);
+    return BlobFile(CreateFileW(p.wstring().c_str(), GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr));
+}
+
+bool FileManager::commitStaging(const std::string& upload_id, int file_id) const {
+    auto from = stagingPath(upload_id);
+    {
+        BlobFile f(CreateFileW(from.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr));
+        if (!f || !FlushFileBuffers(f.handle())) return false;
+    }
+    auto to = filePath(file_id);
+    return MoveFileExW(from.wstring().c_str(), to.wstring().c_str(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
+bool FileManager::hasStaging(const std::string& upload_id) const {
+    std::error_code ec;
+    return std::filesystem::exists(stagingPath(upload_id), ec);
+}
+
+void FileManager::removeStaging(const std::string& upload_id) const {
+    std::error_code ec;
+    std::filesystem::remove(stagingPath(upload_id), ec);
+}
@@ -1,17 +1,195 @@
 #pragma once
 #include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <cstdint>
+#include <winsock2.h>
+
+class SegmentStore;
+
+// Owning wrapper for a blob's Win32 handle. Reads and writes are positioned
+// through the OVERLAPPED offset, so callers never seek. A handle opened with
+// FILE_FLAG_OVERLAPPED (for DiskIo) still supports the blocking calls.
+//
+// A view is a read-only window onto a handle it doesn't own, e.g. a blob
+// packed into a segment: offsets are relative to the window and reads stop
+// at its end. Raw users of handle() add base() themselves.
+class BlobFile {
+public:
+    BlobFile() = default;
+    explicit BlobFile(HANDLE h, bool overlapped = false) : h_(h), overlapped_(overlapped) {}
+    // A window onto `file`'s handle; `owner` keeps it open for as long as
+    // the view exists. A shared handle can only be bound to a completion
+    // port once, so `attached` says whether its owner has done that.
+    static BlobFile view(const BlobFile& file, std::shared_ptr<const void> owner, uint64_t base, uint64_t length,
+                         bool attached = false);
+    ~BlobFile();
+    BlobFile(BlobFile&& o) noexcept
+        : h_(o.h_), overlapped_(o.overlapped_), attached_(o.attached_), owner_(std::move(o.owner_)),
+          base_(o.base_), length_(o.length_) {
+        o.h_ = INVALID_HANDLE_VALUE;
+    }
+    BlobFile& operator=(BlobFile&& o) noexcept;
+    BlobFile(const BlobFile&) = delete;
+    BlobFile& operator=(const BlobFile&) = delete;
+
+    explicit operator bool() const { return h_ != INVALID_HANDLE_VALUE; }
+    HANDLE handle() const { return h_; }
+    bool overlapped() const { return overlapped_; }
+    bool isView() const { return owner_ != nullptr; }
+    bool attached() const { return attached_; }
+    uint64_t base() const { return base_; }
+    uint64_t size() const;
+
+    // Bytes read, 0 at end of file, -1 on error.
+    int64_t readAt(uint64_t offset, void* buf, size_t len) const;
+    bool writeAt(uint64_t offset, const void* buf, size_t len) const;
+
+private:
+    HANDLE h_ = INVALID_HANDLE_VALUE;
+    bool overlapped_ = false;
+    bool attached_ = false;                 // views only
+    std::shared_ptr<const void> owner_;     // set for views, which don't close h_
+    uint64_t base_ = 0;
+    uint64_t length_ = 0;
+
+    bool transfer(bool write, uint64_t offset, void* buf, DWORD len, DWORD& done) const;
+};
+
+struct ByteSpan {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+// Read-only mapping of a whole blob. Readers get spans into the mapping
+// instead of copies, and the pages are shared with every other reader
+// through the system cache.
+//
+// A page that can't be read in (a disk error, a volume going away) faults
+// whoever touches it. Spans are only for the kernel, e.g. to send from,
+// which fails the I/O instead; code that reads the bytes itself goes
+// through read(), which catches the fault and falls back to ReadFile.
+class MappedBlob {
+public:
+    // Read-ahead window for sequential readers.
+    static constexpr uint64_t READ_AHEAD = 4 * 1024 * 1024;
+
+    // nullptr if the file cannot be opened or mapped (e.g. an empty file,
+    // or no address space for it in a 32-bit build). `onClose` runs once
+    // the mapping and its file are closed, including when open fails.
+    static std::shared_ptr<MappedBlob> open(const std::filesystem::path& p, std::function<void()> onClose = nullptr);
+    ~MappedBlob();
+    MappedBlob(const MappedBlob&) = delete;
+    MappedBlob& operator=(const MappedBlob&) = delete;
+
+    uint64_t size() const { return size_; }
+    // Up to `len` bytes at `offset`, clamped to the end of the blob. A
+    // sequential reader passes its read-ahead cursor: whenever the span gets
+    // within half a window of it, the next window is prefetched without
+    // waiting and the cursor moves on.
+    ByteSpan span(uint64_t offset, size_t len, uint64_t* readAhead = nullptr) const;
+    // Copies what span() would give into `buf`. Bytes copied, 0 at the end,
+    // -1 if neither the mapping nor the file could be read.
+    int64_t read(uint64_t offset, void* buf, size_t len, uint64_t* readAhead = nullptr) const;
+
+private:
+    MappedBlob() = default;
+    BlobFile file_;         // kept open for read()'s fallback
+    HANDLE mapping_ = nullptr;
+    const uint8_t* base_ = nullptr;
+    uint64_t size_ = 0;
+    std::function<void()> onClose_;
+};
 
 class FileManager {
 public:
-    explicit FileManager(std::filesystem::path root);
-    bool readChunk(int file_id, uint64_t offset, size_t maxBytes, std::vector<uint8_t>& out);
-    bool writeChunk(int file_id, uint64_t offset, const std::vector<uint8_t>& data);
-    bool allocateForNewFile(int file_id, const std::string& name);
+    // Up to `mappedBlobs` blob mappings stay open for downloads; 0 disables
+    // mapped reads.
+    explicit FileManager(std::filesystem::path root, size_t mappedBlobs = 256);
+    // Blobs packed into segments are found through `segments` (may be null).
+    void setSegments(SegmentStore* segments) { segments_ = segments; }
+    // A file with a content hash reads from its shared blob, packed or under
+    // blobs/; until that blob is in place (see storeBlob) it is still read
+    // from <file_id>.bin.
+    // `overlapped` opens it for DiskIo's completion-port mode.
+    BlobFile openForRead(int file_id, const std::optional<std::string>& contentHash = std::nullopt,
+                         bool overlapped = false) const;
+    // Creates/truncates the blob and reserves `expectedSize` bytes of disk
+    // up front so sequential writes never extend the allocation piecemeal.
+    BlobFile openForWrite(int file_id, uint64_t expectedSize, bool overlapped = false) const;
+    // Shared mapping of a content-addressed blob from the handle cache, or
+    // nullptr (no such blob yet, packed, mapping disabled or failed). Only
+    // blobs are mapped: they never change, whereas Windows refuses to
+    // replace a mapped <file_id>.bin, which delta sync does in place.
+    std::shared_ptr<const MappedBlob> mapBlob(const std::string& hash) const;
+    // Walks a file front to back in spans of `spanSize` bytes (the last may
+    // be shorter), read into a buffer through the blob's mapping if there
+    // is one, so it is prefetched, otherwise from the file. Stops early
+    // when `fn` returns false. False if the file could not be read.
+    bool scan(int file_id, const std::optional<std::string>& contentHash, size_t spanSize,
+              const std::function<bool(ByteSpan)>& fn) const;
+
+    // Chunked uploads land in a staging blob under root/staging, written at
+    // arbitrary offsets from any number of connections, and only become
+    // <file_id>.bin when the upload commits.
+    bool createStaging(const std::string& upload_id, uint64_t expectedSize) const;
+    // As createStaging, keeping the handle for sequential writes.
+    BlobFile openStaging(const std::string& upload_id, uint64_t expectedSize) const;
+    // Reopens one for chunk writes at any offset. Shared for write and
+    // delete: every connection's chunks go through the session's one handle,
+    // and the blob can still be committed or dropped while it is open.
+    BlobFile openStagingForChunks(const std::string& upload_id) const;
+    // Flushes the staging blob and renames it over the file's blob.
+    bool commitStaging(const std::string& upload_id, int file_id) const;
+    bool hasStaging(const std::string& upload_id) const;
+    void removeStaging(const std::string& upload_id) const;
+
+    // Deduplicated storage: moves a finished <file_id>.bin to
+    // blobs/<hh>/<hash>.bin, or deletes it if that blob already exists.
+    // `existed` tells which happened.
+    bool storeBlob(int file_id, const std::string& hash, bool& existed) const;
+    // The same for a finished staging blob.
+    bool storeStagingBlob(const std::string& upload_id, const std::string& hash, bool& existed) const;
+    // The blob's bytes are in place, in a segment or under blobs/.
+    bool hasBlob(const std::string& hash) const;
+    // The blob's last reference is gone.
+    void removeBlob(const std::string& hash) const;
+    // Deletes only blobs/<hash>.bin, e.g. once the blob has been packed.
+    // Windows refuses while the blob is still mapped by a reader; the
+    // delete is then left to the last mapping to close, unless the same
+    // content is stored again first.
+    void dropBlobFile(const std::string& hash) const;
+    void removeFile(int file_id) const;
 
     std::filesystem::path filePath(int file_id) const;
+    std::filesystem::path blobPath(const std::string& hash) const;
+    std::filesystem::path stagingPath(const std::string& upload_id) const;
 
 private:
     std::filesystem::path root_;
+    size_t mappedBlobs_;
+    SegmentStore* segments_ = nullptr;
+    // Blob mappings by hash, most recently used first.
+    mutable std::mutex mapMu_;
+    mutable std::list<std::pair<std::string, std::shared_ptr<MappedBlob>>> maps_;
+    mutable std::unordered_map<std::string, decltype(maps_)::iterator> mapIndex_;
+
+    // Blobs with mappings open, and the deletes waiting on them. Shared
+    // with each mapping's close callback, which may run after the cache
+    // has let it go.
+    struct Unlinks {
+        std::mutex mu;
+        std::unordered_map<std::string, unsigned> mapped;  // open mappings per blob
+        std::unordered_set<std::string> pending;
+    };
+    std::shared_ptr<Unlinks> unlinks_ = std::make_shared<Unlinks>();
+
+    bool moveToBlob(const std::filesystem::path& from, const std::string& hash, bool& existed) const;
 };
@@ -0,0 +1,37 @@
+#include "HeapCounter.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<uint64_t> counted{0};
+thread_local bool tracked = false;
+}
+
+void HeapCounter::track() {
+    tracked = true;
+}
+
+uint64_t HeapCounter::allocations() {
+    return counted.load(std::memory_order_relaxed);
+}
+
+// The replaceable forms the array and nothrow ones fall back on by default.
+void* operator new(std::size_t n) {
+    if (tracked) counted.fetch_add(1, std::memory_order_relaxed);
+    if (n == 0) n = 1;
+    for (;;) {
+        if (void* p = std::malloc(n)) return p;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
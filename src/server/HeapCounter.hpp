@@ -0,0 +1,13 @@
+#pragma once
+#include <cstdint>
+
+// Counts calls to the global operator new made on threads that opt in: the
+// I/O workers and DiskIo's threads, where every request and every frame of
+// a transfer is handled. Reported in stats next to the frames sent, so the
+// steady-state paths can be seen not to touch the heap. Background threads
+// (metadata writer, checkpointer, packer) are left out.
+namespace HeapCounter {
+    // Counts the calling thread's allocations from now on.
+    void track();
+    uint64_t allocations();
+}
@@ -0,0 +1,66 @@
+#include "IoService.hpp"
+#include "HeapCounter.hpp"
+#include "../../common/common.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+IoService::IoService(unsigned threads)
+    : threads_(threads ? threads : std::max<unsigned>(1u, std::thread::hardware_concurrency()))
+{
+    port_ = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, threads_);
+    if (!port_) throw SocketError("CreateIoCompletionPort failed");
+}
+
+IoService::~IoService() {
+    stop();
+    if (port_) CloseHandle(port_);
+}
+
+void IoService::associate(HANDLE h) {
+    if (CreateIoCompletionPort(h, port_, 0, 0) != port_) {
+        throw SocketError("associate with completion port failed");
+    }
+}
+
+void IoService::post(IoOp& op) {
+    if (!PostQueuedCompletionStatus(port_, 0, 0, &op.ov)) {
+        throw SocketError("PostQueuedCompletionStatus failed");
+    }
+}
+
+void IoService::run() {
+    for (unsigned i = 0; i < threads_; ++i) {
+        workers_.emplace_back([this]() { workerLoop(); });
+    }
+}
+
+void IoService::stop() {
+    if (workers_.empty()) return;
+    // A completion without an OVERLAPPED tells one worker to exit.
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        PostQueuedCompletionStatus(port_, 0, 0, nullptr);
+    }
+    for (auto& t : workers_) t.join();
+    workers_.clear();
+}
+
+void IoService::workerLoop() {
+    HeapCounter::track();
+    for (;;) {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        LPOVERLAPPED ov = nullptr;
+        BOOL ok = GetQueuedCompletionStatus(port_, &bytes, &key, &ov, INFINITE);
+        if (!ov) {
+            if (!ok) std::cerr << "GetQueuedCompletionStatus failed: " << GetLastError() << "\n";
+            return;
+        }
+
+        IoOp* op = CONTAINING_RECORD(ov, IoOp, ov);
+        DWORD err = ok ? 0 : GetLastError();
+        // Take the pin before dispatching; the target may repost this op.
+        std::shared_ptr<IoCompletionTarget> target = std::move(op->target);
+        if (target) target->onIoComplete(*op, bytes, err);
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <memory>
+#include <thread>
+#include <vector>
+#include <winsock2.h>
+
+class IoCompletionTarget;
+
+// One overlapped operation in flight. The target is pinned for as long as the
+// operation is pending and released by the worker that dequeues it.
+struct IoOp {
+    OVERLAPPED ov{};
+    std::shared_ptr<IoCompletionTarget> target;
+
+    void reset() { ov = OVERLAPPED{}; }
+};
+
+class IoCompletionTarget {
+public:
+    virtual ~IoCompletionTarget() = default;
+    // error is 0 on success, otherwise the Win32 error of the failed operation.
+    virtual void onIoComplete(IoOp& op, DWORD bytes, DWORD error) = 0;
+};
+
+// I/O completion port plus a pool of worker threads draining it.
+// Windows counterpart of an epoll-loop-per-core design: every socket is
+// associated once, and each completion is delivered to exactly one worker.
+class IoService {
+public:
+    explicit IoService(unsigned threads);
+    ~IoService();
+
+    void associate(HANDLE h);
+    void associate(SOCKET s) { associate(reinterpret_cast<HANDLE>(s)); }
+    // Queues a completion for `op` without any I/O, for operations that
+    // failed before they were issued; its target sees 0 bytes, no error.
+    void post(IoOp& op);
+    void run();
+    void stop();
+
+    unsigned threadCount() const { return threads_; }
+
+private:
+    HANDLE port_ = nullptr;
+    unsigned threads_;
+    std::vector<std::thread> workers_;
+
+    void workerLoop();
+};
@@ -0,0 +1,245 @@
+#include "ListService.hpp"
+#include "MetadataStore.hpp"
+#include "../../common/common.hpp"
+
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+static constexpr int MAX_PAGE = 10000;
+
+static std::string toHex(const std::string& s) {
+    static const char* digits = "0123456789abcdef";
+    std::string out;
+    out.reserve(s.size() * 2);
+    for (unsigned char c : s) {
+        out += digits[c >> 4];
+        out += digits[c & 0xF];
+    }
+    return out;
+}
+
+static bool fromHex(const std::string& s, std::string& out) {
+    if (s.size() % 2) return false;
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    out.clear();
+    for (size_t i = 0; i < s.size(); i += 2) {
+        int hi = nibble(s[i]), lo = nibble(s[i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out += static_cast<char>((hi << 4) | lo);
+    }
+    return true;
+}
+
+static bool isNumber(const std::string& s) {
+    if (s.empty()) return false;
+    for (unsigned char c : s) if (!std::isdigit(c)) return false;
+    return true;
+}
+
+// Cursor = hex("<sort key>\x1f<file_id>"): opaque to clients, safe in a
+// whitespace-separated request.
+static std::string makeCursor(const ListQuery& q, const FileRow& last) {
+    std::string key;
+    switch (q.sort) {
+    case ListQuery::Sort::Newest: key = last.uploaded_at; break;
+    case ListQuery::Sort::Name:   key = last.name; break;
+    case ListQuery::Sort::Size:   key = std::to_string(last.size); break;
+    }
+    return toHex(key + '\x1f' + std::to_string(last.file_id));
+}
+
+static bool parseCursor(const std::string& cursor, ListQuery& q) {
+    std::string raw;
+    if (!fromHex(cursor, raw)) return false;
+    auto sep = raw.rfind('\x1f');
+    if (sep == std::string::npos) return false;
+    std::string id = raw.substr(sep + 1);
+    q.afterKey = raw.substr(0, sep);
+    if (!isNumber(id)) return false;
+    if (q.sort == ListQuery::Sort::Size && !isNumber(q.afterKey)) return false;
+    q.afterId = std::stoll(id);
+    q.hasCursor = true;
+    return true;
+}
+
+static std::string globEscape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '*' || c == '?' || c == '[') {
+            out += '[';
+            out += c;
+            out += ']';
+        }
+        else out += c;
+    }
+    return out;
+}
+
+// "YYYY-MM-DD HH:MM:SS" (UTC, as CURRENT_TIMESTAMP writes it) to Unix time.
+static int64_t toUnixTime(const std::string& ts) {
+    int y = 0, mo = 0, d = 0, h = 0, mi = 0, s = 0;
+    char sep;
+    std::istringstream iss(ts);
+    iss >> y >> sep >> mo >> sep >> d >> h >> sep >> mi >> sep >> s;
+    if (iss.fail()) return 0;
+    y -= mo <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const int64_t yoe = y - era * 400;
+    const int64_t doy = (153 * (mo + (mo > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    const int64_t days = era * 146097 + doe - 719468;
+    return days * 86400 + h * 3600 + mi * 60 + s;
+}
+
+static void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+// Binary page, all integers LEB128 varints:
+//   u8 version(1) | count | cursor_len | cursor
+//   count x { file_id | size | uploaded_at (unix s) | download_count | name_len | name }
+static std::string encodeBinary(const std::vector<FileRow>& rows, const std::string& next) {
+    std::string out;
+    out.reserve(16 + next.size() + rows.size() * 32);
+    out += static_cast<char>(1);
+    putVarint(out, rows.size());
+    putVarint(out, next.size());
+    out += next;
+    for (const auto& r : rows) {
+        putVarint(out, static_cast<uint64_t>(r.file_id));
+        putVarint(out, r.size);
+        putVarint(out, static_cast<uint64_t>(toUnixTime(r.uploaded_at)));
+        putVarint(out, static_cast<uint64_t>(r.download_count));
+        putVarint(out, r.name.size());
+        out += r.name;
+    }
+    return out;
+}
+
+static std::string encodeText(const std::vector<FileRow>& rows, const std::string& next) {
+    std::vector<std::string> lines;
+    lines.reserve(rows.size() + 2);
+    lines.emplace_back("ID   SIZE(bytes)  UPLOADED_AT        DL  NAME");
+    for (auto& r : rows) {
+        std::ostringstream row;
+        row << std::setw(4) << r.file_id << " "
+            << std::setw(12) << r.size << "  "
+            << std::setw(16) << r.uploaded_at << "  "
+            << std::setw(3) << r.download_count << "  "
+            << r.name;
+        lines.push_back(row.str());
+    }
+    if (!next.empty()) lines.push_back("next: " + next);
+    return joinLines(lines);
+}
+
+ListService::ListService(MetadataStore& meta, size_t snapshots)
+    : meta_(meta), capacity_(snapshots) {
+}
+
+bool ListService::handle(const std::string& request, std::string& payload, std::string& error) {
+    ListQuery q;
+    bool binary = false;
+    std::string cursor;
+
+    if (!request.empty() && request[0] == '?') {
+        std::string norm = request.substr(1);
+        for (char& c : norm) if (c == ';' || c == '&') c = ' ';
+        std::istringstream iss(norm);
+        std::string tok;
+        while (iss >> tok) {
+            auto eq = tok.find('=');
+            if (eq == std::string::npos) { error = "bad-list-option"; return false; }
+            std::string key = tok.substr(0, eq), val = tok.substr(eq + 1);
+            if (key == "sort") {
+                if (val == "newest") q.sort = ListQuery::Sort::Newest;
+                else if (val == "name") q.sort = ListQuery::Sort::Name;
+                else if (val == "size") q.sort = ListQuery::Sort::Size;
+                else { error = "bad-sort"; return false; }
+            }
+            else if (key == "limit") {
+                if (!isNumber(val) || val.size() > 6) { error = "bad-limit"; return false; }
+                q.limit = std::stoi(val);
+                if (q.limit < 1 || q.limit > MAX_PAGE) { error = "bad-limit"; return false; }
+            }
+            else if (key == "after") cursor = val;
+            else if (key == "prefix") q.pattern = globEscape(val) + "*";
+            else if (key == "glob") q.pattern = val;
+            else if (key == "format") {
+                if (val == "binary") binary = true;
+                else if (val == "text") binary = false;
+                else { error = "bad-format"; return false; }
+            }
+            else { error = "bad-list-option"; return false; }
+        }
+        // Parsed after the loop: the cursor's key type depends on sort=.
+        if (!cursor.empty() && !parseCursor(cursor, q)) { error = "bad-cursor"; return false; }
+    }
+
+    std::ostringstream key;
+    key << static_cast<int>(q.sort) << '\x1f' << q.limit << '\x1f' << cursor << '\x1f'
+        << q.pattern << '\x1f' << binary;
+
+    // Sampled before querying: a commit that lands mid-query bumps past it.
+    uint64_t version = meta_.catalogVersion();
+    if (auto cached = lookup(key.str(), version)) {
+        payload = *cached;
+        return true;
+    }
+
+    // One extra row tells whether another page follows.
+    ListQuery probe = q;
+    probe.limit = q.limit + 1;
+    std::vector<FileRow> rows = meta_.listFiles(probe);
+    std::string next;
+    if (rows.size() > static_cast<size_t>(q.limit)) {
+        rows.resize(static_cast<size_t>(q.limit));
+        next = makeCursor(q, rows.back());
+    }
+
+    auto out = std::make_shared<const std::string>(binary ? encodeBinary(rows, next) : encodeText(rows, next));
+    store(key.str(), version, out);
+    payload = *out;
+    return true;
+}
+
+std::shared_ptr<const std::string> ListService::lookup(const std::string& key, uint64_t version) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = snaps_.find(key);
+    if (it == snaps_.end() || it->second.version != version) {
+        ++misses_;
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    ++hits_;
+    return it->second.payload;
+}
+
+void ListService::store(const std::string& key, uint64_t version, std::shared_ptr<const std::string> payload) {
+    if (capacity_ == 0) return;
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = snaps_.find(key);
+    if (it != snaps_.end()) {
+        it->second.version = version;
+        it->second.payload = std::move(payload);
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+        return;
+    }
+    if (snaps_.size() >= capacity_) {
+        snaps_.erase(lru_.back());
+        lru_.pop_back();
+    }
+    lru_.push_front(key);
+    snaps_.emplace(key, Snapshot{ version, std::move(payload), lru_.begin() });
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+class MetadataStore;
+
+// Answers LIST_REQ. A request starting with '?' is a whitespace/';'-separated
+// list of key=value options after it:
+//   sort=newest|name|size   limit=N (1..10000)   after=<cursor>
+//   prefix=<text>           glob=<pattern>       format=text|binary
+// Anything else (old clients send a path, which may well contain '=')
+// lists newest-first.
+//
+// Responses are cached per canonical request and reused until the
+// catalog version moves, so repeated identical LISTs cost a map lookup.
+class ListService {
+public:
+    explicit ListService(MetadataStore& meta, size_t snapshots = 256);
+
+    // False with `error` set when the request is malformed.
+    bool handle(const std::string& request, std::string& payload, std::string& error);
+
+    uint64_t snapshotHits() const { return hits_.load(); }
+    uint64_t snapshotMisses() const { return misses_.load(); }
+
+private:
+    struct Snapshot {
+        uint64_t version{};
+        std::shared_ptr<const std::string> payload;
+        std::list<std::string>::iterator lru;
+    };
+
+    MetadataStore& meta_;
+    size_t capacity_;
+    std::mutex mu_;
+    std::unordered_map<std::string, Snapshot> snaps_;
+    std::list<std::string> lru_;    // most recent first
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+
+    std::shared_ptr<const std::string> lookup(const std::string& key, uint64_t version);
+    void store(const std::string& key, uint64_t version, std::shared_ptr<const std::string> payload);
+};
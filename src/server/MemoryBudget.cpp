@@ -0,0 +1,44 @@
+#include "MemoryBudget.hpp"
+
+MemoryBudget::MemoryBudget(uint64_t limit) : limit_(limit) {}
+
+bool MemoryBudget::charge(uint64_t n, std::function<void()> wake) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (limit_ == 0 || used_ == 0 || used_ + n <= limit_) {
+        used_ += n;
+        return true;
+    }
+    // Checked and queued under one lock, so a release can't slip in between.
+    waiters_.push_back(std::move(wake));
+    return false;
+}
+
+bool MemoryBudget::tryCharge(uint64_t n) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (limit_ != 0 && used_ != 0 && used_ + n > limit_) return false;
+    used_ += n;
+    return true;
+}
+
+void MemoryBudget::force(uint64_t n) {
+    std::lock_guard<std::mutex> lock(mu_);
+    used_ += n;
+}
+
+void MemoryBudget::release(uint64_t n) {
+    std::vector<std::function<void()>> woken;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        used_ -= n;
+        // Waiters only need a nudge once there is room again; each one
+        // charges for itself and queues up again if it still doesn't fit.
+        if (waiters_.empty() || (used_ != 0 && used_ >= limit_)) return;
+        woken.swap(waiters_);
+    }
+    for (auto& wake : woken) wake();
+}
+
+uint64_t MemoryBudget::used() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return used_;
+}
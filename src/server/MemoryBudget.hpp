@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Server-wide limit on the memory connections hold for request payloads,
+// queued replies and transfer buffers. A connection that can't charge a
+// payload doesn't read it: it leaves the bytes in the socket, so TCP flow
+// control pushes back on the client, and is woken once memory has been
+// released somewhere. A transfer whose buffers don't fit is refused.
+class MemoryBudget {
+public:
+    // 0 means unlimited.
+    explicit MemoryBudget(uint64_t limit);
+
+    // Charges `n` bytes if they fit, or if nothing is charged at all, so one
+    // payload larger than the whole budget still goes through on its own.
+    // Otherwise queues `wake` to run once memory is released and returns
+    // false. `wake` runs on the releasing thread, possibly under its locks.
+    bool charge(uint64_t n, std::function<void()> wake);
+    // As charge, but with nothing queued when `n` doesn't fit.
+    bool tryCharge(uint64_t n);
+    // Charges regardless of the limit, for memory that is already committed.
+    void force(uint64_t n);
+    void release(uint64_t n);
+
+    uint64_t used() const;
+    uint64_t limit() const { return limit_; }
+
+private:
+    const uint64_t limit_;
+    mutable std::mutex mu_;
+    uint64_t used_ = 0;
+    std::vector<std::function<void()>> waiters_;
+};
@@ -1,4 +1,6 @@
 #include "MetadataStore.hpp"
+#include "FileCache.hpp"
+#include <cstring>
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
@@ -8,32 +10,146 @@
 
 static int64_t to_i64(uint64_t v) { return static_cast<int64_t>(v); }
 
-MetadataStore::MetadataStore(const std::filesystem::path& db_path) {
-    if (sqlite3_open(db_path.string().c_str(), &db_) != SQLITE_OK) {
-        throw std::runtime_error("sqlite3_open failed");
+// Columns: file_id,name,size,checksum,uploaded_at,download_count
+static void readFileRow(sqlite3_stmt* st, FileRow& out) {
+    out.file_id = sqlite3_column_int(st, 0);
+    out.name = reinterpret_cast<const char*>(sqlite3_column_text(st, 1));
+    out.size = static_cast<uint64_t>(sqlite3_column_int64(st, 2));
+    if (sqlite3_column_type(st, 3) == SQLITE_NULL) out.checksum.reset();
+    else out.checksum = std::string(reinterpret_cast<const char*>(sqlite3_column_text(st, 3)));
+    out.uploaded_at = reinterpret_cast<const char*>(sqlite3_column_text(st, 4));
+    out.download_count = sqlite3_column_int(st, 5);
+    if (sqlite3_column_type(st, 6) == SQLITE_NULL) out.content_hash.reset();
+    else out.content_hash = std::string(reinterpret_cast<const char*>(sqlite3_column_text(st, 6)));
+}
+
+// Borrowed cached statement; reset and unbound again when the call is done.
+class MetadataStore::Stmt {
+public:
+    explicit Stmt(sqlite3_stmt* st) : st_(st) {}
+    ~Stmt() {
+        if (st_) {
+            sqlite3_reset(st_);
+            sqlite3_clear_bindings(st_);
+        }
     }
-    exec("PRAGMA journal_mode=WAL;");
-    exec("PRAGMA synchronous=NORMAL;");
-    exec("PRAGMA foreign_keys=ON;");
+    Stmt(const Stmt&) = delete;
+    Stmt& operator=(const Stmt&) = delete;
+
+    explicit operator bool() const { return st_ != nullptr; }
+    operator sqlite3_stmt*() const { return st_; }
+
+private:
+    sqlite3_stmt* st_;
+};
+
+// Exclusive use of one reader connection for the duration of a call.
+class MetadataStore::ReadLease {
+public:
+    explicit ReadLease(MetadataStore& store) : store_(store) {
+        std::unique_lock<std::mutex> lock(store_.poolMu_);
+        store_.poolCv_.wait(lock, [this]() { return !store_.idleReaders_.empty(); });
+        conn_ = store_.idleReaders_.back();
+        store_.idleReaders_.pop_back();
+    }
+    ~ReadLease() {
+        {
+            std::lock_guard<std::mutex> lock(store_.poolMu_);
+            store_.idleReaders_.push_back(conn_);
+        }
+        store_.poolCv_.notify_one();
+    }
+    ReadLease(const ReadLease&) = delete;
+    ReadLease& operator=(const ReadLease&) = delete;
+
+    Conn* operator->() const { return conn_; }
+
+private:
+    MetadataStore& store_;
+    Conn* conn_;
+};
+
+MetadataStore::Conn::~Conn() {
+    for (auto& kv : stmts) sqlite3_finalize(kv.second);
+    if (db) sqlite3_close(db);
+}
+
+sqlite3_stmt* MetadataStore::Conn::prepare(const char* sql) {
+    auto it = stmts.find(sql);
+    if (it != stmts.end()) return it->second;
+    sqlite3_stmt* st{};
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &st, nullptr) != SQLITE_OK) return nullptr;
+    stmts.emplace(sql, st);
+    return st;
+}
+
+MetadataStore::MetadataStore(const std::filesystem::path& db_path, const Options& opts)
+    : cache_(std::make_unique<FileCache>(opts.cacheEntries)),
+      commitInterval_(opts.commitInterval), commitBatch_(opts.commitBatch ? opts.commitBatch : 1)
+{
+    open(writer_, db_path, false);
+    exec(writer_.db, "PRAGMA journal_mode=WAL;");
+    exec(writer_.db, "PRAGMA synchronous=NORMAL;");
+    exec(writer_.db, "PRAGMA foreign_keys=ON;");
     ensureSchema();
+
+    // Readers are opened after the schema exists and WAL is on.
+    unsigned readers = opts.readers ? opts.readers : 1;
+    for (unsigned i = 0; i < readers; ++i) {
+        auto c = std::make_unique<Conn>();
+        open(*c, db_path, true);
+        idleReaders_.push_back(c.get());
+        readers_.push_back(std::move(c));
+    }
+
+    writerThread_ = std::thread([this]() { writerLoop(); });
 }
 
 MetadataStore::~MetadataStore() {
-    if (db_) sqlite3_close(db_);
+    {
+        std::lock_guard<std::mutex> lock(queueMu_);
+        stop_ = true;
+    }
+    queueCv_.notify_all();
+    writerThread_.join();
 }
 
-void MetadataStore::exec(const char* sql) {
+void MetadataStore::open(Conn& c, const std::filesystem::path& db_path, bool readOnly) {
+    // Each connection is only ever used by one thread at a time (writer mutex
+    // or reader lease), so SQLite's own per-connection mutex is redundant.
+    int flags = SQLITE_OPEN_NOMUTEX | (readOnly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE));
+    if (sqlite3_open_v2(db_path.string().c_str(), &c.db, flags, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("sqlite3_open failed");
+    }
+    sqlite3_busy_timeout(c.db, 5000);
+}
+
+void MetadataStore::exec(sqlite3* db, const char* sql) {
     char* err = nullptr;
-    if (sqlite3_exec(db_, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK) {
         std::string msg = err ? err : "sqlite error";
         sqlite3_free(err);
         throw std::runtime_error(msg);
     }
 }
 
+// For migrations: whether an older catalog already has the column.
+static bool hasColumn(sqlite3* db, const char* table, const char* column) {
+    const std::string sql = std::string("PRAGMA table_info(") + table + ");";
+    bool found = false;
+    sqlite3_stmt* st = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &st, nullptr) == SQLITE_OK) {
+        while (!found && sqlite3_step(st) == SQLITE_ROW) {
+            found = std::strcmp(reinterpret_cast<const char*>(sqlite3_column_text(st, 1)), column) == 0;
+        }
+    }
+    sqlite3_finalize(st);
+    return found;
+}
+
 void MetadataStore::ensureSchema() {
     // 'files' and 'resume' tables per design doc 2.4.  :contentReference[oaicite:2]{index=2}
-    exec(
+    exec(writer_.db,
         "CREATE TABLE IF NOT EXISTS files ("
         "  file_id INTEGER PRIMARY KEY AUTOINCREMENT,"
         "  name TEXT NOT NULL,"
@@ -44,7 +160,7 @@ void MetadataStore::ensureSchema() {
         "  UNIQUE(name)"
         ");"
     );
-    exec(
+    exec(writer_.db,
         "CREATE TABLE IF NOT EXISTS resume ("
         "  resume_id TEXT PRIMARY KEY,"
         "  file_id INTEGER NOT NULL,"
@@ -54,127 +170,410 @@ void MetadataStore::ensureSchema() {
         "  FOREIGN KEY(file_id) REFERENCES files(file_id)"
         ");"
     );
-    exec("CREATE INDEX IF NOT EXISTS idx_files_uploaded_at ON files(uploaded_at DESC);");
+    exec(writer_.db,
+        "CREATE TABLE IF NOT EXISTS blobs ("
+        "  hash TEXT PRIMARY KEY,"
+        "  size INTEGER NOT NULL,"
+        "  refcount INTEGER NOT NULL"
+        ");"
+    );
+    exec(writer_.db,
+        "CREATE TABLE IF NOT EXISTS block_hashes ("
+        "  file_id INTEGER PRIMARY KEY,"
+        "  block_size INTEGER NOT NULL,"
+        "  root INTEGER NOT NULL,"
+        "  leaves BLOB NOT NULL,"
+        "  FOREIGN KEY(file_id) REFERENCES files(file_id)"
+        ");"
+    );
+    exec(writer_.db,
+        "CREATE TABLE IF NOT EXISTS upload_sessions ("
+        "  upload_id TEXT PRIMARY KEY,"
+        "  name TEXT NOT NULL,"
+        "  size INTEGER NOT NULL,"
+        "  ranges TEXT NOT NULL DEFAULT '',"
+        "  file_id INTEGER,"
+        "  created_at DATETIME NOT NULL DEFAULT CURRENT_TIMESTAMP"
+        ");"
+    );
+    // Keyset pagination. Each index implicitly ends in file_id (the rowid);
+    // newest-first scans idx_files_newest backwards, file_id tie-break
+    // included. Name order uses UNIQUE(name). The uploaded_at-only index
+    // older catalogs have is covered by it and only slows inserts.
+    exec(writer_.db, "DROP INDEX IF EXISTS idx_files_uploaded_at;");
+    exec(writer_.db, "CREATE INDEX IF NOT EXISTS idx_files_newest ON files(uploaded_at, file_id);");
+    exec(writer_.db, "CREATE INDEX IF NOT EXISTS idx_files_size ON files(size);");
+
+    // Added with the deduplicating store; older catalogs lack the column.
+    if (!hasColumn(writer_.db, "files", "content_hash")) exec(writer_.db, "ALTER TABLE files ADD COLUMN content_hash TEXT;");
+    exec(writer_.db, "CREATE INDEX IF NOT EXISTS idx_files_content_hash ON files(content_hash);");
+
+    // Added with segment packing.
+    if (!hasColumn(writer_.db, "blobs", "segment")) {
+        exec(writer_.db, "ALTER TABLE blobs ADD COLUMN segment INTEGER;");
+        exec(writer_.db, "ALTER TABLE blobs ADD COLUMN seg_offset INTEGER;");
+    }
+
+    // Added when PUT rows became visible only once their bytes are in.
+    if (!hasColumn(writer_.db, "files", "pending")) exec(writer_.db, "ALTER TABLE files ADD COLUMN pending INTEGER NOT NULL DEFAULT 0;");
+
+    // Added when hashes of files stored before --dedup began to be kept.
+    if (!hasColumn(writer_.db, "files", "sha256")) exec(writer_.db, "ALTER TABLE files ADD COLUMN sha256 TEXT;");
 }
 
-int MetadataStore::insertFile(const std::string& name, uint64_t size, std::optional<std::string> checksum) {
-    const char* sql = "INSERT INTO files(name,size,checksum) VALUES(?,?,?);";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) throw std::runtime_error("prepare failed");
-    sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(st, 2, to_i64(size));
-    if (checksum.has_value()) sqlite3_bind_text(st, 3, checksum->c_str(), -1, SQLITE_TRANSIENT);
-    else sqlite3_bind_null(st, 3);
+MetadataStore::Ticket MetadataStore::enqueue(std::function<bool(Conn&)> apply, std::function<void()> onCommit,
+                                             std::function<void(bool)> then) {
+    PendingWrite w;
+    w.apply = std::move(apply);
+    w.onCommit = std::move(onCommit);
+    w.then = std::move(then);
+    Ticket t = w.done.get_future().share();
+    {
+        std::lock_guard<std::mutex> lock(queueMu_);
+        queue_.push_back(std::move(w));
+    }
+    queueCv_.notify_one();
+    return t;
+}
 
-    if (sqlite3_step(st) != SQLITE_DONE) {
-        sqlite3_finalize(st);
-        throw std::runtime_error("insertFile failed");
+void MetadataStore::writerLoop() {
+    std::unique_lock<std::mutex> lock(queueMu_);
+    for (;;) {
+        queueCv_.wait(lock, [this]() { return stop_ || !queue_.empty() || !downloadCounts_.empty(); });
+        // Give the group a moment to fill unless it already is full.
+        queueCv_.wait_for(lock, commitInterval_, [this]() { return stop_ || queue_.size() >= commitBatch_; });
+        if (queue_.empty() && downloadCounts_.empty()) {
+            if (stop_) return;
+            continue;
+        }
+        std::vector<PendingWrite> batch;
+        batch.swap(queue_);
+        std::unordered_map<int, int> downloads;
+        downloads.swap(downloadCounts_);
+        lock.unlock();
+        commitGroup(batch, downloads);
+        lock.lock();
     }
-    sqlite3_finalize(st);
-    return static_cast<int>(sqlite3_last_insert_rowid(db_));
+}
+
+void MetadataStore::commitGroup(std::vector<PendingWrite>& batch, std::unordered_map<int, int>& downloads) {
+    static const char* countSql = "UPDATE files SET download_count=download_count+? WHERE file_id=?;";
+    std::vector<bool> results(batch.size(), false);
+    bool committed = false;
+    try {
+        exec(writer_.db, "BEGIN IMMEDIATE;");
+        for (size_t i = 0; i < batch.size(); ++i) {
+            // A savepoint per operation keeps multi-statement operations
+            // atomic without failing the rest of the group.
+            exec(writer_.db, "SAVEPOINT op;");
+            results[i] = batch[i].apply(writer_);
+            exec(writer_.db, results[i] ? "RELEASE op;" : "ROLLBACK TO op; RELEASE op;");
+        }
+        for (const auto& kv : downloads) {
+            Stmt st(writer_.prepare(countSql));
+            if (!st) continue;
+            sqlite3_bind_int(st, 1, kv.second);
+            sqlite3_bind_int(st, 2, kv.first);
+            sqlite3_step(st);
+        }
+        exec(writer_.db, "COMMIT;");
+        committed = true;
+    }
+    catch (const std::exception& ex) {
+        std::cerr << "metadata group commit failed: " << ex.what() << "\n";
+        sqlite3_exec(writer_.db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+
+    ++commits_;
+    writes_ += batch.size();
+    for (size_t i = 0; i < batch.size(); ++i) {
+        bool ok = committed && results[i];
+        if (ok && batch[i].onCommit) batch[i].onCommit();
+        batch[i].done.set_value(ok);
+        if (batch[i].then) batch[i].then(ok);
+    }
+}
+
+std::future<int> MetadataStore::insertFileAsync(const std::string& name, uint64_t size, std::optional<std::string> checksum) {
+    auto id = std::make_shared<int>(-1);
+    Ticket t = enqueueInsertFile(name, size, std::move(checksum), id, {});
+    return std::async(std::launch::deferred, [t, id]() {
+        if (!t.get()) throw std::runtime_error("insertFile failed");
+        return *id;
+    });
+}
+
+void MetadataStore::insertFileAsync(const std::string& name, uint64_t size, std::optional<std::string> checksum,
+                                    std::function<void(int)> done) {
+    auto id = std::make_shared<int>(-1);
+    enqueueInsertFile(name, size, std::move(checksum), id, [id, done](bool ok) { done(ok ? *id : -1); });
+}
+
+MetadataStore::Ticket MetadataStore::enqueueInsertFile(const std::string& name, uint64_t size,
+                                                       std::optional<std::string> checksum, std::shared_ptr<int> id,
+                                                       std::function<void(bool)> then) {
+    static const char* sql = "INSERT INTO files(name,size,checksum,pending) VALUES(?,?,?,1);";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(st, 2, to_i64(size));
+        if (checksum.has_value()) sqlite3_bind_text(st, 3, checksum->c_str(), -1, SQLITE_TRANSIENT);
+        else sqlite3_bind_null(st, 3);
+        if (sqlite3_step(st) != SQLITE_DONE) return false;
+        *id = static_cast<int>(sqlite3_last_insert_rowid(c.db));
+        return true;
+    }, [this, name]() {
+        cache_->invalidateName(name);
+        catalogVersion_.fetch_add(1, std::memory_order_release);
+    }, std::move(then));
+}
+
+int MetadataStore::insertFile(const std::string& name, uint64_t size, std::optional<std::string> checksum) {
+    return insertFileAsync(name, size, std::move(checksum)).get();
+}
+
+void MetadataStore::insertFiles(const std::vector<std::pair<std::string, uint64_t>>& files,
+                                std::function<void(std::vector<int>)> done) {
+    static const char* sql = "INSERT INTO files(name,size,pending) VALUES(?,?,1);";
+    auto ids = std::make_shared<std::vector<int>>(files.size(), -1);
+    enqueue([files, ids](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        for (size_t i = 0; i < files.size(); ++i) {
+            sqlite3_reset(st);
+            sqlite3_bind_text(st, 1, files[i].first.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(st, 2, to_i64(files[i].second));
+            int rc = sqlite3_step(st);
+            if (rc == SQLITE_DONE) (*ids)[i] = static_cast<int>(sqlite3_last_insert_rowid(c.db));
+            else if ((rc & 0xff) != SQLITE_CONSTRAINT) return false;
+        }
+        return true;
+    }, [this, files]() {
+        for (const auto& f : files) cache_->invalidateName(f.first);
+        catalogVersion_.fetch_add(1, std::memory_order_release);
+    }, [ids, done](bool ok) { done(ok ? std::move(*ids) : std::vector<int>()); });
 }
 
 bool MetadataStore::getFile(int file_id, FileRow& out) {
-    const char* sql =
-        "SELECT file_id,name,size,checksum,uploaded_at,download_count "
-        "FROM files WHERE file_id=?;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-    sqlite3_bind_int(st, 1, file_id);
+    static const char* sql =
+        "SELECT file_id,name,size,checksum,uploaded_at,download_count,content_hash "
+        "FROM files WHERE file_id=? AND pending=0;";
+    if (cache_->get(file_id, out)) return true;
+    return queryFile(sql, nullptr, file_id, out);
+}
+
+bool MetadataStore::getFileByName(const std::string& name, FileRow& out) {
+    static const char* sql =
+        "SELECT file_id,name,size,checksum,uploaded_at,download_count,content_hash "
+        "FROM files WHERE name=? AND pending=0;";
+    if (cache_->getByName(name, out)) return true;
+    return queryFile(sql, &name, 0, out);
+}
+
+bool MetadataStore::queryFile(const char* sql, const std::string* name, int file_id, FileRow& out) {
+    uint64_t gen = cache_->generation();
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return false;
+    if (name) sqlite3_bind_text(st, 1, name->c_str(), -1, SQLITE_TRANSIENT);
+    else sqlite3_bind_int(st, 1, file_id);
 
     bool ok = false;
     if (sqlite3_step(st) == SQLITE_ROW) {
-        out.file_id = sqlite3_column_int(st, 0);
-        out.name = reinterpret_cast<const char*>(sqlite3_column_text(st, 1));
-        out.size = static_cast<uint64_t>(sqlite3_column_int64(st, 2));
-        if (sqlite3_column_type(st, 3) == SQLITE_NULL) out.checksum.reset();
-        else out.checksum = std::string(reinterpret_cast<const char*>(sqlite3_column_text(st, 3)));
-        out.uploaded_at = reinterpret_cast<const char*>(sqlite3_column_text(st, 4));
-        out.download_count = sqlite3_column_int(st, 5);
+        readFileRow(st, out);
         ok = true;
     }
-    sqlite3_finalize(st);
+    if (ok) cache_->put(out, gen);
     return ok;
 }
 
 std::vector<FileRow> MetadataStore::listFilesNewestFirst(int limit) {
-    const char* sql =
-        "SELECT file_id,name,size,checksum,uploaded_at,download_count "
-        "FROM files ORDER BY uploaded_at DESC, file_id DESC LIMIT ?;";
-    sqlite3_stmt* st{};
+    static const char* sql =
+        "SELECT file_id,name,size,checksum,uploaded_at,download_count,content_hash "
+        "FROM files WHERE pending=0 ORDER BY uploaded_at DESC, file_id DESC LIMIT ?;";
     std::vector<FileRow> rows;
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return rows;
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return rows;
     sqlite3_bind_int(st, 1, limit);
 
     while (sqlite3_step(st) == SQLITE_ROW) {
         FileRow r{};
-        r.file_id = sqlite3_column_int(st, 0);
-        r.name = reinterpret_cast<const char*>(sqlite3_column_text(st, 1));
-        r.size = static_cast<uint64_t>(sqlite3_column_int64(st, 2));
-        if (sqlite3_column_type(st, 3) == SQLITE_NULL) r.checksum.reset();
-        else r.checksum = std::string(reinterpret_cast<const char*>(sqlite3_column_text(st, 3)));
-        r.uploaded_at = reinterpret_cast<const char*>(sqlite3_column_text(st, 4));
-        r.download_count = sqlite3_column_int(st, 5);
+        readFileRow(st, r);
         rows.push_back(std::move(r));
     }
-    sqlite3_finalize(st);
     return rows;
 }
 
-bool MetadataStore::updateFileSize(int file_id, uint64_t size) {
-    const char* sql = "UPDATE files SET size=? WHERE file_id=?;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-    sqlite3_bind_int64(st, 1, to_i64(size));
-    sqlite3_bind_int(st, 2, file_id);
-    bool ok = sqlite3_step(st) == SQLITE_DONE;
-    sqlite3_finalize(st);
-    return ok;
+std::vector<FileRow> MetadataStore::listFiles(const ListQuery& q) {
+    // One statement per (sort, filtered) pair so each can seek its index; the
+    // first page binds a sentinel cursor that precedes every row.
+#define LIST_COLS "SELECT file_id,name,size,checksum,uploaded_at,download_count,content_hash FROM files WHERE pending=0 AND "
+    static const char* newest =
+        LIST_COLS "(uploaded_at,file_id) < (?1,?2) ORDER BY uploaded_at DESC, file_id DESC LIMIT ?3;";
+    static const char* newestGlob =
+        LIST_COLS "(uploaded_at,file_id) < (?1,?2) AND name GLOB ?4 ORDER BY uploaded_at DESC, file_id DESC LIMIT ?3;";
+    static const char* byName =
+        LIST_COLS "(name,file_id) > (?1,?2) ORDER BY name, file_id LIMIT ?3;";
+    static const char* byNameGlob =
+        LIST_COLS "(name,file_id) > (?1,?2) AND name GLOB ?4 ORDER BY name, file_id LIMIT ?3;";
+    static const char* bySize =
+        LIST_COLS "(size,file_id) > (?1,?2) ORDER BY size, file_id LIMIT ?3;";
+    static const char* bySizeGlob =
+        LIST_COLS "(size,file_id) > (?1,?2) AND name GLOB ?4 ORDER BY size, file_id LIMIT ?3;";
+#undef LIST_COLS
+
+    const bool filtered = !q.pattern.empty();
+    const char* sql = nullptr;
+    switch (q.sort) {
+    case ListQuery::Sort::Newest: sql = filtered ? newestGlob : newest; break;
+    case ListQuery::Sort::Name:   sql = filtered ? byNameGlob : byName; break;
+    case ListQuery::Sort::Size:   sql = filtered ? bySizeGlob : bySize; break;
+    }
+
+    std::vector<FileRow> rows;
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return rows;
+
+    switch (q.sort) {
+    case ListQuery::Sort::Newest:
+        if (q.hasCursor) sqlite3_bind_text(st, 1, q.afterKey.c_str(), -1, SQLITE_TRANSIENT);
+        else sqlite3_bind_text(st, 1, "9999-12-31 23:59:59", -1, SQLITE_STATIC);
+        sqlite3_bind_int64(st, 2, q.hasCursor ? q.afterId : INT64_MAX);
+        break;
+    case ListQuery::Sort::Name:
+        sqlite3_bind_text(st, 1, q.hasCursor ? q.afterKey.c_str() : "", -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(st, 2, q.hasCursor ? q.afterId : -1);
+        break;
+    case ListQuery::Sort::Size:
+        sqlite3_bind_int64(st, 1, q.hasCursor ? std::stoll(q.afterKey) : -1);
+        sqlite3_bind_int64(st, 2, q.hasCursor ? q.afterId : -1);
+        break;
+    }
+    sqlite3_bind_int(st, 3, q.limit);
+    if (filtered) sqlite3_bind_text(st, 4, q.pattern.c_str(), -1, SQLITE_TRANSIENT);
+
+    while (sqlite3_step(st) == SQLITE_ROW) {
+        FileRow r{};
+        readFileRow(st, r);
+        rows.push_back(std::move(r));
+    }
+    return rows;
 }
 
-bool MetadataStore::updateFileChecksum(int file_id, const std::string& checksum) {
-    const char* sql = "UPDATE files SET checksum=? WHERE file_id=?;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-    sqlite3_bind_text(st, 1, checksum.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(st, 2, file_id);
-    bool ok = sqlite3_step(st) == SQLITE_DONE;
-    sqlite3_finalize(st);
-    return ok;
+void MetadataStore::fileChanged(int file_id) {
+    cache_->invalidate(file_id);
+    catalogVersion_.fetch_add(1, std::memory_order_release);
 }
 
-bool MetadataStore::incrementDownloadCount(int file_id) {
-    const char* sql = "UPDATE files SET download_count=download_count+1 WHERE file_id=?;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-    sqlite3_bind_int(st, 1, file_id);
-    bool ok = sqlite3_step(st) == SQLITE_DONE;
-    sqlite3_finalize(st);
-    return ok;
+MetadataStore::Ticket MetadataStore::updateFileSize(int file_id, uint64_t size) {
+    // The bytes changed, so a digest kept for them no longer holds.
+    static const char* sql = "UPDATE files SET size=?,sha256=NULL WHERE file_id=?;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_int64(st, 1, to_i64(size));
+        sqlite3_bind_int(st, 2, file_id);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, file_id]() { fileChanged(file_id); });
 }
 
-bool MetadataStore::upsertResume(const std::string& resume_id, int file_id, uint64_t offset, uint32_t chunk_size) {
-    const char* sql =
+MetadataStore::Ticket MetadataStore::updateFileChecksum(int file_id, const std::string& checksum) {
+    static const char* sql = "UPDATE files SET checksum=? WHERE file_id=?;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, checksum.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(st, 2, file_id);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, file_id]() { fileChanged(file_id); });
+}
+
+MetadataStore::Ticket MetadataStore::publishFile(int file_id, uint64_t size, const std::string& checksum) {
+    static const char* sql =
+        "UPDATE files SET size=?,checksum=?,pending=0,uploaded_at=CURRENT_TIMESTAMP WHERE file_id=? AND pending=1;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_int64(st, 1, to_i64(size));
+        sqlite3_bind_text(st, 2, checksum.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(st, 3, file_id);
+        return sqlite3_step(st) == SQLITE_DONE && sqlite3_changes(c.db) == 1;
+    }, [this, file_id]() { fileChanged(file_id); });
+}
+
+MetadataStore::Ticket MetadataStore::discardFile(int file_id) {
+    static const char* hashSql =
+        "DELETE FROM block_hashes WHERE file_id=?1 AND EXISTS "
+        "(SELECT 1 FROM files WHERE file_id=?1 AND pending=1);";
+    static const char* fileSql = "DELETE FROM files WHERE file_id=? AND pending=1;";
+    return enqueue([=](Conn& c) {
+        Stmt hashes(c.prepare(hashSql));
+        if (!hashes) return false;
+        sqlite3_bind_int(hashes, 1, file_id);
+        if (sqlite3_step(hashes) != SQLITE_DONE) return false;
+        Stmt st(c.prepare(fileSql));
+        if (!st) return false;
+        sqlite3_bind_int(st, 1, file_id);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+std::future<std::vector<int>> MetadataStore::dropPendingFiles() {
+    static const char* listSql = "SELECT file_id FROM files WHERE pending=1;";
+    static const char* hashSql =
+        "DELETE FROM block_hashes WHERE file_id IN (SELECT file_id FROM files WHERE pending=1);";
+    static const char* fileSql = "DELETE FROM files WHERE pending=1;";
+    auto ids = std::make_shared<std::vector<int>>();
+    Ticket t = enqueue([ids](Conn& c) {
+        Stmt list(c.prepare(listSql));
+        if (!list) return false;
+        while (sqlite3_step(list) == SQLITE_ROW) ids->push_back(sqlite3_column_int(list, 0));
+        for (const char* sql : { hashSql, fileSql }) {
+            Stmt st(c.prepare(sql));
+            if (!st || sqlite3_step(st) != SQLITE_DONE) return false;
+        }
+        return true;
+    });
+    return std::async(std::launch::deferred, [t, ids]() {
+        if (!t.get()) throw std::runtime_error("dropPendingFiles failed");
+        return std::move(*ids);
+    });
+}
+
+void MetadataStore::incrementDownloadCount(int file_id) {
+    {
+        std::lock_guard<std::mutex> lock(queueMu_);
+        ++downloadCounts_[file_id];
+    }
+    queueCv_.notify_one();
+}
+
+MetadataStore::Ticket MetadataStore::upsertResume(const std::string& resume_id, int file_id, uint64_t offset, uint32_t chunk_size) {
+    static const char* sql =
         "INSERT INTO resume(resume_id,file_id,offset,chunk_size) VALUES(?,?,?,?) "
         "ON CONFLICT(resume_id) DO UPDATE SET "
         "  file_id=excluded.file_id, offset=excluded.offset, chunk_size=excluded.chunk_size, "
         "  timestamp=CURRENT_TIMESTAMP;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-    sqlite3_bind_text(st, 1, resume_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(st, 2, file_id);
-    sqlite3_bind_int64(st, 3, to_i64(offset));
-    sqlite3_bind_int(st, 4, static_cast<int>(chunk_size));
-    bool ok = sqlite3_step(st) == SQLITE_DONE;
-    sqlite3_finalize(st);
-    return ok;
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, resume_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(st, 2, file_id);
+        sqlite3_bind_int64(st, 3, to_i64(offset));
+        sqlite3_bind_int(st, 4, static_cast<int>(chunk_size));
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
 }
 
 bool MetadataStore::getResume(const std::string& resume_id, ResumeRow& out) {
-    const char* sql =
+    static const char* sql =
         "SELECT resume_id,file_id,offset,chunk_size,timestamp FROM resume WHERE resume_id=?;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return false;
     sqlite3_bind_text(st, 1, resume_id.c_str(), -1, SQLITE_TRANSIENT);
 
     bool ok = false;
@@ -186,17 +585,377 @@ bool MetadataStore::getResume(const std::string& resume_id, ResumeRow& out) {
         out.timestamp = reinterpret_cast<const char*>(sqlite3_column_text(st, 4));
         ok = true;
     }
-    sqlite3_finalize(st);
     return ok;
 }
 
-bool MetadataStore::deleteResume(const std::string& resume_id) {
-    const char* sql = "DELETE FROM resume WHERE resume_id=?;";
-    sqlite3_stmt* st{};
-    if (sqlite3_prepare_v2(db_, sql, -1, &st, nullptr) != SQLITE_OK) return false;
-    sqlite3_bind_text(st, 1, resume_id.c_str(), -1, SQLITE_TRANSIENT);
-    bool ok = (sqlite3_step(st) == SQLITE_DONE);
-    sqlite3_finalize(st);
-    return ok;
+MetadataStore::Ticket MetadataStore::deleteResume(const std::string& resume_id) {
+    static const char* sql = "DELETE FROM resume WHERE resume_id=?;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, resume_id.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+bool MetadataStore::getBlob(const std::string& hash, uint64_t& size) {
+    static const char* sql = "SELECT size FROM blobs WHERE hash=? AND refcount>0;";
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return false;
+    sqlite3_bind_text(st, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(st) != SQLITE_ROW) return false;
+    size = static_cast<uint64_t>(sqlite3_column_int64(st, 0));
+    return true;
+}
+
+MetadataStore::Ticket MetadataStore::adoptBlob(int file_id, const std::string& hash, uint64_t size) {
+    static const char* blobSql =
+        "INSERT INTO blobs(hash,size,refcount) VALUES(?,?,1) "
+        "ON CONFLICT(hash) DO UPDATE SET refcount=refcount+1;";
+    static const char* fileSql = "UPDATE files SET content_hash=? WHERE file_id=? AND content_hash IS NULL;";
+    return enqueue([=](Conn& c) {
+        {
+            Stmt st(c.prepare(fileSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(st, 2, file_id);
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+        }
+        Stmt st(c.prepare(blobSql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(st, 2, to_i64(size));
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, file_id]() { fileChanged(file_id); });
 }
 
+MetadataStore::Ticket MetadataStore::recordSha256(int file_id, const std::string& hash) {
+    static const char* sql = "UPDATE files SET sha256=? WHERE file_id=? AND content_hash IS NULL;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(st, 2, file_id);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+std::optional<std::string> MetadataStore::getSha256(int file_id) {
+    static const char* sql = "SELECT sha256 FROM files WHERE file_id=? AND sha256 IS NOT NULL;";
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return std::nullopt;
+    sqlite3_bind_int(st, 1, file_id);
+    if (sqlite3_step(st) != SQLITE_ROW) return std::nullopt;
+    return std::string(reinterpret_cast<const char*>(sqlite3_column_text(st, 0)));
+}
+
+std::vector<PackedBlobRow> MetadataStore::listPackableBlobs(uint64_t maxSize) {
+    static const char* sql =
+        "SELECT hash,size,segment,seg_offset FROM blobs WHERE refcount>0 AND (segment IS NOT NULL OR size<=?);";
+    std::vector<PackedBlobRow> rows;
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return rows;
+    sqlite3_bind_int64(st, 1, to_i64(maxSize));
+    while (sqlite3_step(st) == SQLITE_ROW) {
+        PackedBlobRow r;
+        r.hash = reinterpret_cast<const char*>(sqlite3_column_text(st, 0));
+        r.size = static_cast<uint64_t>(sqlite3_column_int64(st, 1));
+        if (sqlite3_column_type(st, 2) != SQLITE_NULL) {
+            r.segment = static_cast<uint32_t>(sqlite3_column_int64(st, 2));
+            r.offset = static_cast<uint64_t>(sqlite3_column_int64(st, 3));
+        }
+        rows.push_back(std::move(r));
+    }
+    return rows;
+}
+
+MetadataStore::Ticket MetadataStore::setBlobLocation(const std::string& hash, uint32_t segment, uint64_t offset) {
+    static const char* sql = "UPDATE blobs SET segment=?, seg_offset=? WHERE hash=? AND refcount>0;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_int64(st, 1, static_cast<int64_t>(segment));
+        sqlite3_bind_int64(st, 2, to_i64(offset));
+        sqlite3_bind_text(st, 3, hash.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE && sqlite3_changes(c.db) == 1;
+    });
+}
+
+void MetadataStore::insertDuplicate(const std::string& name, const std::string& hash, uint64_t size,
+                                    std::function<void(int)> done) {
+    static const char* refSql = "UPDATE blobs SET refcount=refcount+1 WHERE hash=? AND size=? AND refcount>0;";
+    static const char* fileSql =
+        "INSERT INTO files(name,size,checksum,content_hash) "
+        "SELECT ?1,size,checksum,content_hash FROM files WHERE content_hash=?2 ORDER BY file_id LIMIT 1;";
+    static const char* blocksSql =
+        "INSERT INTO block_hashes(file_id,block_size,root,leaves) "
+        "SELECT ?1,block_size,root,leaves FROM block_hashes WHERE file_id="
+        "(SELECT file_id FROM files WHERE content_hash=?2 AND file_id<>?1 ORDER BY file_id LIMIT 1);";
+    auto id = std::make_shared<int>(-1);
+    enqueue([=](Conn& c) {
+        {
+            Stmt st(c.prepare(refSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(st, 2, to_i64(size));
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+        }
+        {
+            Stmt st(c.prepare(fileSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(st, 2, hash.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+            *id = static_cast<int>(sqlite3_last_insert_rowid(c.db));
+        }
+        Stmt st(c.prepare(blocksSql));
+        if (!st) return false;
+        sqlite3_bind_int(st, 1, *id);
+        sqlite3_bind_text(st, 2, hash.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, name]() {
+        cache_->invalidateName(name);
+        catalogVersion_.fetch_add(1, std::memory_order_release);
+    }, [id, done](bool ok) { done(ok ? *id : -1); });
+}
+
+MetadataStore::Ticket MetadataStore::withdrawDuplicate(int file_id, const std::string& hash) {
+    static const char* refSql = "UPDATE blobs SET refcount=refcount-1 WHERE hash=? AND refcount>1;";
+    static const char* fileSql = "DELETE FROM files WHERE file_id=? AND content_hash=?;";
+    static const char* blocksSql = "DELETE FROM block_hashes WHERE file_id=?;";
+    return enqueue([=](Conn& c) {
+        {
+            Stmt st(c.prepare(refSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+        }
+        {
+            Stmt st(c.prepare(fileSql));
+            if (!st) return false;
+            sqlite3_bind_int(st, 1, file_id);
+            sqlite3_bind_text(st, 2, hash.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+        }
+        Stmt st(c.prepare(blocksSql));
+        if (!st) return false;
+        sqlite3_bind_int(st, 1, file_id);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, file_id]() { fileChanged(file_id); });
+}
+
+std::future<std::optional<std::string>> MetadataStore::replaceContent(int file_id, uint64_t size,
+    const std::string& checksum, std::optional<std::string> hash, const BlockHashRow& blocks) {
+    static const char* oldSql = "SELECT content_hash FROM files WHERE file_id=?;";
+    static const char* fileSql =
+        "UPDATE files SET size=?,checksum=?,content_hash=?,sha256=NULL,uploaded_at=CURRENT_TIMESTAMP "
+        "WHERE file_id=?;";
+    static const char* refSql =
+        "INSERT INTO blobs(hash,size,refcount) VALUES(?,?,1) "
+        "ON CONFLICT(hash) DO UPDATE SET refcount=refcount+1;";
+    static const char* unrefSql = "UPDATE blobs SET refcount=refcount-1 WHERE hash=?;";
+    static const char* dropSql = "DELETE FROM blobs WHERE hash=? AND refcount<=0;";
+    static const char* blocksSql =
+        "INSERT OR REPLACE INTO block_hashes(file_id,block_size,root,leaves) VALUES(?,?,?,?);";
+    auto released = std::make_shared<std::optional<std::string>>();
+    Ticket t = enqueue([=](Conn& c) {
+        released->reset();
+        std::optional<std::string> old;
+        {
+            Stmt st(c.prepare(oldSql));
+            if (!st) return false;
+            sqlite3_bind_int(st, 1, file_id);
+            if (sqlite3_step(st) != SQLITE_ROW) return false;
+            if (sqlite3_column_type(st, 0) != SQLITE_NULL)
+                old = std::string(reinterpret_cast<const char*>(sqlite3_column_text(st, 0)));
+        }
+        {
+            Stmt st(c.prepare(fileSql));
+            if (!st) return false;
+            sqlite3_bind_int64(st, 1, to_i64(size));
+            sqlite3_bind_text(st, 2, checksum.c_str(), -1, SQLITE_TRANSIENT);
+            if (hash) sqlite3_bind_text(st, 3, hash->c_str(), -1, SQLITE_TRANSIENT);
+            else sqlite3_bind_null(st, 3);
+            sqlite3_bind_int(st, 4, file_id);
+            if (sqlite3_step(st) != SQLITE_DONE) return false;
+        }
+        if (hash) {
+            Stmt st(c.prepare(refSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, hash->c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(st, 2, to_i64(size));
+            if (sqlite3_step(st) != SQLITE_DONE) return false;
+        }
+        if (old) {
+            {
+                Stmt st(c.prepare(unrefSql));
+                if (!st) return false;
+                sqlite3_bind_text(st, 1, old->c_str(), -1, SQLITE_TRANSIENT);
+                if (sqlite3_step(st) != SQLITE_DONE) return false;
+            }
+            Stmt st(c.prepare(dropSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, old->c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) != SQLITE_DONE) return false;
+            if (sqlite3_changes(c.db) == 1) *released = old;
+        }
+        Stmt st(c.prepare(blocksSql));
+        if (!st) return false;
+        sqlite3_bind_int(st, 1, file_id);
+        sqlite3_bind_int64(st, 2, blocks.block_size);
+        sqlite3_bind_int64(st, 3, blocks.root);
+        sqlite3_bind_blob(st, 4, blocks.leaves.data(), static_cast<int>(blocks.leaves.size() * sizeof(uint32_t)),
+                          SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, file_id]() { fileChanged(file_id); });
+    return std::async(std::launch::deferred, [t, released]() {
+        if (!t.get()) throw std::runtime_error("replaceContent failed");
+        return *released;
+    });
+}
+
+MetadataStore::Ticket MetadataStore::putBlockHashes(const BlockHashRow& row) {
+    static const char* sql =
+        "INSERT OR REPLACE INTO block_hashes(file_id,block_size,root,leaves) VALUES(?,?,?,?);";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_int(st, 1, row.file_id);
+        sqlite3_bind_int64(st, 2, row.block_size);
+        sqlite3_bind_int64(st, 3, row.root);
+        // Leaves are stored as a packed little-endian uint32 array.
+        sqlite3_bind_blob(st, 4, row.leaves.data(), static_cast<int>(row.leaves.size() * sizeof(uint32_t)),
+                          SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+bool MetadataStore::getBlockHashes(int file_id, BlockHashRow& out) {
+    static const char* sql = "SELECT block_size,root,leaves FROM block_hashes WHERE file_id=?;";
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return false;
+    sqlite3_bind_int(st, 1, file_id);
+    if (sqlite3_step(st) != SQLITE_ROW) return false;
+    out.file_id = file_id;
+    out.block_size = static_cast<uint32_t>(sqlite3_column_int64(st, 0));
+    out.root = static_cast<uint32_t>(sqlite3_column_int64(st, 1));
+    const void* blob = sqlite3_column_blob(st, 2);
+    size_t bytes = static_cast<size_t>(sqlite3_column_bytes(st, 2));
+    out.leaves.resize(bytes / sizeof(uint32_t));
+    if (blob && bytes) std::memcpy(out.leaves.data(), blob, out.leaves.size() * sizeof(uint32_t));
+    return true;
+}
+
+MetadataStore::Ticket MetadataStore::insertUploadSession(const UploadSessionRow& row) {
+    static const char* sql = "INSERT INTO upload_sessions(upload_id,name,size,ranges) VALUES(?,?,?,?);";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, row.upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(st, 2, row.name.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(st, 3, to_i64(row.size));
+        sqlite3_bind_text(st, 4, row.ranges.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+MetadataStore::Ticket MetadataStore::updateUploadRanges(const std::string& upload_id, const std::string& ranges) {
+    static const char* sql = "UPDATE upload_sessions SET ranges=? WHERE upload_id=?;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, ranges.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(st, 2, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+std::future<int> MetadataStore::commitUploadSession(const std::string& upload_id, const std::string& name,
+                                                   std::optional<std::string> checksum) {
+    static const char* insertSql =
+        "INSERT INTO files(name,size,checksum) SELECT name,size,? FROM upload_sessions "
+        "WHERE upload_id=? AND file_id IS NULL;";
+    static const char* markSql = "UPDATE upload_sessions SET file_id=? WHERE upload_id=?;";
+    auto id = std::make_shared<int>(-1);
+    Ticket t = enqueue([=](Conn& c) {
+        {
+            Stmt st(c.prepare(insertSql));
+            if (!st) return false;
+            if (checksum.has_value()) sqlite3_bind_text(st, 1, checksum->c_str(), -1, SQLITE_TRANSIENT);
+            else sqlite3_bind_null(st, 1);
+            sqlite3_bind_text(st, 2, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+            *id = static_cast<int>(sqlite3_last_insert_rowid(c.db));
+        }
+        Stmt st(c.prepare(markSql));
+        if (!st) return false;
+        sqlite3_bind_int(st, 1, *id);
+        sqlite3_bind_text(st, 2, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }, [this, name]() {
+        cache_->invalidateName(name);
+        catalogVersion_.fetch_add(1, std::memory_order_release);
+    });
+    return std::async(std::launch::deferred, [t, id]() {
+        if (!t.get()) throw std::runtime_error("commitUploadSession failed");
+        return *id;
+    });
+}
+
+MetadataStore::Ticket MetadataStore::rollbackUploadSession(const std::string& upload_id, int file_id,
+                                                           const std::string& name) {
+    static const char* reopenSql = "UPDATE upload_sessions SET file_id=NULL WHERE upload_id=? AND file_id=?;";
+    static const char* hashSql = "DELETE FROM block_hashes WHERE file_id=?;";
+    static const char* fileSql = "DELETE FROM files WHERE file_id=?;";
+    return enqueue([=](Conn& c) {
+        {
+            Stmt st(c.prepare(reopenSql));
+            if (!st) return false;
+            sqlite3_bind_text(st, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(st, 2, file_id);
+            if (sqlite3_step(st) != SQLITE_DONE || sqlite3_changes(c.db) != 1) return false;
+        }
+        for (const char* sql : { hashSql, fileSql }) {
+            Stmt st(c.prepare(sql));
+            if (!st) return false;
+            sqlite3_bind_int(st, 1, file_id);
+            if (sqlite3_step(st) != SQLITE_DONE) return false;
+        }
+        return true;
+    }, [this, file_id, name]() {
+        fileChanged(file_id);
+        cache_->invalidateName(name);
+    });
+}
+
+MetadataStore::Ticket MetadataStore::deleteUploadSession(const std::string& upload_id) {
+    static const char* sql = "DELETE FROM upload_sessions WHERE upload_id=?;";
+    return enqueue([=](Conn& c) {
+        Stmt st(c.prepare(sql));
+        if (!st) return false;
+        sqlite3_bind_text(st, 1, upload_id.c_str(), -1, SQLITE_TRANSIENT);
+        return sqlite3_step(st) == SQLITE_DONE;
+    });
+}
+
+std::vector<UploadSessionRow> MetadataStore::listUploadSessions() {
+    static const char* sql = "SELECT upload_id,name,size,ranges,file_id FROM upload_sessions;";
+    std::vector<UploadSessionRow> rows;
+    ReadLease conn(*this);
+    Stmt st(conn->prepare(sql));
+    if (!st) return rows;
+    while (sqlite3_step(st) == SQLITE_ROW) {
+        UploadSessionRow r;
+        r.upload_id = reinterpret_cast<const char*>(sqlite3_column_text(st, 0));
+        r.name = reinterpret_cast<const char*>(sqlite3_column_text(st, 1));
+        r.size = static_cast<uint64_t>(sqlite3_column_int64(st, 2));
+        r.ranges = reinterpret_cast<const char*>(sqlite3_column_text(st, 3));
+        if (sqlite3_column_type(st, 4) != SQLITE_NULL) r.file_id = sqlite3_column_int(st, 4);
+        rows.push_back(std::move(r));
+    }
+    return rows;
+}
@@ -4,6 +4,19 @@
 #include <optional>
 #include <filesystem>
 #include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+struct sqlite3;
+struct sqlite3_stmt;
+class FileCache;
 
 struct FileRow {
     int         file_id{};
@@ -12,6 +25,9 @@ struct FileRow {
     std::optional<std::string> checksum;
     std::string uploaded_at;
     int         download_count{};
+    // SHA-256 (hex) of the blob under blobs/ holding the bytes; unset for
+    // files stored as <file_id>.bin.
+    std::optional<std::string> content_hash;
 };
 
 struct ResumeRow {
@@ -22,25 +38,213 @@ struct ResumeRow {
     std::string timestamp;
 };
 
+// Per-block CRC-32C leaves of a file and their Merkle root (see
+// common/blockhash.hpp).
+struct BlockHashRow {
+    int         file_id{};
+    uint32_t    block_size{};
+    uint32_t    root{};
+    std::vector<uint32_t> leaves;
+};
+
+// A chunked upload that has not been committed yet. `ranges` lists the
+// received byte ranges as "start-end,..." (end exclusive). `file_id` is set
+// by the commit transaction; a row that still has one after a restart is a
+// commit whose blob rename did not happen yet.
+struct UploadSessionRow {
+    std::string upload_id;
+    std::string name;
+    uint64_t    size{};
+    std::string ranges;
+    std::optional<int> file_id;
+};
+
+// A blob for the segment tier (see SegmentStore): `segment` is set once
+// its bytes live at `offset` in that segment rather than under blobs/.
+struct PackedBlobRow {
+    std::string hash;
+    uint64_t    size{};
+    std::optional<uint32_t> segment;
+    uint64_t    offset{};
+};
+
+// One page of a keyset-paginated listing. The cursor is the sort key and
+// file_id of the last row of the previous page.
+struct ListQuery {
+    enum class Sort { Newest, Name, Size };
+    Sort        sort = Sort::Newest;
+    std::string pattern;        // GLOB on name; empty matches everything
+    bool        hasCursor = false;
+    std::string afterKey;       // uploaded_at, name or size (decimal)
+    int64_t     afterId = 0;
+    int         limit = 1000;
+};
+
+// SQLite-backed catalog. One writer connection plus a small pool of
+// read-only connections (WAL lets them read while the writer commits).
+// Every connection keeps its prepared statements for its whole lifetime.
+//
+// Mutations are queued to a writer thread that applies them in one
+// transaction per group: every `commitInterval`, or as soon as
+// `commitBatch` are waiting. Each returns a Ticket that becomes ready once
+// its group has committed; callers that don't need durability drop it.
+//
+// File rows are served from a FileCache when possible; mutations that touch
+// a row invalidate it once their group has committed.
 class MetadataStore {
 public:
-    explicit MetadataStore(const std::filesystem::path& db_path);
+    using Ticket = std::shared_future<bool>;
+
+    struct Options {
+        unsigned readers = 4;
+        std::chrono::milliseconds commitInterval{ 5 };
+        size_t commitBatch = 256;
+        size_t cacheEntries = 65536;    // 0 disables the file-row cache
+    };
+
+    MetadataStore(const std::filesystem::path& db_path, const Options& opts);
     ~MetadataStore();
 
+    // Rows added by insertFile(s) are pending: they hold their name but are
+    // left out of every lookup and listing until publishFile, once the
+    // bytes are in. discardFile drops one that never got them, and
+    // dropPendingFiles, at startup, all those a restart cut short, yielding
+    // their ids so the blobs can go too.
+    std::future<int> insertFileAsync(const std::string& name, uint64_t size, std::optional<std::string> checksum);
+    // Calls `done` on the writer thread once the insert's group is over,
+    // with the new id or -1, for callers that must not wait on the commit.
+    // It must not wait on the store itself.
+    void insertFileAsync(const std::string& name, uint64_t size, std::optional<std::string> checksum,
+                         std::function<void(int)> done);
+    // Waits for the commit; throws if the insert failed.
     int  insertFile(const std::string& name, uint64_t size, std::optional<std::string> checksum);
+    // Adds many files in one transaction (MPUT). A name that is already
+    // taken gets -1 instead of an id and the others still go in. `done` is
+    // called on the writer thread as for insertFileAsync, with the ids, or
+    // none at all if the transaction failed.
+    void insertFiles(const std::vector<std::pair<std::string, uint64_t>>& files,
+                     std::function<void(std::vector<int>)> done);
+    Ticket publishFile(int file_id, uint64_t size, const std::string& checksum);
+    Ticket discardFile(int file_id);
+    std::future<std::vector<int>> dropPendingFiles();
+    // download_count in a cached row may lag the table.
     bool getFile(int file_id, FileRow& out);
+    bool getFileByName(const std::string& name, FileRow& out);
     std::vector<FileRow> listFilesNewestFirst(int limit = 1000);
-    bool updateFileSize(int file_id, uint64_t size);
-    bool updateFileChecksum(int file_id, const std::string& checksum);
-    bool incrementDownloadCount(int file_id);
-    bool upsertResume(const std::string& resume_id, int file_id, uint64_t offset, uint32_t chunk_size);
+    std::vector<FileRow> listFiles(const ListQuery& q);
+    // Bumped after every commit that adds a file or changes its size or
+    // checksum (not download counts); lets listings be cached.
+    uint64_t catalogVersion() const { return catalogVersion_.load(std::memory_order_acquire); }
+    Ticket updateFileSize(int file_id, uint64_t size);
+    Ticket updateFileChecksum(int file_id, const std::string& checksum);
+    // Summed in memory and applied as one UPDATE per file per group.
+    void incrementDownloadCount(int file_id);
+    Ticket upsertResume(const std::string& resume_id, int file_id, uint64_t offset, uint32_t chunk_size);
     bool getResume(const std::string& resume_id, ResumeRow& out);
-    bool deleteResume(const std::string& resume_id);
+    Ticket deleteResume(const std::string& resume_id);
+
+    // Deduplicated blobs. getBlob reports a stored blob's size. adoptBlob
+    // takes a reference for `file_id` (the first one creates the row).
+    // insertDuplicate adds a file for an existing blob, with the checksum
+    // and block hashes of a file already referencing it, and calls `done`
+    // on the writer thread with the new file_id or -1, as insertFileAsync.
+    // recordSha256 keeps the digest of a file not yet adopted, so hashing it
+    // again can be skipped; getSha256 reads it back.
+    bool getBlob(const std::string& hash, uint64_t& size);
+    Ticket adoptBlob(int file_id, const std::string& hash, uint64_t size);
+    void insertDuplicate(const std::string& name, const std::string& hash, uint64_t size,
+                         std::function<void(int)> done);
+    // Takes back a duplicate whose client never heard of it: drops the file
+    // and its reference, provided another file still holds the blob (the
+    // blob itself can't be deleted from the writer thread). Fails otherwise
+    // and the file stays.
+    Ticket withdrawDuplicate(int file_id, const std::string& hash);
+    Ticket recordSha256(int file_id, const std::string& hash);
+    std::optional<std::string> getSha256(int file_id);
+
+    // Gives an existing file new contents in one transaction: size,
+    // checksum, block hashes and content hash, moving blob references from
+    // the old hash to the new one. The future yields the old hash if this
+    // dropped its blob's last reference (the blob file can go), or throws.
+    std::future<std::optional<std::string>> replaceContent(int file_id, uint64_t size, const std::string& checksum,
+                                                           std::optional<std::string> hash, const BlockHashRow& blocks);
+
+    // Blobs already in a segment, plus the unpacked ones of at most
+    // `maxSize` bytes. setBlobLocation fails if the blob has no row left.
+    std::vector<PackedBlobRow> listPackableBlobs(uint64_t maxSize);
+    Ticket setBlobLocation(const std::string& hash, uint32_t segment, uint64_t offset);
+
+    Ticket putBlockHashes(const BlockHashRow& row);
+    bool getBlockHashes(int file_id, BlockHashRow& out);
+
+    Ticket insertUploadSession(const UploadSessionRow& row);
+    Ticket updateUploadRanges(const std::string& upload_id, const std::string& ranges);
+    // Inserts the files row and marks the session committed in one
+    // transaction; the future yields the new file_id or throws. `name` is
+    // the session's, for cache invalidation.
+    std::future<int> commitUploadSession(const std::string& upload_id, const std::string& name,
+                                         std::optional<std::string> checksum);
+    // Undoes commitUploadSession when the blob rename fails: the files row
+    // goes and the session is open again.
+    Ticket rollbackUploadSession(const std::string& upload_id, int file_id, const std::string& name);
+    Ticket deleteUploadSession(const std::string& upload_id);
+    std::vector<UploadSessionRow> listUploadSessions();
 
+    uint64_t commitCount() const { return commits_.load(); }
+    uint64_t writeCount() const { return writes_.load(); }
+    const FileCache& cache() const { return *cache_; }
 
 private:
-    struct sqlite3* db_{};
+    struct Conn {
+        sqlite3* db{};
+        // Keyed by the SQL literal's address: every call site passes the same
+        // static string, so the lookup never hashes statement text.
+        std::unordered_map<const char*, sqlite3_stmt*> stmts;
 
-    void exec(const char* sql);
+        ~Conn();
+        sqlite3_stmt* prepare(const char* sql);
+    };
+    class Stmt;
+    class ReadLease;
+
+    struct PendingWrite {
+        std::function<bool(Conn&)> apply;
+        std::function<void()> onCommit;     // runs after a successful commit
+        std::function<void(bool)> then;     // runs after the group either way
+        std::promise<bool> done;
+    };
+
+    Conn writer_;   // touched only by the constructor and the writer thread
+
+    std::vector<std::unique_ptr<Conn>> readers_;
+    std::vector<Conn*> idleReaders_;
+    std::mutex poolMu_;
+    std::condition_variable poolCv_;
+
+    std::unique_ptr<FileCache> cache_;
+
+    std::chrono::milliseconds commitInterval_;
+    size_t commitBatch_;
+    std::mutex queueMu_;
+    std::condition_variable queueCv_;
+    std::vector<PendingWrite> queue_;
+    std::unordered_map<int, int> downloadCounts_;
+    bool stop_ = false;
+    std::thread writerThread_;
+    std::atomic<uint64_t> commits_{0};
+    std::atomic<uint64_t> writes_{0};
+    std::atomic<uint64_t> catalogVersion_{0};
+
+    static void open(Conn& c, const std::filesystem::path& db_path, bool readOnly);
+    static void exec(sqlite3* db, const char* sql);
     void ensureSchema();
+
+    Ticket enqueue(std::function<bool(Conn&)> apply, std::function<void()> onCommit = {},
+                   std::function<void(bool)> then = {});
+    Ticket enqueueInsertFile(const std::string& name, uint64_t size, std::optional<std::string> checksum,
+                             std::shared_ptr<int> id, std::function<void(bool)> then);
+    bool queryFile(const char* sql, const std::string* name, int file_id, FileRow& out);
+    void fileChanged(int file_id);
+    void writerLoop();
+    void commitGroup(std::vector<PendingWrite>& batch, std::unordered_map<int, int>& downloads);
 };
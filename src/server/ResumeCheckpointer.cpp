@@ -0,0 +1,129 @@
+#include "ResumeCheckpointer.hpp"
+#include "ServerStats.hpp"
+
+#include <vector>
+
+ResumeCheckpointer::ResumeCheckpointer(MetadataStore& meta, ServerStats& stats,
+                                       std::chrono::milliseconds interval, uint64_t byteInterval)
+    : meta_(meta), stats_(stats), interval_(interval), byteInterval_(byteInterval)
+{
+    flusher_ = std::thread([this]() { flushLoop(); });
+}
+
+ResumeCheckpointer::~ResumeCheckpointer() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    flusher_.join();
+    persistDirty();
+}
+
+void ResumeCheckpointer::record(const std::string& resume_id, int file_id, uint64_t offset, uint32_t chunk_size) {
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        Entry& e = entries_[resume_id];
+        e.file_id = file_id;
+        e.offset = offset;
+        e.chunk_size = chunk_size;
+        e.dirty = true;
+        e.active = true;
+        if (offset < e.persisted || offset - e.persisted >= byteInterval_) {
+            urgent_ = true;
+            wake = true;
+        }
+    }
+    if (wake) cv_.notify_one();
+}
+
+bool ResumeCheckpointer::lookup(const std::string& resume_id, ResumeRow& out) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = entries_.find(resume_id);
+        if (it != entries_.end()) {
+            out.resume_id = resume_id;
+            out.file_id = it->second.file_id;
+            out.offset = it->second.offset;
+            out.chunk_size = it->second.chunk_size;
+            return true;
+        }
+        // Dropped by a flush whose write hasn't committed yet.
+        auto f = inFlight_.find(resume_id);
+        if (f != inFlight_.end()) {
+            out = f->second;
+            return true;
+        }
+    }
+    return meta_.getResume(resume_id, out);
+}
+
+void ResumeCheckpointer::release(const std::string& resume_id) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = entries_.find(resume_id);
+        if (it == entries_.end()) return;
+        it->second.active = false;
+        urgent_ = true;
+    }
+    cv_.notify_one();
+}
+
+void ResumeCheckpointer::complete(const std::string& resume_id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    entries_.erase(resume_id);
+    inFlight_.erase(resume_id);
+    // Queued behind any upsert already issued for this ID, so it wins.
+    meta_.deleteResume(resume_id);
+}
+
+void ResumeCheckpointer::flushLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!stop_) {
+        cv_.wait_for(lock, interval_, [this]() { return stop_ || urgent_; });
+        if (stop_) break;
+        urgent_ = false;
+        lock.unlock();
+        persistDirty();
+        lock.lock();
+    }
+}
+
+// Only ever runs on one thread at a time: the flusher, then the destructor
+// once it has joined.
+void ResumeCheckpointer::persistDirty() {
+    std::vector<std::string> dropped;
+    std::vector<MetadataStore::Ticket> tickets;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            Entry& e = it->second;
+            if (e.dirty) {
+                ResumeRow r{};
+                r.resume_id = it->first;
+                r.file_id = e.file_id;
+                r.offset = e.offset;
+                r.chunk_size = e.chunk_size;
+                // Queued into the metadata writer's next group commit, under
+                // mu_ so a complete() after this queues its delete after it.
+                tickets.push_back(meta_.upsertResume(r.resume_id, r.file_id, r.offset, r.chunk_size));
+                e.dirty = false;
+                e.persisted = e.offset;
+                if (!e.active) {
+                    dropped.push_back(r.resume_id);
+                    inFlight_[r.resume_id] = std::move(r);
+                }
+            }
+            if (!e.active) it = entries_.erase(it);
+            else ++it;
+        }
+    }
+    for (auto& t : tickets) {
+        if (t.get()) ++stats_.resumeWrites;
+    }
+    // The table has them now (or the write failed, and the table is as good
+    // an answer as any).
+    std::lock_guard<std::mutex> lock(mu_);
+    for (const auto& id : dropped) inFlight_.erase(id);
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "MetadataStore.hpp"
+
+struct ServerStats;
+
+// Keeps in-flight download offsets in memory and persists them to the
+// resume table from a background thread: every `interval`, sooner once a
+// transfer has advanced `byteInterval` past its last persisted offset, and
+// when a transfer is released on disconnect. The persisted offset can lag
+// the real one, never lead it, so a crash only costs a re-send.
+class ResumeCheckpointer {
+public:
+    ResumeCheckpointer(MetadataStore& meta, ServerStats& stats,
+                       std::chrono::milliseconds interval, uint64_t byteInterval);
+    ~ResumeCheckpointer();
+
+    ResumeCheckpointer(const ResumeCheckpointer&) = delete;
+    ResumeCheckpointer& operator=(const ResumeCheckpointer&) = delete;
+
+    void record(const std::string& resume_id, int file_id, uint64_t offset, uint32_t chunk_size);
+    bool lookup(const std::string& resume_id, ResumeRow& out);
+    // Transfer interrupted: persist its latest offset and forget it.
+    void release(const std::string& resume_id);
+    // Transfer finished: drop it from memory and from the table.
+    void complete(const std::string& resume_id);
+
+private:
+    struct Entry {
+        int file_id{};
+        uint64_t offset{};
+        uint32_t chunk_size{};
+        uint64_t persisted{};
+        bool dirty{};
+        bool active{};
+    };
+
+    MetadataStore& meta_;
+    ServerStats& stats_;
+    std::chrono::milliseconds interval_;
+    uint64_t byteInterval_;
+
+    // Resume-table writes are queued under mu_, so a completed transfer's
+    // delete always lands after any upsert issued for it. Nothing waits on
+    // the table while holding it.
+    std::mutex mu_;
+    std::unordered_map<std::string, Entry> entries_;
+    // Rows dropped from entries_ whose upsert hasn't committed yet; lookup
+    // answers from here until the table has them.
+    std::unordered_map<std::string, ResumeRow> inFlight_;
+    std::condition_variable cv_;
+    bool urgent_ = false;
+    bool stop_ = false;
+    std::thread flusher_;
+
+    void flushLoop();
+    void persistDirty();
+};
@@ -0,0 +1,359 @@
+#include "SegmentStore.hpp"
+#include "DiskIo.hpp"
+#include "MetadataStore.hpp"
+#include "ServerStats.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iostream>
+
+namespace {
+constexpr size_t PACK_BATCH = 256;      // blobs whose locations commit together
+}
+
+SegmentStore::SegmentStore(MetadataStore& meta, FileManager& fm, ServerStats& stats, const Options& opts)
+    : meta_(meta), fm_(fm), stats_(stats), opts_(opts), dir_(fm.filePath(0).parent_path() / "segments") {
+    load();
+    fm_.setSegments(this);
+    worker_ = std::thread([this]() { workLoop(); });
+}
+
+SegmentStore::~SegmentStore() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    worker_.join();
+    fm_.setSegments(nullptr);
+}
+
+std::filesystem::path SegmentStore::segmentPath(uint32_t id) const {
+    char name[16];
+    std::snprintf(name, sizeof(name), "%08u.seg", static_cast<unsigned>(id));
+    return dir_ / name;
+}
+
+std::shared_ptr<SegmentStore::Segment> SegmentStore::openSegment(uint32_t id, bool create) {
+    // FILE_SHARE_DELETE lets compaction delete a segment that downloads are
+    // still reading; the file goes once the last view lets go of it.
+    // Overlapped so views can be read through DiskIo; BlobFile's own reads
+    // and writes still block, and post nothing to the port.
+    auto seg = std::make_shared<Segment>();
+    seg->id = id;
+    seg->file = BlobFile(CreateFileW(segmentPath(id).wstring().c_str(), GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+        create ? CREATE_NEW : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS | FILE_FLAG_OVERLAPPED,
+        nullptr), true);
+    if (!seg->file) return nullptr;
+    seg->size = create ? 0 : seg->file.size();
+    return seg;
+}
+
+// Rebuilds the index from the blobs table. A segment no row points into is
+// left over from a compaction or a pack that never committed, and goes.
+void SegmentStore::load() {
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    uint32_t maxId = 0;
+    for (auto& row : meta_.listPackableBlobs(opts_.threshold)) {
+        std::shared_ptr<Segment> seg;
+        if (row.segment) {
+            maxId = std::max<uint32_t>(maxId, *row.segment);
+            auto it = segments_.find(*row.segment);
+            if (it != segments_.end()) seg = it->second;
+            else if ((seg = openSegment(*row.segment, false))) segments_[seg->id] = seg;
+        }
+        if (seg && row.offset + row.size <= seg->size) {
+            index_[row.hash] = Extent{ seg, row.offset, row.size };
+            seg->live += row.size;
+        }
+        else {
+            if (row.segment) std::cerr << "segment " << *row.segment << " lacks blob " << row.hash << "\n";
+            // Still under blobs/, if anywhere; packing it again fixes the row.
+            if (row.size <= opts_.threshold) queue_.emplace_back(row.hash, row.size);
+        }
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(dir_, ec)) {
+        const auto& p = entry.path();
+        const std::string stem = p.stem().string();
+        if (p.extension() != ".seg" || stem.empty() ||
+            !std::all_of(stem.begin(), stem.end(), [](unsigned char c) { return std::isdigit(c) != 0; }))
+            continue;
+        uint32_t id = 0;
+        try { id = static_cast<uint32_t>(std::stoul(stem)); }
+        catch (...) { continue; }
+        maxId = std::max<uint32_t>(maxId, id);
+        if (!segments_.count(id)) std::filesystem::remove(p, ec);
+    }
+    nextId_ = maxId + 1;
+    if (!segments_.empty() && segments_.rbegin()->second->size < opts_.segmentBytes) {
+        active_ = segments_.rbegin()->second;
+    }
+    compactDue_ = true;
+    stats_.packedBlobs = index_.size();
+    updateDead();
+}
+
+void SegmentStore::offer(const std::string& hash, uint64_t size) {
+    if (opts_.threshold == 0 || size > opts_.threshold) return;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (pending_.count(hash)) return;
+        queue_.emplace_back(hash, size);
+    }
+    cv_.notify_one();
+}
+
+bool SegmentStore::contains(const std::string& hash) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return index_.count(hash) != 0;
+}
+
+bool SegmentStore::open(const std::string& hash, BlobFile& out) const {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = index_.find(hash);
+    if (it == index_.end()) return false;
+    const Extent& e = it->second;
+    Segment& seg = *e.seg;
+    if (disk_ && !seg.attachTried) {
+        seg.attachTried = true;
+        seg.attached = disk_->attach(seg.file);
+    }
+    out = BlobFile::view(seg.file, e.seg, e.offset, e.size, seg.attached);
+    return true;
+}
+
+void SegmentStore::setDiskIo(DiskIo* disk) {
+    std::lock_guard<std::mutex> lock(mu_);
+    disk_ = disk;
+}
+
+void SegmentStore::release(const std::string& hash) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto p = pending_.find(hash);
+        if (p != pending_.end()) p->second = true;
+        auto it = index_.find(hash);
+        if (it == index_.end()) return;
+        it->second.seg->live -= it->second.size;
+        index_.erase(it);
+        --stats_.packedBlobs;
+        compactDue_ = true;
+    }
+    cv_.notify_one();
+}
+
+void SegmentStore::workLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    for (;;) {
+        cv_.wait(lock, [this]() { return stop_ || !queue_.empty() || compactDue_; });
+        // Queued blobs stay under blobs/ and are queued again at startup.
+        if (stop_) return;
+        std::vector<std::pair<std::string, uint64_t>> jobs;
+        while (!queue_.empty() && jobs.size() < PACK_BATCH) {
+            jobs.push_back(std::move(queue_.front()));
+            queue_.pop_front();
+        }
+        const bool compact = queue_.empty() && compactDue_;
+        if (compact) compactDue_ = false;
+        lock.unlock();
+        try {
+            if (!jobs.empty()) pack(jobs);
+            // One segment at a time, so new blobs don't wait behind a
+            // long compaction.
+            if (compact && compactOne()) {
+                lock.lock();
+                compactDue_ = true;
+                lock.unlock();
+            }
+            updateDead();
+        }
+        catch (const std::exception& ex) {
+            std::cerr << "segment packing failed: " << ex.what() << "\n";
+        }
+        lock.lock();
+    }
+}
+
+void SegmentStore::pack(std::vector<std::pair<std::string, uint64_t>>& jobs) {
+    std::vector<Placement> placed;
+    std::vector<char> data;
+    for (auto& job : jobs) {
+        bool packed = false;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (pending_.count(job.first)) continue;
+            packed = index_.count(job.first) != 0;
+            if (!packed) pending_[job.first] = false;
+        }
+        if (packed) {
+            // Stored again after it was packed.
+            fm_.dropBlobFile(job.first);
+            continue;
+        }
+        Placement p;
+        p.hash = job.first;
+        p.size = job.second;
+        BlobFile f(CreateFileW(fm_.blobPath(p.hash).wstring().c_str(), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+        data.resize(static_cast<size_t>(p.size));
+        size_t got = 0;
+        if (f && f.size() == p.size) {
+            while (got < data.size()) {
+                int64_t n = f.readAt(got, data.data() + got, data.size() - got);
+                if (n <= 0) break;
+                got += static_cast<size_t>(n);
+            }
+        }
+        if (!f || got != data.size() || !append(data, p)) {
+            std::lock_guard<std::mutex> lock(mu_);
+            pending_.erase(p.hash);
+            continue;
+        }
+        placed.push_back(std::move(p));
+    }
+    land(placed, nullptr);
+}
+
+// Moves the live blobs of the deadest sealed segment and deletes it. False
+// if no segment qualifies.
+bool SegmentStore::compactOne() {
+    std::shared_ptr<Segment> from;
+    uint64_t worst = 0;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& [id, seg] : segments_) {
+            if (seg == active_ || seg->size == 0) continue;
+            const uint64_t dead = seg->size - std::min<uint64_t>(seg->live, seg->size);
+            if (dead == 0 || dead * 100 < seg->size * opts_.compactDeadPct) continue;
+            if (!from || dead * from->size > worst * seg->size) {
+                from = seg;
+                worst = dead;
+            }
+        }
+        if (!from) return false;
+    }
+
+    std::vector<Placement> moves;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& [hash, e] : index_) {
+            if (e.seg != from || pending_.count(hash)) continue;
+            pending_[hash] = false;
+            Placement p;
+            p.hash = hash;
+            p.size = e.size;
+            p.from = e.offset;
+            moves.push_back(std::move(p));
+        }
+    }
+    // In file order, so the old segment is read front to back.
+    std::sort(moves.begin(), moves.end(), [](const Placement& a, const Placement& b) { return a.from < b.from; });
+    std::vector<char> data;
+    uint64_t moved = 0;
+    for (auto& p : moves) {
+        data.resize(static_cast<size_t>(p.size));
+        size_t got = 0;
+        while (got < data.size()) {
+            int64_t n = from->file.readAt(p.from + got, data.data() + got, data.size() - got);
+            if (n <= 0) break;
+            got += static_cast<size_t>(n);
+        }
+        if (got == data.size() && append(data, p)) moved += p.size;
+    }
+    land(moves, from);
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (from->live != 0) return false;
+    }
+    segments_.erase(from->id);
+    std::error_code ec;
+    std::filesystem::remove(segmentPath(from->id), ec);
+    ++stats_.segmentCompactions;
+    stats_.segmentBytesMoved += moved;
+    return true;
+}
+
+bool SegmentStore::append(const std::vector<char>& data, Placement& p) {
+    if (!active_ || (active_->size > 0 && active_->size + data.size() > opts_.segmentBytes)) {
+        auto seg = openSegment(nextId_++, true);
+        if (!seg) return false;
+        segments_[seg->id] = seg;
+        active_ = seg;
+    }
+    // A failed write leaves the end where it was; the next append overwrites it.
+    if (!data.empty() && !active_->file.writeAt(active_->size, data.data(), data.size())) return false;
+    p.seg = active_;
+    p.offset = active_->size;
+    active_->size += data.size();
+    p.ok = true;
+    return true;
+}
+
+void SegmentStore::land(std::vector<Placement>& placed, const std::shared_ptr<Segment>& from) {
+    std::vector<Segment*> flushed;
+    for (auto& p : placed) {
+        if (!p.ok) continue;
+        if (std::find(flushed.begin(), flushed.end(), p.seg.get()) == flushed.end()) {
+            flushed.push_back(p.seg.get());
+            if (!FlushFileBuffers(p.seg->file.handle())) {
+                std::cerr << "segment " << p.seg->id << " flush failed\n";
+                for (auto& q : placed) {
+                    if (q.seg == p.seg) q.ok = false;
+                }
+            }
+        }
+    }
+    std::vector<std::pair<size_t, MetadataStore::Ticket>> tickets;
+    for (size_t i = 0; i < placed.size(); ++i) {
+        if (placed[i].ok) tickets.emplace_back(i, meta_.setBlobLocation(placed[i].hash, placed[i].seg->id, placed[i].offset));
+    }
+    for (auto& [i, ticket] : tickets) {
+        try {
+            placed[i].ok = ticket.get();
+        }
+        catch (...) {
+            placed[i].ok = false;
+        }
+    }
+
+    std::vector<std::string> packed;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& p : placed) {
+            auto pend = pending_.find(p.hash);
+            const bool released = pend != pending_.end() && pend->second;
+            if (pend != pending_.end()) pending_.erase(pend);
+            // A released blob's blobs/ file went with its last reference,
+            // and the bytes just written are dead. Should the content have
+            // been stored again meanwhile, its new row may have picked up
+            // the location; the bytes are the same, and the next start
+            // indexes them.
+            if (!p.ok || released) continue;
+            if (from) {
+                auto it = index_.find(p.hash);
+                if (it == index_.end() || it->second.seg != from) continue;
+                from->live -= it->second.size;
+                it->second = Extent{ p.seg, p.offset, p.size };
+            }
+            else {
+                index_[p.hash] = Extent{ p.seg, p.offset, p.size };
+                ++stats_.packedBlobs;
+                stats_.packedBytes += p.size;
+                packed.push_back(p.hash);
+            }
+            p.seg->live += p.size;
+        }
+    }
+    for (const auto& hash : packed) fm_.dropBlobFile(hash);
+}
+
+void SegmentStore::updateDead() {
+    uint64_t dead = 0;
+    std::lock_guard<std::mutex> lock(mu_);
+    for (auto& [id, seg] : segments_) dead += seg->size - std::min<uint64_t>(seg->live, seg->size);
+    stats_.segmentBytesDead = dead;
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "FileManager.hpp"
+
+class DiskIo;
+class MetadataStore;
+struct ServerStats;
+
+// Small-object tier. Blobs up to a size threshold are appended to large
+// segment files under segments/ instead of each keeping its own file under
+// blobs/, and the blobs table records where each one starts. Only
+// content-addressed blobs are packed: they never change, whereas
+// <file_id>.bin is replaced in place by delta sync.
+//
+// Each segment is opened once and every packed blob in it is read through a
+// view of that handle, so a small GET opens no file. New blobs go to the
+// open segment until it reaches its size limit. A blob whose last reference
+// goes leaves dead bytes behind; once a sealed segment is dead enough, its
+// live blobs are copied to the open segment and the file is deleted.
+//
+// Packing and compaction run on one worker thread, the only writer. Bytes
+// are appended and flushed, their location is committed, and only then do
+// readers see it and blobs/<hash>.bin go away, so a crash leaves either the
+// old copy in use or unreferenced bytes that count as dead at the next start.
+class SegmentStore {
+public:
+    struct Options {
+        uint64_t threshold = 64 * 1024;         // blobs up to this size are packed; 0 packs nothing new
+        uint64_t segmentBytes = 256ull << 20;   // a segment is sealed once it would grow past this
+        unsigned compactDeadPct = 50;           // a sealed segment this dead is compacted
+    };
+
+    // Registers itself with `fm` for reads and queues the small blobs not
+    // yet packed.
+    SegmentStore(MetadataStore& meta, FileManager& fm, ServerStats& stats, const Options& opts);
+    ~SegmentStore();
+
+    SegmentStore(const SegmentStore&) = delete;
+    SegmentStore& operator=(const SegmentStore&) = delete;
+
+    // Queues a blob whose row and blobs/ file are in place for packing, if
+    // it is small enough. A packed blob's stray blobs/ copy is deleted.
+    void offer(const std::string& hash, uint64_t size);
+    bool contains(const std::string& hash) const;
+    // A view of a packed blob; false if it is not packed.
+    bool open(const std::string& hash, BlobFile& out) const;
+    // Segments are bound to `disk`'s completion port as views of them are
+    // first opened, so packed blobs can be read through it. Null stops
+    // that, e.g. before `disk` goes away.
+    void setDiskIo(DiskIo* disk);
+    // The blob's row is gone; its bytes are dead.
+    void release(const std::string& hash);
+
+private:
+    struct Segment {
+        uint32_t id = 0;
+        BlobFile file;          // overlapped, for DiskIo; the worker's I/O blocks
+        uint64_t size = 0;      // bytes appended; worker only
+        uint64_t live = 0;      // bytes of readable blobs; under mu_
+        bool attachTried = false;   // under mu_
+        bool attached = false;      // ...to disk_'s completion port
+    };
+    struct Extent {
+        std::shared_ptr<Segment> seg;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+    };
+    // A blob written to a segment whose location is not committed yet.
+    struct Placement {
+        std::string hash;
+        uint64_t size = 0;
+        uint64_t from = 0;      // offset in the segment being compacted
+        std::shared_ptr<Segment> seg;
+        uint64_t offset = 0;
+        bool ok = false;
+    };
+
+    MetadataStore& meta_;
+    FileManager& fm_;
+    ServerStats& stats_;
+    const Options opts_;
+    const std::filesystem::path dir_;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::unordered_map<std::string, Extent> index_;
+    // Blobs being packed or moved, and whether they were released meanwhile.
+    std::unordered_map<std::string, bool> pending_;
+    std::deque<std::pair<std::string, uint64_t>> queue_;
+    bool compactDue_ = false;
+    bool stop_ = false;
+    DiskIo* disk_ = nullptr;
+
+    // Worker only.
+    std::map<uint32_t, std::shared_ptr<Segment>> segments_;
+    std::shared_ptr<Segment> active_;
+    uint32_t nextId_ = 1;
+
+    std::thread worker_;
+
+    void load();
+    std::filesystem::path segmentPath(uint32_t id) const;
+    std::shared_ptr<Segment> openSegment(uint32_t id, bool create);
+    void workLoop();
+    void pack(std::vector<std::pair<std::string, uint64_t>>& jobs);
+    bool compactOne();
+    bool append(const std::vector<char>& data, Placement& p);
+    // Flushes, commits and publishes what was appended; with `from`, only
+    // blobs still located in that segment are moved.
+    void land(std::vector<Placement>& placed, const std::shared_ptr<Segment>& from);
+    void updateDead();
+};
@@ -5,15 +5,27 @@
 #include <iostream>
 #include <ws2tcpip.h>
 #include <filesystem>
-#include <thread>
 #include "MetadataStore.hpp"
 #include "FileManager.hpp"
+#include "IoService.hpp"
+#include "ResumeCheckpointer.hpp"
+#include "ListService.hpp"
+#include "UploadSessions.hpp"
+#include "ContentStore.hpp"
+#include "DeltaSync.hpp"
+#include "BlockCache.hpp"
+#include "DiskIo.hpp"
+#include "SegmentStore.hpp"
+#include "BufferPool.hpp"
+#include "MemoryBudget.hpp"
+#include "BandwidthScheduler.hpp"
+#include "WorkQueue.hpp"
 
 
 namespace fs = std::filesystem;
 
-Server::Server(const std::string& port, const std::filesystem::path& rootDir, const std::filesystem::path& dbPath)
-    : root(rootDir)
+Server::Server(const ServerConfig& config, const std::filesystem::path& dbPath)
+    : root(config.root), config_(config)
 {
     addrinfo hints{};
     hints.ai_family = AF_INET;
@@ -21,7 +33,7 @@ Server::Server(const std::string& port, const std::filesystem::path& rootDir, co
     hints.ai_flags = AI_PASSIVE;
 
     addrinfo* res = nullptr;
-    if (getaddrinfo(nullptr, port.c_str(), &hints, &res) != 0) {
+    if (getaddrinfo(nullptr, config_.port.c_str(), &hints, &res) != 0) {
         throw SocketError("getaddrinfo failed");
     }
 
@@ -45,27 +57,80 @@ Server::Server(const std::string& port, const std::filesystem::path& rootDir, co
         throw SocketError("listen failed");
     }
 
-    meta_ = std::make_unique<MetadataStore>(dbPath);
-    fm_ = std::make_unique<FileManager>(root);
+    MetadataStore::Options metaOpts;
+    metaOpts.readers = config_.dbReaders;
+    metaOpts.commitInterval = std::chrono::milliseconds(config_.groupCommitMs);
+    metaOpts.commitBatch = config_.groupCommitOps;
+    metaOpts.cacheEntries = config_.metaCacheEntries;
+    meta_ = std::make_unique<MetadataStore>(dbPath, metaOpts);
+    fm_ = std::make_unique<FileManager>(root, config_.mappedBlobs);
+    // Uploads a restart cut short.
+    for (int file_id : meta_->dropPendingFiles().get()) fm_->removeFile(file_id);
+    resume_ = std::make_unique<ResumeCheckpointer>(*meta_, stats_,
+        std::chrono::milliseconds(config_.checkpointMs), config_.checkpointBytes);
+    list_ = std::make_unique<ListService>(*meta_);
+    SegmentStore::Options segOpts;
+    segOpts.threshold = config_.packThreshold;
+    segOpts.segmentBytes = config_.segmentBytes;
+    segOpts.compactDeadPct = config_.compactDeadPct;
+    segments_ = std::make_unique<SegmentStore>(*meta_, *fm_, stats_, segOpts);
+    content_ = std::make_unique<ContentStore>(*meta_, *fm_, stats_, *segments_, config_.dedup);
+    uploads_ = std::make_unique<UploadSessions>(*meta_, *fm_, stats_, *content_,
+        std::chrono::hours(config_.uploadSessionHours));
+    delta_ = std::make_unique<DeltaSync>(*meta_, *fm_, stats_, *content_, *segments_);
+    buffers_ = std::make_unique<BufferPool>(config_.bufferPoolBytes);
+    memory_ = std::make_unique<MemoryBudget>(config_.serverMemoryBytes);
+    BandwidthScheduler::Limits rates;
+    rates.global = config_.rateGlobal;
+    rates.conn = config_.rateConn;
+    rates.small = config_.rateSmall;
+    rates.bulk = config_.rateBulk;
+    rates.smallBytes = config_.smallTransferBytes;
+    rates.smallWeight = config_.smallWeight;
+    sendRate_ = std::make_unique<BandwidthScheduler>(rates);
+    recvRate_ = std::make_unique<BandwidthScheduler>(rates);
+    blocks_ = std::make_unique<BlockCache>(config_.blockCacheBytes, *buffers_);
+    io_ = std::make_unique<IoService>(config_.ioThreads);
+    DiskIo::Mode diskMode = DiskIo::Mode::Iocp;
+    DiskIo::parseMode(config_.diskIo, diskMode);
+    disk_ = std::make_unique<DiskIo>(diskMode, *io_, config_.diskThreads);
+    segments_->setDiskIo(disk_.get());
+    work_ = std::make_unique<WorkQueue>(config_.workThreads);
+    ctx_ = std::make_unique<ServerContext>(ServerContext{ config_, *meta_, *fm_, stats_, *resume_, *list_, *uploads_, *content_, *delta_, *blocks_, *disk_, *buffers_, *memory_, *sendRate_, *recvRate_, *io_, *work_ });
 
-    std::cout << "Server setup complete. Listening..." << std::endl;
+    std::cout << "Server setup complete. Listening with " << io_->threadCount() << " I/O threads, "
+              << DiskIo::modeName(diskMode) << " disk I/O..." << std::endl;
 }
 
 Server::~Server() {
     if (listenSocket != INVALID_SOCKET) {
         closesocket(listenSocket);
     }
+    if (io_) io_->stop();
+    // Destroyed before the segments.
+    if (segments_) segments_->setDiskIo(nullptr);
 }
 
-void Server::start() { acceptLoop(); }
+void Server::start() {
+    io_->run();
+    acceptLoop();
+}
 
 void Server::acceptLoop() {
+    // Accepting stays blocking; everything after accept runs on the
+    // completion-port workers, so connections no longer cost a thread each.
     for (;;) {
         SOCKET clientSock = accept(listenSocket, nullptr, nullptr);
         if (clientSock == INVALID_SOCKET) { std::cerr << "accept failed\n"; continue; }
-        std::thread([this, clientSock]() {
-            ClientHandler handler(clientSock, this->root, *this->meta_, *this->fm_);
-            handler.process();
-            }).detach();
+        try {
+            io_->associate(clientSock);
+        }
+        catch (const std::exception& ex) {
+            std::cerr << ex.what() << "\n";
+            closesocket(clientSock);
+            continue;
+        }
+        auto handler = std::make_shared<ClientHandler>(clientSock, *ctx_);
+        handler->start();
     }
 }
@@ -1,25 +1,61 @@
 #pragma once
 #include <string>
 #include <filesystem>
+#include <memory>
 #include <winsock2.h>
+#include "ServerConfig.hpp"
+#include "ServerContext.hpp"
+#include "ServerStats.hpp"
 
 class MetadataStore;
 class FileManager;
+class IoService;
+class ResumeCheckpointer;
+class ListService;
+class UploadSessions;
+class ContentStore;
+class DeltaSync;
+class BlockCache;
+class DiskIo;
+class SegmentStore;
+class BufferPool;
+class MemoryBudget;
+class BandwidthScheduler;
+class WorkQueue;
 
 class Server {
 public:
-    Server(const std::string& port, const std::filesystem::path& rootDir, const std::filesystem::path& dbPath);
+    Server(const ServerConfig& config, const std::filesystem::path& dbPath);
     ~Server();
     void start();
 
 private:
     SOCKET listenSocket = INVALID_SOCKET;
     std::filesystem::path root;
+    ServerConfig config_;
 
     std::unique_ptr<MetadataStore> meta_;
     std::unique_ptr<FileManager>   fm_;
+    ServerStats stats_;
+    std::unique_ptr<BufferPool>    buffers_;
+    std::unique_ptr<MemoryBudget>  memory_;
+    std::unique_ptr<SegmentStore>  segments_;
+    std::unique_ptr<ResumeCheckpointer> resume_;
+    std::unique_ptr<ListService>   list_;
+    std::unique_ptr<ContentStore>  content_;
+    std::unique_ptr<UploadSessions> uploads_;
+    std::unique_ptr<DeltaSync>     delta_;
+    std::unique_ptr<BlockCache>    blocks_;
+    std::unique_ptr<IoService>     io_;
+    // After io_, so their tickers are joined before it goes: a wake still
+    // due for a pinned handler posts to io_.
+    std::unique_ptr<BandwidthScheduler> sendRate_;
+    std::unique_ptr<BandwidthScheduler> recvRate_;
+    std::unique_ptr<DiskIo>        disk_;
+    std::unique_ptr<ServerContext> ctx_;
+    // Goes first: a queued job holds its handler, which releases into the
+    // pools and budgets above as it goes.
+    std::unique_ptr<WorkQueue>     work_;
 
 	void acceptLoop();
-
-    void handleClient(SOCKET clientSocket);
 };
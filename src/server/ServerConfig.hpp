@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <filesystem>
+
+// Startup options. Positional port/root keep their old meaning; everything
+// else is a --name=value flag parsed in main.cpp.
+struct ServerConfig {
+    std::string port = "8021";
+    std::filesystem::path root;
+    unsigned ioThreads = 0;     // completion-port workers; 0 = one per core
+    bool zeroCopy = true;       // serve GET with TransmitFile when available
+    unsigned dbReaders = 4;     // read-only SQLite connections in the pool
+    unsigned checkpointMs = 250;            // resume offsets persisted at least this often
+    uint64_t checkpointBytes = 8ull << 20;  // ...or once a transfer has moved this far
+    unsigned groupCommitMs = 5;             // metadata writes are batched this long...
+    unsigned groupCommitOps = 256;          // ...or until this many are queued
+    size_t metaCacheEntries = 65536;        // cached file rows; 0 disables
+    bool dedup = true;          // store uploads once per content hash under blobs/
+    uint64_t blockCacheBytes = 256ull << 20;    // shared page cache for buffered GETs; 0 disables
+    size_t mappedBlobs = 256;   // blob mappings kept open for buffered GETs; 0 disables mapping
+    std::string diskIo = "iocp";    // async disk backend: iocp, threads, or sync (blocking reads)
+    unsigned diskDepth = 8;         // reads kept in flight per buffered GET
+    unsigned diskThreads = 4;       // pool size for --disk-io=threads
+    unsigned workThreads = 2;       // requests that read a whole file: SIG_REQ, DELTA_*, UPLOAD_COMMIT_REQ
+    unsigned uploadBuffers = 4;     // write-behind buffers per PUT; below 2 writes inline
+    uint64_t bufferPoolBytes = 64ull << 20;     // idle transfer buffers kept for reuse; 0 disables
+    unsigned uploadSessionHours = 24;   // chunked uploads idle this long are dropped; 0 keeps them
+    uint32_t maxMessageBytes = 4u << 20;        // larger request payloads are dropped with an error
+    uint64_t connMemoryBytes = 16ull << 20;     // request payloads and queued replies per connection...
+    uint64_t serverMemoryBytes = 1ull << 30;    // ...and across all of them; 0 = unlimited
+    // File data rates in bytes/s, applied to downloads and uploads alike
+    // until changed at runtime with RATE_REQ; 0 = unlimited.
+    uint64_t rateGlobal = 0;        // whole server
+    uint64_t rateConn = 0;          // each connection
+    uint64_t rateSmall = 0;         // all small transfers together
+    uint64_t rateBulk = 0;          // all bulk transfers together
+    uint64_t smallTransferBytes = 1ull << 20;   // transfers up to this size are small
+    unsigned smallWeight = 8;       // their share against bulk transfers of weight 1
+    uint64_t packThreshold = 64 * 1024;     // blobs up to this size go into segments; 0 disables
+    uint64_t segmentBytes = 256ull << 20;   // size at which a segment is sealed
+    unsigned compactDeadPct = 50;           // sealed segments this dead are compacted
+    std::filesystem::path benchDisk;    // if set, benchmark the disk backends on this file and exit
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include "ServerConfig.hpp"
+#include "ServerStats.hpp"
+
+class MetadataStore;
+class FileManager;
+class ResumeCheckpointer;
+class ListService;
+class UploadSessions;
+class ContentStore;
+class DeltaSync;
+class BlockCache;
+class DiskIo;
+class BufferPool;
+class MemoryBudget;
+class BandwidthScheduler;
+class IoService;
+class WorkQueue;
+
+// Shared services handed to every connection. Owned by Server.
+struct ServerContext {
+    const ServerConfig& config;
+    MetadataStore& meta;
+    FileManager& fm;
+    ServerStats& stats;
+    ResumeCheckpointer& resume;
+    ListService& list;
+    UploadSessions& uploads;
+    ContentStore& content;
+    DeltaSync& delta;
+    BlockCache& blocks;
+    DiskIo& disk;
+    BufferPool& buffers;
+    MemoryBudget& memory;
+    BandwidthScheduler& sendRate;   // GET data
+    BandwidthScheduler& recvRate;   // PUT data
+    IoService& io;
+    WorkQueue& work;
+};
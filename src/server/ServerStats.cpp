@@ -0,0 +1,34 @@
+#include "ServerStats.hpp"
+#include <sstream>
+
+std::string ServerStats::format() const {
+    std::ostringstream oss;
+    oss << "get_bytes_zero_copy=" << bytesZeroCopy.load() << "\n"
+        << "get_bytes_buffered=" << bytesBuffered.load() << "\n"
+        << "get_frames=" << getFrames.load() << "\n"
+        << "put_bytes=" << bytesUploaded.load() << "\n"
+        << "resume_checkpoints_written=" << resumeWrites.load() << "\n"
+        << "dedup_files=" << dedupFiles.load() << "\n"
+        << "dedup_bytes_saved=" << dedupBytes.load() << "\n"
+        << "delta_bytes_literal=" << deltaBytesLiteral.load() << "\n"
+        << "delta_bytes_copied=" << deltaBytesCopied.load() << "\n"
+        << "compress_bytes_raw=" << codecBytesRaw.load() << "\n"
+        << "compress_bytes_wire=" << codecBytesWire.load() << "\n"
+        << "compress_chunks_stored=" << codecStoredChunks.load() << "\n"
+        << "compress_us=" << codecUs.load() << "\n"
+        << "disk_async_reads=" << diskAsyncReads.load() << "\n"
+        << "disk_async_read_bytes=" << diskAsyncBytes.load() << "\n"
+        << "put_write_stalls=" << uploadStalls.load() << "\n"
+        << "memory_waits=" << memoryWaits.load() << "\n"
+        << "memory_refusals=" << memoryRefusals.load() << "\n"
+        << "messages_too_large=" << oversizeMessages.load() << "\n"
+        << "mget_files=" << mgetFiles.load() << "\n"
+        << "mput_files=" << mputFiles.load() << "\n"
+        << "upload_sessions_expired=" << uploadSessionsExpired.load() << "\n"
+        << "packed_blobs=" << packedBlobs.load() << "\n"
+        << "packed_bytes=" << packedBytes.load() << "\n"
+        << "segment_bytes_dead=" << segmentBytesDead.load() << "\n"
+        << "segment_compactions=" << segmentCompactions.load() << "\n"
+        << "segment_bytes_moved=" << segmentBytesMoved.load();
+    return oss.str();
+}
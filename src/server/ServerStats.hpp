@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Server-wide counters, reported to clients through STATS_REQ.
+struct ServerStats {
+    std::atomic<uint64_t> bytesZeroCopy{0};   // GET bytes sent with TransmitFile
+    std::atomic<uint64_t> bytesBuffered{0};   // GET bytes read into user space and sent
+    std::atomic<uint64_t> getFrames{0};       // GET sends of either kind, one per frame or chunk
+    std::atomic<uint64_t> bytesUploaded{0};   // PUT bytes written to blobs
+    std::atomic<uint64_t> resumeWrites{0};    // resume-table upserts by the checkpointer
+    std::atomic<uint64_t> dedupFiles{0};      // uploads stored as a reference to an existing blob
+    std::atomic<uint64_t> dedupBytes{0};      // bytes those uploads did not add to disk
+    std::atomic<uint64_t> deltaBytesLiteral{0};   // delta-sync bytes received as literals
+    std::atomic<uint64_t> deltaBytesCopied{0};    // ...and copied from the previous version
+    std::atomic<uint64_t> codecBytesRaw{0};   // compressed GET/PUT bytes, before compression
+    std::atomic<uint64_t> codecBytesWire{0};  // ...and as sent or received
+    std::atomic<uint64_t> codecStoredChunks{0};   // chunks that went out raw
+    std::atomic<uint64_t> codecUs{0};         // time in the compressor and decompressor
+    std::atomic<uint64_t> diskAsyncReads{0};  // reads issued through DiskIo
+    std::atomic<uint64_t> diskAsyncBytes{0};  // ...and the bytes they returned
+    std::atomic<uint64_t> uploadStalls{0};    // PUT receives held back until the disk caught up
+    std::atomic<uint64_t> memoryWaits{0};     // request payloads left unread until memory was free
+    std::atomic<uint64_t> memoryRefusals{0};  // transfers refused because their buffers didn't fit
+    std::atomic<uint64_t> oversizeMessages{0};    // requests dropped for exceeding --max-message-kb
+    std::atomic<uint64_t> mgetFiles{0};       // files sent through MGET
+    std::atomic<uint64_t> mputFiles{0};       // files stored through MPUT
+    std::atomic<uint64_t> uploadSessionsExpired{0};   // chunked uploads dropped after --upload-session-hours
+    std::atomic<uint64_t> packedBlobs{0};     // blobs currently stored in segments
+    std::atomic<uint64_t> packedBytes{0};     // bytes packed into segments since startup
+    std::atomic<uint64_t> segmentBytesDead{0};    // segment bytes no blob points to
+    std::atomic<uint64_t> segmentCompactions{0};  // segments rewritten and deleted
+    std::atomic<uint64_t> segmentBytesMoved{0};   // ...and the live bytes they copied
+
+    // One "key=value" per line.
+    std::string format() const;
+};
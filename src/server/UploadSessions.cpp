@@ -0,0 +1,408 @@
+#include "UploadSessions.hpp"
+#include "MetadataStore.hpp"
+#include "FileManager.hpp"
+#include "ServerStats.hpp"
+#include "ContentStore.hpp"
+#include "../../common/blockhash.hpp"
+#include "../../common/crc32c.hpp"
+#include "../../common/sha256.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <vector>
+
+// How often idle sessions are looked for.
+static constexpr auto SWEEP_INTERVAL = std::chrono::minutes(1);
+
+UploadSessions::UploadSessions(MetadataStore& meta, FileManager& fm, ServerStats& stats, ContentStore& content,
+                               std::chrono::seconds ttl)
+    : meta_(meta), fm_(fm), stats_(stats), content_(content), ttl_(ttl) {
+    for (auto& row : meta_.listUploadSessions()) {
+        if (row.file_id && fm_.hasStaging(row.upload_id) && !fm_.commitStaging(row.upload_id, *row.file_id)) {
+            // Committed in the catalog, but the rename fails again; kept as
+            // an open session the client can commit once more.
+            std::cerr << "upload " << row.upload_id << ": staging blob could not become file "
+                      << *row.file_id << "; commit rolled back\n";
+            meta_.rollbackUploadSession(row.upload_id, *row.file_id, row.name);
+        }
+        else if (row.file_id) {
+            // Committed in the catalog, and renamed now if it wasn't yet.
+            renamed_.push_back({ row.upload_id, *row.file_id, row.size });
+            continue;
+        }
+        if (!fm_.hasStaging(row.upload_id)) {
+            meta_.deleteUploadSession(row.upload_id);
+            continue;
+        }
+        auto s = std::make_shared<Session>();
+        s->name = row.name;
+        s->size = row.size;
+        s->ranges = parseRanges(row.ranges);
+        sessions_[row.upload_id] = std::move(s);
+    }
+    if (ttl_.count() > 0 || !renamed_.empty()) sweeper_ = std::thread([this]() { sweepLoop(); });
+}
+
+UploadSessions::~UploadSessions() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    if (sweeper_.joinable()) sweeper_.join();
+}
+
+// Drops sessions that have had no chunk for ttl_, unless they are being
+// committed. A write still in flight for one lands in the deleted blob.
+void UploadSessions::sweepLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    // Reading the blobs back can take a while, so not in the constructor.
+    while (!stop_ && !renamed_.empty()) {
+        Renamed r = std::move(renamed_.back());
+        renamed_.pop_back();
+        lock.unlock();
+        finishCommit(r.file_id, r.size, std::nullopt, {});
+        meta_.deleteUploadSession(r.upload_id);
+        lock.lock();
+    }
+    if (ttl_.count() <= 0) return;
+    while (!stop_) {
+        cv_.wait_for(lock, SWEEP_INTERVAL);
+        if (stop_) break;
+        const auto now = std::chrono::steady_clock::now();
+        std::vector<std::string> expired;
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            Session& s = *it->second;
+            std::lock_guard<std::mutex> sl(s.mu);
+            if (s.committing || now - s.touched < ttl_) {
+                ++it;
+                continue;
+            }
+            s.out.reset();
+            expired.push_back(it->first);
+            it = sessions_.erase(it);
+        }
+        lock.unlock();
+        for (const auto& upload_id : expired) {
+            fm_.removeStaging(upload_id);
+            meta_.deleteUploadSession(upload_id);
+            ++stats_.uploadSessionsExpired;
+        }
+        lock.lock();
+    }
+}
+
+static std::vector<std::string> splitFields(const std::string& request) {
+    std::vector<std::string> fields;
+    for (size_t pos = 0;;) {
+        size_t sep = request.find('|', pos);
+        fields.push_back(request.substr(pos, sep - pos));
+        if (sep == std::string::npos) break;
+        pos = sep + 1;
+    }
+    return fields;
+}
+
+bool UploadSessions::offered(const std::string& request, std::string& name, uint64_t& size, std::string& hash) {
+    std::vector<std::string> fields = splitFields(request);
+    if (fields.size() != 4 || fields[0].empty() || !parseSha256(fields[3], hash)) return false;
+    try { size = std::stoull(fields[1]); }
+    catch (...) { return false; }
+    name = fields[0];
+    return true;
+}
+
+bool UploadSessions::open(const std::string& request, std::string& reply, std::string& error) {
+    std::vector<std::string> fields = splitFields(request);
+    if (fields.size() < 2 || fields.size() > 4 || fields[0].empty()) {
+        error = "bad-request";
+        return false;
+    }
+    const std::string& name = fields[0];
+    uint64_t size = 0;
+    try { size = std::stoull(fields[1]); }
+    catch (...) { error = "bad-request"; return false; }
+
+    std::string hash;
+    if (fields.size() == 4 && !fields[3].empty() && !parseSha256(fields[3], hash)) {
+        error = "bad-request";
+        return false;
+    }
+
+    if (fields.size() >= 3 && !fields[2].empty()) {
+        if (auto s = find(fields[2])) {
+            std::lock_guard<std::mutex> lock(s->mu);
+            if (s->name == name && s->size == size && !s->committing) {
+                s->touched = std::chrono::steady_clock::now();
+                reply = fields[2] + "|" + formatRanges(s->ranges);
+                return true;
+            }
+        }
+    }
+
+    FileRow existing;
+    if (meta_.getFileByName(name, existing)) {
+        error = "name-exists";
+        return false;
+    }
+
+    std::string upload_id = newUploadId();
+    if (!fm_.createStaging(upload_id, size)) {
+        error = "alloc-failed";
+        return false;
+    }
+    UploadSessionRow row;
+    row.upload_id = upload_id;
+    row.name = name;
+    row.size = size;
+    meta_.insertUploadSession(row);
+
+    auto s = std::make_shared<Session>();
+    s->name = name;
+    s->size = size;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        sessions_[upload_id] = std::move(s);
+    }
+    reply = upload_id + "|";
+    return true;
+}
+
+std::unique_ptr<UploadSessions::Chunk> UploadSessions::openChunk(const std::string& upload_id, uint64_t offset,
+                                                                 std::string& error) {
+    auto s = find(upload_id);
+    if (!s) { error = "unknown-upload"; return nullptr; }
+    std::lock_guard<std::mutex> lock(s->mu);
+    if (s->committing) { error = "committing"; return nullptr; }
+    if (offset > s->size) { error = "bad-range"; return nullptr; }
+    if (!s->out) {
+        BlobFile f = fm_.openStagingForChunks(upload_id);
+        if (!f) { error = "write-failed"; return nullptr; }
+        s->out = std::make_shared<BlobFile>(std::move(f));
+    }
+    auto c = std::make_unique<Chunk>();
+    c->uploadId_ = upload_id;
+    c->session_ = s;
+    c->out_ = s->out;
+    c->start_ = c->offset_ = offset;
+    s->touched = std::chrono::steady_clock::now();
+    return c;
+}
+
+// Writes to disjoint ranges run concurrently, and take no lock: a session's
+// size never changes.
+bool UploadSessions::write(Chunk& c, const char* data, size_t len, std::string& error) {
+    if (len > c.session_->size - c.offset_) { error = "bad-range"; return false; }
+    if (!c.out_->writeAt(c.offset_, data, len)) { error = "write-failed"; return false; }
+    stats_.bytesUploaded += len;
+    for (uint64_t pos = 0; pos < len;) {
+        const uint64_t at = c.offset_ + pos;
+        const uint64_t n = std::min<uint64_t>(len - pos, HASH_BLOCK_SIZE - at % HASH_BLOCK_SIZE);
+        const uint32_t crc = crc32c(0, data + pos, static_cast<size_t>(n));
+        // A block split across pieces is chained into the entry it started.
+        if (!c.crcs_.empty() && at % HASH_BLOCK_SIZE != 0) {
+            auto& last = c.crcs_.back().second;
+            last.second = crc32cCombine(last.second, crc, n);
+            last.first += n;
+        }
+        else {
+            c.crcs_.push_back({ at, { n, crc } });
+        }
+        pos += n;
+    }
+    c.offset_ += len;
+    return true;
+}
+
+bool UploadSessions::finishChunk(Chunk& c, std::string& error) {
+    if (c.offset_ == c.start_) return true;
+    // The bytes reach the disk before their range is recorded, so a range
+    // the table lists after a crash is really there.
+    if (!FlushFileBuffers(c.out_->handle())) { error = "write-failed"; return false; }
+    Session& s = *c.session_;
+    std::lock_guard<std::mutex> lock(s.mu);
+    addRange(s.ranges, c.start_, c.offset_);
+    for (const auto& piece : c.crcs_) s.chunkCrcs[piece.first] = piece.second;
+    s.touched = std::chrono::steady_clock::now();
+    // Queued under the session lock so the group commits see the updates in
+    // order. Not waited on: after a crash the client re-sends what the
+    // table does not list.
+    meta_.updateUploadRanges(c.uploadId_, formatRanges(s.ranges));
+    return true;
+}
+
+bool UploadSessions::commit(const std::string& upload_id, int& file_id, std::string& error) {
+    auto s = find(upload_id);
+    if (!s) { error = "unknown-upload"; return false; }
+    {
+        std::lock_guard<std::mutex> lock(s->mu);
+        if (s->committing) { error = "committing"; return false; }
+        bool complete = s->size == 0 ||
+            (s->ranges.size() == 1 && s->ranges.begin()->first == 0 && s->ranges.begin()->second == s->size);
+        if (!complete) { error = "incomplete"; return false; }
+        s->committing = true;
+        // Every chunk is on disk; a write still holding the handle is a
+        // repeat of bytes already there, and doesn't stop the rename.
+        s->out.reset();
+    }
+
+    // Chunks arrive in any order, so the block hashes and the file's CRC
+    // are stitched together from theirs and the CRC committed with the row.
+    // Chunks received before a restart have no CRC in memory; then the blob
+    // is read after the rename.
+    std::optional<std::string> checksum;
+    std::vector<uint32_t> leaves;
+    {
+        std::lock_guard<std::mutex> lock(s->mu);
+        if (blockLeaves(*s, leaves)) {
+            uint32_t crc = 0;
+            uint64_t pos = 0;
+            for (uint32_t leaf : leaves) {
+                const uint64_t n = std::min<uint64_t>(HASH_BLOCK_SIZE, s->size - pos);
+                crc = crc32cCombine(crc, leaf, n);
+                pos += n;
+            }
+            checksum = formatCrc32c(crc);
+        }
+    }
+
+    try {
+        file_id = meta_.commitUploadSession(upload_id, s->name, checksum).get();
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock(s->mu);
+        s->committing = false;
+        error = "insert-meta-failed";
+        return false;
+    }
+    // The row is visible from here; the rename follows immediately, and a
+    // restart in between completes it (see the constructor). If it fails,
+    // the row goes again and the session is back to taking a commit.
+    if (!fm_.commitStaging(upload_id, file_id)) {
+        meta_.rollbackUploadSession(upload_id, file_id, s->name);
+        std::lock_guard<std::mutex> lock(s->mu);
+        s->committing = false;
+        error = "commit-failed";
+        return false;
+    }
+    meta_.deleteUploadSession(upload_id);
+    finishCommit(file_id, s->size, checksum, std::move(leaves));
+
+    std::lock_guard<std::mutex> lock(mu_);
+    sessions_.erase(upload_id);
+    return true;
+}
+
+// Everything after the rename. Without a checksum the chunks' CRCs didn't
+// cover the file, and the blob is read for them; one that can't be read
+// back whole is left without checksum and block hashes, like a file stored
+// before they existed.
+void UploadSessions::finishCommit(int file_id, uint64_t size, const std::optional<std::string>& checksum,
+                                  std::vector<uint32_t> leaves) {
+    if (checksum || hashBlob(file_id, size, leaves)) storeHashes(file_id, leaves);
+    // Chunks arrived out of order, so the content hash comes from reading
+    // the blob in the background; clients that offer one at open skip the
+    // upload altogether when it matches.
+    content_.adopt(file_id, size);
+}
+
+// Walks chunk CRCs from offset 0 to the end, chaining them into one CRC
+// per hash block; false if no chain of chunks covers the file exactly.
+bool UploadSessions::blockLeaves(const Session& s, std::vector<uint32_t>& leaves) {
+    leaves.clear();
+    uint32_t crc = 0;
+    for (uint64_t pos = 0; pos < s.size;) {
+        auto it = s.chunkCrcs.find(pos);
+        if (it == s.chunkCrcs.end() || it->second.first == 0) return false;
+        crc = crc32cCombine(crc, it->second.second, it->second.first);
+        pos += it->second.first;
+        if (pos % HASH_BLOCK_SIZE == 0 || pos == s.size) {
+            leaves.push_back(crc);
+            crc = 0;
+        }
+    }
+    return true;
+}
+
+bool UploadSessions::hashBlob(int file_id, uint64_t size, std::vector<uint32_t>& leaves) {
+    BlockHasher hasher;
+    uint64_t pos = 0;
+    bool ok = fm_.scan(file_id, std::nullopt, HASH_BLOCK_SIZE, [&](ByteSpan s) {
+        hasher.update(s.data, s.size);
+        pos += s.size;
+        return true;
+    });
+    if (!ok || pos != size) return false;
+    hasher.finish();
+    meta_.updateFileChecksum(file_id, formatCrc32c(hasher.fileCrc()));
+    leaves = hasher.leaves();
+    return true;
+}
+
+void UploadSessions::storeHashes(int file_id, const std::vector<uint32_t>& leaves) {
+    BlockHashRow row;
+    row.file_id = file_id;
+    row.block_size = HASH_BLOCK_SIZE;
+    row.leaves = leaves;
+    row.root = merkleRoot(leaves);
+    meta_.putBlockHashes(row);
+}
+
+std::shared_ptr<UploadSessions::Session> UploadSessions::find(const std::string& upload_id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = sessions_.find(upload_id);
+    return it == sessions_.end() ? nullptr : it->second;
+}
+
+std::string UploadSessions::newUploadId() {
+    std::random_device rd;
+    std::ostringstream oss;
+    oss << std::hex << std::setfill('0');
+    for (int i = 0; i < 4; ++i) oss << std::setw(8) << rd();
+    return oss.str();
+}
+
+void UploadSessions::addRange(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end) {
+    if (start >= end) return;
+    // Merge with every range that overlaps or touches [start, end).
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin()) {
+        auto prev = std::prev(it);
+        if (prev->second >= start) {
+            start = prev->first;
+            if (prev->second > end) end = prev->second;
+            it = ranges.erase(prev);
+        }
+    }
+    while (it != ranges.end() && it->first <= end) {
+        if (it->second > end) end = it->second;
+        it = ranges.erase(it);
+    }
+    ranges[start] = end;
+}
+
+std::string UploadSessions::formatRanges(const std::map<uint64_t, uint64_t>& ranges) {
+    std::string out;
+    for (const auto& [start, end] : ranges) {
+        if (!out.empty()) out += ",";
+        out += std::to_string(start) + "-" + std::to_string(end);
+    }
+    return out;
+}
+
+std::map<uint64_t, uint64_t> UploadSessions::parseRanges(const std::string& text) {
+    std::map<uint64_t, uint64_t> ranges;
+    std::istringstream iss(text);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        auto dash = item.find('-');
+        if (dash == std::string::npos) continue;
+        try { addRange(ranges, std::stoull(item.substr(0, dash)), std::stoull(item.substr(dash + 1))); }
+        catch (...) {}
+    }
+    return ranges;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class MetadataStore;
+class FileManager;
+class ContentStore;
+class BlobFile;
+struct ServerStats;
+
+// Resumable chunked uploads. A session is opened for a name and size, takes
+// chunks at any offset from any number of connections, and becomes a file
+// only on commit. Received ranges are persisted with every chunk, once its
+// bytes are flushed, so after a disconnect or restart the client re-sends
+// only what is missing. A session left without chunks for `ttl` is dropped
+// with its staging blob.
+//
+// Commit inserts the files row and marks the session in one transaction,
+// then renames the staging blob into place. If the rename fails, the
+// transaction is rolled back and the session can be committed again. A
+// session found marked at startup had its rename interrupted; the
+// constructor finishes it, or rolls it back the same way, and leaves its
+// hashing to the sweeper thread.
+class UploadSessions {
+public:
+    UploadSessions(MetadataStore& meta, FileManager& fm, ServerStats& stats, ContentStore& content,
+                   std::chrono::seconds ttl);
+    ~UploadSessions();
+
+    UploadSessions(const UploadSessions&) = delete;
+    UploadSessions& operator=(const UploadSessions&) = delete;
+
+    // "name|size[|upload_id[|sha256:<hex>]]". Reopens `upload_id` if it is
+    // still open for the same name and size, otherwise starts a new session.
+    // `reply` is "upload_id|ranges" with ranges as "start-end,..." (end
+    // exclusive). An offered hash is not looked at here: the handler first
+    // offers it to the ContentStore, and opens only if that finds nothing.
+    bool open(const std::string& request, std::string& reply, std::string& error);
+    // The name, size and hash of a request that offers one.
+    static bool offered(const std::string& request, std::string& name, uint64_t& size, std::string& hash);
+    // One UPLOAD_CHUNK_REQ, taken a piece at a time: openChunk, write for
+    // each piece, then finishChunk, which flushes the bytes and records
+    // their range and CRCs once for the whole request.
+    class Chunk;
+    std::unique_ptr<Chunk> openChunk(const std::string& upload_id, uint64_t offset, std::string& error);
+    bool write(Chunk& c, const char* data, size_t len, std::string& error);
+    bool finishChunk(Chunk& c, std::string& error);
+    // Waits on the row's commit and, for chunks received before a restart,
+    // reads the whole blob; called from the work queue, not an I/O worker.
+    bool commit(const std::string& upload_id, int& file_id, std::string& error);
+
+private:
+    struct Session {
+        std::mutex mu;
+        std::string name;
+        uint64_t size{};
+        std::map<uint64_t, uint64_t> ranges;   // start -> end, disjoint
+        // CRC-32C per received chunk, offset -> (length, crc), with chunks
+        // split at hash-block boundaries. Lost on restart; commit then falls
+        // back to reading the blob.
+        std::map<uint64_t, std::pair<uint64_t, uint32_t>> chunkCrcs;
+        bool committing = false;
+        // The staging blob, opened on the first chunk and shared by every
+        // connection writing to it.
+        std::shared_ptr<BlobFile> out;
+        std::chrono::steady_clock::time_point touched = std::chrono::steady_clock::now();
+    };
+
+    MetadataStore& meta_;
+    FileManager& fm_;
+    ServerStats& stats_;
+    ContentStore& content_;
+    std::chrono::seconds ttl_;
+    std::mutex mu_;
+    std::unordered_map<std::string, std::shared_ptr<Session>> sessions_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread sweeper_;
+    // Sessions committed and renamed before a restart whose hashes were
+    // never stored; the sweeper does them first. Their rows are deleted
+    // once done, so a restart in between tries again.
+    struct Renamed {
+        std::string upload_id;
+        int file_id{};
+        uint64_t size{};
+    };
+    std::vector<Renamed> renamed_;
+
+    std::shared_ptr<Session> find(const std::string& upload_id);
+    void sweepLoop();
+    static bool blockLeaves(const Session& s, std::vector<uint32_t>& leaves);
+    bool hashBlob(int file_id, uint64_t size, std::vector<uint32_t>& leaves);
+    void storeHashes(int file_id, const std::vector<uint32_t>& leaves);
+    void finishCommit(int file_id, uint64_t size, const std::optional<std::string>& checksum,
+                      std::vector<uint32_t> leaves);
+    static std::string newUploadId();
+    static void addRange(std::map<uint64_t, uint64_t>& ranges, uint64_t start, uint64_t end);
+    static std::string formatRanges(const std::map<uint64_t, uint64_t>& ranges);
+    static std::map<uint64_t, uint64_t> parseRanges(const std::string& text);
+};
+
+class UploadSessions::Chunk {
+    friend class UploadSessions;
+    std::string uploadId_;
+    std::shared_ptr<Session> session_;
+    std::shared_ptr<BlobFile> out_;
+    uint64_t start_{};
+    uint64_t offset_{};     // where the next piece goes
+    // CRC-32C of what was written, offset -> (length, crc), one entry per
+    // hash block touched.
+    std::vector<std::pair<uint64_t, std::pair<uint64_t, uint32_t>>> crcs_;
+};
@@ -0,0 +1,39 @@
+#include "WorkQueue.hpp"
+#include <algorithm>
+
+WorkQueue::WorkQueue(unsigned threads) {
+    threads = std::max<unsigned>(1, threads);
+    for (unsigned i = 0; i < threads; ++i) threads_.emplace_back([this]() { workLoop(); });
+}
+
+WorkQueue::~WorkQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+void WorkQueue::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        jobs_.push_back(std::move(job));
+    }
+    cv_.notify_one();
+}
+
+void WorkQueue::workLoop() {
+    std::unique_lock<std::mutex> lock(mu_);
+    for (;;) {
+        cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+        if (stop_) return;
+        std::function<void()> job = std::move(jobs_.front());
+        jobs_.pop_front();
+        lock.unlock();
+        job();
+        // Whatever the job holds, a handler say, goes before the lock does.
+        job = nullptr;
+        lock.lock();
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A few threads for requests that read a whole file before they can be
+// answered, so a large one doesn't hold an I/O worker for the length of
+// the read. Jobs run in the order queued, must not throw, and those still
+// queued at shutdown are dropped.
+class WorkQueue {
+public:
+    explicit WorkQueue(unsigned threads);
+    ~WorkQueue();
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    void submit(std::function<void()> job);
+
+private:
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+
+    void workLoop();
+};
@@ -0,0 +1,76 @@
+#include "WritePipeline.hpp"
+#include "FileManager.hpp"
+#include "BufferPool.hpp"
+
+WritePipeline::WritePipeline(DiskIo& disk, BufferPool& pool, std::shared_ptr<BlobFile> file, uint64_t size,
+                             size_t buffers, size_t bufferSize, std::function<void(WritePipeline&)> onEvent)
+    : disk_(disk), pool_(pool), file_(std::move(file)), size_(size), bufferSize_(bufferSize),
+      onEvent_(std::move(onEvent)), filled_(buffers), free_(buffers) {
+    // Buffers start empty and get their memory when first handed out, so a
+    // small upload never allocates the whole pool.
+    for (size_t i = 0; i < buffers; ++i) free_.push(DiskIo::Buffer());
+}
+
+// No write is in flight any more, each holding a reference; whatever
+// buffers are left sit in the rings.
+WritePipeline::~WritePipeline() {
+    DiskIo::Buffer buf;
+    while (free_.pop(buf)) pool_.release(buf);
+    Chunk c;
+    while (filled_.pop(c)) pool_.release(c.buf);
+}
+
+DiskIo::Buffer WritePipeline::acquire() {
+    DiskIo::Buffer buf;
+    if (!free_.pop(buf)) {
+        stalled_ = true;
+        // A write that finished between the pop and the flag would not have
+        // seen it; look once more.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!free_.pop(buf)) return buf;
+        stalled_ = false;
+    }
+    if (buf.size() < bufferSize_) buf = pool_.acquire(bufferSize_);
+    return buf;
+}
+
+void WritePipeline::submit(DiskIo::Buffer buf, size_t len) {
+    queued_ += len;
+    filled_.push(Chunk{ std::move(buf), len });
+    kick();
+}
+
+// Starts the next write unless one is in flight; the owner of that write
+// calls back in here when it completes.
+void WritePipeline::kick() {
+    for (;;) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (failed_ || filled_.empty()) return;
+        if (writing_.exchange(true)) return;
+        Chunk c;
+        if (filled_.pop(c)) {
+            const uint64_t offset = offset_;
+            const size_t len = c.len;
+            offset_ += len;
+            auto self = shared_from_this();
+            disk_.write(file_, offset, std::move(c.buf), len,
+                [self, len](int64_t n, DiskIo::Buffer& buf) { self->onWritten(n, len, buf); });
+            return;
+        }
+        writing_ = false;
+    }
+}
+
+void WritePipeline::onWritten(int64_t n, size_t len, DiskIo::Buffer& buf) {
+    if (n != static_cast<int64_t>(len)) failed_ = true;
+    else written_ += len;
+    // The handle must be closed before the upload is adopted into blobs/.
+    const bool done = written_.load() == size_;
+    if (done) file_.reset();
+    free_.push(std::move(buf));
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const bool wake = stalled_.exchange(false);
+    writing_ = false;
+    kick();
+    if (wake || done || failed_) onEvent_(*this);
+}
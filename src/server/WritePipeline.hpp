@@ -0,0 +1,64 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include "DiskIo.hpp"
+#include "SpscRing.hpp"
+
+class BlobFile;
+class BufferPool;
+
+// Write-behind for one upload, so receiving the next chunk overlaps writing
+// the last one. The receiving side fills buffers from a small pool and
+// queues them; the disk side writes them through DiskIo in order, one at a
+// time, so the file only ever grows at its end. The sides meet in two
+// lock-free rings, filled buffers one way and written ones back, and the
+// disk side is owned by whoever flips `writing_`, so neither takes a lock.
+//
+// When every buffer is queued acquire() comes back empty; the receiver stops
+// reading the socket and TCP flow control pushes back on the client.
+class WritePipeline : public std::enable_shared_from_this<WritePipeline> {
+public:
+    // `onEvent` runs on a disk thread when a receiver left without a buffer
+    // may go on, once `size` bytes are written, and when a write fails.
+    // Buffers come from `pool` and go back to it with the pipeline.
+    WritePipeline(DiskIo& disk, BufferPool& pool, std::shared_ptr<BlobFile> file, uint64_t size,
+                  size_t buffers, size_t bufferSize, std::function<void(WritePipeline&)> onEvent);
+    ~WritePipeline();
+
+    // Receiving side.
+    // A buffer of bufferSize bytes to fill, or empty if none is free.
+    DiskIo::Buffer acquire();
+    // Queues the first `len` bytes of `buf` after everything queued so far.
+    void submit(DiskIo::Buffer buf, size_t len);
+    uint64_t queued() const { return queued_; }
+    // Everything queued has reached the file.
+    bool idle() const { return written_.load() == queued_; }
+    bool failed() const { return failed_.load(); }
+
+private:
+    struct Chunk {
+        DiskIo::Buffer buf;
+        size_t len = 0;
+    };
+
+    DiskIo& disk_;
+    BufferPool& pool_;
+    std::shared_ptr<BlobFile> file_;    // released after the last write
+    const uint64_t size_;
+    const size_t bufferSize_;
+    std::function<void(WritePipeline&)> onEvent_;
+
+    SpscRing<Chunk> filled_;            // receiver -> disk
+    SpscRing<DiskIo::Buffer> free_;     // disk -> receiver
+    uint64_t queued_ = 0;               // receiver only
+    uint64_t offset_ = 0;               // disk side only: where the next write goes
+    std::atomic<uint64_t> written_{0};
+    std::atomic<bool> writing_{false};  // a write is in flight; its owner drives the disk side
+    std::atomic<bool> stalled_{false};  // the receiver found no free buffer
+    std::atomic<bool> failed_{false};
+
+    void kick();
+    void onWritten(int64_t n, size_t len, DiskIo::Buffer& buf);
+};
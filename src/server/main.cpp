@@ -1,20 +1,92 @@
+#include <algorithm>
 #include <iostream>
 #include <filesystem>
 #include <string>
 #include "../../common/common.hpp" 
 #include "Server.hpp"
+#include "ServerConfig.hpp"
+#include "DiskIo.hpp"
 
 namespace fs = std::filesystem;
 
+// ftplite_server [port] [root] [--io-threads=N] [--zero-copy=0|1] [--db-readers=N]
+//                [--checkpoint-ms=N] [--checkpoint-bytes=N]
+//                [--group-commit-ms=N] [--group-commit-ops=N] [--meta-cache-entries=N]
+//                [--dedup=0|1] [--block-cache-mb=N] [--mapped-blobs=N]
+//                [--disk-io=iocp|threads|sync] [--disk-depth=N] [--disk-threads=N] [--work-threads=N]
+//                [--upload-buffers=N] [--buffer-pool-mb=N] [--upload-session-hours=N]
+//                [--max-message-kb=N] [--conn-memory-mb=N] [--server-memory-mb=N]
+//                [--rate-global-kbs=N] [--rate-conn-kbs=N] [--rate-small-kbs=N] [--rate-bulk-kbs=N]
+//                [--small-transfer-kb=N] [--small-weight=N]
+//                [--pack-threshold-kb=N] [--segment-mb=N] [--compact-dead-pct=N]
+//                [--bench-disk=PATH]
+static ServerConfig parseArgs(int argc, char** argv) {
+    ServerConfig cfg;
+    cfg.root = std::filesystem::current_path();
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            if (positional == 0) cfg.port = arg;
+            else if (positional == 1) cfg.root = std::filesystem::path(arg);
+            ++positional;
+            continue;
+        }
+        auto eq = arg.find('=');
+        std::string key = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+        std::string val = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+        if (key == "io-threads") cfg.ioThreads = static_cast<unsigned>(std::stoul(val));
+        else if (key == "zero-copy") cfg.zeroCopy = (val != "0");
+        else if (key == "db-readers") cfg.dbReaders = static_cast<unsigned>(std::stoul(val));
+        else if (key == "checkpoint-ms") cfg.checkpointMs = static_cast<unsigned>(std::stoul(val));
+        else if (key == "checkpoint-bytes") cfg.checkpointBytes = std::stoull(val);
+        else if (key == "group-commit-ms") cfg.groupCommitMs = static_cast<unsigned>(std::stoul(val));
+        else if (key == "group-commit-ops") cfg.groupCommitOps = static_cast<unsigned>(std::stoul(val));
+        else if (key == "meta-cache-entries") cfg.metaCacheEntries = static_cast<size_t>(std::stoull(val));
+        else if (key == "dedup") cfg.dedup = (val != "0");
+        else if (key == "block-cache-mb") cfg.blockCacheBytes = std::stoull(val) << 20;
+        else if (key == "mapped-blobs") cfg.mappedBlobs = static_cast<size_t>(std::stoull(val));
+        else if (key == "disk-io") {
+            DiskIo::Mode mode;
+            if (!DiskIo::parseMode(val, mode)) throw std::runtime_error("unknown disk I/O mode: " + val);
+            cfg.diskIo = val;
+        }
+        else if (key == "disk-depth") cfg.diskDepth = std::max<unsigned>(1u, static_cast<unsigned>(std::stoul(val)));
+        else if (key == "disk-threads") cfg.diskThreads = static_cast<unsigned>(std::stoul(val));
+        else if (key == "work-threads") cfg.workThreads = static_cast<unsigned>(std::stoul(val));
+        else if (key == "upload-buffers") cfg.uploadBuffers = static_cast<unsigned>(std::stoul(val));
+        else if (key == "buffer-pool-mb") cfg.bufferPoolBytes = std::stoull(val) << 20;
+        else if (key == "upload-session-hours") cfg.uploadSessionHours = static_cast<unsigned>(std::stoul(val));
+        else if (key == "max-message-kb") cfg.maxMessageBytes = static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(1, std::stoull(val)), 1u << 20) << 10);
+        else if (key == "conn-memory-mb") cfg.connMemoryBytes = std::max<uint64_t>(1, std::stoull(val)) << 20;
+        else if (key == "server-memory-mb") cfg.serverMemoryBytes = std::stoull(val) << 20;
+        else if (key == "rate-global-kbs") cfg.rateGlobal = std::stoull(val) * 1024;
+        else if (key == "rate-conn-kbs") cfg.rateConn = std::stoull(val) * 1024;
+        else if (key == "rate-small-kbs") cfg.rateSmall = std::stoull(val) * 1024;
+        else if (key == "rate-bulk-kbs") cfg.rateBulk = std::stoull(val) * 1024;
+        else if (key == "small-transfer-kb") cfg.smallTransferBytes = std::stoull(val) * 1024;
+        else if (key == "small-weight") cfg.smallWeight = std::max<unsigned>(1u, static_cast<unsigned>(std::stoul(val)));
+        else if (key == "pack-threshold-kb") cfg.packThreshold = std::stoull(val) * 1024;
+        else if (key == "segment-mb") cfg.segmentBytes = std::max<uint64_t>(1, std::stoull(val)) << 20;
+        else if (key == "compact-dead-pct") cfg.compactDeadPct = std::min<unsigned>(100, static_cast<unsigned>(std::stoul(val)));
+        else if (key == "bench-disk") cfg.benchDisk = std::filesystem::path(val);
+        else throw std::runtime_error("unknown option: " + arg);
+    }
+    return cfg;
+}
+
 int main(int argc, char** argv) {
     try {
         WinsockInit _w;
-        const char* port = (argc >= 2) ? argv[1] : "8021";
-        std::filesystem::path root = (argc >= 3) ? std::filesystem::path(argv[2]) : std::filesystem::current_path();
-        std::filesystem::path db = root / "ftplite.sqlite";
+        ServerConfig cfg = parseArgs(argc, argv);
+        if (!cfg.benchDisk.empty()) {
+            DiskIo::benchmark(cfg.benchDisk, cfg.diskDepth, std::cout);
+            return 0;
+        }
+        std::filesystem::path db = cfg.root / "ftplite.sqlite";
 
-        std::cout << "FTP-Lite Server\nPort: " << port << "\nRoot: " << root.string() << "\nDB: " << db.string() << "\n\n";
-        Server server(port, root, db);
+        std::cout << "FTP-Lite Server\nPort: " << cfg.port << "\nRoot: " << cfg.root.string() << "\nDB: " << db.string() << "\n\n";
+        Server server(cfg, db);
         server.start();
 
     }